@@ -283,7 +283,7 @@ void display_gfs2(void *buf)
 		rgrp_print(buf);
 		break;
 	case GFS2_METATYPE_DI:
-		dinode_print(di);
+		dinode_print(buf);
 		break;
 	case GFS2_METATYPE_LF:
 		leaf_print(buf);
@@ -16,6 +16,8 @@
 #include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "copyright.cf"
 
@@ -31,7 +33,13 @@ const char *mtypes[] = {"none", "sb", "rg", "rb", "di", "in", "lf", "jd",
 
 static struct lgfs2_buffer_head *bh;
 static int pgnum;
-static long int gziplevel = 9;
+static long int complevel = -1; /* Use the method's default */
+static const char *compmethod = "gzip";
+static long int zthreads = 0; /* Use one thread per CPU */
+#define MAX_BASE_FILES (64)
+static const char *basefiles[MAX_BASE_FILES]; /* Earlier captures, for incremental ones */
+static int nbasefiles;
+static long int saveformat = 2; /* The savemeta file format to write */
 static int termcols;
 
 int details = 0;
@@ -1019,6 +1027,163 @@ static uint64_t pop_block(void)
 	return blockstack[bhst].block;
 }
 
+/*
+ * The search for blocks which aren't in the bitmaps reads the device in
+ * extents of FIND_EXTENT_SIZE, aligned to that size. The extents are handed
+ * out in order to a few threads, which keeps several reads in flight. Every
+ * extent before the first match is searched so the lowest match is found.
+ */
+#define FIND_EXTENT_SIZE (4 << 20)
+#define FIND_THREADS (4)
+
+struct find_scan {
+	pthread_mutex_t lock;
+	uint64_t next;  /* The first block of the next extent to search */
+	uint64_t end;  /* The first block past the area to search */
+	uint64_t found;  /* The lowest match so far, or end */
+	uint64_t magic;  /* The first 8 bytes of a matching block */
+	uint64_t scanned;  /* Bytes searched, for progress reports */
+	uint64_t total;
+	double start;  /* When the search started */
+	double reported;  /* When progress was last reported */
+	int progress;  /* Report progress on stderr */
+};
+
+static double find_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns the first block in buf whose header matches, or count */
+static unsigned find_in_extent(const char *buf, unsigned count, uint64_t magic)
+{
+	unsigned i;
+
+	for (i = 0; i < count; i++) {
+		uint64_t w;
+
+		memcpy(&w, buf + (size_t)i * sbd.sd_bsize, sizeof(w));
+		if (w == magic)
+			break;
+	}
+	return i;
+}
+
+static int find_read(char *buf, size_t len, off_t off)
+{
+	while (len > 0) {
+		ssize_t ret = pread(sbd.device_fd, buf, len, off);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+		off += ret;
+	}
+	return 0;
+}
+
+/* Search an extent, block by block if it can't be read in one go so that
+   unreadable blocks are skipped */
+static uint64_t find_extent(char *buf, uint64_t start, unsigned count, uint64_t magic)
+{
+	unsigned i;
+
+	if (find_read(buf, (size_t)count * sbd.sd_bsize, start * sbd.sd_bsize) == 0)
+		return start + find_in_extent(buf, count, magic);
+	for (i = 0; i < count; i++) {
+		if (find_read(buf, sizeof(magic), (start + i) * sbd.sd_bsize) == 0 &&
+		    find_in_extent(buf, 1, magic) == 0)
+			break;
+	}
+	return start + i;
+}
+
+static void find_report(struct find_scan *fs, int force)
+{
+	double now = find_now();
+
+	if (!force && now - fs->reported < 1.0)
+		return;
+	fs->reported = now;
+	fprintf(stderr, "\rSearched %.2fGB of %.2fGB (%.0fMB/s)%s",
+	        fs->scanned / 1073741824.0, fs->total / 1073741824.0,
+	        fs->scanned / 1048576.0 / (now - fs->start), force ? "\n" : "");
+}
+
+static void *find_worker(void *data)
+{
+	struct find_scan *fs = data;
+	unsigned per = FIND_EXTENT_SIZE / sbd.sd_bsize;
+	char *buf = malloc(FIND_EXTENT_SIZE);
+
+	if (buf == NULL) {
+		perror("Failed to search the device");
+		exit(-1);
+	}
+	pthread_mutex_lock(&fs->lock);
+	while (fs->next < fs->found) {
+		uint64_t start = fs->next;
+		unsigned count = per - (start % per);
+		uint64_t blk;
+
+		if (count > fs->end - start)
+			count = fs->end - start;
+		fs->next += count;
+		pthread_mutex_unlock(&fs->lock);
+		blk = find_extent(buf, start, count, fs->magic);
+		pthread_mutex_lock(&fs->lock);
+		if (blk < start + count && blk < fs->found)
+			fs->found = blk;
+		fs->scanned += (uint64_t)count * sbd.sd_bsize;
+		if (fs->progress)
+			find_report(fs, 0);
+	}
+	pthread_mutex_unlock(&fs->lock);
+	free(buf);
+	return NULL;
+}
+
+/* Returns the first block from start to end which has a metadata header of
+   the given type, or end if there is none */
+static uint64_t find_scan(uint64_t start, uint64_t end, int metatype, int print)
+{
+	struct gfs2_meta_header mh = {
+		.mh_magic = cpu_to_be32(GFS2_MAGIC),
+		.mh_type = cpu_to_be32(metatype),
+	};
+	struct find_scan fs = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.next = start,
+		.end = end,
+		.found = end,
+		.total = start < end ? (end - start) * sbd.sd_bsize : 0,
+		.progress = print && isatty(STDERR_FILENO),
+	};
+	pthread_t threads[FIND_THREADS - 1];
+	int started = 0;
+
+	if (start >= end)
+		return end;
+	memcpy(&fs.magic, &mh, sizeof(fs.magic));
+	posix_fadvise(sbd.device_fd, start * sbd.sd_bsize, fs.total, POSIX_FADV_SEQUENTIAL);
+	fs.start = fs.reported = find_now();
+	for (; started < FIND_THREADS - 1; started++)
+		if (pthread_create(&threads[started], NULL, find_worker, &fs) != 0)
+			break;
+	find_worker(&fs);
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	if (fs.progress)
+		find_report(&fs, 1);
+	return fs.found;
+}
+
 /* ------------------------------------------------------------------------ */
 /* Find next metadata block of a given type AFTER a given point in the fs   */
 /*                                                                          */
@@ -1028,24 +1193,10 @@ static uint64_t pop_block(void)
 static uint64_t find_metablockoftype_slow(uint64_t startblk, int metatype, int print)
 {
 	uint64_t blk, last_fs_block;
-	int found = 0;
-	struct lgfs2_buffer_head *lbh;
 
 	last_fs_block = lseek(sbd.device_fd, 0, SEEK_END) / sbd.sd_bsize;
-	for (blk = startblk + 1; blk < last_fs_block; blk++) {
-		lbh = lgfs2_bread(&sbd, blk);
-		/* Can't use get_block_type here (returns false "none") */
-		if (lbh->b_data[0] == 0x01 && lbh->b_data[1] == 0x16 &&
-		    lbh->b_data[2] == 0x19 && lbh->b_data[3] == 0x70 &&
-		    lbh->b_data[4] == 0x00 && lbh->b_data[5] == 0x00 &&
-		    lbh->b_data[6] == 0x00 && lbh->b_data[7] == metatype) {
-			found = 1;
-			lgfs2_brelse(lbh);
-			break;
-		}
-		lgfs2_brelse(lbh);
-	}
-	if (!found)
+	blk = find_scan(startblk + 1, last_fs_block, metatype, print);
+	if (blk == last_fs_block)
 		blk = 0;
 	if (print) {
 		if (dmode == HEX_MODE)
@@ -1893,7 +2044,7 @@ static void interactive_mode(void)
 /* ------------------------------------------------------------------------ */
 static void usage(void)
 {
-	fprintf(stderr,"\nFormat is: gfs2_edit [-c 1] [-V] [-x] [-h] [identify] [-z <0-9>] [-p structures|blocks][blocktype][blockalloc [val]][blockbits][blockrg][rgcount][rgflags][rgbitmaps][find sb|rg|rb|di|in|lf|jd|lh|ld|ea|ed|lb|13|qc][field <f>[val]] /dev/device\n\n");
+	fprintf(stderr,"\nFormat is: gfs2_edit [-c 1] [-V] [-x] [-h] [identify] [-z <level>] [-Z gzip|zstd|lz4] [-j <threads>] [-b <file>] [--format=1|2] [-p structures|blocks][blocktype][blockalloc [val]][blockbits][blockrg][rgcount][rgflags][rgbitmaps][find sb|rg|rb|di|in|lf|jd|lh|ld|ea|ed|lb|13|qc][field <f>[val]] /dev/device\n\n");
 	fprintf(stderr,"If only the device is specified, it enters into hexedit mode.\n");
 	fprintf(stderr,"identify - prints out only the block type, not the details.\n");
 	fprintf(stderr,"printsavedmeta - prints out the saved metadata blocks from a savemeta file.\n");
@@ -1938,8 +2089,13 @@ static void usage(void)
 	fprintf(stderr,"-p   <b> find sb|rg|rb|di|in|lf|jd|lh|ld|ea|ed|lb|"
 		"13|qc - find block of given type after block <b>\n");
 	fprintf(stderr,"     <b> specifies the starting block for search\n");
-	fprintf(stderr,"-z 1 use gzip compression level 1 for savemeta (default 9)\n");
+	fprintf(stderr,"-z 1 use compression level 1 for savemeta (default 9 for gzip, 3 for zstd, 1 for lz4)\n");
 	fprintf(stderr,"-z 0 do not use compression\n");
+	fprintf(stderr,"-Z zstd use zstd compression for savemeta (default gzip)\n");
+	fprintf(stderr,"-j 4 use 4 threads for savemeta compression and restoremeta (default: one per CPU)\n");
+	fprintf(stderr,"-b <file> savemeta only the blocks changed since the capture in <file>, or\n"
+		"     give restoremeta the earlier captures an incremental capture needs\n");
+	fprintf(stderr,"--format=1 write a savemeta file which older versions of gfs2_edit can restore\n");
 	fprintf(stderr,"-s   specifies a starting block such as root, rindex, quota, inum.\n");
 	fprintf(stderr,"-x   print in hexmode.\n");
 	fprintf(stderr,"-h   prints this help.\n\n");
@@ -1971,32 +2127,77 @@ static void usage(void)
 }/* usage */
 
 /**
- * getgziplevel - Process the -z parameter to savemeta operations
+ * getsaveopts - Process the -z, -Z, -j, -b and --format parameters to savemeta operations
  * argv - argv
  * i    - a pointer to the argv index at which to begin processing
- * The index pointed to by i will be incremented past the -z option if found
+ * The index pointed to by i will be incremented past the options found
  */
-static void getgziplevel(char *argv[], int *i)
+static void getsaveopts(int argc, char *argv[], int *i)
 {
 	char *opt, *arg;
 	char *endptr;
 
-	arg = argv[1 + *i];
-	if (strncmp(arg, "-z", 2)) {
-		return;
-	} else if (arg[2] != '\0') {
-		opt = &arg[2];
-	} else {
+	while (*i + 1 < argc) {
+		arg = argv[1 + *i];
+		if (!strncmp(arg, "--format=", 9)) {
+			opt = &arg[9];
+			errno = 0;
+			saveformat = strtol(opt, &endptr, 10);
+			if (errno || endptr == opt || *endptr != '\0' || saveformat < 1 || saveformat > 2) {
+				fprintf(stderr, "Invalid metadata file format: %s\n", opt);
+				exit(-1);
+			}
+			(*i)++;
+			continue;
+		}
+		if (strncmp(arg, "-z", 2) && strncmp(arg, "-Z", 2) && strncmp(arg, "-j", 2) &&
+		    strncmp(arg, "-b", 2))
+			return;
+		if (arg[2] != '\0') {
+			opt = &arg[2];
+		} else {
+			(*i)++;
+			opt = argv[1 + *i];
+			if (opt == NULL) {
+				fprintf(stderr, "Missing value for option %s\n", arg);
+				exit(-1);
+			}
+		}
+		errno = 0;
+		if (arg[1] == 'z') {
+			/* The maximum depends on the method, savemeta() checks it */
+			complevel = strtol(opt, &endptr, 10);
+			if (errno || endptr == opt || complevel < 0 || complevel > 99) {
+				fprintf(stderr, "Compression level out of range: %s\n", opt);
+				exit(-1);
+			}
+		} else if (arg[1] == 'Z') {
+			compmethod = opt;
+		} else if (arg[1] == 'b') {
+			if (nbasefiles == MAX_BASE_FILES) {
+				fprintf(stderr, "Too many base files\n");
+				exit(-1);
+			}
+			basefiles[nbasefiles++] = opt;
+		} else {
+			zthreads = strtol(opt, &endptr, 10);
+			if (errno || endptr == opt || *endptr != '\0' || zthreads < 1) {
+				fprintf(stderr, "Invalid number of threads: %s\n", opt);
+				exit(-1);
+			}
+		}
 		(*i)++;
-		opt = argv[1 + *i];
 	}
-	errno = 0;
-	gziplevel = strtol(opt, &endptr, 10);
-	if (errno || endptr == opt || gziplevel < 0 || gziplevel > 9) {
-		fprintf(stderr, "Compression level out of range: %s\n", opt);
+}
+
+/* The capture an incremental savemeta is based on, if any */
+static const char *savebase(void)
+{
+	if (nbasefiles > 1) {
+		fprintf(stderr, "Only one base file can be given to savemeta\n");
 		exit(-1);
 	}
-	(*i)++;
+	return nbasefiles ? basefiles[0] : NULL;
 }
 
 static int count_dinode_blks(struct lgfs2_rgrp_tree *rgd, int bitmap,
@@ -2035,24 +2236,17 @@ static int count_dinode_blks(struct lgfs2_rgrp_tree *rgd, int bitmap,
 
 static int count_dinode_bits(struct lgfs2_buffer_head *rbh)
 {
-	uint64_t blk;
 	struct gfs2_meta_header *mh = (struct gfs2_meta_header *)rbh->b_data;
-	char *byte;
-	int bit;
-	int dinodes = 0;
+	uint32_t count[4];
+	unsigned off;
 
 	if (be32_to_cpu(mh->mh_type) == GFS2_METATYPE_RG)
-		blk = sizeof(struct gfs2_rgrp);
+		off = sizeof(struct gfs2_rgrp);
 	else
-		blk = sizeof(struct gfs2_meta_header);
+		off = sizeof(struct gfs2_meta_header);
 
-	for (; blk < sbd.sd_bsize; blk++) {
-		byte = rbh->b_data + (blk / GFS2_NBBY);
-		bit = (blk % GFS2_NBBY) * GFS2_BIT_SIZE;
-		if (((*byte >> bit) & GFS2_BIT_MASK) == GFS2_BLKST_DINODE)
-			dinodes++;
-	}
-	return dinodes;
+	lgfs2_bitmap_count((unsigned char *)rbh->b_data + off, sbd.sd_bsize - off, count);
+	return count[GFS2_BLKST_DINODE];
 }
 
 static void rg_repair(void)
@@ -2165,11 +2359,12 @@ static void parameterpass1(int argc, char *argv[], int i)
 	else if (!strcasecmp(argv[i], "printsavedmeta")) {
 		if (dmode == INIT_MODE)
 			dmode = GFS2_MODE;
-		restoremeta(argv[i+1], argv[i+2], TRUE);
+		restoremeta(argv[i+1], argv[i+2], TRUE, 1, NULL, 0);
 	} else if (!strcasecmp(argv[i], "restoremeta")) {
 		if (dmode == INIT_MODE)
 			dmode = HEX_MODE; /* hopefully not used */
-		restoremeta(argv[i+1], argv[i+2], FALSE);
+		getsaveopts(argc, argv, &i);
+		restoremeta(argv[i+1], argv[i+2], FALSE, zthreads, basefiles, nbasefiles);
 	} else if (!strcmp(argv[i], "rgcount"))
 		termlines = 0;
 	else if (!strcmp(argv[i], "rgflags"))
@@ -2180,7 +2375,9 @@ static void parameterpass1(int argc, char *argv[], int i)
 		termlines = 0;
 	else if (!strcasecmp(argv[i], "-x"))
 		dmode = HEX_MODE;
-	else if (device == NULL && strchr(argv[i],'/')) {
+	/* The base file of an incremental savemeta is not the device */
+	else if (device == NULL && strchr(argv[i],'/') && argv[i][0] != '-' &&
+		 strcmp(argv[i - 1], "-b")) {
 		device = argv[i];
 	}
 }
@@ -2354,14 +2551,17 @@ static void process_parameters(int argc, char *argv[], int pass)
 		else if (!strcmp(argv[i], "rgrepair"))
 			rg_repair();
 		else if (!strcasecmp(argv[i], "savemeta")) {
-			getgziplevel(argv, &i);
-			savemeta(argv[i+2], 0, gziplevel);
+			getsaveopts(argc, argv, &i);
+			savemeta(argv[i+2], 0, compmethod, complevel, zthreads, savebase(),
+			         saveformat);
 		} else if (!strcasecmp(argv[i], "savemetaslow")) {
-			getgziplevel(argv, &i);
-			savemeta(argv[i+2], 1, gziplevel);
+			getsaveopts(argc, argv, &i);
+			savemeta(argv[i+2], 1, compmethod, complevel, zthreads, savebase(),
+			         saveformat);
 		} else if (!strcasecmp(argv[i], "savergs")) {
-			getgziplevel(argv, &i);
-			savemeta(argv[i+2], 2, gziplevel);
+			getsaveopts(argc, argv, &i);
+			savemeta(argv[i+2], 2, compmethod, complevel, zthreads, savebase(),
+			         saveformat);
 		} else if (isdigit(argv[i][0])) { /* decimal addr */
 			sscanf(argv[i], "%"SCNd64, &temp_blk);
 			push_block(temp_blk);
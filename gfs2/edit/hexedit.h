@@ -195,9 +195,11 @@ extern int block_is_quota_file(uint64_t blk);
 extern int block_is_per_node(uint64_t blk);
 extern int display_block_type(char *buf, uint64_t addr, int from_restore);
 extern void gfs_log_header_print(void *lhp);
-extern void savemeta(char *out_fn, int saveoption, int gziplevel);
+extern void savemeta(char *out_fn, int saveoption, const char *method, int level, int zthreads,
+                     const char *base_fn, int format);
 extern void restoremeta(const char *in_fn, const char *out_device,
-			uint64_t printblocksonly);
+			uint64_t printblocksonly, int nthreads,
+			const char **bases, int nbases);
 extern int display(int identify_only, int trunc_zeros, uint64_t flagref,
 		   uint64_t ref_blk);
 extern uint64_t check_keywords(const char *kword);
@@ -14,11 +14,19 @@
 #include <curses.h>
 #include <term.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <limits.h>
 #include <sys/time.h>
 #include <zlib.h>
 #include <bzlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
 #include <time.h>
+#include <pthread.h>
 
 #include <logging.h>
 #include "osi_list.h"
@@ -29,21 +37,97 @@
 #define DFT_SAVE_FILE "/tmp/gfsmeta.XXXXXX"
 #define MAX_JOURNALS_SAVED 256
 
+/* The first bytes of zstd and lz4 frames, in little endian order */
+#define ZSTD_FRAME_MAGIC (0xFD2FB528)
+#define LZ4_FRAME_MAGIC (0x184D2204)
+
 /* Header for the savemeta output file */
 struct savemeta_header {
 #define SAVEMETA_MAGIC (0x01171970)
 	__be32 sh_magic;
-#define SAVEMETA_FORMAT (1)
+#define SAVEMETA_FORMAT (2)
 	__be32 sh_format; /* In case we want to change the layout */
 	__be64 sh_time; /* When savemeta was run */
 	__be64 sh_fs_bytes; /* Size of the fs */
-	uint8_t __reserved[104];
+#define SAVEMETA_INCREMENTAL (0x1) /* Only the blocks which changed since the base */
+	__be32 sh_flags;
+	__be32 __pad;
+	__be64 sh_base_time; /* When the base of an incremental capture was saved */
+	uint8_t __reserved[88];
+};
+
+/*
+ * Format 2 files are made up of frames which can be decompressed on their
+ * own: one for the header, then the records in frames of up to
+ * SAVE_CHUNK_SIZE bytes. The frames are followed by an index of the record
+ * frames and then a trailer which locates the index. The index and trailer
+ * are written in frames which decompressors skip, so decompressing the file
+ * still gives the header and the records only.
+ *
+ * In incremental captures each record frame is followed by frames holding a
+ * hash of every block the records were taken from, including the blocks left
+ * out because they had not changed. These are compressed like the records
+ * and then wrapped in skippable frames. The index lists them too, with
+ * SAVEMETA_HASHES set and si_offset pointing past the wrapping.
+ */
+struct savemeta_index {
+	__be64 si_offset; /* Where the frame starts in the file */
+	__be32 si_clen; /* Length of the frame in the file */
+	__be32 si_ulen; /* Length of the frame when decompressed */
+	__be64 si_first; /* Lowest block number saved in the frame */
+	__be64 si_last; /* Highest block number saved in the frame */
+	__be32 si_count; /* Number of records or hashes in the frame */
+#define SAVEMETA_HASHES (0x1)
+	__be32 si_flags;
+};
+
+struct savemeta_hash {
+	__be64 hs_blk;
+	__be64 hs_hash; /* block_hash() of the block's significant data */
 };
 
+/* The most hashes in a hash frame, which keeps it within a gzip extra field */
+#define SAVEMETA_HASH_FRAME (2048)
+
+/* Compression methods, for st_method */
+#define SAVEMETA_NONE (0)
+#define SAVEMETA_GZIP (1)
+#define SAVEMETA_ZSTD (2)
+#define SAVEMETA_LZ4  (3)
+
+struct savemeta_trailer {
+	__be32 st_magic; /* SAVEMETA_MAGIC */
+	__be32 st_method; /* How the frames are compressed */
+	__be64 st_index; /* Where the first frame of the index starts */
+	__be64 st_entries; /* The number of index entries */
+	uint8_t __reserved[8];
+};
+
+/* The index is split over frames of up to this many entries */
+#define SAVEMETA_INDEX_FRAME (1024)
+
+/*
+ * Frames which are skipped when the file is decompressed. Files compressed
+ * with gzip use gzip members which have no data but carry the payload in an
+ * extra field. Other files use the skippable frames of the zstd and lz4
+ * formats: a magic number and the length of the payload, both little endian.
+ */
+#define SKIP_MAGIC (0x184D2A50)
+#define SKIP_HDR_LEN (8)
+#define SKIP_GZ_HDR_LEN (16)
+#define SKIP_GZ_TAIL_LEN (10)
+#define SKIP_GZ_ID1 'S'
+#define SKIP_GZ_ID2 'M'
+
 struct savemeta {
 	time_t sm_time;
 	unsigned sm_format;
 	uint64_t sm_fs_bytes;
+	struct savemeta_index *sm_index; /* The index, when there is one */
+	uint64_t sm_entries;
+	unsigned sm_method;
+	unsigned sm_flags;
+	time_t sm_base_time;
 };
 
 struct saved_metablock {
@@ -58,18 +142,154 @@ struct metafd {
 	int fd;
 	gzFile gzfd;
 	BZFILE *bzfd;
+#ifdef HAVE_ZSTD
+	ZSTD_DStream *zstdfd;
+#endif
+#ifdef HAVE_LZ4
+	LZ4F_dctx *lz4fd;
+#endif
+	/* Compressed data read from fd, for the methods which don't read it
+	   themselves */
+	char *inbuf;
+	size_t inlen;
+	size_t inpos;
+	int inframe;  /* The decompressor is part way through a frame */
+	const char *errstr;
 	const char *filename;
-	int gziplevel;
+	int level;
 	int eof;
 	int (*read)(struct metafd *mfd, void *buf, unsigned len);
 	void (*close)(struct metafd *mfd);
 	const char* (*strerr)(struct metafd *mfd);
 };
 
+/* The length of a block's data without its trailing zeroes */
+static unsigned block_siglen(const char *buf, unsigned len)
+{
+	for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t)) {
+		uint64_t w;
+
+		memcpy(&w, buf + len - sizeof(w), sizeof(w));
+		if (w != 0)
+			break;
+	}
+	for (; len > 0 && buf[len - 1] == '\0'; len--);
+	return len;
+}
+
+/* A hash of the significant data of a block, which is the same whatever the
+   byte order of the machine */
+static uint64_t block_hash(const char *buf, unsigned len)
+{
+	uint64_t h = len * 0x9e3779b97f4a7c15ULL;
+
+	for (unsigned i = 0; i < len; i += sizeof(uint64_t)) {
+		uint64_t w = 0;
+
+		memcpy(&w, buf + i, len - i < sizeof(w) ? len - i : sizeof(w));
+		h = (h ^ le64_to_cpu(w)) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 29;
+	}
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/*
+ * An open addressing hash table of block hashes, keyed by block number. Block
+ * 0 never holds metadata so it marks an empty slot. When done is allocated it
+ * tracks which of the blocks have been restored.
+ */
+struct blkmap_slot {
+	uint64_t blk;
+	uint64_t hash;
+};
+
+struct blkmap {
+	struct blkmap_slot *slots;
+	uint8_t *done;
+	uint64_t count;
+	unsigned bits;
+};
+
+#define BLKMAP_MIN_BITS (10)
+#define BLKMAP_NONE (~0ULL)
+
+static uint64_t blkmap_idx(const struct blkmap *m, uint64_t blk)
+{
+	return (blk * 0x9e3779b97f4a7c15ULL) >> (64 - m->bits);
+}
+
+/* Returns the slot of blk or BLKMAP_NONE if it is not in the map */
+static uint64_t blkmap_find(const struct blkmap *m, uint64_t blk)
+{
+	uint64_t mask, i;
+
+	if (m->slots == NULL)
+		return BLKMAP_NONE;
+	mask = (1ULL << m->bits) - 1;
+	for (i = blkmap_idx(m, blk); m->slots[i].blk != 0; i = (i + 1) & mask)
+		if (m->slots[i].blk == blk)
+			return i;
+	return BLKMAP_NONE;
+}
+
+static void blkmap_put(struct blkmap *m, uint64_t blk, uint64_t hash)
+{
+	uint64_t mask = (1ULL << m->bits) - 1;
+	uint64_t i;
+
+	for (i = blkmap_idx(m, blk); m->slots[i].blk != 0; i = (i + 1) & mask)
+		if (m->slots[i].blk == blk)
+			break;
+	if (m->slots[i].blk == 0)
+		m->count++;
+	m->slots[i].blk = blk;
+	m->slots[i].hash = hash;
+}
+
+static void blkmap_insert(struct blkmap *m, uint64_t blk, uint64_t hash)
+{
+	if (blk == 0)
+		return;
+	/* Keep the table at most 3/4 full so that probe sequences stay short */
+	if (m->slots == NULL || (m->count + 1) * 4 > (3ULL << m->bits)) {
+		struct blkmap_slot *old = m->slots;
+		uint64_t oldsize = old ? 1ULL << m->bits : 0;
+
+		m->bits = old ? m->bits + 1 : BLKMAP_MIN_BITS;
+		m->slots = calloc(1ULL << m->bits, sizeof(*m->slots));
+		if (m->slots == NULL) {
+			perror("Failed to index block hashes");
+			exit(1);
+		}
+		m->count = 0;
+		for (uint64_t i = 0; i < oldsize; i++)
+			if (old[i].blk != 0)
+				blkmap_put(m, old[i].blk, old[i].hash);
+		free(old);
+	}
+	blkmap_put(m, blk, hash);
+}
+
+static void blkmap_free(struct blkmap *m)
+{
+	free(m->slots);
+	free(m->done);
+	memset(m, 0, sizeof(*m));
+}
+
 static char *restore_buf;
 static ssize_t restore_left;
 static off_t restore_off;
+static int restore_sparse; /* Restoring into a sparse image file */
+static struct blkmap *restore_want; /* The blocks of an incremental capture */
 #define RESTORE_BUF_SIZE (2 * 1024 * 1024)
+/* The smallest file: a header and the superblock, which is all an incremental
+   capture holds when nothing else has changed */
+#define RESTORE_MIN_LEN ((ssize_t)(sizeof(struct savemeta_header) + \
+                                   sizeof(struct saved_metablock) + sizeof(struct gfs2_sb)))
 
 static char *restore_buf_next(struct metafd *mfd, size_t required_len)
 {
@@ -127,7 +347,7 @@ static int restore_try_gzip(struct metafd *mfd)
 		return 1;
 	gzbuffer(mfd->gzfd, (1<<20)); /* Increase zlib's buffers to 1MB */
 	restore_left = mfd->read(mfd, restore_buf, RESTORE_BUF_SIZE);
-	if (restore_left < 512)
+	if (restore_left < RESTORE_MIN_LEN)
 		return -1;
 	return 0;
 }
@@ -180,10 +400,202 @@ static int restore_try_bzip(struct metafd *mfd)
 	if (!mfd->bzfd)
 		return 1;
 	restore_left = mfd->read(mfd, restore_buf, RESTORE_BUF_SIZE);
-	if (restore_left < 512)
+	if (restore_left < RESTORE_MIN_LEN)
+		return -1;
+	return 0;
+}
+
+/* Common code for the zstd and lz4 methods */
+
+#define RESTORE_INBUF_SIZE (1 << 20)
+
+static int restore_check_magic(struct metafd *mfd, uint32_t magic)
+{
+	uint32_t buf;
+
+	if (pread(mfd->fd, &buf, sizeof(buf), 0) != sizeof(buf))
+		return 0;
+	return le32_to_cpu(buf) == magic;
+}
+
+#if defined(HAVE_ZSTD) || defined(HAVE_LZ4)
+static int inbuf_open(struct metafd *mfd)
+{
+	mfd->inbuf = malloc(RESTORE_INBUF_SIZE);
+	if (mfd->inbuf == NULL)
+		return -1;
+	mfd->inlen = 0;
+	mfd->inpos = 0;
+	mfd->inframe = 0;
+	mfd->errstr = NULL;
+	return lseek(mfd->fd, 0, SEEK_SET) == 0 ? 0 : -1;
+}
+
+/* Returns the number of bytes read, 0 at the end of the file or -1 on error */
+static ssize_t inbuf_fill(struct metafd *mfd)
+{
+	ssize_t ret;
+
+	do {
+		ret = read(mfd->fd, mfd->inbuf, RESTORE_INBUF_SIZE);
+	} while (ret < 0 && errno == EINTR);
+	mfd->inlen = ret > 0 ? ret : 0;
+	mfd->inpos = 0;
+	if (ret == 0 && mfd->inframe) {
+		mfd->errstr = "Unexpected end of file";
+		return -1;
+	}
+	if (ret == 0)
+		mfd->eof = 1;
+	return ret;
+}
+
+static const char *inbuf_strerr(struct metafd *mfd)
+{
+	if (mfd->errstr != NULL)
+		return mfd->errstr;
+	return strerror(errno);
+}
+
+static int restore_try_method(struct metafd *mfd, const char *name)
+{
+	restore_left = mfd->read(mfd, restore_buf, RESTORE_BUF_SIZE);
+	if (restore_left < RESTORE_MIN_LEN) {
+		fprintf(stderr, "Failed to decompress %s data: %s\n", name,
+		        restore_left < 0 ? mfd->strerr(mfd) : "File is too short");
 		return -1;
+	}
 	return 0;
 }
+#endif
+
+/* zstd compression method */
+
+#ifdef HAVE_ZSTD
+static int zstd_read(struct metafd *mfd, void *buf, unsigned len)
+{
+	ZSTD_outBuffer out = { .dst = buf, .size = len, .pos = 0 };
+
+	while (out.pos < out.size) {
+		ZSTD_inBuffer in = { .src = mfd->inbuf, .size = mfd->inlen, .pos = mfd->inpos };
+		size_t outpos = out.pos;
+		size_t ret;
+
+		ret = ZSTD_decompressStream(mfd->zstdfd, &out, &in);
+		if (ZSTD_isError(ret)) {
+			mfd->errstr = ZSTD_getErrorName(ret);
+			return -1;
+		}
+		/* ret is 0 at the end of a frame */
+		if (out.pos != outpos || in.pos != mfd->inpos)
+			mfd->inframe = (ret != 0);
+		mfd->inpos = in.pos;
+		/* zstd may still have output buffered when the input runs out */
+		if (out.pos == outpos && in.pos == in.size) {
+			ssize_t n = inbuf_fill(mfd);
+
+			if (n < 0)
+				return -1;
+			if (n == 0)
+				break;
+		}
+	}
+	return out.pos;
+}
+
+static void zstd_close(struct metafd *mfd)
+{
+	ZSTD_freeDStream(mfd->zstdfd);
+	free(mfd->inbuf);
+	close(mfd->fd);
+}
+#endif /* HAVE_ZSTD */
+
+/* Returns 1 if the file is not zstd-compressed */
+static int restore_try_zstd(struct metafd *mfd)
+{
+	if (!restore_check_magic(mfd, ZSTD_FRAME_MAGIC))
+		return 1;
+#ifdef HAVE_ZSTD
+	mfd->read = zstd_read;
+	mfd->close = zstd_close;
+	mfd->strerr = inbuf_strerr;
+	mfd->zstdfd = ZSTD_createDStream();
+	if (mfd->zstdfd == NULL || inbuf_open(mfd) != 0) {
+		perror("Failed to set up zstd decompression");
+		return -1;
+	}
+	ZSTD_initDStream(mfd->zstdfd);
+	return restore_try_method(mfd, "zstd");
+#else
+	fprintf(stderr, "The metadata file is compressed with zstd, which is not supported by this build\n");
+	return -1;
+#endif
+}
+
+/* lz4 compression method */
+
+#ifdef HAVE_LZ4
+static int lz4_read(struct metafd *mfd, void *buf, unsigned len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		size_t outlen = len - done;
+		size_t inlen = mfd->inlen - mfd->inpos;
+		size_t ret;
+
+		ret = LZ4F_decompress(mfd->lz4fd, (char *)buf + done, &outlen,
+		                      mfd->inbuf + mfd->inpos, &inlen, NULL);
+		if (LZ4F_isError(ret)) {
+			mfd->errstr = LZ4F_getErrorName(ret);
+			return -1;
+		}
+		/* ret is 0 at the end of a frame */
+		if (outlen != 0 || inlen != 0)
+			mfd->inframe = (ret != 0);
+		mfd->inpos += inlen;
+		done += outlen;
+		if (outlen == 0 && mfd->inpos == mfd->inlen) {
+			ssize_t n = inbuf_fill(mfd);
+
+			if (n < 0)
+				return -1;
+			if (n == 0)
+				break;
+		}
+	}
+	return done;
+}
+
+static void lz4_close(struct metafd *mfd)
+{
+	LZ4F_freeDecompressionContext(mfd->lz4fd);
+	free(mfd->inbuf);
+	close(mfd->fd);
+}
+#endif /* HAVE_LZ4 */
+
+/* Returns 1 if the file is not lz4-compressed */
+static int restore_try_lz4(struct metafd *mfd)
+{
+	if (!restore_check_magic(mfd, LZ4_FRAME_MAGIC))
+		return 1;
+#ifdef HAVE_LZ4
+	mfd->read = lz4_read;
+	mfd->close = lz4_close;
+	mfd->strerr = inbuf_strerr;
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&mfd->lz4fd, LZ4F_VERSION)) ||
+	    inbuf_open(mfd) != 0) {
+		perror("Failed to set up lz4 decompression");
+		return -1;
+	}
+	return restore_try_method(mfd, "lz4");
+#else
+	fprintf(stderr, "The metadata file is compressed with lz4, which is not supported by this build\n");
+	return -1;
+#endif
+}
 
 static uint64_t blks_saved;
 static uint64_t journal_blocks[MAX_JOURNALS_SAVED];
@@ -421,19 +833,21 @@ static void report_progress(uint64_t pblock, int force)
 /**
  * Open a file and prepare it for writing by savemeta()
  * out_fn: the path to the file, which will be truncated if it exists
- * gziplevel: 0   - do not compress the file,
- *            1-9 - use gzip compression level 1-9
+ * level: 0    - do not compress the file,
+ *        >0   - the compression level
  * Returns a struct metafd containing the opened file descriptor
+ *
+ * The data is compressed before it is passed to savemetawrite(), see
+ * struct save_method.
  */
-static struct metafd savemetaopen(char *out_fn, int gziplevel)
+static struct metafd savemetaopen(char *out_fn, int level)
 {
 	struct metafd mfd = {0};
-	char gzmode[3] = "w9";
 	char dft_fn[] = DFT_SAVE_FILE;
 	mode_t mask = umask(S_IXUSR | S_IRWXG | S_IRWXO);
 	struct stat st;
 
-	mfd.gziplevel = gziplevel;
+	mfd.level = level;
 
 	if (!out_fn) {
 		out_fn = dft_fn;
@@ -457,16 +871,6 @@ static struct metafd savemetaopen(char *out_fn, int gziplevel)
 		exit(1);
 	}
 
-	if (gziplevel > 0) {
-		gzmode[1] = '0' + gziplevel;
-		mfd.gzfd = gzdopen(mfd.fd, gzmode);
-		if (!mfd.gzfd) {
-			fprintf(stderr, "gzdopen error: %s\n", strerror(errno));
-			exit(1);
-		}
-		gzbuffer(mfd.gzfd, (1<<20)); /* Increase zlib's buffers to 1MB */
-	}
-
 	return mfd;
 }
 
@@ -479,22 +883,18 @@ static struct metafd savemetaopen(char *out_fn, int gziplevel)
  */
 static ssize_t savemetawrite(struct metafd *mfd, const void *buf, size_t nbyte)
 {
-	ssize_t ret;
-	int gzerr;
-	const char *gzerrmsg;
+	size_t done = 0;
 
-	if (mfd->gziplevel == 0) {
-		return write(mfd->fd, buf, nbyte);
-	}
+	while (done < nbyte) {
+		ssize_t ret = write(mfd->fd, (const char *)buf + done, nbyte - done);
 
-	ret = gzwrite(mfd->gzfd, buf, nbyte);
-	if (ret != nbyte) {
-		gzerrmsg = gzerror(mfd->gzfd, &gzerr);
-		if (gzerr != Z_ERRNO) {
-			fprintf(stderr, "Error: zlib: %s\n", gzerrmsg);
-		}
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return done ? (ssize_t)done : ret;
+		done += ret;
 	}
-	return ret;
+	return done;
 }
 
 /**
@@ -504,50 +904,354 @@ static ssize_t savemetawrite(struct metafd *mfd, const void *buf, size_t nbyte)
  */
 static int savemetaclose(struct metafd *mfd)
 {
-	int gzret;
-	if (mfd->gziplevel > 0) {
-		gzret = gzclose(mfd->gzfd);
-		if (gzret == Z_STREAM_ERROR) {
-			fprintf(stderr, "gzclose: file is not valid\n");
-			return -1;
-		} else if (gzret == Z_ERRNO) {
-			return -1;
+	return close(mfd->fd);
+}
+
+/*
+ * Saving is split between reader threads, which each walk a resource group at
+ * a time and gather the records they find in chunks, and the main thread,
+ * which writes the chunks out in resource group order. The output is the same
+ * as if the resource groups had been walked in turn by one thread.
+ *
+ * When the output is compressed, each chunk is compressed separately so that
+ * chunks can be compressed in parallel, by helper threads and by the writer.
+ */
+
+/* Records are gathered in chunks of this size before being written out */
+#define SAVE_CHUNK_SIZE (1 << 20)
+/* Readers wait when this much is queued, unless the writer is waiting on them */
+#define SAVE_QUEUE_MAX (64 * SAVE_CHUNK_SIZE)
+#define SAVE_MAX_THREADS (16)
+/* Chunks are also handed over when they have this many block hashes */
+#define SAVE_CHUNK_HASHES (1 << 16)
+
+enum {
+	CHUNK_QUEUED,       /* Waiting to be compressed */
+	CHUNK_COMPRESSING,  /* Being compressed by a helper thread */
+	CHUNK_READY,        /* Ready to be written */
+};
+
+struct save_chunk {
+	struct save_chunk *next;
+	uint64_t first_blk;  /* Lowest block in the chunk */
+	uint64_t max_blk;  /* Highest block in the chunk */
+	uint64_t last_blk;  /* For progress reports */
+	unsigned nrec;
+	int state;
+	size_t len;
+	char *zdata;  /* The compressed form of data */
+	size_t zlen;
+	struct savemeta_hash *hashes;  /* Hashes of the blocks read for the chunk */
+	unsigned nhashes;
+	unsigned hashes_size;
+	char data[SAVE_CHUNK_SIZE];
+};
+
+/* The records of a resource group, or of the superblock if rgd is NULL */
+struct save_job {
+	struct save_job *next;
+	struct lgfs2_rgrp_tree *rgd;
+	struct save_chunk *chunks;  /* Complete chunks in the order they were filled */
+	struct save_chunk **chunks_tail;
+	int done;
+};
+
+static char *save_zalloc(size_t bound)
+{
+	char *p = malloc(bound);
+
+	if (p == NULL) {
+		perror("Failed to compress metadata");
+		exit(1);
+	}
+	return p;
+}
+
+/* Compress a buffer into a gzip member of its own */
+static size_t gzip_compress(const char *buf, size_t len, int level, char **zdata)
+{
+	z_stream zs = {0};
+	uLong bound;
+	int ret;
+
+	ret = deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+	if (ret != Z_OK) {
+		fprintf(stderr, "Error: zlib: %s\n", zs.msg ? zs.msg : zError(ret));
+		exit(1);
+	}
+	bound = deflateBound(&zs, len);
+	*zdata = save_zalloc(bound);
+	zs.next_in = (Bytef *)buf;
+	zs.avail_in = len;
+	zs.next_out = (Bytef *)*zdata;
+	zs.avail_out = bound;
+	ret = deflate(&zs, Z_FINISH);
+	if (ret != Z_STREAM_END) {
+		fprintf(stderr, "Error: zlib: %s\n", zs.msg ? zs.msg : zError(ret));
+		exit(1);
+	}
+	deflateEnd(&zs);
+	return bound - zs.avail_out;
+}
+
+#ifdef HAVE_ZSTD
+/* Compress a buffer into a zstd frame of its own */
+static size_t zstd_compress(const char *buf, size_t len, int level, char **zdata)
+{
+	size_t bound = ZSTD_compressBound(len);
+	ZSTD_CCtx *cctx = ZSTD_createCCtx();
+	size_t ret;
+
+	if (cctx == NULL) {
+		perror("Failed to compress metadata");
+		exit(1);
+	}
+	*zdata = save_zalloc(bound);
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+	ret = ZSTD_compress2(cctx, *zdata, bound, buf, len);
+	if (ZSTD_isError(ret)) {
+		fprintf(stderr, "Error: zstd: %s\n", ZSTD_getErrorName(ret));
+		exit(1);
+	}
+	ZSTD_freeCCtx(cctx);
+	return ret;
+}
+#endif
+
+#ifdef HAVE_LZ4
+/* Compress a buffer into an lz4 frame of its own */
+static size_t lz4_compress(const char *buf, size_t len, int level, char **zdata)
+{
+	LZ4F_preferences_t prefs = {
+		.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled,
+		.compressionLevel = level,
+	};
+	size_t bound = LZ4F_compressFrameBound(len, &prefs);
+	size_t ret;
+
+	*zdata = save_zalloc(bound);
+	ret = LZ4F_compressFrame(*zdata, bound, buf, len, &prefs);
+	if (LZ4F_isError(ret)) {
+		fprintf(stderr, "Error: lz4: %s\n", LZ4F_getErrorName(ret));
+		exit(1);
+	}
+	return ret;
+}
+#endif
+
+/*
+ * The compression methods savemeta can write. Each chunk is compressed
+ * independently and the results are concatenated, which the tools and
+ * libraries for all of these formats read as a single stream.
+ */
+struct save_method {
+	const char *name;
+	unsigned id;  /* For the file trailer */
+	int dftlevel;
+	int maxlevel;
+	size_t (*compress)(const char *buf, size_t len, int level, char **zdata);
+};
+
+static const struct save_method save_methods[] = {
+	{ "gzip", SAVEMETA_GZIP, 9, 9, gzip_compress },
+#ifdef HAVE_ZSTD
+	{ "zstd", SAVEMETA_ZSTD, 3, 19, zstd_compress },
+#endif
+#ifdef HAVE_LZ4
+	{ "lz4", SAVEMETA_LZ4, 1, 12, lz4_compress },
+#endif
+};
+
+static const struct save_method *save_method_find(const char *name)
+{
+	for (unsigned i = 0; i < sizeof(save_methods) / sizeof(save_methods[0]); i++)
+		if (!strcmp(save_methods[i].name, name))
+			return &save_methods[i];
+	return NULL;
+}
+
+struct save_pipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;  /* Signalled when a chunk is queued or a job is done */
+	pthread_cond_t space;  /* Signalled when the writer has made progress */
+	struct osi_node *next_rgrp;  /* The next resource group to be walked */
+	struct save_job *jobs;  /* Jobs not yet written, in output order */
+	struct save_job **jobs_tail;
+	size_t queued;  /* Bytes in the queued chunks */
+	pthread_cond_t work;  /* Signalled when there is a chunk to compress */
+	const struct save_method *method;
+	int level;  /* Compression level or 0 for no compression */
+	int stop;  /* Tells the compression threads to exit */
+	int withcontents;
+	int trim;  /* Drop trailing zeroes from records */
+	const struct blkmap *base;  /* Block hashes of the base capture, if incremental */
+	time_t base_time;
+	uint64_t sb_addr;
+	unsigned format;  /* Format 1 files have no index, trailer or hashes */
+	/* Only used by the writer */
+	uint64_t offset;  /* Bytes written to the file */
+	struct savemeta_index *index;
+	uint64_t entries;
+	uint64_t index_size;  /* Number of entries allocated */
+};
+
+/* A reader thread's view of the pipeline */
+struct save_ctx {
+	struct save_pipeline *sp;
+	struct save_job *job;
+	struct save_chunk *cur;  /* The chunk being filled */
+};
+
+static struct save_job *save_job_new(struct save_pipeline *sp, struct lgfs2_rgrp_tree *rgd)
+{
+	struct save_job *job = calloc(1, sizeof(*job));
+
+	if (job == NULL) {
+		perror("Failed to save metadata");
+		exit(1);
+	}
+	job->rgd = rgd;
+	job->chunks_tail = &job->chunks;
+	*sp->jobs_tail = job;
+	sp->jobs_tail = &job->next;
+	return job;
+}
+
+/* Hand the current chunk over to the writer */
+static void save_chunk_queue(struct save_ctx *sc)
+{
+	struct save_pipeline *sp = sc->sp;
+	struct save_job *job = sc->job;
+
+	if (sc->cur == NULL)
+		return;
+	pthread_mutex_lock(&sp->lock);
+	*job->chunks_tail = sc->cur;
+	job->chunks_tail = &sc->cur->next;
+	sp->queued += sc->cur->len + sc->cur->nhashes * sizeof(struct savemeta_hash);
+	sc->cur->state = sp->level ? CHUNK_QUEUED : CHUNK_READY;
+	pthread_cond_signal(&sp->ready);
+	if (sp->level)
+		pthread_cond_signal(&sp->work);
+	/* The writer can only drain the oldest job so don't wait if this is it */
+	while (sp->queued > SAVE_QUEUE_MAX && sp->jobs != job)
+		pthread_cond_wait(&sp->space, &sp->lock);
+	pthread_mutex_unlock(&sp->lock);
+	sc->cur = NULL;
+}
+
+static void save_job_done(struct save_ctx *sc)
+{
+	struct save_pipeline *sp = sc->sp;
+
+	save_chunk_queue(sc);
+	pthread_mutex_lock(&sp->lock);
+	sc->job->done = 1;
+	pthread_cond_signal(&sp->ready);
+	pthread_mutex_unlock(&sp->lock);
+	sc->job = NULL;
+}
+
+/* Reserve len bytes at the end of the current chunk */
+static char *save_space(struct save_ctx *sc, size_t len)
+{
+	struct save_chunk *c = sc->cur;
+	char *p;
+
+	if (c != NULL && c->len + len > SAVE_CHUNK_SIZE) {
+		save_chunk_queue(sc);
+		c = NULL;
+	}
+	if (c == NULL) {
+		c = sc->cur = malloc(sizeof(*c));
+		if (c == NULL) {
+			perror("Failed to save block");
+			exit(1);
 		}
+		c->next = NULL;
+		c->nrec = 0;
+		c->len = 0;
+		c->zdata = NULL;
+		c->zlen = 0;
+		c->hashes = NULL;
+		c->nhashes = 0;
+		c->hashes_size = 0;
+		c->first_blk = 0;
+		c->max_blk = 0;
+		c->last_blk = 0;
 	}
-	return close(mfd->fd);
+	p = c->data + c->len;
+	c->len += len;
+	return p;
+}
+
+/* Note the hash of a block in the current chunk */
+static void save_hash(struct save_ctx *sc, uint64_t addr, uint64_t hash)
+{
+	struct save_chunk *c = sc->cur;
+	struct savemeta_hash *hs;
+
+	if (c->nhashes == c->hashes_size) {
+		c->hashes_size = c->hashes_size ? c->hashes_size * 2 : 256;
+		c->hashes = realloc(c->hashes, c->hashes_size * sizeof(*c->hashes));
+		if (c->hashes == NULL) {
+			perror("Failed to save block");
+			exit(1);
+		}
+	}
+	hs = &c->hashes[c->nhashes++];
+	hs->hs_blk = cpu_to_be64(addr);
+	hs->hs_hash = cpu_to_be64(hash);
+	if (c->nhashes == SAVE_CHUNK_HASHES)
+		save_chunk_queue(sc);
 }
 
-static int save_buf(struct metafd *mfd, const char *buf, uint64_t addr, unsigned blklen)
+static int save_buf(struct save_ctx *sc, const char *buf, uint64_t addr, unsigned blklen)
 {
-	struct saved_metablock *savedata;
-	size_t outsz;
+	struct saved_metablock savedata;
+	const struct blkmap *base = sc->sp->base;
+	unsigned siglen = blklen;
+	uint64_t hash = 0;
+	char *p;
 
 	/* No need to save trailing zeroes, but leave that for compression to
 	   deal with when enabled as this adds a significant overhead */
-	if (mfd->gziplevel == 0)
-		for (; blklen > 0 && buf[blklen - 1] == '\0'; blklen--);
+	if (sc->sp->trim || base != NULL)
+		siglen = block_siglen(buf, blklen);
+	if (sc->sp->trim)
+		blklen = siglen;
 
 	if (blklen == 0) /* No significant data; skip. */
 		return 0;
 
-	outsz = sizeof(*savedata) + blklen;
-	savedata = calloc(1, outsz);
-	if (savedata == NULL) {
-		perror("Failed to save block");
-		exit(1);
-	}
-	savedata->blk = cpu_to_be64(addr);
-	savedata->siglen = cpu_to_be16(blklen);
-	memcpy(savedata + 1, buf, blklen);
-
-	if (savemetawrite(mfd, savedata, outsz) != outsz) {
-		fprintf(stderr, "write error: %s from %s:%d: block %"PRIu64"\n",
-		        strerror(errno), __FUNCTION__, __LINE__, addr);
-		free(savedata);
-		exit(-1);
+	if (base != NULL) {
+		uint64_t i = blkmap_find(base, addr);
+
+		hash = block_hash(buf, siglen);
+		/* Unchanged since the base capture so only the hash is needed. The
+		   superblock is always saved as restoring starts from it. */
+		if (addr != sc->sp->sb_addr && i != BLKMAP_NONE && base->slots[i].hash == hash) {
+			if (sc->cur == NULL)
+				save_space(sc, 0);
+			sc->cur->last_blk = addr;
+			save_hash(sc, addr, hash);
+			return 0;
+		}
 	}
-	blks_saved++;
-	free(savedata);
+	p = save_space(sc, sizeof(savedata) + blklen);
+	savedata.blk = cpu_to_be64(addr);
+	savedata.siglen = cpu_to_be16(blklen);
+	memcpy(p, &savedata, sizeof(savedata));
+	memcpy(p + sizeof(savedata), buf, blklen);
+	if (sc->cur->nrec == 0 || addr < sc->cur->first_blk)
+		sc->cur->first_blk = addr;
+	if (sc->cur->nrec == 0 || addr > sc->cur->max_blk)
+		sc->cur->max_blk = addr;
+	sc->cur->last_blk = addr;
+	sc->cur->nrec++;
+	if (base != NULL)
+		save_hash(sc, addr, hash);
 	return 0;
 }
 
@@ -562,7 +1266,9 @@ struct block_range {
 
 static int block_range_prepare(struct block_range *br)
 {
-	br->buf = calloc(br->len, sbd.sd_bsize + sizeof(*br->blktype) + sizeof(*br->blklen));
+	/* Not zeroed: the blocks are read in full and block_range_setinfo()
+	   fills in the type and length of each one before they are used */
+	br->buf = malloc(br->len * (sbd.sd_bsize + sizeof(*br->blktype) + sizeof(*br->blklen)));
 	if (br->buf == NULL) {
 		perror("Failed to allocate block range buffer");
 		return 1;
@@ -630,12 +1336,12 @@ static struct block_range *block_range_queue_pop(struct block_range_queue *q)
 	return br;
 }
 
-static int save_range(struct metafd *mfd, struct block_range *br)
+static int save_range(struct save_ctx *sc, struct block_range *br)
 {
 	for (unsigned i = 0; i < br->len; i++) {
 		int err;
 
-		err = save_buf(mfd, br->buf + (i * sbd.sd_bsize), br->start + i, br->blklen[i]);
+		err = save_buf(sc, br->buf + (i * sbd.sd_bsize), br->start + i, br->blklen[i]);
 		if (err != 0)
 			return err;
 	}
@@ -683,7 +1389,7 @@ static char *check_read_block(int fd, uint64_t blk, uint64_t owner, int *blktype
 /*
  * save_ea_block - save off an extended attribute block
  */
-static void save_ea_block(struct metafd *mfd, char *buf, uint64_t owner)
+static void save_ea_block(struct save_ctx *sc, char *buf, uint64_t owner)
 {
 	struct gfs2_ea_header *ea;
 	uint32_t rec_len = 0;
@@ -708,7 +1414,7 @@ static void save_ea_block(struct metafd *mfd, char *buf, uint64_t owner)
 			blk = be64_to_cpu(*b);
 			_buf = check_read_block(sbd.device_fd, blk, owner, NULL, NULL);
 			if (_buf != NULL) {
-				save_buf(mfd, _buf, blk, sbd.sd_bsize);
+				save_buf(sc, _buf, blk, sbd.sd_bsize);
 				free(_buf);
 			}
 		}
@@ -718,7 +1424,7 @@ static void save_ea_block(struct metafd *mfd, char *buf, uint64_t owner)
 	}
 }
 
-static void save_indirect_range(struct metafd *mfd, struct block_range **brp, uint64_t owner,
+static void save_indirect_range(struct save_ctx *sc, struct block_range **brp, uint64_t owner,
                                 struct block_range_queue *q)
 {
 	struct block_range *br = *brp;
@@ -726,10 +1432,10 @@ static void save_indirect_range(struct metafd *mfd, struct block_range **brp, ui
 	if (check_read_range(sbd.device_fd, br, owner) != 0)
 		return;
 
-	save_range(mfd, br);
+	save_range(sc, br);
 	for (unsigned i = 0; i < br->len; i++) {
 		if (br->blktype[i] == GFS2_METATYPE_EA)
-			save_ea_block(mfd, br->buf + (i * sbd.sd_bsize), owner);
+			save_ea_block(sc, br->buf + (i * sbd.sd_bsize), owner);
 	}
 	if (q) {
 		block_range_queue_insert(q, br);
@@ -740,7 +1446,7 @@ static void save_indirect_range(struct metafd *mfd, struct block_range **brp, ui
 	}
 }
 
-static void save_indirect_blocks(struct metafd *mfd, char *buf, uint64_t owner,
+static void save_indirect_blocks(struct save_ctx *sc, char *buf, uint64_t owner,
                                  struct block_range_queue *q, unsigned headsize)
 {
 	uint64_t old_block = 0, indir_block;
@@ -769,7 +1475,7 @@ new_range:
 		} else if (indir_block == br->start + br->len) {
 			br->len++;
 		} else {
-			save_indirect_range(mfd, &br, owner, q);
+			save_indirect_range(sc, &br, owner, q);
 			if (br == NULL) /* This one was queued up for later */
 				goto new_range;
 			br->start = indir_block;
@@ -777,11 +1483,11 @@ new_range:
 		}
 	}
 	if (br != NULL && br->start != 0)
-		save_indirect_range(mfd, &br, owner, q);
+		save_indirect_range(sc, &br, owner, q);
 	free(br);
 }
 
-static int save_leaf_chain(struct metafd *mfd, struct lgfs2_sbd *sdp, char *buf)
+static int save_leaf_chain(struct save_ctx *sc, struct lgfs2_sbd *sdp, char *buf)
 {
 	struct gfs2_leaf *leaf = (struct gfs2_leaf *)buf;
 
@@ -798,9 +1504,8 @@ static int save_leaf_chain(struct metafd *mfd, struct lgfs2_sbd *sdp, char *buf)
 			        blk, strerror(errno));
 			return 1;
 		}
-		report_progress(blk, 0);
 		if (lgfs2_check_meta(buf, GFS2_METATYPE_LF) == 0) {
-			int ret = save_buf(mfd, buf, blk, sdp->sd_bsize);
+			int ret = save_buf(sc, buf, blk, sdp->sd_bsize);
 			if (ret != 0)
 				return ret;
 		}
@@ -809,7 +1514,7 @@ static int save_leaf_chain(struct metafd *mfd, struct lgfs2_sbd *sdp, char *buf)
 	return 0;
 }
 
-static void save_leaf_blocks(struct metafd *mfd, struct block_range_queue *q)
+static void save_leaf_blocks(struct save_ctx *sc, struct block_range_queue *q)
 {
 	while (q->tail != NULL) {
 		struct block_range *br = q->tail;
@@ -817,7 +1522,7 @@ static void save_leaf_blocks(struct metafd *mfd, struct block_range_queue *q)
 		for (unsigned i = 0; i < br->len; i++) {
 			char *buf = br->buf + (i * sbd.sd_bsize);
 
-			save_leaf_chain(mfd, &sbd, buf);
+			save_leaf_chain(sc, &sbd, buf);
 		}
 		q->tail = br->next;
 		block_range_free(&br);
@@ -827,7 +1532,7 @@ static void save_leaf_blocks(struct metafd *mfd, struct block_range_queue *q)
 /*
  * save_inode_data - save off important data associated with an inode
  *
- * mfd - destination file descriptor
+ * sc - where the records are gathered
  * buf - buffer containing the inode block
  * iblk - block number of the inode to save the data for
  *
@@ -840,7 +1545,7 @@ static void save_leaf_blocks(struct metafd *mfd, struct block_range_queue *q)
  * For file system journals, the "data" is a mixture of metadata and
  * journaled data.  We want all the metadata and none of the user data.
  */
-static void save_inode_data(struct metafd *mfd, char *ibuf, uint64_t iblk)
+static void save_inode_data(struct save_ctx *sc, char *ibuf, uint64_t iblk)
 {
 	struct block_range_queue indq[GFS2_MAX_META_HEIGHT] = {{NULL}};
 	struct gfs2_dinode *dip = (struct gfs2_dinode *)ibuf;
@@ -867,9 +1572,9 @@ static void save_inode_data(struct metafd *mfd, char *ibuf, uint64_t iblk)
 		height--;
 
 	if (height == 1)
-		save_indirect_blocks(mfd, ibuf, iblk, NULL, sizeof(*dip));
+		save_indirect_blocks(sc, ibuf, iblk, NULL, sizeof(*dip));
 	else if (height > 1)
-		save_indirect_blocks(mfd, ibuf, iblk, &indq[0], sizeof(*dip));
+		save_indirect_blocks(sc, ibuf, iblk, &indq[0], sizeof(*dip));
 
 	for (unsigned i = 1; i < height; i++) {
 		struct block_range_queue *nextq = &indq[i];
@@ -885,14 +1590,13 @@ static void save_inode_data(struct metafd *mfd, char *ibuf, uint64_t iblk)
 			for (unsigned j = 0; j < q->len; j++) {
 				char *_buf = q->buf + (j * sbd.sd_bsize);
 
-				save_indirect_blocks(mfd, _buf, iblk, nextq, sizeof(dip->di_header));
+				save_indirect_blocks(sc, _buf, iblk, nextq, sizeof(dip->di_header));
 			}
-			report_progress(q->start + q->len, 0);
 			block_range_free(&q);
 		}
 	}
 	if (is_exhash)
-		save_leaf_blocks(mfd, &indq[height - 1]);
+		save_leaf_blocks(sc, &indq[height - 1]);
 	if (dip->di_eattr) { /* if this inode has extended attributes */
 		size_t blklen;
 		uint64_t blk;
@@ -902,11 +1606,11 @@ static void save_inode_data(struct metafd *mfd, char *ibuf, uint64_t iblk)
 		blk = be64_to_cpu(dip->di_eattr);
 		buf = check_read_block(sbd.device_fd, blk, iblk, &mhtype, &blklen);
 		if (buf != NULL) {
-			save_buf(mfd, buf, blk, blklen);
+			save_buf(sc, buf, blk, blklen);
 			if (mhtype == GFS2_METATYPE_EA)
-				save_ea_block(mfd, buf, iblk);
+				save_ea_block(sc, buf, iblk);
 			else if (mhtype == GFS2_METATYPE_IN)
-				save_indirect_blocks(mfd, buf, iblk, NULL, sizeof(dip->di_header));
+				save_indirect_blocks(sc, buf, iblk, NULL, sizeof(dip->di_header));
 			free(buf);
 		}
 	}
@@ -937,17 +1641,17 @@ static void get_journal_inode_blocks(void)
 	}
 }
 
-static void save_allocated_range(struct metafd *mfd, struct block_range *br)
+static void save_allocated_range(struct save_ctx *sc, struct block_range *br)
 {
 	if (check_read_range(sbd.device_fd, br, 0) != 0)
 		return;
 
-	save_range(mfd, br);
+	save_range(sc, br);
 	for (unsigned i = 0; i < br->len; i++) {
 		char *buf = br->buf + (i * sbd.sd_bsize);
 
 		if (br->blktype[i] == GFS2_METATYPE_DI)
-			save_inode_data(mfd, buf, br->start + i);
+			save_inode_data(sc, buf, br->start + i);
 	}
 	free(br->buf);
 }
@@ -959,7 +1663,7 @@ static int uint64_cmp(const void *_a, const void *_b)
 	return (a < b) ? -1 : ((a > b) ? 1 : 0);
 }
 
-static void save_allocated(struct lgfs2_rgrp_tree *rgd, struct metafd *mfd)
+static void save_allocated(struct lgfs2_rgrp_tree *rgd, struct save_ctx *sc)
 {
 	uint64_t blk = 0;
 	unsigned i, j, m, n;
@@ -982,14 +1686,13 @@ static void save_allocated(struct lgfs2_rgrp_tree *rgd, struct metafd *mfd)
 			} else if (blk == br.start + br.len) {
 				br.len++;
 			} else {
-				save_allocated_range(mfd, &br);
+				save_allocated_range(sc, &br);
 				br.start = blk;
 				br.len = 1;
 			}
-			report_progress(blk, 0);
 		}
 		if (br.start != 0)
-			save_allocated_range(mfd, &br);
+			save_allocated_range(sc, &br);
 	}
 	free(ibuf);
 }
@@ -1014,7 +1717,7 @@ static char *rgrp_read(struct lgfs2_sbd *sdp, uint64_t addr, unsigned blocks)
 	return buf;
 }
 
-static void save_rgrp(struct lgfs2_sbd *sdp, struct metafd *mfd, struct lgfs2_rgrp_tree *rgd, int withcontents)
+static void save_rgrp(struct lgfs2_sbd *sdp, struct save_ctx *sc, struct lgfs2_rgrp_tree *rgd, int withcontents)
 {
 	uint64_t addr = rgd->rt_addr;
 	char *buf;
@@ -1028,64 +1731,376 @@ static void save_rgrp(struct lgfs2_sbd *sdp, struct metafd *mfd, struct lgfs2_rg
 
 	log_debug("RG at %"PRIu64" is %"PRIu32" long\n", addr, rgd->rt_length);
 	/* Save the rg and bitmaps */
-	for (unsigned i = 0; i < rgd->rt_length; i++) {
-		report_progress(rgd->rt_addr + i, 0);
-		save_buf(mfd, buf + (i * sdp->sd_bsize), rgd->rt_addr + i, sdp->sd_bsize);
-	}
+	for (unsigned i = 0; i < rgd->rt_length; i++)
+		save_buf(sc, buf + (i * sdp->sd_bsize), rgd->rt_addr + i, sdp->sd_bsize);
 	/* Save the other metadata: inodes, etc. if mode is not 'savergs' */
 	if (withcontents)
-		save_allocated(rgd, mfd);
+		save_allocated(rgd, sc);
 
 	free(buf);
 	for (unsigned i = 0; i < rgd->rt_length; i++)
 		rgd->rt_bits[i].bi_data = NULL;
 }
 
-static int save_header(struct metafd *mfd, uint64_t fsbytes)
+/* Compress queued chunks, oldest first, until told to stop */
+static void *save_compressor(void *data)
 {
-	struct savemeta_header smh = {
-		.sh_magic = cpu_to_be32(SAVEMETA_MAGIC),
-		.sh_format = cpu_to_be32(SAVEMETA_FORMAT),
-		.sh_time = cpu_to_be64(time(NULL)),
-		.sh_fs_bytes = cpu_to_be64(fsbytes)
-	};
+	struct save_pipeline *sp = data;
 
-	if (savemetawrite(mfd, (char *)(&smh), sizeof(smh)) != sizeof(smh))
-		return -1;
-	return 0;
+	pthread_mutex_lock(&sp->lock);
+	while (!sp->stop) {
+		struct save_chunk *c = NULL;
+
+		for (struct save_job *job = sp->jobs; job != NULL && c == NULL; job = job->next)
+			for (c = job->chunks; c != NULL && c->state != CHUNK_QUEUED; c = c->next);
+		if (c == NULL) {
+			pthread_cond_wait(&sp->work, &sp->lock);
+			continue;
+		}
+		c->state = CHUNK_COMPRESSING;
+		pthread_mutex_unlock(&sp->lock);
+		if (c->len > 0)
+			c->zlen = sp->method->compress(c->data, c->len, sp->level, &c->zdata);
+		pthread_mutex_lock(&sp->lock);
+		c->state = CHUNK_READY;
+		pthread_cond_signal(&sp->ready);
+	}
+	pthread_mutex_unlock(&sp->lock);
+	return NULL;
 }
 
-static int parse_header(char *buf, struct savemeta *sm)
+static void *save_worker(void *data)
 {
-	struct savemeta_header *smh = (void *)buf;
+	struct save_ctx sc = { .sp = data };
+	struct save_pipeline *sp = sc.sp;
 
-	if (be32_to_cpu(smh->sh_magic) != SAVEMETA_MAGIC) {
-		printf("No valid file header found. Falling back to old format...\n");
-		return 1;
+	for (;;) {
+		struct lgfs2_rgrp_tree *rgd = NULL;
+
+		pthread_mutex_lock(&sp->lock);
+		if (sp->next_rgrp != NULL) {
+			rgd = (struct lgfs2_rgrp_tree *)sp->next_rgrp;
+			sp->next_rgrp = osi_next(sp->next_rgrp);
+			sc.job = save_job_new(sp, rgd);
+		}
+		pthread_mutex_unlock(&sp->lock);
+		if (rgd == NULL)
+			break;
+		save_rgrp(&sbd, &sc, rgd, sp->withcontents);
+		save_job_done(&sc);
 	}
-	if (be32_to_cpu(smh->sh_format) > SAVEMETA_FORMAT) {
+	return NULL;
+}
+
+static void save_index_add(struct save_pipeline *sp, uint64_t off, size_t clen, size_t ulen,
+                           uint64_t first, uint64_t last, uint32_t count, uint32_t flags)
+{
+	struct savemeta_index *si;
+
+	if (sp->format < 2)
+		return;
+	if (sp->entries == sp->index_size) {
+		uint64_t size = sp->index_size ? sp->index_size * 2 : 1024;
+
+		si = realloc(sp->index, size * sizeof(*si));
+		if (si == NULL) {
+			perror("Failed to index metadata");
+			exit(1);
+		}
+		sp->index = si;
+		sp->index_size = size;
+	}
+	si = &sp->index[sp->entries++];
+	memset(si, 0, sizeof(*si));
+	si->si_offset = cpu_to_be64(off);
+	si->si_clen = cpu_to_be32(clen);
+	si->si_ulen = cpu_to_be32(ulen);
+	if (count > 0) {
+		si->si_first = cpu_to_be64(first);
+		si->si_last = cpu_to_be64(last);
+		si->si_count = cpu_to_be32(count);
+	}
+	si->si_flags = cpu_to_be32(flags);
+}
+
+static int save_skip_gzip(struct save_pipeline *sp)
+{
+	return sp->level > 0 && sp->method->id == SAVEMETA_GZIP;
+}
+
+/* Write data in a frame which is skipped when the file is decompressed */
+static void save_skippable(struct save_pipeline *sp, struct metafd *mfd, const void *data, uint16_t len)
+{
+	static const uint8_t gz_tail[SKIP_GZ_TAIL_LEN] = {
+		0x03, 0x00, /* An empty deflate stream, then the crc and size of nothing */
+	};
+	uint8_t hdr[SKIP_GZ_HDR_LEN] = {0};
+	size_t hlen = SKIP_HDR_LEN;
+
+	if (save_skip_gzip(sp)) {
+		hdr[0] = 0x1f;
+		hdr[1] = 0x8b;
+		hdr[2] = 8; /* deflate */
+		hdr[3] = 4; /* FEXTRA */
+		hdr[9] = 255; /* Unknown OS */
+		hdr[10] = (len + 4) & 0xff;
+		hdr[11] = (len + 4) >> 8;
+		hdr[12] = SKIP_GZ_ID1;
+		hdr[13] = SKIP_GZ_ID2;
+		hdr[14] = len & 0xff;
+		hdr[15] = len >> 8;
+		hlen = SKIP_GZ_HDR_LEN;
+	} else {
+		uint32_t magic = cpu_to_le32(SKIP_MAGIC);
+		uint32_t size = cpu_to_le32(len);
+
+		memcpy(hdr, &magic, sizeof(magic));
+		memcpy(hdr + 4, &size, sizeof(size));
+	}
+	if (savemetawrite(mfd, hdr, hlen) != hlen ||
+	    savemetawrite(mfd, data, len) != len)
+		goto write_err;
+	sp->offset += hlen + len;
+	if (hlen == SKIP_GZ_HDR_LEN) {
+		if (savemetawrite(mfd, gz_tail, sizeof(gz_tail)) != sizeof(gz_tail))
+			goto write_err;
+		sp->offset += sizeof(gz_tail);
+	}
+	return;
+write_err:
+	fprintf(stderr, "write error: %s from %s:%d\n", strerror(errno), __FUNCTION__, __LINE__);
+	exit(-1);
+}
+
+/* Write the index of the frames and the trailer which points to it */
+static void save_write_index(struct save_pipeline *sp, struct metafd *mfd)
+{
+	struct savemeta_trailer st = {
+		.st_magic = cpu_to_be32(SAVEMETA_MAGIC),
+		.st_method = cpu_to_be32(sp->level ? sp->method->id : SAVEMETA_NONE),
+		.st_index = cpu_to_be64(sp->offset),
+		.st_entries = cpu_to_be64(sp->entries),
+	};
+
+	for (uint64_t i = 0; i < sp->entries; i += SAVEMETA_INDEX_FRAME) {
+		uint64_t n = sp->entries - i;
+
+		if (n > SAVEMETA_INDEX_FRAME)
+			n = SAVEMETA_INDEX_FRAME;
+		save_skippable(sp, mfd, &sp->index[i], n * sizeof(*sp->index));
+	}
+	save_skippable(sp, mfd, &st, sizeof(st));
+	free(sp->index);
+	sp->index = NULL;
+}
+
+/* Write the hashes of a chunk's blocks in frames which the index points to */
+static void save_write_hashes(struct save_pipeline *sp, struct metafd *mfd, struct save_chunk *c)
+{
+	size_t hlen = save_skip_gzip(sp) ? SKIP_GZ_HDR_LEN : SKIP_HDR_LEN;
+
+	for (unsigned i = 0; i < c->nhashes; i += SAVEMETA_HASH_FRAME) {
+		unsigned n = c->nhashes - i;
+		const char *buf = (const char *)&c->hashes[i];
+		uint64_t first = UINT64_MAX, last = 0;
+		char *zdata = NULL;
+		size_t len;
+
+		if (n > SAVEMETA_HASH_FRAME)
+			n = SAVEMETA_HASH_FRAME;
+		for (unsigned j = i; j < i + n; j++) {
+			uint64_t blk = be64_to_cpu(c->hashes[j].hs_blk);
+
+			if (blk < first)
+				first = blk;
+			if (blk > last)
+				last = blk;
+		}
+		len = n * sizeof(*c->hashes);
+		if (sp->level > 0)
+			len = sp->method->compress(buf, len, sp->level, &zdata);
+		save_index_add(sp, sp->offset + hlen, len, n * sizeof(*c->hashes),
+		               first, last, n, SAVEMETA_HASHES);
+		save_skippable(sp, mfd, zdata ? zdata : buf, len);
+		free(zdata);
+	}
+}
+
+static void save_write_jobs(struct save_pipeline *sp, struct metafd *mfd)
+{
+	pthread_mutex_lock(&sp->lock);
+	for (;;) {
+		struct save_job *job = sp->jobs;
+		struct save_chunk *c;
+
+		if (job == NULL) {
+			if (sp->next_rgrp == NULL)
+				break;
+			pthread_cond_wait(&sp->ready, &sp->lock);
+			continue;
+		}
+		c = job->chunks;
+		if (c != NULL && c->state == CHUNK_COMPRESSING) {
+			pthread_cond_wait(&sp->ready, &sp->lock);
+		} else if (c != NULL) {
+			job->chunks = c->next;
+			if (job->chunks == NULL)
+				job->chunks_tail = &job->chunks;
+			sp->queued -= c->len + c->nhashes * sizeof(*c->hashes);
+			pthread_cond_broadcast(&sp->space);
+			pthread_mutex_unlock(&sp->lock);
+
+			/* Don't wait for a helper if none has picked it up yet */
+			if (c->state == CHUNK_QUEUED && c->len > 0)
+				c->zlen = sp->method->compress(c->data, c->len, sp->level, &c->zdata);
+			if (c->zdata != NULL) {
+				if (savemetawrite(mfd, c->zdata, c->zlen) != c->zlen)
+					goto write_err;
+				save_index_add(sp, sp->offset, c->zlen, c->len, c->first_blk,
+				               c->max_blk, c->nrec, 0);
+				sp->offset += c->zlen;
+			} else if (c->len > 0) {
+				if (savemetawrite(mfd, c->data, c->len) != c->len)
+					goto write_err;
+				save_index_add(sp, sp->offset, c->len, c->len, c->first_blk,
+				               c->max_blk, c->nrec, 0);
+				sp->offset += c->len;
+			}
+			save_write_hashes(sp, mfd, c);
+			blks_saved += c->nrec;
+			report_progress(c->last_blk, 0);
+			free(c->hashes);
+			free(c->zdata);
+			free(c);
+			pthread_mutex_lock(&sp->lock);
+		} else if (job->done) {
+			sp->jobs = job->next;
+			if (sp->jobs == NULL)
+				sp->jobs_tail = &sp->jobs;
+			free(job);
+			pthread_cond_broadcast(&sp->space);
+		} else {
+			pthread_cond_wait(&sp->ready, &sp->lock);
+		}
+	}
+	pthread_mutex_unlock(&sp->lock);
+	return;
+write_err:
+	fprintf(stderr, "write error: %s from %s:%d\n", strerror(errno), __FUNCTION__, __LINE__);
+	exit(-1);
+}
+
+/* Reading is mostly waiting for the device, so use more threads than cpus */
+static unsigned save_nthreads(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+
+	if (n < 4)
+		return 4;
+	if (n > SAVE_MAX_THREADS)
+		return SAVE_MAX_THREADS;
+	return n;
+}
+
+static void save_header(struct save_ctx *sc, uint64_t fsbytes)
+{
+	struct savemeta_header smh = {
+		.sh_magic = cpu_to_be32(SAVEMETA_MAGIC),
+		.sh_format = cpu_to_be32(sc->sp->format),
+		.sh_time = cpu_to_be64(time(NULL)),
+		.sh_fs_bytes = cpu_to_be64(fsbytes)
+	};
+
+	if (sc->sp->base != NULL) {
+		smh.sh_flags = cpu_to_be32(SAVEMETA_INCREMENTAL);
+		smh.sh_base_time = cpu_to_be64(sc->sp->base_time);
+	}
+
+	memcpy(save_space(sc, sizeof(smh)), &smh, sizeof(smh));
+	/* The header has a frame of its own */
+	save_chunk_queue(sc);
+}
+
+static int parse_header(char *buf, struct savemeta *sm)
+{
+	struct savemeta_header *smh = (void *)buf;
+
+	if (be32_to_cpu(smh->sh_magic) != SAVEMETA_MAGIC) {
+		printf("No valid file header found. Falling back to old format...\n");
+		return 1;
+	}
+	if (be32_to_cpu(smh->sh_format) > SAVEMETA_FORMAT) {
 		printf("This version of gfs2_edit is too old to restore this metadata format.\n");
 		return -1;
 	}
 	sm->sm_format = be32_to_cpu(smh->sh_format);
 	sm->sm_time = be64_to_cpu(smh->sh_time);
 	sm->sm_fs_bytes = be64_to_cpu(smh->sh_fs_bytes);
+	sm->sm_flags = be32_to_cpu(smh->sh_flags);
+	sm->sm_base_time = be64_to_cpu(smh->sh_base_time);
 	printf("Metadata saved at %s", ctime(&sm->sm_time)); /* ctime() adds \n */
+	if (sm->sm_flags & SAVEMETA_INCREMENTAL)
+		printf("Only blocks changed since %s", ctime(&sm->sm_base_time));
 	printf("File system size %.2fGB\n", sm->sm_fs_bytes / ((float)(1 << 30)));
 	return 0;
 }
 
-void savemeta(char *out_fn, int saveoption, int gziplevel)
+static time_t save_load_base(const char *path, struct blkmap *base);
+
+void savemeta(char *out_fn, int saveoption, const char *mname, int level, int zthreads,
+              const char *base_fn, int format)
 {
+	struct save_pipeline sp = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.ready = PTHREAD_COND_INITIALIZER,
+		.space = PTHREAD_COND_INITIALIZER,
+		.work = PTHREAD_COND_INITIALIZER,
+		.jobs_tail = &sp.jobs,
+		.method = save_method_find(mname),
+		.withcontents = (saveoption != 2),
+		.format = format,
+	};
+	pthread_t threads[SAVE_MAX_THREADS];
+	pthread_t zthr[SAVE_MAX_THREADS];
+	unsigned nthreads = save_nthreads();
+	unsigned nzthreads = 0;
+	struct save_ctx sc = { .sp = &sp };
+	struct blkmap base = {0};
 	struct metafd mfd;
-	struct osi_node *n;
 	uint64_t sb_addr;
 	int err = 0;
 	char *buf;
 
+	if (sp.method == NULL) {
+		fprintf(stderr, "Unsupported compression method: %s\n", mname);
+		exit(1);
+	}
+	if (level < 0)
+		level = sp.method->dftlevel;
+	if (level > sp.method->maxlevel) {
+		fprintf(stderr, "Compression level out of range for %s: %d (maximum %d)\n",
+		        mname, level, sp.method->maxlevel);
+		exit(1);
+	}
+	if (format < 1 || format > SAVEMETA_FORMAT) {
+		fprintf(stderr, "Unsupported metadata file format: %d\n", format);
+		exit(1);
+	}
+	/* Older versions of gfs2_edit can only read format 1 files compressed with gzip */
+	if (format == 1 && level > 0 && sp.method->id != SAVEMETA_GZIP) {
+		fprintf(stderr, "Format 1 files can not be compressed with %s\n", mname);
+		exit(1);
+	}
+	if (format == 1 && base_fn != NULL) {
+		fprintf(stderr, "Incremental captures need format %d\n", SAVEMETA_FORMAT);
+		exit(1);
+	}
+	sp.level = level;
+	sp.trim = (level == 0);
+
 	sbd.md.journals = 1;
 
-	mfd = savemetaopen(out_fn, gziplevel);
+	mfd = savemetaopen(out_fn, level);
 
 	blks_saved = 0;
 	printf("There are %"PRIu64" blocks of %u bytes in the filesystem.\n",
@@ -1098,53 +2113,115 @@ void savemeta(char *out_fn, int saveoption, int gziplevel)
 	if (err)
 		exit(1);
 
-	/* Write the savemeta file header */
-	err = save_header(&mfd, sbd.fssize * sbd.sd_bsize);
-	if (err) {
-		perror("Failed to write metadata file header");
-		exit(1);
-	}
-	/* Save off the superblock */
 	sb_addr = GFS2_SB_ADDR * GFS2_BASIC_BLOCK / sbd.sd_bsize;
+	sp.sb_addr = sb_addr;
+	if (base_fn != NULL) {
+		sp.base_time = save_load_base(base_fn, &base);
+		sp.base = &base;
+	}
+
+	/* The savemeta file header and the superblock */
+	sc.job = save_job_new(&sp, NULL);
+	save_header(&sc, sbd.fssize * sbd.sd_bsize);
 	buf = check_read_block(sbd.device_fd, sb_addr, 0, NULL, NULL);
 	if (buf != NULL) {
-		save_buf(&mfd, buf, sb_addr, sizeof(struct gfs2_sb));
+		save_buf(&sc, buf, sb_addr, sizeof(struct gfs2_sb));
 		free(buf);
 	}
+	save_job_done(&sc);
+	/* The writer compresses too, so it makes up one of the threads */
+	if (zthreads <= 0)
+		zthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	while (level > 0 && nzthreads + 1 < (unsigned)zthreads && nzthreads < SAVE_MAX_THREADS) {
+		if (pthread_create(&zthr[nzthreads], NULL, save_compressor, &sp) != 0)
+			break;
+		nzthreads++;
+	}
 	/* Walk through the resource groups saving everything within */
-	for (n = osi_first(&sbd.rgtree); n; n = osi_next(n)) {
-		struct lgfs2_rgrp_tree *rgd;
-
-		rgd = (struct lgfs2_rgrp_tree *)n;
-		save_rgrp(&sbd, &mfd, rgd, (saveoption != 2));
+	sp.next_rgrp = osi_first(&sbd.rgtree);
+	for (unsigned i = 0; i < nthreads; i++) {
+		err = pthread_create(&threads[i], NULL, save_worker, &sp);
+		if (err != 0) {
+			if (i == 0) {
+				fprintf(stderr, "Failed to start save threads: %s\n", strerror(err));
+				exit(1);
+			}
+			nthreads = i;
+			break;
+		}
 	}
+	save_write_jobs(&sp, &mfd);
+	if (format >= 2)
+		save_write_index(&sp, &mfd);
+	for (unsigned i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_lock(&sp.lock);
+	sp.stop = 1;
+	pthread_cond_broadcast(&sp.work);
+	pthread_mutex_unlock(&sp.lock);
+	for (unsigned i = 0; i < nzthreads; i++)
+		pthread_join(zthr[i], NULL);
 	/* Clean up */
 	/* There may be a gap between end of file system and end of device */
 	/* so we tell the user that we've processed everything. */
 	report_progress(sbd.fssize, 1);
 	printf("\nMetadata saved to file %s ", mfd.filename);
-	if (mfd.gziplevel) {
-		printf("(gzipped, level %d).\n", mfd.gziplevel);
+	if (mfd.level) {
+		printf("(%s, level %d, %u threads).\n", sp.method->name, mfd.level, nzthreads + 1);
 	} else {
 		printf("(uncompressed).\n");
 	}
+	if (base_fn != NULL)
+		printf("%"PRIu64" blocks changed since %s", blks_saved, ctime(&sp.base_time));
 	savemetaclose(&mfd);
 	close(sbd.device_fd);
+	blkmap_free(&base);
 	destroy_per_node_lookup();
 	free(indirect);
 	lgfs2_rgrp_free(&sbd, &sbd.rgtree);
 	exit(0);
 }
 
+/*
+ * Skip the rest of a skippable frame, whose header has been read along with
+ * the first few bytes of its payload
+ */
+static int restore_skip(struct metafd *mfd, size_t len)
+{
+	while (len > 0) {
+		size_t n = len > RESTORE_BUF_SIZE / 2 ? RESTORE_BUF_SIZE / 2 : len;
+
+		if (restore_buf_next(mfd, n) == NULL)
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
 static char *restore_block(struct metafd *mfd, uint64_t *blk, uint16_t *siglen)
 {
 	struct saved_metablock *svb;
 	const char *errstr;
 	char *buf = NULL;
 
-	svb = (struct saved_metablock *)(restore_buf_next(mfd, sizeof(*svb)));
-	if (svb == NULL)
-		goto nobuffer;
+	for (;;) {
+		uint32_t magic, size;
+
+		svb = (struct saved_metablock *)(restore_buf_next(mfd, sizeof(*svb)));
+		if (svb == NULL)
+			goto nobuffer;
+		/* The index, trailer and hashes of an uncompressed format 2 file are
+		   in skippable frames between the records. No record can start with
+		   the magic number as no file system is that large. */
+		memcpy(&magic, svb, sizeof(magic));
+		memcpy(&size, (char *)svb + sizeof(magic), sizeof(size));
+		if (le32_to_cpu(magic) != SKIP_MAGIC)
+			break;
+		size = le32_to_cpu(size);
+		if (size < sizeof(*svb) - SKIP_HDR_LEN ||
+		    restore_skip(mfd, size - (sizeof(*svb) - SKIP_HDR_LEN)) != 0)
+			goto nobuffer;
+	}
 	*blk = be64_to_cpu(svb->blk);
 	*siglen = be16_to_cpu(svb->siglen);
 
@@ -1184,25 +2261,204 @@ static int restore_super(struct metafd *mfd, void *buf, int printonly)
 		fprintf(stderr, "Error: Invalid superblock in metadata file.\n");
 		return -1;
 	}
-	if ((!printonly) && lgfs2_sb_write(&sbd, sbd.device_fd)) {
-		fprintf(stderr, "Failed to write superblock\n");
-		return -1;
-	}
 	blks_saved++;
 	return 0;
 }
 
-static int restore_data(int fd, struct metafd *mfd, int printonly)
-{
-	uint64_t writes = 0;
-	char *buf;
+/* The most records gathered before they are written out */
+#define RESTORE_BATCH_RECS (1024)
+#define RESTORE_IOV_MAX (1024)
+
+struct restore_rec {
+	uint64_t blk;
+	const char *data;
+	uint32_t seq;  /* Order of arrival, so that the last copy of a block wins */
+	uint16_t siglen;
+};
+
+/*
+ * Records waiting to be written to the device. They are sorted by block when
+ * the batch is flushed so that runs of contiguous blocks can be written with
+ * one pwritev() each.
+ */
+struct restore_batch {
+	int fd;
+	struct restore_rec *recs;
+	unsigned nrecs;
+	char *zeroes;  /* Padding for the insignificant part of each block */
+	char *store;  /* Copies of the records, when their buffer is reused */
+	size_t stored;
+};
 
-	buf = calloc(1, sbd.sd_bsize);
-	if (buf == NULL) {
+static void restore_batch_init(struct restore_batch *rb, int fd, int copy)
+{
+	memset(rb, 0, sizeof(*rb));
+	rb->fd = fd;
+	rb->recs = malloc(RESTORE_BATCH_RECS * sizeof(*rb->recs));
+	rb->zeroes = calloc(1, sbd.sd_bsize);
+	if (copy)
+		rb->store = malloc(RESTORE_BATCH_RECS * sbd.sd_bsize);
+	if (rb->recs == NULL || rb->zeroes == NULL || (copy && rb->store == NULL)) {
 		perror("Failed to restore data");
 		exit(1);
 	}
+}
+
+static void restore_batch_free(struct restore_batch *rb)
+{
+	free(rb->recs);
+	free(rb->zeroes);
+	free(rb->store);
+}
+
+static int restore_rec_cmp(const void *a, const void *b)
+{
+	const struct restore_rec *ra = a, *rb = b;
+
+	if (ra->blk != rb->blk)
+		return ra->blk < rb->blk ? -1 : 1;
+	return ra->seq < rb->seq ? -1 : ra->seq > rb->seq;
+}
+
+static int restore_writev(int fd, struct iovec *iov, int iovcnt, off_t off)
+{
+	while (iovcnt > 0) {
+		ssize_t ret = pwritev(fd, iov, iovcnt, off);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			if (ret == 0)
+				errno = ENOSPC;
+			return -1;
+		}
+		off += ret;
+		for (; iovcnt > 0 && (size_t)ret >= iov->iov_len; iov++, iovcnt--)
+			ret -= iov->iov_len;
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+static int restore_batch_flush(struct restore_batch *rb)
+{
+	struct iovec iov[RESTORE_IOV_MAX];
+	struct restore_rec *recs = rb->recs;
+	unsigned n = rb->nrecs;
+	unsigned i = 0;
+
+	qsort(recs, n, sizeof(*recs), restore_rec_cmp);
+	while (i < n) {
+		uint64_t start = recs[i].blk;
+		uint64_t next = start;
+		int niov = 0;
+
+		for (; i < n && niov + 2 <= RESTORE_IOV_MAX; i++) {
+			struct restore_rec *r = &recs[i];
+
+			/* Only the last copy of a block is written */
+			if (i + 1 < n && recs[i + 1].blk == r->blk)
+				continue;
+			if (r->blk != next)
+				break;
+			iov[niov].iov_base = (void *)r->data;
+			iov[niov++].iov_len = r->siglen;
+			if (r->siglen < sbd.sd_bsize) {
+				iov[niov].iov_base = rb->zeroes;
+				iov[niov++].iov_len = sbd.sd_bsize - r->siglen;
+			}
+			next++;
+		}
+		if (restore_writev(rb->fd, iov, niov, start * sbd.sd_bsize) != 0) {
+			fprintf(stderr, "write error: %s from %s:%d: block %"PRIu64" (0x%"PRIx64")\n",
+			        strerror(errno), __FUNCTION__, __LINE__, start, start);
+			return -1;
+		}
+	}
+	rb->nrecs = 0;
+	rb->stored = 0;
+	return 0;
+}
 
+static int is_zero(const char *buf, size_t len)
+{
+	return len == 0 || (buf[0] == '\0' && memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+static int restore_batch_add(struct restore_batch *rb, uint64_t blk, const char *bp, uint16_t siglen)
+{
+	struct restore_rec *r;
+
+	/* Only the copy of a block which the newest capture has the hash of is
+	   restored, so the files of an incremental capture can be restored in any
+	   order */
+	if (restore_want != NULL) {
+		uint64_t i = blkmap_find(restore_want, blk);
+
+		if (i == BLKMAP_NONE ||
+		    restore_want->slots[i].hash != block_hash(bp, block_siglen(bp, siglen)) ||
+		    __atomic_exchange_n(&restore_want->done[i], 1, __ATOMIC_RELAXED))
+			return 0;
+	}
+	/* Leave a hole rather than writing a block of zeroes */
+	if (restore_sparse && is_zero(bp, siglen))
+		return 0;
+	if (rb->nrecs == RESTORE_BATCH_RECS && restore_batch_flush(rb) != 0)
+		return -1;
+	r = &rb->recs[rb->nrecs];
+	r->blk = blk;
+	r->siglen = siglen;
+	r->seq = rb->nrecs++;
+	r->data = bp;
+	if (rb->store != NULL) {
+		r->data = memcpy(rb->store + rb->stored, bp, siglen);
+		rb->stored += siglen;
+	}
+	return 0;
+}
+
+/**
+ * Restore or print one saved block
+ * Returns 1 when printonly names a block and it has been found, 0 to carry on
+ * or -1 on error.
+ */
+static int restore_record(struct restore_batch *rb, uint64_t blk, char *bp, uint16_t siglen,
+                          int printonly)
+{
+	if (printonly) {
+		if (printonly > 1 && printonly == blk) {
+			display_block_type(bp, blk, TRUE);
+			display_gfs2(bp);
+			return 1;
+		} else if (printonly == 1) {
+			print_gfs2("%"PRId64" (l=0x%x): ", blks_saved, siglen);
+			display_block_type(bp, blk, TRUE);
+		}
+	} else if (restore_batch_add(rb, blk, bp, siglen) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static int restore_sync(int fd)
+{
+	if (fsync(fd) != 0 && errno != EINVAL) {
+		perror("Failed to sync the restored metadata");
+		return -1;
+	}
+	return 0;
+}
+
+static int restore_data(int fd, struct metafd *mfd, int printonly)
+{
+	struct restore_batch rb;
+	int ret = 0;
+
+	if (!printonly)
+		restore_batch_init(&rb, fd, 1);
 	while (TRUE) {
 		uint16_t siglen = 0;
 		uint64_t blk = 0;
@@ -1212,55 +2468,485 @@ static int restore_data(int fd, struct metafd *mfd, int printonly)
 		if (bp == NULL && mfd->eof)
 			break;
 		if (bp == NULL) {
-			free(buf);
-			return -1;
+			ret = -1;
+			break;
 		}
-		if (printonly) {
-			if (printonly > 1 && printonly == blk) {
-				display_block_type(bp, blk, TRUE);
-				display_gfs2(bp);
-				break;
-			} else if (printonly == 1) {
-				print_gfs2("%"PRId64" (l=0x%x): ", blks_saved, siglen);
-				display_block_type(bp, blk, TRUE);
-			}
-		} else {
+		ret = restore_record(&rb, blk, bp, siglen, printonly);
+		if (ret != 0)
+			break;
+		blks_saved++;
+		if (!printonly)
 			report_progress(blk, 0);
-			memcpy(buf, bp, siglen);
-			memset(buf + siglen, 0, sbd.sd_bsize - siglen);
-			if (pwrite(fd, buf, sbd.sd_bsize, blk * sbd.sd_bsize) != sbd.sd_bsize) {
-				fprintf(stderr, "write error: %s from %s:%d: block %"PRIu64" (0x%"PRIx64")\n",
-					strerror(errno), __FUNCTION__, __LINE__, blk, blk);
-				free(buf);
-				return -1;
-			}
-			writes++;
-			if (writes % 1000 == 0)
-				fsync(fd);
+	}
+	if (!printonly) {
+		if (ret == 0)
+			ret = restore_batch_flush(&rb);
+		if (ret == 0)
+			ret = restore_sync(fd);
+		if (ret == 0)
+			report_progress(sbd.fssize, 1);
+		restore_batch_free(&rb);
+	}
+	return ret < 0 ? -1 : 0;
+}
+
+/**
+ * Find the trailer of a format 2 file
+ * Returns 0 on success or 1 if there is no valid trailer.
+ */
+static int restore_read_trailer(struct metafd *mfd, struct savemeta_trailer *st)
+{
+	const size_t gzlen = SKIP_GZ_HDR_LEN + sizeof(*st) + SKIP_GZ_TAIL_LEN;
+	uint8_t tail[SKIP_GZ_HDR_LEN + sizeof(*st) + SKIP_GZ_TAIL_LEN];
+	const uint8_t *p;
+	uint32_t magic, size;
+	struct stat sb;
+
+	if (fstat(mfd->fd, &sb) != 0 || sb.st_size < (off_t)gzlen)
+		return 1;
+	if (pread(mfd->fd, tail, gzlen, sb.st_size - gzlen) != gzlen)
+		return 1;
+
+	/* A skippable frame */
+	p = tail + gzlen - sizeof(*st) - SKIP_HDR_LEN;
+	memcpy(&magic, p, sizeof(magic));
+	memcpy(&size, p + 4, sizeof(size));
+	if (le32_to_cpu(magic) == SKIP_MAGIC && le32_to_cpu(size) == sizeof(*st)) {
+		p += SKIP_HDR_LEN;
+	} else {
+		/* A gzip member with an extra field */
+		p = tail;
+		if (p[0] != 0x1f || p[1] != 0x8b || p[3] != 4 ||
+		    p[12] != SKIP_GZ_ID1 || p[13] != SKIP_GZ_ID2 ||
+		    p[14] != sizeof(*st) || p[15] != 0)
+			return 1;
+		p += SKIP_GZ_HDR_LEN;
+	}
+	memcpy(st, p, sizeof(*st));
+	if (be32_to_cpu(st->st_magic) != SAVEMETA_MAGIC)
+		return 1;
+	return 0;
+}
+
+/**
+ * Read the index of a format 2 file into sm
+ * Returns 0 on success, 1 if the file has no index or -1 on error.
+ */
+static int restore_read_index(struct metafd *mfd, struct savemeta *sm)
+{
+	struct savemeta_trailer st;
+	uint64_t entries, n = 0;
+	off_t off, end;
+	size_t hlen;
+	char *buf;
+
+	if (restore_read_trailer(mfd, &st) != 0)
+		return 1;
+	entries = be64_to_cpu(st.st_entries);
+	off = be64_to_cpu(st.st_index);
+	sm->sm_method = be32_to_cpu(st.st_method);
+	hlen = sm->sm_method == SAVEMETA_GZIP ? SKIP_GZ_HDR_LEN : SKIP_HDR_LEN;
+	sm->sm_index = calloc(entries, sizeof(*sm->sm_index));
+	if (sm->sm_index == NULL) {
+		perror("Failed to read metadata index");
+		return -1;
+	}
+	buf = (char *)sm->sm_index;
+	while (n < entries) {
+		uint8_t hdr[SKIP_GZ_HDR_LEN];
+		size_t len;
+
+		if (pread(mfd->fd, hdr, hlen, off) != hlen)
+			goto bad_index;
+		if (hlen == SKIP_GZ_HDR_LEN)
+			len = hdr[14] | (hdr[15] << 8);
+		else
+			len = hdr[4] | (hdr[5] << 8) | (hdr[6] << 16) | ((size_t)hdr[7] << 24);
+		if (len % sizeof(*sm->sm_index) != 0 ||
+		    len / sizeof(*sm->sm_index) > entries - n ||
+		    pread(mfd->fd, buf, len, off + hlen) != len)
+			goto bad_index;
+		buf += len;
+		n += len / sizeof(*sm->sm_index);
+		off += hlen + len + (hlen == SKIP_GZ_HDR_LEN ? SKIP_GZ_TAIL_LEN : 0);
+	}
+	end = be64_to_cpu(st.st_index);
+	for (n = 0; n < entries; n++) {
+		struct savemeta_index *si = &sm->sm_index[n];
+
+		if (be32_to_cpu(si->si_ulen) > SAVE_CHUNK_SIZE ||
+		    be64_to_cpu(si->si_offset) + be32_to_cpu(si->si_clen) > end ||
+		    (sm->sm_method == SAVEMETA_NONE && si->si_clen != si->si_ulen))
+			goto bad_index;
+	}
+	sm->sm_entries = entries;
+	return 0;
+bad_index:
+	fprintf(stderr, "The metadata file index is not valid, reading the whole file\n");
+	free(sm->sm_index);
+	sm->sm_index = NULL;
+	return 1;
+}
+
+/* Read and decompress the frame described by si into ubuf */
+static int restore_frame(struct metafd *mfd, unsigned method, const struct savemeta_index *si,
+                         char *cbuf, char *ubuf)
+{
+	size_t clen = be32_to_cpu(si->si_clen);
+	size_t ulen = be32_to_cpu(si->si_ulen);
+	off_t off = be64_to_cpu(si->si_offset);
+
+	if (method == SAVEMETA_NONE)
+		return pread(mfd->fd, ubuf, ulen, off) == ulen ? 0 : -1;
+	if (pread(mfd->fd, cbuf, clen, off) != clen)
+		return -1;
+
+	switch (method) {
+	case SAVEMETA_GZIP: {
+		z_stream zs = {0};
+		int ret;
+
+		if (inflateInit2(&zs, 15 + 16) != Z_OK)
+			return -1;
+		zs.next_in = (Bytef *)cbuf;
+		zs.avail_in = clen;
+		zs.next_out = (Bytef *)ubuf;
+		zs.avail_out = ulen;
+		ret = inflate(&zs, Z_FINISH);
+		inflateEnd(&zs);
+		return (ret == Z_STREAM_END && zs.total_out == ulen) ? 0 : -1;
+	}
+#ifdef HAVE_ZSTD
+	case SAVEMETA_ZSTD:
+		return ZSTD_decompress(ubuf, ulen, cbuf, clen) == ulen ? 0 : -1;
+#endif
+#ifdef HAVE_LZ4
+	case SAVEMETA_LZ4: {
+		LZ4F_dctx *dctx;
+		size_t outlen = ulen;
+		size_t inlen = clen;
+		size_t ret;
+
+		if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+			return -1;
+		ret = LZ4F_decompress(dctx, ubuf, &outlen, cbuf, &inlen, NULL);
+		LZ4F_freeDecompressionContext(dctx);
+		return (ret == 0 && outlen == ulen) ? 0 : -1;
+	}
+#endif
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+/**
+ * Read the record frame described by si and pass each of its records to fn,
+ * along with its position in the frame and priv. Stops at the first record
+ * for which fn returns non-zero.
+ * Returns what fn returned, or -1 if the frame can't be read or holds a bad
+ * record.
+ */
+static int restore_frame_each(struct metafd *mfd, unsigned method, const struct savemeta_index *si,
+                              char *cbuf, char *ubuf, void *priv,
+                              int (*fn)(void *priv, uint32_t r, uint64_t blk, char *buf, uint16_t siglen))
+{
+	uint32_t count = be32_to_cpu(si->si_count);
+	char *end = ubuf + be32_to_cpu(si->si_ulen);
+	char *p = ubuf;
+	uint32_t r;
+	int ret = 0;
+
+	if (restore_frame(mfd, method, si, cbuf, ubuf) != 0) {
+		fprintf(stderr, "Failed to read metadata frame at offset %"PRIu64"\n",
+		        be64_to_cpu(si->si_offset));
+		return -1;
+	}
+	for (r = 0; r < count && ret == 0; r++) {
+		struct saved_metablock svb;
+		uint64_t blk;
+		uint16_t siglen;
+
+		if (end - p < (ptrdiff_t)sizeof(svb))
+			break;
+		memcpy(&svb, p, sizeof(svb));
+		p += sizeof(svb);
+		blk = be64_to_cpu(svb.blk);
+		siglen = be16_to_cpu(svb.siglen);
+		if (siglen > sbd.sd_bsize || end - p < siglen ||
+		    (sbd.fssize && blk >= sbd.fssize))
+			break;
+		p += siglen;
+		ret = fn(priv, r, blk, p - siglen, siglen);
+	}
+	if (ret == 0 && r < count) {
+		fprintf(stderr, "Bad record in metadata frame at offset %"PRIu64"\n",
+		        be64_to_cpu(si->si_offset));
+		return -1;
+	}
+	return ret;
+}
+
+/**
+ * Read the block hashes of an indexed file into m
+ * Returns 0 on success, 1 if the file has no hashes or -1 on error.
+ */
+static int restore_read_hashes(struct metafd *mfd, struct savemeta *sm, struct blkmap *m)
+{
+	size_t maxclen = 0;
+	int found = 0;
+	char *cbuf, *ubuf;
+	int ret = 0;
+
+	for (uint64_t i = 0; i < sm->sm_entries; i++) {
+		const struct savemeta_index *si = &sm->sm_index[i];
+
+		if (!(be32_to_cpu(si->si_flags) & SAVEMETA_HASHES))
+			continue;
+		if (be32_to_cpu(si->si_clen) > maxclen)
+			maxclen = be32_to_cpu(si->si_clen);
+		found = 1;
+	}
+	if (!found)
+		return 1;
+	cbuf = malloc(maxclen);
+	ubuf = malloc(SAVE_CHUNK_SIZE);
+	if (cbuf == NULL || ubuf == NULL) {
+		perror("Failed to read block hashes");
+		exit(1);
+	}
+	for (uint64_t i = 0; i < sm->sm_entries && ret == 0; i++) {
+		const struct savemeta_index *si = &sm->sm_index[i];
+		const struct savemeta_hash *hs = (struct savemeta_hash *)ubuf;
+		uint32_t count = be32_to_cpu(si->si_count);
+
+		if (!(be32_to_cpu(si->si_flags) & SAVEMETA_HASHES))
+			continue;
+		if (be32_to_cpu(si->si_ulen) != count * sizeof(*hs) ||
+		    restore_frame(mfd, sm->sm_method, si, cbuf, ubuf) != 0) {
+			fprintf(stderr, "Failed to read block hashes at offset %"PRIu64"\n",
+			        be64_to_cpu(si->si_offset));
+			ret = -1;
+			break;
 		}
+		for (uint32_t j = 0; j < count; j++)
+			blkmap_insert(m, be64_to_cpu(hs[j].hs_blk), be64_to_cpu(hs[j].hs_hash));
+	}
+	free(ubuf);
+	free(cbuf);
+	return ret;
+}
+
+static int restore_hash_record(void *priv, uint32_t r, uint64_t blk, char *buf, uint16_t siglen)
+{
+	blkmap_insert(priv, blk, block_hash(buf, block_siglen(buf, siglen)));
+	return 0;
+}
+
+/**
+ * Work out the block hashes of an indexed file without hashes from its record
+ * frames, which are found through the index so that the index and trailer
+ * frames are never taken for records.
+ * Returns 0 on success or -1 on error.
+ */
+static int restore_hash_records(struct metafd *mfd, struct savemeta *sm, struct blkmap *m)
+{
+	size_t maxclen = 1;
+	char *cbuf, *ubuf;
+	int ret = 0;
+
+	for (uint64_t i = 0; i < sm->sm_entries; i++)
+		if (be32_to_cpu(sm->sm_index[i].si_clen) > maxclen)
+			maxclen = be32_to_cpu(sm->sm_index[i].si_clen);
+	cbuf = malloc(maxclen);
+	ubuf = malloc(SAVE_CHUNK_SIZE);
+	if (cbuf == NULL || ubuf == NULL) {
+		perror("Failed to read block hashes");
+		exit(1);
+	}
+	for (uint64_t i = 0; i < sm->sm_entries && ret == 0; i++) {
+		const struct savemeta_index *si = &sm->sm_index[i];
+
+		if (si->si_count == 0 || (be32_to_cpu(si->si_flags) & SAVEMETA_HASHES))
+			continue;
+		ret = restore_frame_each(mfd, sm->sm_method, si, cbuf, ubuf, m, restore_hash_record);
+	}
+	free(ubuf);
+	free(cbuf);
+	return ret;
+}
+
+/* State shared by the threads restoring an indexed file */
+struct restore_pipeline {
+	pthread_mutex_t lock;
+	struct metafd *mfd;
+	struct savemeta *sm;
+	int fd;
+	int printonly;
+	uint64_t next;  /* The next frame to restore */
+	uint64_t sbframe;  /* The frame which holds the superblock */
+	size_t maxclen;
+	int error;
+};
+
+/* A frame being restored by restore_frame_records() */
+struct restore_frame_ctx {
+	struct restore_batch *rb;
+	int printonly;
+	int sbframe;  /* Whether the frame holds the superblock */
+};
+
+static int restore_frame_record(void *priv, uint32_t r, uint64_t blk, char *buf, uint16_t siglen)
+{
+	struct restore_frame_ctx *fc = priv;
+	int ret;
+
+	/* The first record is the superblock, restored by restoremeta() */
+	if (fc->sbframe && r == 0)
+		return 0;
+	ret = restore_record(fc->rb, blk, buf, siglen, fc->printonly);
+	if (fc->printonly && ret == 0)
 		blks_saved++;
+	return ret;
+}
+
+/**
+ * Restore or print the records in a frame
+ * Returns 1 when printonly names a block and it has been found, 0 to carry on
+ * or -1 on error.
+ */
+static int restore_frame_records(struct restore_pipeline *rp, uint64_t i, struct restore_batch *rb,
+                                 char *cbuf, char *ubuf)
+{
+	const struct savemeta_index *si = &rp->sm->sm_index[i];
+	struct restore_frame_ctx fc = {
+		.rb = rb,
+		.printonly = rp->printonly,
+		.sbframe = (i == rp->sbframe),
+	};
+	int printonly = rp->printonly;
+	int ret;
+
+	if (si->si_count == 0 || (be32_to_cpu(si->si_flags) & SAVEMETA_HASHES))
+		return 0;
+	if (printonly > 1 && (printonly < be64_to_cpu(si->si_first) ||
+	                      printonly > be64_to_cpu(si->si_last)))
+		return 0;
+	ret = restore_frame_each(rp->mfd, rp->sm->sm_method, si, cbuf, ubuf, &fc,
+	                         restore_frame_record);
+	/* The records point into ubuf so they must be written before it is reused */
+	if (ret == 0 && !printonly)
+		ret = restore_batch_flush(rb);
+	return ret;
+}
+
+static void *restore_worker(void *data)
+{
+	struct restore_pipeline *rp = data;
+	struct restore_batch rb;
+	char *cbuf = malloc(rp->maxclen);
+	char *ubuf = malloc(SAVE_CHUNK_SIZE);
+
+	if (cbuf == NULL || ubuf == NULL) {
+		perror("Failed to restore data");
+		exit(1);
 	}
-	if (!printonly)
+	restore_batch_init(&rb, rp->fd, 0);
+	pthread_mutex_lock(&rp->lock);
+	while (!rp->error && rp->next < rp->sm->sm_entries) {
+		uint64_t i = rp->next++;
+		int ret;
+
+		pthread_mutex_unlock(&rp->lock);
+		ret = restore_frame_records(rp, i, &rb, cbuf, ubuf);
+		pthread_mutex_lock(&rp->lock);
+		if (ret < 0) {
+			rp->error = 1;
+			break;
+		}
+		if (!rp->printonly && !(be32_to_cpu(rp->sm->sm_index[i].si_flags) & SAVEMETA_HASHES)) {
+			uint32_t count = be32_to_cpu(rp->sm->sm_index[i].si_count);
+
+			blks_saved += (i == rp->sbframe) ? count - 1 : count;
+			report_progress(be64_to_cpu(rp->sm->sm_index[i].si_last), 0);
+		} else if (ret > 0) {
+			/* Found the block to print */
+			break;
+		}
+	}
+	pthread_mutex_unlock(&rp->lock);
+	restore_batch_free(&rb);
+	free(ubuf);
+	free(cbuf);
+	return NULL;
+}
+
+/*
+ * Like restore_data() but reads the file through its index. Frames are
+ * restored by several threads in parallel, except when printing. Savemeta
+ * reads each block once per frame so a block appearing in more than one
+ * frame has the same contents in each, and the order the frames are written
+ * in does not matter.
+ */
+static int restore_data_indexed(int fd, struct metafd *mfd, struct savemeta *sm, int printonly,
+                                int nthreads)
+{
+	struct restore_pipeline rp = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.mfd = mfd,
+		.sm = sm,
+		.fd = fd,
+		.printonly = printonly,
+		.sbframe = sm->sm_entries,
+	};
+	pthread_t threads[SAVE_MAX_THREADS];
+	int started = 0;
+
+	for (uint64_t i = 0; i < sm->sm_entries; i++) {
+		const struct savemeta_index *si = &sm->sm_index[i];
+		size_t clen = be32_to_cpu(si->si_clen);
+
+		if (clen > rp.maxclen)
+			rp.maxclen = clen;
+		if (rp.sbframe == sm->sm_entries && si->si_count != 0 &&
+		    !(be32_to_cpu(si->si_flags) & SAVEMETA_HASHES))
+			rp.sbframe = i;
+	}
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	/* Printing must be done in order */
+	if (printonly || nthreads < 1)
+		nthreads = 1;
+	if (nthreads > SAVE_MAX_THREADS)
+		nthreads = SAVE_MAX_THREADS;
+	for (; started < nthreads - 1; started++)
+		if (pthread_create(&threads[started], NULL, restore_worker, &rp) != 0)
+			break;
+	restore_worker(&rp);
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	if (rp.error)
+		return -1;
+	if (!printonly) {
+		if (restore_sync(fd) != 0)
+			return -1;
 		report_progress(sbd.fssize, 1);
-	free(buf);
+	}
 	return 0;
 }
 
 static void restoremeta_usage(void)
 {
 	fprintf(stderr, "Usage:\n");
-	fprintf(stderr, "gfs2_edit restoremeta <metadata_file> <block_device>\n");
+	fprintf(stderr, "gfs2_edit restoremeta [-j <threads>] [-b <base_file>]... <metadata_file> <block_device>\n");
 }
 
-static int restore_init(const char *path, struct metafd *mfd, struct savemeta *sm, int printonly)
+/* Open a metadata file and read its header and, if it has one, its index */
+static int restore_open(const char *path, struct metafd *mfd, struct savemeta *sm)
 {
-	struct gfs2_sb rsb;
-	uint16_t sb_siglen;
-	char *end;
-	char *bp;
 	int ret;
 
-	blks_saved = 0;
+	free(restore_buf);
 	restore_buf = malloc(RESTORE_BUF_SIZE);
 	if (restore_buf == NULL) {
 		perror("Restore failed");
@@ -1275,19 +2961,41 @@ static int restore_init(const char *path, struct metafd *mfd, struct savemeta *s
 		perror("Could not open metadata file");
 		return 1;
 	}
-	if (restore_try_bzip(mfd) != 0 &&
+	ret = restore_try_zstd(mfd);
+	if (ret > 0)
+		ret = restore_try_lz4(mfd);
+	if (ret > 0 && restore_try_bzip(mfd) != 0 &&
 	    restore_try_gzip(mfd) != 0) {
 		fprintf(stderr, "Failed to read metadata file header and superblock\n");
 		return -1;
 	}
-	bp = restore_buf;
-	ret = parse_header(bp, sm);
+	if (ret < 0)
+		return -1;
+	ret = parse_header(restore_buf, sm);
+	if (ret == -1)
+		return -1;
 	if (ret == 0) {
-		bp = restore_buf + sizeof(struct savemeta_header);
 		restore_off = sizeof(struct savemeta_header);
-	} else if (ret == -1) {
-		return -1;
+		restore_left -= restore_off;
 	}
+	if (ret == 0 && sm->sm_format >= 2 && restore_read_index(mfd, sm) < 0)
+		return -1;
+	return 0;
+}
+
+static int restore_init(const char *path, struct metafd *mfd, struct savemeta *sm, int printonly)
+{
+	struct gfs2_sb rsb;
+	uint16_t sb_siglen;
+	char *end;
+	char *bp;
+	int ret;
+
+	blks_saved = 0;
+	ret = restore_open(path, mfd, sm);
+	if (ret != 0)
+		return ret;
+	bp = restore_buf + restore_off;
 	/* Scan for the position of the superblock. Required to support old formats(?). */
 	end = &restore_buf[256 + sizeof(struct saved_metablock) + sizeof(struct gfs2_meta_header)];
 	while (bp <= end) {
@@ -1322,15 +3030,115 @@ static int restore_init(const char *path, struct metafd *mfd, struct savemeta *s
 		display_block_type(bp, LGFS2_SB_ADDR(&sbd), TRUE);
 	}
 	bp += sb_siglen;
+	restore_left -= (bp - restore_buf) - restore_off;
 	restore_off = bp - restore_buf;
-	restore_left -= restore_off;
 	return 0;
 }
 
-void restoremeta(const char *in_fn, const char *out_device, uint64_t printonly)
+/*
+ * Restore the blocks of an incremental capture which are only in the earlier
+ * captures it is based on
+ */
+static int restore_base(const char *path, int nthreads)
 {
 	struct metafd mfd = {0};
 	struct savemeta sm = {0};
+	int ret;
+
+	printf("Restoring unchanged blocks from %s\n", path);
+	ret = restore_open(path, &mfd, &sm);
+	if (ret != 0)
+		return -1;
+	if (sm.sm_index != NULL)
+		ret = restore_data_indexed(sbd.device_fd, &mfd, &sm, 0, nthreads);
+	else
+		ret = restore_data(sbd.device_fd, &mfd, 0);
+	free(sm.sm_index);
+	mfd.close(&mfd);
+	return ret;
+}
+
+/* Set up restoring only the blocks which an incremental capture has hashes of */
+static int restore_want_init(struct metafd *mfd, struct savemeta *sm, struct blkmap *want)
+{
+	uint64_t i;
+
+	if (sm->sm_index == NULL || restore_read_hashes(mfd, sm, want) != 0) {
+		fprintf(stderr, "Failed to read the block hashes of %s\n", mfd->filename);
+		return -1;
+	}
+	want->done = calloc(1ULL << want->bits, 1);
+	if (want->done == NULL) {
+		perror("Restore failed");
+		return -1;
+	}
+	/* restoremeta() writes the superblock */
+	i = blkmap_find(want, GFS2_SB_ADDR * GFS2_BASIC_BLOCK / sbd.sd_bsize);
+	if (i != BLKMAP_NONE)
+		want->done[i] = 1;
+	restore_want = want;
+	return 0;
+}
+
+/*
+ * Read the block hashes of the capture which an incremental capture is based
+ * on. Files without hashes have them worked out from their records. Returns
+ * the time the base capture was saved.
+ */
+static time_t save_load_base(const char *path, struct blkmap *base)
+{
+	struct metafd mfd = {0};
+	struct savemeta sm = {0};
+	int ret;
+
+	printf("Reading block hashes from %s\n", path);
+	if (restore_open(path, &mfd, &sm) != 0)
+		exit(1);
+	ret = 1;
+	if (sm.sm_index != NULL) {
+		ret = restore_read_hashes(&mfd, &sm, base);
+		if (ret > 0)
+			ret = restore_hash_records(&mfd, &sm, base);
+	}
+	while (ret > 0) {
+		uint16_t siglen = 0;
+		uint64_t blk = 0;
+		char *bp;
+
+		bp = restore_block(&mfd, &blk, &siglen);
+		if (bp == NULL) {
+			ret = mfd.eof ? 0 : -1;
+			break;
+		}
+		blkmap_insert(base, blk, block_hash(bp, block_siglen(bp, siglen)));
+	}
+	if (ret != 0) {
+		fprintf(stderr, "Failed to read the base capture %s\n", path);
+		exit(1);
+	}
+	printf("The base capture has %"PRIu64" blocks\n", base->count);
+	free(sm.sm_index);
+	mfd.close(&mfd);
+	return sm.sm_time;
+}
+
+/* Returns the number of blocks of an incremental capture not yet restored */
+static uint64_t restore_want_missing(const struct blkmap *want)
+{
+	uint64_t missing = 0;
+
+	for (uint64_t i = 0; i < (1ULL << want->bits); i++)
+		if (want->slots[i].blk != 0 && !want->done[i])
+			missing++;
+	return missing;
+}
+
+void restoremeta(const char *in_fn, const char *out_device, uint64_t printonly, int nthreads,
+                 const char **bases, int nbases)
+{
+	struct metafd mfd = {0};
+	struct savemeta sm = {0};
+	struct blkmap want = {0};
 	struct stat st;
 	int error;
 
@@ -1352,6 +3160,10 @@ void restoremeta(const char *in_fn, const char *out_device, uint64_t printonly)
 			    out_device, strerror(errno));
 			exit(1);
 		}
+		if (fstat(sbd.device_fd, &st) == -1) {
+			fprintf(stderr, "Failed to stat %s: %s\n", out_device, strerror(errno));
+			exit(1);
+		}
 	} else if (out_device) /* for printsavedmeta, the out_device is an
 				  optional block no */
 		printonly = check_keywords(out_device);
@@ -1360,12 +3172,61 @@ void restoremeta(const char *in_fn, const char *out_device, uint64_t printonly)
 	if (error != 0)
 		exit(error);
 
+	if (!printonly && (sm.sm_flags & SAVEMETA_INCREMENTAL)) {
+		if (nbases == 0) {
+			fprintf(stderr, "%s only holds the blocks which changed since an earlier capture. "
+			        "Use -b to give the earlier captures.\n", in_fn);
+			exit(1);
+		}
+		if (restore_want_init(&mfd, &sm, &want) != 0)
+			exit(1);
+	} else if (nbases > 0) {
+		fprintf(stderr, "%s is not an incremental capture.\n", in_fn);
+		exit(1);
+	}
 	if (!printonly) {
+		/* Start image files from scratch so that the blocks which are not
+		   restored are holes. The file is extended to the size of the file
+		   system at the end. This is only done once the metadata file is
+		   known to be good, so that a bad one leaves the target alone. */
+		if (S_ISREG(st.st_mode)) {
+			if (ftruncate(sbd.device_fd, 0) != 0) {
+				fprintf(stderr, "Failed to truncate: %s, %s\n", out_device, strerror(errno));
+				exit(1);
+			}
+			restore_sparse = 1;
+		}
+		if (lgfs2_sb_write(&sbd, sbd.device_fd)) {
+			fprintf(stderr, "Failed to write superblock\n");
+			exit(1);
+		}
+	}
+
+	if (restore_sparse) {
+		printf("Restoring to a sparse image file.\n");
+	} else if (!printonly) {
 		uint64_t space = lseek(sbd.device_fd, 0, SEEK_END) / sbd.sd_bsize;
 		printf("There are %"PRIu64" free blocks on the destination device.\n", space);
 	}
 
-	error = restore_data(sbd.device_fd, &mfd, printonly);
+	if (sm.sm_index != NULL)
+		error = restore_data_indexed(sbd.device_fd, &mfd, &sm, printonly, nthreads);
+	else
+		error = restore_data(sbd.device_fd, &mfd, printonly);
+	free(sm.sm_index);
+	for (int i = 0; error == 0 && i < nbases; i++)
+		error = restore_base(bases[i], nthreads);
+	if (error == 0 && restore_want != NULL) {
+		uint64_t missing = restore_want_missing(restore_want);
+
+		if (missing > 0) {
+			fprintf(stderr, "%"PRIu64" blocks were not found in the earlier captures.\n",
+			        missing);
+			error = 1;
+		}
+	}
+	blkmap_free(&want);
+	restore_want = NULL;
 
 	/* When there is a metadata header available, truncate to filesystem 
 	   size if our device_fd is a regular file */   
@@ -202,7 +202,7 @@ void dinode_print(void *dip)
 	meta_header_print(&_di->di_header);
 	inum_print(&_di->di_num);
 
-	print_it("  di_mode", "0%"PRIo32, NULL, be32_to_cpu(di->di_mode));
+	print_it("  di_mode", "0%"PRIo32, NULL, be32_to_cpu(_di->di_mode));
 	printbe32(_di, di_uid);
 	printbe32(_di, di_gid);
 	printbe32(_di, di_nlink);
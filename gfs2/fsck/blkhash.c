@@ -0,0 +1,162 @@
+#include "clusterautoconfig.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "blkhash.h"
+
+#define BLKHASH_MIN_BITS (10)
+
+/* The size of the slabs allocated by node_arena_alloc() */
+#define ARENA_SLAB_SIZE (1UL << 16)
+
+struct arena_slab {
+	struct arena_slab *next;
+	char data[];
+};
+
+static void blkhash_put(struct blkhash *h, uint64_t key, void *val)
+{
+	uint64_t mask = (1ULL << h->bits) - 1;
+	uint64_t i;
+
+	for (i = blkhash_idx(h, key); h->slots[i].key != 0; i = (i + 1) & mask)
+		if (h->slots[i].key == key)
+			break;
+	if (h->slots[i].key == 0)
+		h->count++;
+	h->slots[i].key = key;
+	h->slots[i].val = val;
+}
+
+static int blkhash_grow(struct blkhash *h)
+{
+	struct blkhash_slot *old = h->slots;
+	uint64_t oldsize = old ? 1ULL << h->bits : 0;
+	unsigned bits = old ? h->bits + 1 : BLKHASH_MIN_BITS;
+
+	h->slots = calloc(1ULL << bits, sizeof(*h->slots));
+	if (h->slots == NULL) {
+		h->slots = old;
+		return -1;
+	}
+	h->bits = bits;
+	h->count = 0;
+	for (uint64_t i = 0; i < oldsize; i++)
+		if (old[i].key != 0)
+			blkhash_put(h, old[i].key, old[i].val);
+	free(old);
+	return 0;
+}
+
+/**
+ * blkhash_insert - add a block to the index or update its value
+ * Returns 0 on success or -1 if the table could not be grown, with errno set.
+ */
+int blkhash_insert(struct blkhash *h, uint64_t key, void *val)
+{
+	if (key == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* Keep the table at most 3/4 full so that probe sequences stay short */
+	if (h->slots == NULL || (h->count + 1) * 4 > (3ULL << h->bits)) {
+		if (blkhash_grow(h) != 0)
+			return -1;
+	}
+	blkhash_put(h, key, val);
+	return 0;
+}
+
+void blkhash_remove(struct blkhash *h, uint64_t key)
+{
+	uint64_t mask, i, j;
+
+	if (h->slots == NULL || key == 0)
+		return;
+	mask = (1ULL << h->bits) - 1;
+	for (i = blkhash_idx(h, key); h->slots[i].key != key; i = (i + 1) & mask)
+		if (h->slots[i].key == 0)
+			return;
+
+	/* Move later entries of the probe sequence back into the hole so that
+	   lookups don't need tombstones */
+	for (j = (i + 1) & mask; h->slots[j].key != 0; j = (j + 1) & mask) {
+		uint64_t k = blkhash_idx(h, h->slots[j].key);
+
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		h->slots[i] = h->slots[j];
+		i = j;
+	}
+	h->slots[i].key = 0;
+	h->slots[i].val = NULL;
+	h->count--;
+}
+
+void blkhash_free(struct blkhash *h)
+{
+	free(h->slots);
+	h->slots = NULL;
+	h->count = 0;
+	h->bits = 0;
+}
+
+size_t blkhash_mem(const struct blkhash *h)
+{
+	return h->slots ? (1UL << h->bits) * sizeof(*h->slots) : 0;
+}
+
+/**
+ * node_arena_alloc - allocate a zeroed object
+ * @a: The arena
+ * @size: The size of the object, which must be the same for every call
+ * Returns the object or NULL if memory could not be allocated.
+ */
+void *node_arena_alloc(struct node_arena *a, size_t size)
+{
+	size_t per_slab;
+	void *obj;
+
+	if (a->size == 0)
+		a->size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	per_slab = (ARENA_SLAB_SIZE - sizeof(struct arena_slab)) / a->size;
+
+	if (a->free != NULL) {
+		obj = a->free;
+		a->free = *(void **)obj;
+	} else {
+		if (a->slabs == NULL || a->used == per_slab) {
+			struct arena_slab *slab = malloc(ARENA_SLAB_SIZE);
+
+			if (slab == NULL)
+				return NULL;
+			slab->next = a->slabs;
+			a->slabs = slab;
+			a->used = 0;
+			a->mem += ARENA_SLAB_SIZE;
+		}
+		obj = a->slabs->data + (a->used++ * a->size);
+	}
+	memset(obj, 0, a->size);
+	return obj;
+}
+
+void node_arena_release(struct node_arena *a, void *obj)
+{
+	*(void **)obj = a->free;
+	a->free = obj;
+}
+
+void node_arena_free(struct node_arena *a)
+{
+	struct arena_slab *slab;
+
+	while ((slab = a->slabs) != NULL) {
+		a->slabs = slab->next;
+		free(slab);
+	}
+	memset(a, 0, sizeof(*a));
+}
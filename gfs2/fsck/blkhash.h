@@ -0,0 +1,64 @@
+#ifndef _BLKHASH_H
+#define _BLKHASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * An open addressing hash table which maps block addresses to pointers, used
+ * to index the inode and directory trees so that lookups don't have to walk
+ * the trees. Block 0 can't be used as a key as it marks an empty slot.
+ */
+struct blkhash_slot {
+	uint64_t key;
+	void *val;
+};
+
+struct blkhash {
+	struct blkhash_slot *slots;
+	uint64_t count;
+	unsigned bits;
+};
+
+static inline uint64_t blkhash_idx(const struct blkhash *h, uint64_t key)
+{
+	return (key * 0x9e3779b97f4a7c15ULL) >> (64 - h->bits);
+}
+
+static inline void *blkhash_find(const struct blkhash *h, uint64_t key)
+{
+	uint64_t mask, i;
+
+	if (h->slots == NULL)
+		return NULL;
+	mask = (1ULL << h->bits) - 1;
+	for (i = blkhash_idx(h, key); h->slots[i].key != 0; i = (i + 1) & mask) {
+		if (h->slots[i].key == key)
+			return h->slots[i].val;
+	}
+	return NULL;
+}
+
+extern int blkhash_insert(struct blkhash *h, uint64_t key, void *val);
+extern void blkhash_remove(struct blkhash *h, uint64_t key);
+extern void blkhash_free(struct blkhash *h);
+extern size_t blkhash_mem(const struct blkhash *h);
+
+/*
+ * Allocates fixed size objects from large slabs, without the per-allocation
+ * overhead of malloc. Released objects are reused by later allocations and
+ * the slabs are only freed by node_arena_free().
+ */
+struct node_arena {
+	struct arena_slab *slabs;
+	void *free;
+	size_t size;   /* Object size, set by the first allocation */
+	unsigned used; /* Objects handed out from the newest slab */
+	size_t mem;    /* Bytes allocated to slabs */
+};
+
+extern void *node_arena_alloc(struct node_arena *a, size_t size);
+extern void node_arena_release(struct node_arena *a, void *obj);
+extern void node_arena_free(struct node_arena *a);
+
+#endif /* _BLKHASH_H */
@@ -9,6 +9,319 @@
 #include <errno.h>
 
 #include "fsck.h"
+#include "util.h"
+
+/**
+ * bmap_mem_budget - the most memory the blockmaps should use as flat maps
+ * Returns half of the physical memory, or no limit if that is unknown.
+ */
+uint64_t bmap_mem_budget(void)
+{
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long pagesize = sysconf(_SC_PAGESIZE);
+
+	if (pages <= 0 || pagesize <= 0)
+		return UINT64_MAX;
+	return (uint64_t)pages * pagesize / 2;
+}
+
+/* Allocate a map of mapsize bytes, in chunks if it is larger than budget */
+static int bmap_init(struct bmap *bmap, uint64_t size, uint64_t mapsize, uint64_t budget)
+{
+	memset(bmap, 0, sizeof(*bmap));
+	bmap->size = size;
+	bmap->mapsize = mapsize;
+	if (mapsize <= budget) {
+		if (!(bmap->map = calloc(bmap->mapsize, sizeof(char))))
+			return -ENOMEM;
+		return 0;
+	}
+	bmap->nchunks = (mapsize + BMAP_CHUNK_SIZE - 1) >> BMAP_CHUNK_SHIFT;
+	bmap->chunks = calloc(bmap->nchunks, sizeof(*bmap->chunks));
+	bmap->fill = calloc(bmap->nchunks, sizeof(*bmap->fill));
+	if (bmap->chunks == NULL || bmap->fill == NULL) {
+		free(bmap->chunks);
+		free(bmap->fill);
+		bmap->chunks = NULL;
+		bmap->fill = NULL;
+		return -ENOMEM;
+	}
+	bmap->compact_at = budget;
+	return 0;
+}
+
+static void blockmap_destroy(struct bmap *bmap)
+{
+	if (bmap->map)
+		free(bmap->map);
+	if (bmap->chunks) {
+		for (uint64_t i = 0; i < bmap->nchunks; i++)
+			free(bmap->chunks[i]);
+		free(bmap->chunks);
+		free(bmap->fill);
+	}
+	memset(bmap, 0, sizeof(*bmap));
+}
+
+static int blockmap_create(struct bmap *bmap, uint64_t size, uint64_t budget)
+{
+	/* Have to add 1 to BLOCKMAP_SIZE since it's 0-based and mallocs
+	 * must be 1-based */
+	return bmap_init(bmap, size, BLOCKMAP_SIZE2(size) + 1, budget);
+}
+
+/**
+ * bmap_create - create a 2-bit blockmap
+ * @size: The number of blocks
+ * @budget: The size in bytes above which the map is chunked
+ * @addl_mem_needed: Set to the size of the map if it cannot be allocated
+ */
+struct bmap *bmap_create(uint64_t size, uint64_t budget, uint64_t *addl_mem_needed)
+{
+	struct bmap *il;
+
+	*addl_mem_needed = 0L;
+	il = calloc(1, sizeof(*il));
+	if (!il)
+		return NULL;
+
+	if (blockmap_create(il, size, budget)) {
+		*addl_mem_needed = il->mapsize;
+		free(il);
+		il = NULL;
+	}
+	return il;
+}
+
+void bmap_destroy(struct bmap *il)
+{
+	if (il) {
+		blockmap_destroy(il);
+		free(il);
+	}
+}
+
+int link1_create(struct bmap *bmap, uint64_t size, uint64_t budget)
+{
+	return bmap_init(bmap, size, BLOCKMAP_SIZE1(size) + 1, budget);
+}
+
+void link1_destroy(struct bmap *bmap)
+{
+	blockmap_destroy(bmap);
+}
+
+/**
+ * bmap_byte_ptr - get a pointer to a byte of a map so that it can be updated
+ * @bmap: The map
+ * @off: The offset of the byte in the map
+ *
+ * The chunk holding the byte is allocated, and filled with its fill byte, if
+ * it has not been already.
+ * Returns the pointer or NULL if the chunk could not be allocated.
+ */
+unsigned char *bmap_byte_ptr(struct bmap *bmap, uint64_t off)
+{
+	uint64_t idx = off >> BMAP_CHUNK_SHIFT;
+	unsigned char *chunk, *cur = NULL;
+
+	if (bmap->map != NULL)
+		return bmap->map + off;
+	chunk = __atomic_load_n(&bmap->chunks[idx], __ATOMIC_ACQUIRE);
+	if (chunk != NULL)
+		return chunk + (off & (BMAP_CHUNK_SIZE - 1));
+
+	chunk = malloc(BMAP_CHUNK_SIZE);
+	if (chunk == NULL)
+		return NULL;
+	memset(chunk, bmap->fill[idx], BMAP_CHUNK_SIZE);
+	if (__atomic_compare_exchange_n(&bmap->chunks[idx], &cur, chunk, 0,
+	                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		__atomic_fetch_add(&bmap->chunk_mem, BMAP_CHUNK_SIZE, __ATOMIC_RELAXED);
+		return chunk + (off & (BMAP_CHUNK_SIZE - 1));
+	}
+	/* Another thread allocated it first */
+	free(chunk);
+	return cur + (off & (BMAP_CHUNK_SIZE - 1));
+}
+
+/* Returns 1 if the first len bytes of a chunk all have the same value */
+static int chunk_uniform(const unsigned char *chunk, size_t len)
+{
+	return chunk[0] == chunk[len - 1] && memcmp(chunk, chunk + 1, len - 1) == 0;
+}
+
+/**
+ * bmap_compact - free the chunks of a chunked map which have become uniform
+ * @bmap: The map
+ * @force: Compact the map even if it has not reached its memory budget
+ *
+ * This must not be called while other threads may be using the map.
+ */
+void bmap_compact(struct bmap *bmap, int force)
+{
+	uint64_t freed = 0;
+
+	if (bmap->chunks == NULL || (!force && bmap->chunk_mem < bmap->compact_at))
+		return;
+	for (uint64_t i = 0; i < bmap->nchunks; i++) {
+		unsigned char *chunk = bmap->chunks[i];
+		uint64_t len = bmap->mapsize - (i << BMAP_CHUNK_SHIFT);
+
+		if (chunk == NULL)
+			continue;
+		if (len > BMAP_CHUNK_SIZE)
+			len = BMAP_CHUNK_SIZE;
+		if (!chunk_uniform(chunk, len))
+			continue;
+		bmap->fill[i] = chunk[0];
+		bmap->chunks[i] = NULL;
+		free(chunk);
+		freed += BMAP_CHUNK_SIZE;
+	}
+	bmap->chunk_mem -= freed;
+	/* Don't rescan the whole map every time if little of it can be freed */
+	if (bmap->compact_at < bmap->chunk_mem * 2)
+		bmap->compact_at = bmap->chunk_mem * 2;
+}
+
+/**
+ * blockmap_cmpxchg - Change the state of a block in the blockmap if it has
+ *                    an expected state
+ * @bmap: The blockmap
+ * @bblock: The block
+ * @old: The expected state or -1 to change the block whatever its state
+ * @mark: The new state
+ *
+ * This is safe to call from several threads at once, including for blocks
+ * which share a byte of the map.
+ * Returns the previous state of the block, which is not @old if the block was
+ * not changed, or -1 if the block is out of range or memory could not be
+ * allocated for it.
+ */
+int blockmap_cmpxchg(struct bmap *bmap, uint64_t bblock, int old, int mark)
+{
+	unsigned char *byte;
+	unsigned char cur, new;
+	uint64_t b;
+	int prev;
+
+	if (bblock > bmap->size)
+		return -1;
+
+	b = BLOCKMAP_BYTE_OFFSET2(bblock);
+	/* Avoid allocating a chunk of a chunked map when nothing changes */
+	prev = block_type(bmap, bblock);
+	if (prev == (mark & BLOCKMAP_MASK2) || (old >= 0 && prev != old))
+		return prev;
+
+	byte = bmap_byte_ptr(bmap, BLOCKMAP_SIZE2(bblock));
+	if (byte == NULL)
+		return -1;
+	cur = __atomic_load_n(byte, __ATOMIC_RELAXED);
+	do {
+		prev = (cur >> b) & BLOCKMAP_MASK2;
+		if (old >= 0 && prev != old)
+			break;
+		new = cur & ~(BLOCKMAP_MASK2 << b);
+		new |= (mark & BLOCKMAP_MASK2) << b;
+	} while (!__atomic_compare_exchange_n(byte, &cur, new, 1, __ATOMIC_RELAXED,
+	                                      __ATOMIC_RELAXED));
+	return prev;
+}
+
+int blockmap_set(struct bmap *bmap, uint64_t bblock, int mark)
+{
+	if (!bmap)
+		return 0;
+	return blockmap_cmpxchg(bmap, bblock, -1, mark) < 0 ? -1 : 0;
+}
+
+/**
+ * blockmap_states - copy the states of a range of blocks from a blockmap
+ * @bmap: The blockmap
+ * @bblock: The first block
+ * @len: The number of bytes to fill, 4 blocks per byte
+ * @out: The states are written here in the layout of an rgrp bitmap
+ *
+ * Blocks beyond the end of the map are reported as free.
+ */
+void blockmap_states(struct bmap *bmap, uint64_t bblock, unsigned len, unsigned char *out)
+{
+	uint64_t off = BLOCKMAP_SIZE2(bblock);
+	unsigned shift = BLOCKMAP_BYTE_OFFSET2(bblock);
+	unsigned char cur = off < bmap->mapsize ? bmap_byte(bmap, off) : 0;
+
+	for (unsigned i = 0; i < len; i++) {
+		unsigned char next;
+
+		off++;
+		next = off < bmap->mapsize ? bmap_byte(bmap, off) : 0;
+		if (shift == 0)
+			out[i] = cur;
+		else
+			out[i] = (cur >> shift) | (next << (8 - shift));
+		cur = next;
+	}
+}
+
+void owner_index_init(struct owner_index *oi, uint64_t budget)
+{
+	memset(oi, 0, sizeof(*oi));
+	oi->budget = budget;
+	oi->enabled = (budget > 0);
+}
+
+void owner_index_free(struct owner_index *oi)
+{
+	free(oi->ext);
+	oi->ext = NULL;
+	oi->count = 0;
+	oi->alloc = 0;
+	oi->enabled = 0;
+}
+
+/**
+ * owner_index_add - record that an inode references a block
+ *
+ * Inodes mostly reference runs of consecutive blocks, so a reference which
+ * follows on from the previous one extends its extent.
+ * Returns 0, or -1 if the index has reached its budget and was dropped.
+ */
+int owner_index_add(struct owner_index *oi, uint64_t block, uint64_t owner)
+{
+	struct owner_extent *ext;
+
+	if (!oi->enabled)
+		return 0;
+	if (oi->count > 0) {
+		ext = &oi->ext[oi->count - 1];
+		if (ext->owner == owner && block >= ext->start &&
+		    block <= ext->start + ext->len) {
+			if (block == ext->start + ext->len)
+				ext->len++;
+			return 0;
+		}
+	}
+	if (oi->count == oi->alloc) {
+		uint64_t alloc = oi->alloc ? oi->alloc * 2 : 4096;
+
+		ext = NULL;
+		if (alloc * sizeof(*ext) <= oi->budget)
+			ext = realloc(oi->ext, alloc * sizeof(*ext));
+		if (ext == NULL) {
+			owner_index_free(oi);
+			return -1;
+		}
+		oi->ext = ext;
+		oi->alloc = alloc;
+	}
+	ext = &oi->ext[oi->count++];
+	ext->start = block;
+	ext->owner = owner;
+	ext->len = 1;
+	return 0;
+}
 
 void special_free(struct special_blocks *blist)
 {
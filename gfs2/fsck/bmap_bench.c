@@ -0,0 +1,127 @@
+#include "clusterautoconfig.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "fsck.h"
+#include "util.h"
+
+/*
+ * Measures the throughput of blockmap updates and lookups using 1 to N
+ * threads. Each thread works on an interleaved set of blocks so that threads
+ * regularly update blocks which share a byte of the map.
+ *
+ * Usage: bmap_bench [max_threads [blocks [rounds [chunked]]]]
+ *
+ * If chunked is non-zero the chunked form of the map is measured.
+ */
+
+struct bench_arg {
+	struct bmap *bl;
+	unsigned tid;
+	unsigned nthreads;
+	unsigned rounds;
+	uint64_t found;
+};
+
+static void *bench_set(void *data)
+{
+	struct bench_arg *a = data;
+
+	for (unsigned r = 0; r < a->rounds; r++)
+		for (uint64_t b = a->tid; b < a->bl->size; b += a->nthreads)
+			blockmap_set(a->bl, b, (b + r) & BLOCKMAP_MASK2);
+	return NULL;
+}
+
+static void *bench_get(void *data)
+{
+	struct bench_arg *a = data;
+
+	for (unsigned r = 0; r < a->rounds; r++)
+		for (uint64_t b = a->tid; b < a->bl->size; b += a->nthreads)
+			a->found += (block_type(a->bl, b) == GFS2_BLKST_USED);
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(struct bmap *bl, unsigned nthreads, unsigned rounds, void *(*fn)(void *))
+{
+	pthread_t threads[nthreads];
+	struct bench_arg args[nthreads];
+	double start = now();
+
+	for (unsigned i = 0; i < nthreads; i++) {
+		args[i].bl = bl;
+		args[i].tid = i;
+		args[i].nthreads = nthreads;
+		args[i].rounds = rounds;
+		args[i].found = 0;
+		if (pthread_create(&threads[i], NULL, fn, &args[i]) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	for (unsigned i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	return now() - start;
+}
+
+/* Every block must hold the state written by the last round of bench_set */
+static int verify(struct bmap *bl, unsigned rounds)
+{
+	for (uint64_t b = 0; b < bl->size; b++) {
+		if (block_type(bl, b) != (int)((b + rounds - 1) & BLOCKMAP_MASK2)) {
+			fprintf(stderr, "Block %"PRIu64" has the wrong state\n", b);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned max_threads = argc > 1 ? strtoul(argv[1], NULL, 0) : 8;
+	uint64_t blocks = argc > 2 ? strtoull(argv[2], NULL, 0) : 1 << 26;
+	unsigned rounds = argc > 3 ? strtoul(argv[3], NULL, 0) : 4;
+	int chunked = argc > 4 ? atoi(argv[4]) : 0;
+	uint64_t addl_mem_needed;
+	struct bmap *bl;
+
+	if (max_threads == 0 || blocks == 0 || rounds == 0) {
+		fprintf(stderr, "Usage: %s [max_threads [blocks [rounds [chunked]]]]\n", argv[0]);
+		return 1;
+	}
+	bl = bmap_create(blocks, chunked ? 0 : UINT64_MAX, &addl_mem_needed);
+	if (bl == NULL) {
+		perror("bmap_create");
+		return 1;
+	}
+	printf("%"PRIu64" blocks, %u rounds, %s map\n", blocks, rounds,
+	       chunked ? "chunked" : "flat");
+	printf("threads     set Mblk/s     get Mblk/s\n");
+	for (unsigned n = 1; n <= max_threads; n *= 2) {
+		double mblk = (double)blocks * rounds / 1e6;
+		double set = run(bl, n, rounds, bench_set);
+		double get = run(bl, n, rounds, bench_get);
+
+		printf("%7u %14.1f %14.1f\n", n, mblk / set, mblk / get);
+		if (verify(bl, rounds)) {
+			bmap_destroy(bl);
+			return 1;
+		}
+	}
+	bmap_destroy(bl);
+	return 0;
+}
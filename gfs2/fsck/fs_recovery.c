@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include <libintl.h>
 #define _(String) gettext(String)
 
@@ -13,176 +15,431 @@
 #include "fs_recovery.h"
 #include "libgfs2.h"
 #include "metawalk.h"
+#include "prefetch.h"
 #include "util.h"
 
 #define JOURNAL_NAME_SIZE 18
 #define JOURNAL_SEQ_TOLERANCE 10
 
-static unsigned int sd_found_jblocks = 0;
-static unsigned int sd_replayed_jblocks = 0;
-static unsigned int sd_found_metablocks = 0;
-static unsigned int sd_replayed_metablocks = 0;
-static unsigned int sd_found_revokes = 0;
-static osi_list_t sd_revoke_list;
-static unsigned int sd_replay_tail;
+/* The size of the reads used to scan the journals */
+#define JSCAN_CHUNK_SIZE (4 << 20)
+/* Replayed blocks are written out once this much has been queued */
+#define REPLAY_BATCH_SIZE (64 << 20)
+#define REPLAY_WRITE_THREADS 4
+/* Batches smaller than this are written by one thread */
+#define REPLAY_WRITE_SPLIT 1024
+
+#ifndef IOV_MAX
+  #ifdef UIO_MAXIOV
+    #define IOV_MAX UIO_MAXIOV
+  #else
+    #define IOV_MAX (1024)
+  #endif
+#endif
 
 struct revoke_replay {
-	osi_list_t rr_list;
 	uint64_t rr_blkno;
 	unsigned int rr_where;
 };
 
-static int revoke_add(struct lgfs2_sbd *sdp, uint64_t blkno, unsigned int where)
+/* A run of journal blocks which are contiguous on disk, or a hole if dblk is 0 */
+struct jextent {
+	uint32_t lblk;
+	uint32_t len;
+	uint64_t dblk;
+};
+
+/* A logged block to be written back to its place in the file system */
+struct replay_blk {
+	uint64_t rb_blkno;
+	unsigned int rb_where;
+	unsigned int rb_flags;
+};
+
+#define REPLAY_META    0x1 /* Metadata, otherwise journaled data */
+#define REPLAY_ESCAPED 0x2 /* Journaled data with its magic number escaped */
+#define REPLAY_REVOKED 0x4 /* Revoked later in the log, so not to be written */
+
+/*
+ * What is known about a journal after it has been scanned: its valid log
+ * headers, the head of the log and, for a dirty journal, the revokes and the
+ * blocks to replay in log order.  Journals are scanned by a pool of threads
+ * before they are recovered in order, so that they are read in parallel and
+ * in large chunks rather than a block at a time.
+ */
+struct jscan {
+	struct lgfs2_inode *ip;
+	uint32_t jd_blocks;
+	struct jextent *ext;
+	unsigned nr_ext;
+	unsigned ext_size;
+	int want_plan;
+	int stale;           /* Written to by a replay since it was scanned */
+	int error;           /* Reading the journal failed */
+	struct lgfs2_log_header *lhs; /* The valid log headers, by block */
+	uint32_t nlhs;
+	uint32_t lhs_size;
+	int head_error;
+	struct lgfs2_log_header head;
+	char *ld;            /* The log descriptor being looked at */
+
+	/* The replay plan, if the journal is dirty and is to be replayed */
+	struct revoke_replay *revokes; /* In log order */
+	unsigned nrevokes;
+	unsigned revokes_size;
+	struct revoke_replay *revoked; /* By block, with the last revoke of each */
+	unsigned found_revokes;
+	struct replay_blk *blks;
+	unsigned nblks;
+	unsigned blks_size;
+	int replay_error;    /* The error which ended the walk through the log */
+	int replay_pass;
+	int corrupt_at;      /* Where a bad log header ended the walk, or -1 */
+
+	unsigned found_jblocks;
+	unsigned replayed_jblocks;
+	unsigned found_metablocks;
+	unsigned replayed_metablocks;
+};
+
+/* Reads the blocks of a journal a chunk at a time */
+struct jreader {
+	struct jscan *js;
+	struct lgfs2_sbd *sdp;
+	char *buf;
+	uint32_t start;
+	uint32_t count;
+};
+
+struct jscan_pool {
+	pthread_mutex_t lock;
+	struct jscan *scans;
+	unsigned nscans;
+	unsigned next;
+};
+
+/* The journal extents of all of the journals, to find replays which hit them */
+struct jmap {
+	uint64_t dblk;
+	uint32_t len;
+	unsigned j;
+};
+
+struct replay_write {
+	uint64_t rw_blkno;
+	unsigned rw_idx;
+};
+
+/* Replayed blocks waiting to be written */
+struct replay_batch {
+	struct lgfs2_sbd *sdp;
+	struct replay_write *w;
+	char *data;
+	unsigned n;
+	unsigned size;
+	unsigned max;
+};
+
+struct replay_writer {
+	struct replay_batch *rb;
+	unsigned start;
+	unsigned end;
+	int error;
+};
+
+static struct jextent *jscan_extent(const struct jscan *js, uint32_t blk)
 {
-	osi_list_t *tmp, *head = &sd_revoke_list;
-	struct revoke_replay *rr;
-	int found = 0;
+	unsigned lo = 0, hi = js->nr_ext;
 
-	osi_list_foreach(tmp, head) {
-		rr = osi_list_entry(tmp, struct revoke_replay, rr_list);
-		if (rr->rr_blkno == blkno) {
-			found = 1;
-			break;
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+
+		if (js->ext[mid].lblk + js->ext[mid].len <= blk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < js->nr_ext && js->ext[lo].lblk <= blk)
+		return &js->ext[lo];
+	return NULL;
+}
+
+static int jscan_map(struct jscan *js)
+{
+	struct lgfs2_inode *ip = js->ip;
+	uint32_t lblk = 0;
+
+	while (lblk < js->jd_blocks) {
+		uint64_t dblock = 0;
+		uint32_t extlen = 0;
+		struct jextent *e;
+		int new = 0;
+
+		if (lgfs2_block_map(ip, lblk, &new, &dblock, &extlen, 0) || !dblock)
+			extlen = 1;
+		if (extlen > js->jd_blocks - lblk)
+			extlen = js->jd_blocks - lblk;
+
+		e = js->nr_ext ? &js->ext[js->nr_ext - 1] : NULL;
+		if (e && ((e->dblk == 0 && dblock == 0) ||
+		          (e->dblk != 0 && e->dblk + e->len == dblock))) {
+			e->len += extlen;
+		} else {
+			if (js->nr_ext == js->ext_size) {
+				unsigned size = js->ext_size ? js->ext_size * 2 : 16;
+				struct jextent *ext = realloc(js->ext, size * sizeof(*ext));
+
+				if (ext == NULL)
+					return -ENOMEM;
+				js->ext = ext;
+				js->ext_size = size;
+			}
+			e = &js->ext[js->nr_ext++];
+			e->lblk = lblk;
+			e->len = extlen;
+			e->dblk = dblock;
 		}
+		lblk += extlen;
 	}
+	return 0;
+}
 
-	if (found) {
-		rr->rr_where = where;
-		return 0;
+static int jscan_pread(int fd, char *buf, size_t len, off_t off)
+{
+	while (len > 0) {
+		ssize_t ret = pread(fd, buf, len, off);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf += ret;
+		off += ret;
+		len -= ret;
 	}
+	return 0;
+}
 
-	rr = malloc(sizeof(struct revoke_replay));
-	if (!rr)
-		return -ENOMEM;
+/*
+ * Return a pointer to a journal block. The following blocks are read along
+ * with it, up to the size of a chunk, as the log is walked forwards.
+ */
+static int jreader_read(struct jreader *jr, uint32_t blk, char **data)
+{
+	uint32_t bsize = jr->sdp->sd_bsize;
+	uint32_t max = JSCAN_CHUNK_SIZE / bsize;
+	struct jextent *e;
+	uint32_t n;
+
+	if (blk >= jr->start && blk - jr->start < jr->count) {
+		*data = jr->buf + (size_t)(blk - jr->start) * bsize;
+		return 0;
+	}
+	jr->count = 0;
+	e = jscan_extent(jr->js, blk);
+	if (e == NULL || e->dblk == 0)
+		return -EIO;
+	if (jr->buf == NULL) {
+		jr->buf = malloc(JSCAN_CHUNK_SIZE);
+		if (jr->buf == NULL)
+			return -ENOMEM;
+	}
+	n = e->lblk + e->len - blk;
+	if (n > max)
+		n = max;
+	if (jscan_pread(jr->sdp->device_fd, jr->buf, (size_t)n * bsize,
+	                (e->dblk + blk - e->lblk) * bsize) != 0)
+		return -EIO;
+	jr->start = blk;
+	jr->count = n;
+	*data = jr->buf;
+	return 0;
+}
 
-	rr->rr_blkno = blkno;
-	rr->rr_where = where;
-	osi_list_add(&rr->rr_list, head);
+/* Look up a log header like lgfs2_get_log_header() does, in a scanned journal */
+static int jscan_get_lh(void *priv, unsigned int blk, struct lgfs2_log_header *head)
+{
+	const struct jscan *js = priv;
+	const struct jextent *e = jscan_extent(js, blk);
+	uint32_t lo = 0, hi = js->nlhs;
+
+	if (e == NULL || e->dblk == 0)
+		return -EIO;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (js->lhs[mid].lh_blkno < blk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < js->nlhs && js->lhs[lo].lh_blkno == blk) {
+		*head = js->lhs[lo];
+		return 0;
+	}
 	return 1;
 }
 
-static int revoke_check(struct lgfs2_sbd *sdp, uint64_t blkno, unsigned int where)
+static int get_log_header(void *priv, unsigned int blk, struct lgfs2_log_header *head)
 {
-	osi_list_t *tmp;
-	struct revoke_replay *rr;
-	int wrap, a, b;
-	int found = 0;
+	return lgfs2_get_log_header(priv, blk, head);
+}
 
-	osi_list_foreach(tmp, &sd_revoke_list) {
-		rr = osi_list_entry(tmp, struct revoke_replay, rr_list);
-		if (rr->rr_blkno == blkno) {
-			found = 1;
-			break;
-		}
+static int jscan_add_lh(struct jscan *js, const struct lgfs2_log_header *lh)
+{
+	if (js->nlhs == js->lhs_size) {
+		uint32_t size = js->lhs_size ? js->lhs_size * 2 : 64;
+		struct lgfs2_log_header *lhs = realloc(js->lhs, size * sizeof(*lhs));
+
+		if (lhs == NULL)
+			return -ENOMEM;
+		js->lhs = lhs;
+		js->lhs_size = size;
+	}
+	js->lhs[js->nlhs++] = *lh;
+	return 0;
+}
+
+static int plan_revoke(struct jscan *js, uint64_t blkno, unsigned int where)
+{
+	if (js->nrevokes == js->revokes_size) {
+		unsigned size = js->revokes_size ? js->revokes_size * 2 : 64;
+		struct revoke_replay *rr = realloc(js->revokes, size * sizeof(*rr));
+
+		if (rr == NULL)
+			return -ENOMEM;
+		js->revokes = rr;
+		js->revokes_size = size;
 	}
+	js->revokes[js->nrevokes].rr_blkno = blkno;
+	js->revokes[js->nrevokes].rr_where = where;
+	js->nrevokes++;
+	return 0;
+}
 
-	if (!found)
-		return 0;
+static int plan_blk(struct jscan *js, uint64_t blkno, unsigned int where, unsigned int flags)
+{
+	if (js->nblks == js->blks_size) {
+		unsigned size = js->blks_size ? js->blks_size * 2 : 256;
+		struct replay_blk *rb = realloc(js->blks, size * sizeof(*rb));
+
+		if (rb == NULL)
+			return -ENOMEM;
+		js->blks = rb;
+		js->blks_size = size;
+	}
+	js->blks[js->nblks].rb_blkno = blkno;
+	js->blks[js->nblks].rb_where = where;
+	js->blks[js->nblks].rb_flags = flags;
+	js->nblks++;
+	return 0;
+}
 
-	wrap = (rr->rr_where < sd_replay_tail);
-	a = (sd_replay_tail < where);
-	b = (where < rr->rr_where);
-	return (wrap) ? (a || b) : (a && b);
+static int revoke_cmp(const void *a, const void *b)
+{
+	const struct revoke_replay *x = a, *y = b;
+
+	if (x->rr_blkno != y->rr_blkno)
+		return x->rr_blkno < y->rr_blkno ? -1 : 1;
+	/* Keep the log order of revokes of the same block */
+	if (x != y)
+		return x < y ? -1 : 1;
+	return 0;
 }
 
-static void revoke_clean(struct lgfs2_sbd *sdp)
+/* Build the table of revoked blocks, where only the last revoke of each counts */
+static int revoke_index(struct jscan *js)
 {
-	osi_list_t *head = &sd_revoke_list;
-	struct revoke_replay *rr;
+	unsigned i, n = 0;
 
-	while (!osi_list_empty(head)) {
-		rr = osi_list_entry(head->next, struct revoke_replay, rr_list);
-		osi_list_del(&rr->rr_list);
-		free(rr);
+	if (js->nrevokes == 0)
+		return 0;
+	js->revoked = malloc(js->nrevokes * sizeof(*js->revoked));
+	if (js->revoked == NULL)
+		return -ENOMEM;
+	memcpy(js->revoked, js->revokes, js->nrevokes * sizeof(*js->revoked));
+	qsort(js->revoked, js->nrevokes, sizeof(*js->revoked), revoke_cmp);
+	for (i = 0; i < js->nrevokes; i++) {
+		if (n > 0 && js->revoked[n - 1].rr_blkno == js->revoked[i].rr_blkno)
+			n--;
+		js->revoked[n++] = js->revoked[i];
 	}
+	js->found_revokes = n;
+	return 0;
 }
 
-static void refresh_rgrp(struct lgfs2_sbd *sdp, struct lgfs2_rgrp_tree *rgd,
-			 struct lgfs2_buffer_head *bh, uint64_t blkno)
+static int revoke_check(const struct jscan *js, uint64_t blkno, unsigned int where)
 {
-	int i;
+	unsigned lo = 0, hi = js->found_revokes;
+	const struct revoke_replay *rr;
+	unsigned int tail = js->head.lh_tail;
+	int wrap, a, b;
 
-	log_debug(_("Block is part of rgrp 0x%"PRIx64"; refreshing the rgrp.\n"),
-	          rgd->rt_addr);
-	for (i = 0; i < rgd->rt_length; i++) {
-		if (rgd->rt_addr + i != blkno)
-			continue;
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
 
-		memcpy(rgd->rt_bits[i].bi_data, bh->b_data, sdp->sd_bsize);
-		rgd->rt_bits[i].bi_modified = 1;
-		if (i == 0) /* this is the rgrp itself */
-			lgfs2_rgrp_in(rgd, rgd->rt_bits[0].bi_data);
-		break;
+		if (js->revoked[mid].rr_blkno < blkno)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+	if (lo == js->found_revokes || js->revoked[lo].rr_blkno != blkno)
+		return 0;
+	rr = &js->revoked[lo];
+
+	wrap = (rr->rr_where < tail);
+	a = (tail < where);
+	b = (where < rr->rr_where);
+	return (wrap) ? (a || b) : (a && b);
 }
 
-static int buf_lo_scan_elements(struct lgfs2_inode *ip, unsigned int start,
+static void replay_incr_blk(const struct jscan *js, unsigned int *blk)
+{
+	if (++*blk == js->jd_blocks)
+		*blk = 0;
+}
+
+static int buf_lo_scan_elements(struct jscan *js, unsigned int start,
 				struct gfs2_log_descriptor *ld, __be64 *ptr,
 				int pass)
 {
-	struct lgfs2_sbd *sdp = ip->i_sbd;
 	unsigned int blks = be32_to_cpu(ld->ld_data1);
+	__be64 *end = (__be64 *)(js->ld + js->ip->i_sbd->sd_bsize);
 	uint64_t blkno;
-	int error = 0;
-	struct lgfs2_rgrp_tree *rgd;
+	int error;
 
 	if (pass != 1 || be32_to_cpu(ld->ld_type) != GFS2_LOG_DESC_METADATA)
 		return 0;
 
-	lgfs2_replay_incr_blk(ip, &start);
-
-	for (; blks; lgfs2_replay_incr_blk(ip, &start), blks--) {
-		struct lgfs2_buffer_head *bh_log, *bh_ip;
-		struct gfs2_meta_header *mhp;
+	replay_incr_blk(js, &start);
 
-		sd_found_metablocks++;
+	for (; blks; replay_incr_blk(js, &start), blks--) {
+		const struct jextent *e;
+		unsigned int flags = REPLAY_META;
 
+		if (ptr >= end)
+			return -EIO;
 		blkno = be64_to_cpu(*ptr);
 		ptr++;
-		if (revoke_check(sdp, blkno, start))
-			continue;
-
-		error = lgfs2_replay_read_block(ip, start, &bh_log);
-		if (error)
-			return error;
-
-		log_info(_("Journal replay writing metadata block #%"PRIu64" (0x%"PRIx64") for journal+0x%x\n"),
-		         blkno, blkno, start);
-		bh_ip = lgfs2_bget(sdp, blkno);
-		if (!bh_ip) {
-			log_err(_("Out of memory when replaying journals.\n"));
-			lgfs2_bfree(&bh_log);
-			return FSCK_ERROR;
-		}
-		memcpy(bh_ip->b_data, bh_log->b_data, sdp->sd_bsize);
-
-		mhp = (struct gfs2_meta_header *)bh_ip->b_data;
-		if (be32_to_cpu(mhp->mh_magic) != GFS2_MAGIC) {
-			log_err(_("Journal corruption detected at block #%"PRIu64" (0x%"PRIx64") for journal+0x%x.\n"),
-			        blkno, blkno, start);
-			error = -EIO;
+		if (revoke_check(js, blkno, start)) {
+			flags |= REPLAY_REVOKED;
 		} else {
-			lgfs2_bmodified(bh_ip);
-			rgd = lgfs2_blk2rgrpd(sdp, blkno);
-			if (rgd && blkno < rgd->rt_data0)
-				refresh_rgrp(sdp, rgd, bh_ip, blkno);
+			e = jscan_extent(js, start);
+			if (e == NULL || e->dblk == 0)
+				return -EIO;
 		}
-
-		lgfs2_brelse(bh_log);
-		lgfs2_brelse(bh_ip);
+		error = plan_blk(js, blkno, start, flags);
 		if (error)
-			break;
-
-		sd_replayed_metablocks++;
+			return error;
 	}
-	return error;
+	return 0;
 }
 
-static int revoke_lo_scan_elements(struct lgfs2_inode *ip, unsigned int start,
+static int revoke_lo_scan_elements(struct jscan *js, struct jreader *jr, unsigned int start,
 				   struct gfs2_log_descriptor *ld, __be64 *ptr,
 				   int pass)
 {
-	struct lgfs2_sbd *sdp = ip->i_sbd;
+	struct lgfs2_sbd *sdp = js->ip->i_sbd;
 	unsigned int blks = be32_to_cpu(ld->ld_length);
 	unsigned int revokes = be32_to_cpu(ld->ld_data1);
 	unsigned int offset;
@@ -195,114 +452,93 @@ static int revoke_lo_scan_elements(struct lgfs2_inode *ip, unsigned int start,
 
 	offset = sizeof(struct gfs2_log_descriptor);
 
-	for (; blks; lgfs2_replay_incr_blk(ip, &start), blks--) {
-		struct lgfs2_buffer_head *bh;
+	for (; blks; replay_incr_blk(js, &start), blks--) {
+		char *buf;
 
-		error = lgfs2_replay_read_block(ip, start, &bh);
+		error = jreader_read(jr, start, &buf);
 		if (error)
 			return error;
 
 		if (!first) {
-			if (lgfs2_check_meta(bh->b_data, GFS2_METATYPE_LB))
+			if (lgfs2_check_meta(buf, GFS2_METATYPE_LB))
 				continue;
 		}
 		while (offset + sizeof(uint64_t) <= sdp->sd_bsize) {
-			blkno = be64_to_cpu(*(__be64 *)(bh->b_data + offset));
-			log_info(_("Journal replay processing revoke for block #%"PRIu64" (0x%"PRIx64") for journal+0x%x\n"),
-			         blkno, blkno, start);
-			error = revoke_add(sdp, blkno, start);
-			if (error < 0) {
-				lgfs2_bfree(&bh);
+			blkno = be64_to_cpu(*(__be64 *)(buf + offset));
+			error = plan_revoke(js, blkno, start);
+			if (error)
 				return error;
-			}
-			else if (error)
-				sd_found_revokes++;
 
 			if (!--revokes)
 				break;
 			offset += sizeof(uint64_t);
 		}
 
-		lgfs2_bmodified(bh);
-		lgfs2_brelse(bh);
 		offset = sizeof(struct gfs2_meta_header);
 		first = 0;
 	}
 	return 0;
 }
 
-static int databuf_lo_scan_elements(struct lgfs2_inode *ip, unsigned int start,
+static int databuf_lo_scan_elements(struct jscan *js, unsigned int start,
 				    struct gfs2_log_descriptor *ld,
 				    __be64 *ptr, int pass)
 {
-	struct lgfs2_sbd *sdp = ip->i_sbd;
 	unsigned int blks = be32_to_cpu(ld->ld_data1);
+	__be64 *end = (__be64 *)(js->ld + js->ip->i_sbd->sd_bsize);
 	uint64_t blkno;
 	uint64_t esc;
-	int error = 0;
+	int error;
 
 	if (pass != 1 || be32_to_cpu(ld->ld_type) != GFS2_LOG_DESC_JDATA)
 		return 0;
 
-	lgfs2_replay_incr_blk(ip, &start);
-	for (; blks; lgfs2_replay_incr_blk(ip, &start), blks--) {
-		struct lgfs2_buffer_head *bh_log, *bh_ip;
+	replay_incr_blk(js, &start);
+	for (; blks; replay_incr_blk(js, &start), blks--) {
+		const struct jextent *e;
+		unsigned int flags = 0;
 
+		if (ptr + 1 >= end)
+			return -EIO;
 		blkno = be64_to_cpu(*ptr);
 		ptr++;
 		esc = be64_to_cpu(*ptr);
 		ptr++;
 
-		sd_found_jblocks++;
-
-		if (revoke_check(sdp, blkno, start))
-			continue;
-
-		error = lgfs2_replay_read_block(ip, start, &bh_log);
+		if (revoke_check(js, blkno, start)) {
+			flags |= REPLAY_REVOKED;
+		} else {
+			e = jscan_extent(js, start);
+			if (e == NULL || e->dblk == 0)
+				return -EIO;
+		}
+		if (esc)
+			flags |= REPLAY_ESCAPED;
+		error = plan_blk(js, blkno, start, flags);
 		if (error)
 			return error;
-
-		log_info(_("Journal replay writing data block #%"PRIu64" (0x%"PRIx64") for journal+0x%x\n"),
-		         blkno, blkno, start);
-		bh_ip = lgfs2_bget(sdp, blkno);
-		if (!bh_ip) {
-			log_err(_("Out of memory when replaying journals.\n"));
-			lgfs2_bfree(&bh_log);
-			return FSCK_ERROR;
-		}
-		memcpy(bh_ip->b_data, bh_log->b_data, sdp->sd_bsize);
-
-		/* Unescape */
-		if (esc) {
-			__be32 *eptr = (__be32 *)bh_ip->b_data;
-			*eptr = cpu_to_be32(GFS2_MAGIC);
-		}
-
-		lgfs2_brelse(bh_log);
-		lgfs2_bmodified(bh_ip);
-		lgfs2_brelse(bh_ip);
-
-		sd_replayed_jblocks++;
 	}
-	return error;
+	return 0;
 }
 
 /**
  * foreach_descriptor - go through the active part of the log
- * @ip: the journal incore inode
+ * @js: the scanned journal
+ * @jr: reads the blocks of the journal
  * @start: the first log header in the active region
  * @end: the last log header (don't process the contents of this entry))
  *
  * Call a given function once for every log descriptor in the active
- * portion of the log.
+ * portion of the log, adding the revokes and the blocks to replay to the
+ * journal's replay plan.
  *
  * Returns: errno
  */
 
-static int foreach_descriptor(struct lgfs2_inode *ip, unsigned int start,
+static int foreach_descriptor(struct jscan *js, struct jreader *jr, unsigned int start,
 		       unsigned int end, int pass)
 {
-	struct lgfs2_buffer_head *bh;
+	uint32_t bsize = js->ip->i_sbd->sd_bsize;
 	struct gfs2_log_descriptor *ld;
 	int error = 0;
 	uint32_t length;
@@ -313,80 +549,485 @@ static int foreach_descriptor(struct lgfs2_inode *ip, unsigned int start,
 
 	while (start != end) {
 		struct gfs2_meta_header *mhp;
+		char *buf;
 
-		error = lgfs2_replay_read_block(ip, start, &bh);
+		error = jreader_read(jr, start, &buf);
 		if (error)
 			return error;
-		mhp = (struct gfs2_meta_header *)bh->b_data;
-		if (be32_to_cpu(mhp->mh_magic) != GFS2_MAGIC) {
-			lgfs2_bmodified(bh);
-			lgfs2_brelse(bh);
+		mhp = (struct gfs2_meta_header *)buf;
+		if (be32_to_cpu(mhp->mh_magic) != GFS2_MAGIC)
 			return -EIO;
-		}
-		ld = (struct gfs2_log_descriptor *)bh->b_data;
+		ld = (struct gfs2_log_descriptor *)buf;
 		length = be32_to_cpu(ld->ld_length);
 
 		if (be32_to_cpu(ld->ld_header.mh_type) == GFS2_METATYPE_LH) {
 			struct lgfs2_log_header lh;
 
-			error = lgfs2_get_log_header(ip, start, &lh);
+			error = jscan_get_lh(js, start, &lh);
 			if (!error) {
-				lgfs2_replay_incr_blk(ip, &start);
-				lgfs2_bmodified(bh);
-				lgfs2_brelse(bh);
+				replay_incr_blk(js, &start);
 				continue;
 			}
 			if (error == 1) {
-				log_err(_("Journal corruption detected at "
-					  "journal+0x%x.\n"), start);
+				js->corrupt_at = start;
 				error = -EIO;
 			}
-			lgfs2_bmodified(bh);
-			lgfs2_brelse(bh);
 			return error;
-		} else if (lgfs2_check_meta(bh->b_data, GFS2_METATYPE_LD)) {
-			lgfs2_bmodified(bh);
-			lgfs2_brelse(bh);
+		} else if (lgfs2_check_meta(buf, GFS2_METATYPE_LD)) {
 			return -EIO;
 		}
-		ptr = (__be64 *)(bh->b_data + offset);
-		error = databuf_lo_scan_elements(ip, start, ld, ptr, pass);
-		if (error) {
-			lgfs2_bmodified(bh);
-			lgfs2_brelse(bh);
+		/* The revokes may read the following blocks, so keep a copy */
+		memcpy(js->ld, buf, bsize);
+		ld = (struct gfs2_log_descriptor *)js->ld;
+		ptr = (__be64 *)(js->ld + offset);
+		error = databuf_lo_scan_elements(js, start, ld, ptr, pass);
+		if (error)
 			return error;
-		}
-		error = buf_lo_scan_elements(ip, start, ld, ptr, pass);
-		if (error) {
-			lgfs2_bmodified(bh);
-			lgfs2_brelse(bh);
+		error = buf_lo_scan_elements(js, start, ld, ptr, pass);
+		if (error)
 			return error;
+		error = revoke_lo_scan_elements(js, jr, start, ld, ptr, pass);
+		if (error)
+			return error;
+
+		while (length--)
+			replay_incr_blk(js, &start);
+	}
+
+	return 0;
+}
+
+static void jscan_reset(struct jscan *js)
+{
+	free(js->lhs);
+	free(js->revokes);
+	free(js->revoked);
+	free(js->blks);
+	free(js->ld);
+	js->lhs = NULL;
+	js->nlhs = js->lhs_size = 0;
+	js->revokes = js->revoked = NULL;
+	js->nrevokes = js->revokes_size = js->found_revokes = 0;
+	js->blks = NULL;
+	js->nblks = js->blks_size = 0;
+	js->ld = NULL;
+	js->stale = 0;
+	js->error = 0;
+}
+
+/*
+ * Read a journal, note its valid log headers and find the head of the log.
+ * If the journal is dirty, walk through the log to find the blocks to be
+ * replayed, as recovery would, so that the replay only needs to write them.
+ * This doesn't use the buffer functions, so several journals can be scanned
+ * at the same time.
+ */
+static void jscan_journal(struct jscan *js, char *buf)
+{
+	struct lgfs2_sbd *sdp = js->ip->i_sbd;
+	struct jreader jr = { .js = js, .sdp = sdp, .buf = buf };
+	unsigned pass;
+	uint32_t blk;
+
+	jscan_reset(js);
+	for (blk = 0; blk < js->jd_blocks; blk++) {
+		const struct jextent *e = jscan_extent(js, blk);
+		struct lgfs2_log_header lh;
+		char *data;
+		int error;
+
+		if (e->dblk == 0) {
+			/* A hole, which jscan_get_lh() reports */
+			blk = e->lblk + e->len - 1;
+			continue;
 		}
-		error = revoke_lo_scan_elements(ip, start, ld, ptr, pass);
+		error = jreader_read(&jr, blk, &data);
 		if (error) {
-			lgfs2_bmodified(bh);
-			lgfs2_brelse(bh);
-			return error;
+			js->error = error;
+			goto out;
+		}
+		if (lgfs2_check_log_header(data, blk, sdp->sd_bsize, &lh) == 0 &&
+		    jscan_add_lh(js, &lh) != 0) {
+			js->error = -ENOMEM;
+			goto out;
 		}
+	}
+	js->head_error = lgfs2_find_jhead_with(js->jd_blocks, jscan_get_lh, js, &js->head);
+	if (js->head_error || !js->want_plan || (js->head.lh_flags & GFS2_LOG_HEAD_UNMOUNT))
+		goto out;
 
-		while (length--)
-			lgfs2_replay_incr_blk(ip, &start);
+	js->ld = malloc(sdp->sd_bsize);
+	if (js->ld == NULL) {
+		js->error = -ENOMEM;
+		goto out;
+	}
+	js->corrupt_at = -1;
+	js->replay_error = 0;
+	for (pass = 0; pass < 2; pass++) {
+		js->replay_error = foreach_descriptor(js, &jr, js->head.lh_tail,
+		                                      js->head.lh_blkno, pass);
+		if (js->replay_error == -ENOMEM) {
+			js->error = -ENOMEM;
+			goto out;
+		}
+		if (js->replay_error) {
+			js->replay_pass = pass;
+			break;
+		}
+		if (pass == 0 && revoke_index(js) != 0) {
+			js->error = -ENOMEM;
+			goto out;
+		}
+	}
+out:
+	if (jr.buf != buf)
+		free(jr.buf);
+}
 
-		lgfs2_bmodified(bh);
-		lgfs2_brelse(bh);
+static void *jscan_worker(void *arg)
+{
+	struct jscan_pool *pool = arg;
+	char *buf = malloc(JSCAN_CHUNK_SIZE);
+
+	for (;;) {
+		struct jscan *js;
+
+		pthread_mutex_lock(&pool->lock);
+		js = pool->next < pool->nscans ? &pool->scans[pool->next++] : NULL;
+		pthread_mutex_unlock(&pool->lock);
+		if (js == NULL)
+			break;
+		if (js->ip != NULL)
+			jscan_journal(js, buf);
+	}
+	free(buf);
+	return NULL;
+}
+
+/* Scan the journals with a pool of threads, in journal order */
+static void jscan_all(struct jscan *scans, unsigned nscans)
+{
+	struct jscan_pool pool = { .scans = scans, .nscans = nscans };
+	unsigned nthreads = prefetch_nthreads();
+	pthread_t *threads;
+	unsigned i, n = 0;
+
+	if (nthreads > nscans)
+		nthreads = nscans;
+	threads = calloc(nthreads, sizeof(*threads));
+	pthread_mutex_init(&pool.lock, NULL);
+	while (threads != NULL && n < nthreads &&
+	       pthread_create(&threads[n], NULL, jscan_worker, &pool) == 0)
+		n++;
+	if (n == 0)
+		jscan_worker(&pool);
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&pool.lock);
+	free(threads);
+}
+
+static int jmap_cmp(const void *a, const void *b)
+{
+	const struct jmap *x = a, *y = b;
+
+	if (x->dblk < y->dblk)
+		return -1;
+	return x->dblk > y->dblk;
+}
+
+static struct jmap *jmap_build(const struct jscan *scans, unsigned nscans, unsigned *count)
+{
+	struct jmap *map;
+	unsigned i, e, n = 0;
+
+	for (i = 0; i < nscans; i++)
+		n += scans[i].nr_ext;
+	map = malloc((n ? n : 1) * sizeof(*map));
+	if (map == NULL)
+		return NULL;
+	n = 0;
+	for (i = 0; i < nscans; i++) {
+		for (e = 0; e < scans[i].nr_ext; e++) {
+			if (scans[i].ext[e].dblk == 0)
+				continue;
+			map[n].dblk = scans[i].ext[e].dblk;
+			map[n].len = scans[i].ext[e].len;
+			map[n].j = i;
+			n++;
+		}
+	}
+	qsort(map, n, sizeof(*map), jmap_cmp);
+	*count = n;
+	return map;
+}
+
+/* Returns the journal which holds a block, or -1 */
+static int jmap_find(const struct jmap *map, unsigned n, uint64_t blk)
+{
+	unsigned lo = 0, hi = n;
+
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+
+		if (map[mid].dblk + map[mid].len <= blk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < n && map[lo].dblk <= blk)
+		return map[lo].j;
+	return -1;
+}
+
+static int rw_cmp(const void *a, const void *b)
+{
+	const struct replay_write *x = a, *y = b;
+
+	if (x->rw_blkno != y->rw_blkno)
+		return x->rw_blkno < y->rw_blkno ? -1 : 1;
+	return x->rw_idx < y->rw_idx ? -1 : x->rw_idx > y->rw_idx;
+}
+
+static void *replay_writer(void *arg)
+{
+	struct replay_writer *wr = arg;
+	struct replay_batch *rb = wr->rb;
+	uint32_t bsize = rb->sdp->sd_bsize;
+	struct iovec iov[IOV_MAX];
+	unsigned i, j;
+
+	for (i = wr->start; i < wr->end; i = j) {
+		uint64_t start = rb->w[i].rw_blkno;
+		size_t len = 0;
+		ssize_t ret;
+
+		for (j = i; j < wr->end && j - i < IOV_MAX &&
+		     rb->w[j].rw_blkno == start + (j - i); j++) {
+			iov[j - i].iov_base = rb->data + (size_t)rb->w[j].rw_idx * bsize;
+			iov[j - i].iov_len = bsize;
+			len += bsize;
+		}
+		ret = pwritev(rb->sdp->device_fd, iov, j - i, start * bsize);
+		if (ret != len) {
+			wr->error = ret < 0 ? errno : EIO;
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Write out the queued blocks. Only the last copy of each block is written
+ * and, as the blocks are then all different, they are split into ranges which
+ * are written by several threads at the same time.
+ */
+static int replay_flush(struct replay_batch *rb)
+{
+	struct replay_writer wr[REPLAY_WRITE_THREADS];
+	pthread_t threads[REPLAY_WRITE_THREADS];
+	unsigned nthreads = 1, started = 0;
+	unsigned i, n = 0;
+	int error = 0;
+
+	if (rb->n == 0)
+		return 0;
+	qsort(rb->w, rb->n, sizeof(*rb->w), rw_cmp);
+	for (i = 0; i < rb->n; i++) {
+		if (n > 0 && rb->w[n - 1].rw_blkno == rb->w[i].rw_blkno)
+			n--;
+		rb->w[n++] = rb->w[i];
+	}
+	if (n >= REPLAY_WRITE_SPLIT * 2)
+		nthreads = REPLAY_WRITE_THREADS;
+	for (i = 0; i < nthreads; i++) {
+		wr[i].rb = rb;
+		wr[i].start = (uint64_t)n * i / nthreads;
+		wr[i].end = (uint64_t)n * (i + 1) / nthreads;
+		wr[i].error = 0;
+	}
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, replay_writer, &wr[i]) != 0)
+			break;
+		started++;
+	}
+	/* Write the ranges which didn't get a thread here */
+	replay_writer(&wr[0]);
+	for (i = started + 1; i < nthreads; i++)
+		replay_writer(&wr[i]);
+	for (i = 1; i <= started; i++)
+		pthread_join(threads[i], NULL);
+	for (i = 0; i < nthreads; i++) {
+		if (wr[i].error && !error) {
+			log_err(_("Failed to write replayed blocks: %s\n"), strerror(wr[i].error));
+			error = FSCK_ERROR;
+		}
+	}
+	rb->n = 0;
+	return error;
+}
+
+/* Queue a copy of a block to be written, which is returned in copy */
+static int replay_queue(struct replay_batch *rb, uint64_t blkno, const char *data, char **copy)
+{
+	uint32_t bsize = rb->sdp->sd_bsize;
+	int error;
+
+	if (rb->n == rb->max) {
+		error = replay_flush(rb);
+		if (error)
+			return error;
+	}
+	if (rb->n == rb->size) {
+		unsigned size = rb->size ? rb->size * 2 : 256;
+		struct replay_write *w;
+		char *d;
+
+		if (size > rb->max)
+			size = rb->max;
+		w = realloc(rb->w, size * sizeof(*w));
+		if (w == NULL)
+			goto nomem;
+		rb->w = w;
+		d = realloc(rb->data, (size_t)size * bsize);
+		if (d == NULL)
+			goto nomem;
+		rb->data = d;
+		rb->size = size;
+	}
+	*copy = rb->data + (size_t)rb->n * bsize;
+	memcpy(*copy, data, bsize);
+	rb->w[rb->n].rw_blkno = blkno;
+	rb->w[rb->n].rw_idx = rb->n;
+	rb->n++;
+	return 0;
+nomem:
+	log_err(_("Out of memory when replaying journals.\n"));
+	return FSCK_ERROR;
+}
+
+static void refresh_rgrp(struct lgfs2_sbd *sdp, struct lgfs2_rgrp_tree *rgd,
+			 const char *buf, uint64_t blkno)
+{
+	int i;
+
+	log_debug(_("Block is part of rgrp 0x%"PRIx64"; refreshing the rgrp.\n"),
+	          rgd->rt_addr);
+	for (i = 0; i < rgd->rt_length; i++) {
+		if (rgd->rt_addr + i != blkno)
+			continue;
+
+		memcpy(rgd->rt_bits[i].bi_data, buf, sdp->sd_bsize);
+		rgd->rt_bits[i].bi_modified = 1;
+		if (i == 0) /* this is the rgrp itself */
+			lgfs2_rgrp_in(rgd, rgd->rt_bits[0].bi_data);
+		break;
 	}
+}
+
+/*
+ * Replay a scanned journal. The scan found the blocks to be replayed, so this
+ * reads them from the journal in large chunks and queues them to be written.
+ * Later journals which are hit by the writes are marked to be scanned again.
+ */
+static int replay_journal(struct jscan *js, int j, struct replay_batch *rb,
+                          struct jscan *scans, const struct jmap *map, unsigned nmap)
+{
+	struct lgfs2_sbd *sdp = js->ip->i_sbd;
+	struct jreader jr = { .js = js, .sdp = sdp };
+	int error = 0, flush_error;
+	unsigned i;
+
+	for (i = 0; i < js->nrevokes; i++)
+		log_info(_("Journal replay processing revoke for block #%"PRIu64" (0x%"PRIx64") for journal+0x%x\n"),
+		         js->revokes[i].rr_blkno, js->revokes[i].rr_blkno, js->revokes[i].rr_where);
+	js->found_jblocks = js->replayed_jblocks = 0;
+	js->found_metablocks = js->replayed_metablocks = 0;
+	if (js->replay_error && js->replay_pass == 0)
+		goto corrupt;
+	for (i = 0; i < js->nblks; i++) {
+		const struct replay_blk *b = &js->blks[i];
+		uint64_t blkno = b->rb_blkno;
+		char *data, *copy;
+		int k;
+
+		if (b->rb_flags & REPLAY_META)
+			js->found_metablocks++;
+		else
+			js->found_jblocks++;
+		if (b->rb_flags & REPLAY_REVOKED)
+			continue;
 
+		error = jreader_read(&jr, b->rb_where, &data);
+		if (error)
+			break;
+		if (b->rb_flags & REPLAY_META) {
+			struct gfs2_meta_header *mhp = (struct gfs2_meta_header *)data;
+			struct lgfs2_rgrp_tree *rgd;
+
+			log_info(_("Journal replay writing metadata block #%"PRIu64" (0x%"PRIx64") for journal+0x%x\n"),
+			         blkno, blkno, b->rb_where);
+			if (be32_to_cpu(mhp->mh_magic) != GFS2_MAGIC) {
+				log_err(_("Journal corruption detected at block #%"PRIu64" (0x%"PRIx64") for journal+0x%x.\n"),
+				        blkno, blkno, b->rb_where);
+				error = -EIO;
+				break;
+			}
+			error = replay_queue(rb, blkno, data, &copy);
+			if (error)
+				break;
+			rgd = lgfs2_blk2rgrpd(sdp, blkno);
+			if (rgd && blkno < rgd->rt_data0)
+				refresh_rgrp(sdp, rgd, copy, blkno);
+			js->replayed_metablocks++;
+		} else {
+			log_info(_("Journal replay writing data block #%"PRIu64" (0x%"PRIx64") for journal+0x%x\n"),
+			         blkno, blkno, b->rb_where);
+			error = replay_queue(rb, blkno, data, &copy);
+			if (error)
+				break;
+			/* Unescape */
+			if (b->rb_flags & REPLAY_ESCAPED) {
+				__be32 *eptr = (__be32 *)copy;
+				*eptr = cpu_to_be32(GFS2_MAGIC);
+			}
+			js->replayed_jblocks++;
+		}
+		k = jmap_find(map, nmap, blkno);
+		if (k > j)
+			scans[k].stale = 1;
+	}
+	if (error)
+		goto out;
+corrupt:
+	/* The walk through the log stopped where the scan found a problem */
+	error = js->replay_error;
+	if (error && js->corrupt_at >= 0)
+		log_err(_("Journal corruption detected at "
+			  "journal+0x%x.\n"), js->corrupt_at);
+out:
+	free(jr.buf);
+	/* Whatever was replayed is written, even if the log turned out to be bad */
+	flush_error = replay_flush(rb);
+	if (!error)
+		error = flush_error;
+	if (error)
+		return error;
+	log_info( _("jid=%u: Found %u revoke tags\n"), j, js->found_revokes);
 	return 0;
 }
 
 /**
  * check_journal_seq_no - Check and Fix log header sequencing problems
  * @ip: the journal incore inode
+ * @get_lh: returns the log header at a block like lgfs2_get_log_header()
+ * @priv: passed to get_lh
  * @fix: if 1, fix the sequence numbers, otherwise just report the problem
  *
  * Returns: The number of sequencing errors (hopefully none).
  */
-static int check_journal_seq_no(struct lgfs2_inode *ip, int fix)
+static int check_journal_seq_no(struct lgfs2_inode *ip, lgfs2_get_lh_t get_lh, void *priv,
+                                int fix)
 {
 	int error = 0, wrapped = 0;
 	uint32_t jd_blocks = ip->i_size / ip->i_sbd->sd_bsize;
@@ -400,7 +1041,7 @@ static int check_journal_seq_no(struct lgfs2_inode *ip, int fix)
 
 	memset(&lh, 0, sizeof(lh));
 	for (blk = 0; blk < jd_blocks; blk++) {
-		error = lgfs2_get_log_header(ip, blk, &lh);
+		error = get_lh(priv, blk, &lh);
 		if (error == 1) /* if not a log header */
 			continue; /* just journal data--ignore it */
 		if (!lowest_seq || lh.lh_sequence < lowest_seq)
@@ -468,12 +1109,14 @@ int preen_is_safe(struct lgfs2_sbd *sdp, const struct fsck_options * const opts)
 
 /**
  * gfs2_recover_journal - recovery a given journal
- * @ip: the journal incore inode
+ * @js: the scanned journal
  * j: which journal to check
- * preen: Was preen (-a or -p) specified?
- * force_check: Was -f specified to force the check?
  * @was_clean: if the journal was originally clean, this is set to 1.
  *             if the journal was dirty from the start, this is set to 0.
+ * @rb: queues the replayed blocks to be written
+ * @scans: all of the scanned journals
+ * @map: the journal extents of all of the journals
+ * @nmap: the number of entries in map
  *
  * Acquire the journal's lock, check to see if the journal is clean, and
  * do recovery if necessary.
@@ -481,20 +1124,28 @@ int preen_is_safe(struct lgfs2_sbd *sdp, const struct fsck_options * const opts)
  * Returns: errno
  */
 
-static int recover_journal(struct lgfs2_inode *ip, int j, struct fsck_cx *cx, int *was_clean)
+static int recover_journal(struct jscan *js, int j, struct fsck_cx *cx, int *was_clean,
+                           struct replay_batch *rb, struct jscan *scans,
+                           const struct jmap *map, unsigned nmap)
 {
+	struct lgfs2_inode *ip = js->ip;
 	struct lgfs2_sbd *sdp = ip->i_sbd;
-	struct lgfs2_log_header head;
-	unsigned int pass;
 	int error;
 
 	*was_clean = 0;
 	log_info( _("jid=%u: Looking at journal...\n"), j);
 
-	osi_list_init(&sd_revoke_list);
-	error = lgfs2_find_jhead(ip, &head);
+	/* An earlier journal's replay wrote to this one, so look at it again */
+	if (js->stale)
+		jscan_journal(js, NULL);
+	if (js->error) {
+		log_err(_("jid=%u: Unable to read the journal: %s\n"), j, strerror(-js->error));
+		error = js->error;
+		goto out;
+	}
+	error = js->head_error;
 	if (!error) {
-		error = check_journal_seq_no(ip, 0);
+		error = check_journal_seq_no(ip, jscan_get_lh, js, 0);
 		if (error > JOURNAL_SEQ_TOLERANCE) {
 			log_err( _("Journal #%d (\"journal%d\") has %d "
 				   "sequencing errors; tolerance is %d.\n"),
@@ -527,13 +1178,14 @@ static int recover_journal(struct lgfs2_inode *ip, int j, struct fsck_cx *cx, in
 			goto out;
 		}
 		log_info( _("jid=%u: Repairing journal...\n"), j);
-		error = check_journal_seq_no(ip, 1);
+		error = check_journal_seq_no(ip, get_log_header, ip, 1);
 		if (error) {
 			log_err( _("jid=%u: Unable to fix the bad journal.\n"), 
 				 j);
 			goto out;
 		}
-		error = lgfs2_find_jhead(ip, &head);
+		jscan_journal(js, NULL);
+		error = js->error ? js->error : js->head_error;
 		if (error) {
 			log_err( _("jid=%u: Unable to fix the bad journal.\n"),
 				 j);
@@ -542,7 +1194,7 @@ static int recover_journal(struct lgfs2_inode *ip, int j, struct fsck_cx *cx, in
 		log_err( _("jid=%u: The journal was successfully fixed.\n"),
 			 j);
 	}
-	if (head.lh_flags & GFS2_LOG_HEAD_UNMOUNT) {
+	if (js->head.lh_flags & GFS2_LOG_HEAD_UNMOUNT) {
 		log_info( _("jid=%u: Journal is clean.\n"), j);
 		*was_clean = 1;
 		return 0;
@@ -569,27 +1221,18 @@ static int recover_journal(struct lgfs2_inode *ip, int j, struct fsck_cx *cx, in
 
 	log_info( _("jid=%u: Replaying journal...\n"), j);
 
-	sd_found_jblocks = sd_replayed_jblocks = 0;
-	sd_found_metablocks = sd_replayed_metablocks = 0;
-	sd_found_revokes = 0;
-	sd_replay_tail = head.lh_tail;
-	for (pass = 0; pass < 2; pass++) {
-		error = foreach_descriptor(ip, head.lh_tail,
-					   head.lh_blkno, pass);
-		if (error) {
-			log_err(_("Error found during journal replay.\n"));
-			goto out;
-		}
+	error = replay_journal(js, j, rb, scans, map, nmap);
+	if (error) {
+		log_err(_("Error found during journal replay.\n"));
+		goto out;
 	}
-	log_info( _("jid=%u: Found %u revoke tags\n"), j, sd_found_revokes);
-	revoke_clean(sdp);
-	error = lgfs2_clean_journal(ip, &head);
+	error = lgfs2_clean_journal(ip, &js->head);
 	if (error)
 		goto out;
 	log_err( _("jid=%u: Replayed %u of %u journaled data blocks\n"),
-		 j, sd_replayed_jblocks, sd_found_jblocks);
+		 j, js->replayed_jblocks, js->found_jblocks);
 	log_err( _("jid=%u: Replayed %u of %u metadata blocks\n"),
-		 j, sd_replayed_metablocks, sd_found_metablocks);
+		 j, js->replayed_metablocks, js->found_metablocks);
 
 	/* Check for errors and give them the option to reinitialize the
 	   journal. */
@@ -677,11 +1320,19 @@ static struct metawalk_fxns rangecheck_journal = {
  * feature.  The fsck falls back to clearing the journal if an 
  * inconsistency is found, but only for the bad journal.
  *
+ * The journals are all read and scanned in parallel first, then they are
+ * recovered one at a time, in order.
+ *
  * Returns: 0 on success, -1 on failure
  */
 int replay_journals(struct fsck_cx *cx, int *clean_journals)
 {
 	struct lgfs2_sbd *sdp = cx->sdp;
+	struct replay_batch rb = { .sdp = sdp };
+	struct jscan *scans;
+	struct jmap *map = NULL;
+	unsigned nmap = 0;
+	int want_plan;
 	int dirty_journals = 0;
 	int gave_msg = 0;
 	int error = 0;
@@ -693,42 +1344,79 @@ int replay_journals(struct fsck_cx *cx, int *clean_journals)
 	cx->jnl_size = LGFS2_DEFAULT_JSIZE;
 
 	for(i = 0; i < sdp->md.journals; i++) {
-		if (sdp->md.journal[i]) {
-			error = check_metatree(cx, sdp->md.journal[i],
-					       &rangecheck_journal);
-			if (error)
-				/* Don't use fsck_inode_put here because it's a
-				   system file and we need to dismantle it. */
-				lgfs2_inode_put(&sdp->md.journal[i]);
-			error = 0; /* bad journal is non-fatal */
-		}
+		if (!sdp->md.journal[i])
+			continue;
+		error = check_metatree(cx, sdp->md.journal[i], &rangecheck_journal);
+		if (error)
+			/* Don't use fsck_inode_put here because it's a
+			   system file and we need to dismantle it. */
+			lgfs2_inode_put(&sdp->md.journal[i]);
+	}
+	error = 0; /* bad journal is non-fatal */
+
+	scans = calloc(sdp->md.journals ? sdp->md.journals : 1, sizeof(*scans));
+	if (scans == NULL) {
+		log_crit(_("Unable to allocate memory for journal recovery.\n"));
+		return FSCK_ERROR;
+	}
+	want_plan = !cx->opts->no && preen_is_safe(sdp, cx->opts);
+	for (i = 0; i < sdp->md.journals; i++) {
+		struct jscan *js = &scans[i];
+
+		if (!sdp->md.journal[i])
+			continue;
+		js->ip = sdp->md.journal[i];
+		js->jd_blocks = js->ip->i_size / sdp->sd_bsize;
+		js->want_plan = want_plan;
+		if (jscan_map(js) != 0)
+			goto nomem;
+	}
+	map = jmap_build(scans, sdp->md.journals, &nmap);
+	if (map == NULL)
+		goto nomem;
+	rb.max = REPLAY_BATCH_SIZE / sdp->sd_bsize;
+	jscan_all(scans, sdp->md.journals);
+
+	for(i = 0; i < sdp->md.journals; i++) {
+		uint64_t jsize;
+
 		if (!sdp->md.journal[i]) {
 			log_err(_("File system journal \"journal%d\" is "
 				  "missing or corrupt: pass1 will try to "
 				  "recreate it.\n"), i);
 			continue;
 		}
-		if (!error) {
-			uint64_t jsize = sdp->md.journal[i]->i_size / (1024 * 1024);
-
-			if (cx->jnl_size == LGFS2_DEFAULT_JSIZE && jsize &&
-			    jsize != cx->jnl_size)
-				cx->jnl_size = jsize;
-			error = recover_journal(sdp->md.journal[i], i, cx, &clean);
-			if (!clean)
-				dirty_journals++;
-			if (!gave_msg && dirty_journals == 1 && !cx->opts->no &&
-			    preen_is_safe(sdp, cx->opts)) {
-				gave_msg = 1;
-				log_notice( _("Recovering journals (this may "
-					      "take a while)\n"));
-			}
-			*clean_journals += clean;
+		jsize = sdp->md.journal[i]->i_size / (1024 * 1024);
+		if (cx->jnl_size == LGFS2_DEFAULT_JSIZE && jsize &&
+		    jsize != cx->jnl_size)
+			cx->jnl_size = jsize;
+		error = recover_journal(&scans[i], i, cx, &clean, &rb, scans, map, nmap);
+		if (!clean)
+			dirty_journals++;
+		if (!gave_msg && dirty_journals == 1 && !cx->opts->no &&
+		    preen_is_safe(sdp, cx->opts)) {
+			gave_msg = 1;
+			log_notice( _("Recovering journals (this may "
+				      "take a while)\n"));
 		}
+		*clean_journals += clean;
+	}
+out:
+	for (i = 0; i < sdp->md.journals; i++) {
+		jscan_reset(&scans[i]);
+		free(scans[i].ext);
 	}
+	free(scans);
+	free(map);
+	free(rb.w);
+	free(rb.data);
 	/* Sync the buffers to disk so we get a fresh start. */
 	fsync(sdp->device_fd);
 	return error;
+nomem:
+	log_crit(_("Unable to allocate memory for journal recovery.\n"));
+	error = FSCK_ERROR;
+	goto out;
 }
 
 /*
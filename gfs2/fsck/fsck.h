@@ -3,6 +3,7 @@
 
 #include "libgfs2.h"
 #include "osi_tree.h"
+#include "blkhash.h"
 
 #define FSCK_MAX_FORMAT (1802)
 
@@ -27,10 +28,50 @@
 
 #define BAD_POINTER_TOLERANCE 10 /* How many bad pointers is too many? */
 
+#define FSCK_BCACHE_BUDGET (128ULL << 20) /* Memory for the libgfs2 block cache */
+#define FSCK_OWNERS_BUDGET (256ULL << 20) /* Memory for the block owner index */
+
+/* Bytes of a chunked blockmap which are allocated together */
+#define BMAP_CHUNK_SHIFT (14)
+#define BMAP_CHUNK_SIZE (1UL << BMAP_CHUNK_SHIFT)
+
+/*
+ * A map of a few bits per block. Small maps are a flat array (map). Maps
+ * bigger than the memory budget are split into chunks which are only
+ * allocated when they stop being uniform: an unallocated chunk reads as its
+ * fill byte repeated, and bmap_compact() frees chunks which have become
+ * uniform again, so free space and long runs of data blocks cost nothing.
+ */
 struct bmap {
 	uint64_t size;
 	uint64_t mapsize;
 	unsigned char *map;
+	unsigned char **chunks;
+	unsigned char *fill;
+	uint64_t nchunks;
+	uint64_t chunk_mem;  /* Bytes allocated to chunks */
+	uint64_t compact_at; /* Value of chunk_mem at which to compact the map */
+};
+
+/* A run of blocks which pass1 found to be referenced by an inode */
+struct owner_extent {
+	uint64_t start;
+	uint64_t owner;
+	uint64_t len;
+};
+
+/*
+ * The block owner index records which inode referenced each block in pass1 so
+ * that pass1b only needs to look at the inodes which may reference duplicate
+ * blocks. If it would use more than its budget it is dropped and pass1b falls
+ * back to scanning every inode.
+ */
+struct owner_index {
+	struct owner_extent *ext;
+	uint64_t count;
+	uint64_t alloc;
+	uint64_t budget;
+	int enabled;
 };
 
 struct inode_info
@@ -50,6 +91,7 @@ struct dir_info
 	struct lgfs2_inum dotdot_parent;
 	uint32_t di_nlink;
 	uint32_t counted_links;
+	uint32_t di_blocks; /* As found by pass1, to size pass2's prefetching */
 	uint8_t  checked:1;
 };
 
@@ -121,6 +163,12 @@ struct fsck_cx {
 	struct osi_root dup_blocks;
 	struct osi_root dirtree;
 	struct osi_root inodetree;
+	/* The trees are kept for in-order traversal, lookups use the indexes */
+	struct blkhash dirindex;
+	struct blkhash inodeindex;
+	struct node_arena dir_arena;
+	struct node_arena inode_arena;
+	struct owner_index owners;
 	const struct fsck_options * const opts;
 	unsigned int jnl_size;
 };
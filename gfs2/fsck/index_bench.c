@@ -0,0 +1,190 @@
+#include "clusterautoconfig.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <time.h>
+
+#include "fsck.h"
+
+/*
+ * Compares the inode index used by fsck (nodes allocated from an arena,
+ * linked into a tree for in-order traversal and looked up through a hash
+ * table) with plain tree lookups and a calloc per node, for a synthetic file
+ * system with the given number of inodes.
+ *
+ * Usage: index_bench [inodes [lookups]]
+ */
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* A cheap generator so that the benchmark is repeatable */
+static uint64_t rnd(uint64_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+/* Inode addresses in ascending order with the gaps of data blocks between */
+static uint64_t *make_addrs(uint64_t n)
+{
+	uint64_t *addrs = malloc(n * sizeof(*addrs));
+	uint64_t state = 88172645463325252ULL;
+	uint64_t addr = 100;
+
+	if (addrs == NULL)
+		return NULL;
+	for (uint64_t i = 0; i < n; i++) {
+		addr += 1 + rnd(&state) % 16;
+		addrs[i] = addr;
+	}
+	/* Insert in a random order, as pass1 finds inodes in several rgrps */
+	for (uint64_t i = n - 1; i > 0; i--) {
+		uint64_t j = rnd(&state) % (i + 1);
+		uint64_t t = addrs[i];
+
+		addrs[i] = addrs[j];
+		addrs[j] = t;
+	}
+	return addrs;
+}
+
+static struct inode_info *tree_find(struct osi_root *root, uint64_t block)
+{
+	struct osi_node *node = root->osi_node;
+
+	while (node) {
+		struct inode_info *data = (struct inode_info *)node;
+
+		if (block < data->num.in_addr)
+			node = node->osi_left;
+		else if (block > data->num.in_addr)
+			node = node->osi_right;
+		else
+			return data;
+	}
+	return NULL;
+}
+
+static void tree_insert(struct osi_root *root, struct inode_info *data)
+{
+	struct osi_node **newn = &root->osi_node, *parent = NULL;
+
+	while (*newn) {
+		struct inode_info *cur = (struct inode_info *)*newn;
+
+		parent = *newn;
+		if (data->num.in_addr < cur->num.in_addr)
+			newn = &((*newn)->osi_left);
+		else
+			newn = &((*newn)->osi_right);
+	}
+	osi_link_node(&data->node, parent, newn);
+	osi_insert_color(&data->node, root);
+}
+
+static void report(const char *name, double ins, double look, uint64_t n, uint64_t lookups,
+                   uint64_t found, size_t mem)
+{
+	printf("%-12s %10.2f %10.2f %12.1f %10.1f %12"PRIu64"\n", name, n / ins / 1e6,
+	       lookups / look / 1e6, mem / 1048576.0, (double)mem / n, found);
+}
+
+static int bench_tree(const uint64_t *addrs, uint64_t n, uint64_t lookups)
+{
+	struct osi_root root = { NULL };
+	struct osi_node *node;
+	uint64_t state = 1, found = 0;
+	size_t mem = 0;
+	double start, ins;
+
+	start = now();
+	for (uint64_t i = 0; i < n; i++) {
+		struct inode_info *ii = calloc(1, sizeof(*ii));
+
+		if (ii == NULL)
+			return 1;
+		ii->num.in_addr = addrs[i];
+		tree_insert(&root, ii);
+		/* Include malloc's overhead of one size_t per chunk */
+		mem += malloc_usable_size(ii) + sizeof(size_t);
+	}
+	ins = now() - start;
+	start = now();
+	for (uint64_t i = 0; i < lookups; i++)
+		found += tree_find(&root, addrs[rnd(&state) % n] + (i & 1)) != NULL;
+	report("rbtree", ins, now() - start, n, lookups, found, mem);
+
+	while ((node = osi_first(&root)) != NULL) {
+		osi_erase(node, &root);
+		free(node);
+	}
+	return 0;
+}
+
+static int bench_index(const uint64_t *addrs, uint64_t n, uint64_t lookups)
+{
+	struct osi_root root = { NULL };
+	struct node_arena arena = { NULL };
+	struct blkhash index = { NULL };
+	uint64_t state = 1, found = 0;
+	double start, ins;
+
+	start = now();
+	for (uint64_t i = 0; i < n; i++) {
+		struct inode_info *ii = node_arena_alloc(&arena, sizeof(*ii));
+
+		if (ii == NULL || blkhash_insert(&index, addrs[i], ii) != 0)
+			return 1;
+		ii->num.in_addr = addrs[i];
+		tree_insert(&root, ii);
+	}
+	ins = now() - start;
+	start = now();
+	for (uint64_t i = 0; i < lookups; i++)
+		found += blkhash_find(&index, addrs[rnd(&state) % n] + (i & 1)) != NULL;
+	report("hash+arena", ins, now() - start, n, lookups, found,
+	       arena.mem + blkhash_mem(&index));
+
+	blkhash_free(&index);
+	node_arena_free(&arena);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t n = argc > 1 ? strtoull(argv[1], NULL, 0) : 50000000;
+	uint64_t lookups = argc > 2 ? strtoull(argv[2], NULL, 0) : n;
+	uint64_t *addrs;
+
+	if (n == 0 || lookups == 0) {
+		fprintf(stderr, "Usage: %s [inodes [lookups]]\n", argv[0]);
+		return 1;
+	}
+	addrs = make_addrs(n);
+	if (addrs == NULL) {
+		perror("malloc");
+		return 1;
+	}
+	/* Half of the lookups miss, like the lookups of dirents which point to
+	   directories in the inode tree */
+	printf("%"PRIu64" inodes, %"PRIu64" lookups\n", n, lookups);
+	printf("index        Mins/s     Mlook/s    memory MiB  bytes/ino        found\n");
+	if (bench_tree(addrs, n, lookups) || bench_index(addrs, n, lookups)) {
+		perror("Unable to build the index");
+		free(addrs);
+		return 1;
+	}
+	free(addrs);
+	return 0;
+}
@@ -86,6 +86,8 @@ static void dirtree_free(struct fsck_cx *cx)
 		dt = (struct dir_info *)n;
 		dirtree_delete(cx, dt);
 	}
+	blkhash_free(&cx->dirindex);
+	node_arena_free(&cx->dir_arena);
 }
 
 static void inodetree_free(struct fsck_cx *cx)
@@ -97,6 +99,8 @@ static void inodetree_free(struct fsck_cx *cx)
 		dt = (struct inode_info *)n;
 		inodetree_delete(cx, dt);
 	}
+	blkhash_free(&cx->inodeindex);
+	node_arena_free(&cx->inode_arena);
 }
 
 /*
@@ -116,6 +120,7 @@ static void empty_super_block(struct fsck_cx *cx)
 	inodetree_free(cx);
 	dirtree_free(cx);
 	dup_free(cx);
+	owner_index_free(&cx->owners);
 }
 
 
@@ -188,20 +193,23 @@ static void check_rgrp_integrity(struct fsck_cx *cx, struct lgfs2_rgrp_tree *rgd
 				 int *fixit, int *this_rg_fixed,
 				 int *this_rg_bad, int *this_rg_cleaned)
 {
-	uint32_t rg_free, rg_reclaimed, rg_unlinked, rg_usedmeta, rg_useddi;
-	int rgb, x, y, off, bytes_to_check, total_bytes_to_check, asked = 0;
+	uint32_t rg_free, rg_reclaimed, rg_unlinked;
+	int rgb, off, bytes_to_check, total_bytes_to_check, asked = 0;
 	struct lgfs2_sbd *sdp = cx->sdp;
-	unsigned int state;
-	uint64_t diblock;
+	uint64_t diblock, *unlinked = NULL;
 	struct lgfs2_buffer_head *bh;
 
-	rg_free = rg_reclaimed = rg_unlinked = rg_usedmeta = rg_useddi = 0;
+	rg_free = rg_reclaimed = rg_unlinked = 0;
 	total_bytes_to_check = rgd->rt_bitbytes;
 
 	*this_rg_fixed = *this_rg_bad = *this_rg_cleaned = 0;
 
 	diblock = rgd->rt_data0;
 	for (rgb = 0; rgb < rgd->rt_length; rgb++){
+		unsigned char *bits;
+		uint32_t count[4];
+		unsigned n;
+
 		/* Count up the free blocks in the bitmap */
 		off = (rgb) ? sizeof(struct gfs2_meta_header) :
 			sizeof(struct gfs2_rgrp);
@@ -210,77 +218,68 @@ static void check_rgrp_integrity(struct fsck_cx *cx, struct lgfs2_rgrp_tree *rgd
 		else
 			bytes_to_check = sdp->sd_bsize - off;
 		total_bytes_to_check -= bytes_to_check;
-		for (x = 0; x < bytes_to_check; x++) {
-			unsigned char *byte;
-
-			byte = (unsigned char *)&rgd->rt_bits[rgb].bi_data[off + x];
-			if (*byte == 0x55) {
-				diblock += GFS2_NBBY;
+		bits = (unsigned char *)rgd->rt_bits[rgb].bi_data + off;
+		lgfs2_bitmap_count(bits, bytes_to_check, count);
+		rg_free += count[GFS2_BLKST_FREE];
+		if (count[GFS2_BLKST_UNLINKED] == 0) {
+			diblock += bytes_to_check * GFS2_NBBY;
+			continue;
+		}
+		if (unlinked == NULL) {
+			unlinked = malloc(sdp->sd_bsize * GFS2_NBBY * sizeof(*unlinked));
+			if (unlinked == NULL) {
+				log_err(_("Unable to allocate memory to check unlinked blocks.\n"));
+				rg_unlinked += count[GFS2_BLKST_UNLINKED];
+				diblock += bytes_to_check * GFS2_NBBY;
 				continue;
 			}
-			if (*byte == 0x00) {
-				diblock += GFS2_NBBY;
-				rg_free += GFS2_NBBY;
+		}
+		n = lgfs2_bitmap_scan(bits, bytes_to_check, GFS2_BLKST_UNLINKED, diblock, unlinked);
+		for (unsigned i = 0; i < n; i++) {
+			uint64_t blk = unlinked[i] - diblock;
+			unsigned char *byte = bits + (blk / GFS2_NBBY);
+			unsigned y = blk % GFS2_NBBY;
+
+			log_info(_("Unlinked dinode 0x%"PRIx64" found.\n"), unlinked[i]);
+			if (!asked) {
+				asked = 1;
+				if (query(cx, _("Okay to reclaim free "
+						"metadata in resource group "
+						"%"PRIu64" (0x%"PRIx64")? (y/n)"),
+					  rgd->rt_addr, rgd->rt_addr))
+					*fixit = 1;
+			}
+			if (!(*fixit)) {
+				rg_unlinked++;
 				continue;
 			}
-			for (y = 0; y < GFS2_NBBY; y++) {
-				state = (*byte >>
-					 (GFS2_BIT_SIZE * y)) & GFS2_BIT_MASK;
-				if (state == GFS2_BLKST_USED) {
-					diblock++;
-					continue;
+			*byte &= ~(GFS2_BIT_MASK <<
+				   (GFS2_BIT_SIZE * y));
+			rgd->rt_bits[rgb].bi_modified = 1;
+			rg_reclaimed++;
+			rg_free++;
+			rgd->rt_free++;
+			log_info(_("Free metadata block %"PRIu64" (0x%"PRIx64") reclaimed.\n"),
+			         unlinked[i], unlinked[i]);
+			bh = lgfs2_bread(sdp, unlinked[i]);
+			if (!lgfs2_check_meta(bh->b_data, GFS2_METATYPE_DI)) {
+				struct lgfs2_inode *ip =
+					fsck_inode_get(sdp, rgd, bh);
+				if (ip->i_blocks > 1) {
+					blks_2free += ip->i_blocks - 1;
+					log_info(_("%"PRIu64" blocks "
+						   "(total) may need "
+						   "to be freed in "
+						   "pass 5.\n"),
+						 blks_2free);
 				}
-				if (state == GFS2_BLKST_DINODE) {
-					diblock++;
-					continue;
-				}
-				if (state == GFS2_BLKST_FREE) {
-					diblock++;
-					rg_free++;
-					continue;
-				}
-				/* GFS2_BLKST_UNLINKED */
-				log_info(_("Unlinked dinode 0x%"PRIx64" found.\n"), diblock);
-				if (!asked) {
-					asked = 1;
-					if (query(cx, _("Okay to reclaim free "
-							"metadata in resource group "
-							"%"PRIu64" (0x%"PRIx64")? (y/n)"),
-						  rgd->rt_addr, rgd->rt_addr))
-						*fixit = 1;
-				}
-				if (!(*fixit)) {
-					rg_unlinked++;
-					diblock++;
-					continue;
-				}
-				*byte &= ~(GFS2_BIT_MASK <<
-					   (GFS2_BIT_SIZE * y));
-				rgd->rt_bits[rgb].bi_modified = 1;
-				rg_reclaimed++;
-				rg_free++;
-				rgd->rt_free++;
-				log_info(_("Free metadata block %"PRIu64" (0x%"PRIx64") reclaimed.\n"),
-				         diblock, diblock);
-				bh = lgfs2_bread(sdp, diblock);
-				if (!lgfs2_check_meta(bh->b_data, GFS2_METATYPE_DI)) {
-					struct lgfs2_inode *ip =
-						fsck_inode_get(sdp, rgd, bh);
-					if (ip->i_blocks > 1) {
-						blks_2free += ip->i_blocks - 1;
-						log_info(_("%"PRIu64" blocks "
-							   "(total) may need "
-							   "to be freed in "
-							   "pass 5.\n"),
-							 blks_2free);
-					}
-					fsck_inode_put(&ip);
-				}
-				lgfs2_brelse(bh);
-				diblock++;
+				fsck_inode_put(&ip);
 			}
+			lgfs2_brelse(bh);
 		}
+		diblock += bytes_to_check * GFS2_NBBY;
 	}
+	free(unlinked);
 	/* The unlinked blocks we reclaim shouldn't be considered errors,
 	   since we're just reclaiming them as a courtesy. If we already
 	   got permission to reclaim them, we adjust the rgrp counts
@@ -1423,6 +1422,9 @@ void destroy(struct fsck_cx *cx)
 		fsync(sdp->device_fd);
 	}
 	empty_super_block(cx);
+	log_debug(_("Buffer pool: %"PRIu64" hits, %"PRIu64" misses\n"),
+	          sdp->bpool.bp_hits, sdp->bpool.bp_misses);
+	lgfs2_bpool_drain(sdp);
 	close(sdp->device_fd);
 	if (was_mounted_ro && errors_corrected) {
 		sdp->device_fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
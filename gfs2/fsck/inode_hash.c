@@ -14,19 +14,7 @@
 
 struct inode_info *inodetree_find(struct fsck_cx *cx, uint64_t block)
 {
-	struct osi_node *node = cx->inodetree.osi_node;
-
-	while (node) {
-		struct inode_info *data = (struct inode_info *)node;
-
-		if (block < data->num.in_addr)
-			node = node->osi_left;
-		else if (block > data->num.in_addr)
-			node = node->osi_right;
-		else
-			return data;
-	}
-	return NULL;
+	return blkhash_find(&cx->inodeindex, block);
 }
 
 struct inode_info *inodetree_insert(struct fsck_cx *cx, struct lgfs2_inum no)
@@ -34,6 +22,10 @@ struct inode_info *inodetree_insert(struct fsck_cx *cx, struct lgfs2_inum no)
 	struct osi_node **newn = &cx->inodetree.osi_node, *parent = NULL;
 	struct inode_info *data;
 
+	data = inodetree_find(cx, no.in_addr);
+	if (data)
+		return data;
+
 	/* Figure out where to put new node */
 	while (*newn) {
 		struct inode_info *cur = (struct inode_info *)*newn;
@@ -41,15 +33,15 @@ struct inode_info *inodetree_insert(struct fsck_cx *cx, struct lgfs2_inum no)
 		parent = *newn;
 		if (no.in_addr < cur->num.in_addr)
 			newn = &((*newn)->osi_left);
-		else if (no.in_addr > cur->num.in_addr)
-			newn = &((*newn)->osi_right);
 		else
-			return cur;
+			newn = &((*newn)->osi_right);
 	}
 
-	data = calloc(1, sizeof(struct inode_info));
-	if (!data) {
+	data = node_arena_alloc(&cx->inode_arena, sizeof(struct inode_info));
+	if (!data || blkhash_insert(&cx->inodeindex, no.in_addr, data)) {
 		log_crit( _("Unable to allocate inode_info structure\n"));
+		if (data)
+			node_arena_release(&cx->inode_arena, data);
 		return NULL;
 	}
 	/* Add new node and rebalance tree. */
@@ -63,5 +55,6 @@ struct inode_info *inodetree_insert(struct fsck_cx *cx, struct lgfs2_inum no)
 void inodetree_delete(struct fsck_cx *cx, struct inode_info *b)
 {
 	osi_erase(&b->node, &cx->inodetree);
-	free(b);
+	blkhash_remove(&cx->inodeindex, b->num.in_addr);
+	node_arena_release(&cx->inode_arena, b);
 }
@@ -20,18 +20,24 @@ struct bmap clink1map = { 0 }; /* map of dinodes w/counted links == 1 */
 
 int link1_set(struct bmap *bmap, uint64_t bblock, int mark)
 {
-	static unsigned char *byte;
-	static uint64_t b;
+	unsigned char *byte;
+	unsigned char bit;
 
 	if (!bmap)
 		return 0;
 	if (bblock > bmap->size)
 		return -1;
 
-	byte = bmap->map + BLOCKMAP_SIZE1(bblock);
-	b = BLOCKMAP_BYTE_OFFSET1(bblock);
-	*byte &= ~(BLOCKMAP_MASK1 << b);
-	*byte |= (mark & BLOCKMAP_MASK1) << b;
+	if (link1_type(bmap, bblock) == (mark & BLOCKMAP_MASK1))
+		return 0;
+	byte = bmap_byte_ptr(bmap, BLOCKMAP_SIZE1(bblock));
+	if (byte == NULL)
+		return -1;
+	bit = BLOCKMAP_MASK1 << BLOCKMAP_BYTE_OFFSET1(bblock);
+	if (mark & BLOCKMAP_MASK1)
+		__atomic_fetch_or(byte, bit, __ATOMIC_RELAXED);
+	else
+		__atomic_fetch_and(byte, (unsigned char)~bit, __ATOMIC_RELAXED);
 	return 0;
 }
 
@@ -264,6 +264,17 @@ static void exitlog(void)
 }
 #endif
 
+/*
+ * Make sure blocks held in the write-back cache reach the device when a pass
+ * bails out with exit().
+ */
+static struct lgfs2_sbd *cached_sdp;
+static void bcache_exit(void)
+{
+	if (cached_sdp != NULL && lgfs2_bcache_free(cached_sdp) != 0)
+		log_err(_("Failed to write cached blocks to disk: %s\n"), strerror(errno));
+}
+
 static void startlog(int argc, char **argv)
 {
 	int i;
@@ -303,6 +314,7 @@ int main(int argc, char **argv)
 	int error = 0;
 	int all_clean = 0;
 	struct sigaction act = { .sa_handler = interrupt, };
+	struct lgfs2_bcache_stats bcs;
 
 	setlocale(LC_ALL, "");
 	textdomain("gfs2-utils");
@@ -332,6 +344,14 @@ int main(int argc, char **argv)
 
 	sigaction(SIGINT, &act, NULL);
 
+	/* The passes revisit a lot of metadata so cache it */
+	if (lgfs2_bcache_init(&sb, FSCK_BCACHE_BUDGET) != 0)
+		log_info(_("Block cache not available: %s\n"), strerror(errno));
+	else {
+		cached_sdp = &sb;
+		atexit(bcache_exit);
+	}
+
 	for (i = 0; passes[i].name; i++)
 		error = fsck_pass(passes + i, &cx);
 
@@ -353,6 +373,15 @@ int main(int argc, char **argv)
 
 	if (!opts.no && errors_corrected)
 		log_notice( _("Writing changes to disk\n"));
+	lgfs2_bcache_stats(&sb, &bcs);
+	log_debug(_("Block cache: %"PRIu64" hits, %"PRIu64" misses, %"PRIu64" evictions, "
+	            "%"PRIu64" blocks written in %"PRIu64" batches\n"), bcs.bs_hits, bcs.bs_misses,
+	          bcs.bs_evictions, bcs.bs_writes, bcs.bs_batches);
+	cached_sdp = NULL;
+	if (lgfs2_bcache_free(&sb) != 0) {
+		log_err(_("Failed to write cached blocks to disk: %s\n"), strerror(errno));
+		error = FSCK_ERROR;
+	}
 	fsync(sb.device_fd);
 	link1_destroy(&nlink1map);
 	link1_destroy(&clink1map);
@@ -1088,6 +1088,58 @@ static void file_ra(struct lgfs2_inode *ip, struct lgfs2_buffer_head *bh,
 			      extlen * sdp->sd_bsize, POSIX_FADV_WILLNEED);
 }
 
+static int cmp_blk(const void *a, const void *b)
+{
+	uint64_t blk_a = *(const uint64_t *)a;
+	uint64_t blk_b = *(const uint64_t *)b;
+
+	if (blk_a < blk_b)
+		return -1;
+	return blk_a > blk_b;
+}
+
+/**
+ * metalist_prefetch - read the blocks referenced by an indirect block into the
+ *                     block cache with one read per extent, so that the
+ *                     check_metalist functions' reads are cache hits.
+ * Returns 0 if the blocks were read or -1 if the caller should fall back to
+ * file_ra().
+ */
+static int metalist_prefetch(struct lgfs2_inode *ip, struct lgfs2_buffer_head *bh,
+                             int head_size)
+{
+	struct lgfs2_sbd *sdp = ip->i_sbd;
+	struct lgfs2_buffer_head **bhs;
+	unsigned maxptrs = (sdp->sd_bsize - head_size) / sizeof(uint64_t);
+	unsigned n = 0;
+	uint64_t *blks;
+	__be64 *p;
+
+	if (sdp->bcache == NULL)
+		return -1;
+
+	blks = malloc(maxptrs * (sizeof(*blks) + sizeof(*bhs)));
+	if (blks == NULL)
+		return -1;
+	bhs = (void *)(blks + maxptrs);
+
+	for (p = (__be64 *)(bh->b_data + head_size);
+	     p < (__be64 *)(bh->b_data + sdp->sd_bsize); p++) {
+		uint64_t blk = be64_to_cpu(*p);
+
+		if (blk != 0 && valid_block_ip(ip, blk))
+			blks[n++] = blk;
+	}
+	qsort(blks, n, sizeof(*blks), cmp_blk);
+	/* A failure here isn't fatal, the blocks will be read one at a time */
+	if (lgfs2_bread_vec(sdp, blks, n, bhs) == 0) {
+		for (unsigned i = 0; i < n; i++)
+			lgfs2_brelse(bhs[i]);
+	}
+	free(blks);
+	return 0;
+}
+
 static int do_check_metalist(struct fsck_cx *cx, struct iptr iptr, int height, struct lgfs2_buffer_head **bhp,
                              struct metawalk_fxns *pass)
 {
@@ -1198,7 +1250,8 @@ static int build_and_check_metalist(struct fsck_cx *cx, struct lgfs2_inode *ip,
 
 				continue;
 			}
-			if (pass->readahead)
+			if (pass->readahead &&
+			    metalist_prefetch(ip, iptr.ipt_bh, head_size) != 0)
 				file_ra(ip, iptr.ipt_bh, head_size, maxptrs, h);
 
 			/* Now check the metadata itself */
@@ -27,6 +27,7 @@
 #include "link.h"
 #include "metawalk.h"
 #include "fs_recovery.h"
+#include "prefetch.h"
 
 static struct bmap *bl = NULL;
 static struct metawalk_fxns pass1_fxns;
@@ -37,21 +38,14 @@ struct block_count {
 	uint64_t ea_count;
 };
 
-static int blockmap_set(struct bmap *bmap, uint64_t bblock, int mark)
+/* Record the inode which referenced a block for pass1b */
+static void note_owner(struct fsck_cx *cx, struct lgfs2_inode *ip, uint64_t bblock)
 {
-	static unsigned char *byte;
-	static uint64_t b;
-
-	if (!bmap)
-		return 0;
-	if (bblock > bmap->size)
-		return -1;
-
-	byte = bmap->map + BLOCKMAP_SIZE2(bblock);
-	b = BLOCKMAP_BYTE_OFFSET2(bblock);
-	*byte &= ~(BLOCKMAP_MASK2 << b);
-	*byte |= (mark & BLOCKMAP_MASK2) << b;
-	return 0;
+	if (ip == NULL)
+		return;
+	if (owner_index_add(&cx->owners, bblock, ip->i_num.in_addr))
+		log_info(_("Not enough memory to index block references, "
+		           "pass1b will need to scan every inode.\n"));
 }
 
 /*
@@ -67,6 +61,8 @@ static int _fsck_blockmap_set(struct fsck_cx *cx, struct lgfs2_inode *ip, uint64
 	if (error)
 		return error;
 
+	if (mark != GFS2_BLKST_FREE)
+		note_owner(cx, ip, bblock);
 	return blockmap_set(bl, bblock, mark);
 }
 
@@ -1028,6 +1024,7 @@ static struct metawalk_fxns eattr_undo_fxns = {
 static int set_ip_blockmap(struct fsck_cx *cx, struct lgfs2_inode *ip)
 {
 	uint64_t block = ip->i_bh->b_blocknr;
+	struct dir_info *dt = NULL;
 	struct lgfs2_inum no;
 	uint32_t mode;
 	const char *ty;
@@ -1061,10 +1058,12 @@ static int set_ip_blockmap(struct fsck_cx *cx, struct lgfs2_inode *ip)
 	}
 	no = ip->i_num;
 	if (fsck_blockmap_set(cx, ip, block, ty, GFS2_BLKST_DINODE) ||
-	    (mode == S_IFDIR && !dirtree_insert(cx, no))) {
+	    (mode == S_IFDIR && (dt = dirtree_insert(cx, no)) == NULL)) {
 		stack;
 		return -EPERM;
 	}
+	if (dt != NULL)
+		dt->di_blocks = ip->i_blocks < UINT32_MAX ? ip->i_blocks : UINT32_MAX;
 	return 0;
 }
 
@@ -1086,6 +1085,7 @@ static int alloc_metalist(struct fsck_cx *cx, struct iptr iptr, struct lgfs2_buf
 	if (q == GFS2_BLKST_FREE) {
 		log_debug(_("%s reference to new metadata block %"PRIu64" (0x%"PRIx64") is now marked as indirect.\n"),
 		          desc, block, block);
+		note_owner(cx, ip, block);
 		blockmap_set(bl, block, GFS2_BLKST_USED);
 	}
 	return META_IS_GOOD;
@@ -1105,6 +1105,7 @@ static int alloc_data(struct fsck_cx *cx, struct lgfs2_inode *ip, uint64_t metab
 	if (q == GFS2_BLKST_FREE) {
 		log_debug(_("%s reference to new data block %"PRIu64" (0x%"PRIx64") is now marked as data.\n"),
 		          desc, block, block);
+		note_owner(cx, ip, block);
 		blockmap_set(bl, block, GFS2_BLKST_USED);
 	}
 	return 0;
@@ -1652,8 +1653,184 @@ static int check_system_inodes(struct fsck_cx *cx)
 	return 0;
 }
 
-static int pass1_process_bitmap(struct fsck_cx *cx, struct lgfs2_rgrp_tree *rgd, uint64_t *ibuf, unsigned n)
+/* The number of dinode reads kept in flight during the sweep */
+#define PASS1_READ_DEPTH (64)
+
+/* A window of dinode reads queued ahead of the block being checked */
+struct dinode_window {
+	struct lgfs2_ioq *ioq;
+	uint64_t *ibuf;
+	unsigned n;
+	unsigned next; /* The next index of ibuf to be queued */
+	struct lgfs2_buffer_head *bh[PASS1_READ_DEPTH];
+	int done[PASS1_READ_DEPTH];
+};
+
+static void dinode_window_fill(struct lgfs2_sbd *sdp, struct dinode_window *dw, unsigned i)
+{
+	for (; dw->next < dw->n && dw->next < i + PASS1_READ_DEPTH; dw->next++) {
+		uint64_t block = dw->ibuf[dw->next];
+
+		if (fsck_system_inode(sdp, block))
+			continue;
+		if (lgfs2_ioq_submit(dw->ioq, block, &dw->ibuf[dw->next]) != 0)
+			break;
+	}
+}
+
+/**
+ * dinode_window_get - wait for the read of the block at index i of the
+ *                     window and queue the reads of the following blocks
+ * Returns the buffer or NULL if the block could not be read.
+ */
+static struct lgfs2_buffer_head *dinode_window_get(struct lgfs2_sbd *sdp,
+                                                   struct dinode_window *dw, unsigned i)
+{
+	unsigned slot = i % PASS1_READ_DEPTH;
+	struct lgfs2_buffer_head *bh;
+
+	if (dw->next <= i)
+		dw->next = i;
+	dinode_window_fill(sdp, dw, i);
+	while (!dw->done[slot]) {
+		void *priv = NULL;
+		unsigned idx;
+		int ret;
+
+		ret = lgfs2_ioq_reap(dw->ioq, &bh, &priv);
+		if (ret == 1) {
+			/* It couldn't be queued so read it now */
+			dw->bh[slot] = lgfs2_bread(sdp, dw->ibuf[i]);
+			break;
+		}
+		if (ret < 0 && priv == NULL) {
+			log_err(_("Error waiting for dinode reads: %s\n"), strerror(errno));
+			return NULL;
+		}
+		idx = (uint64_t *)priv - dw->ibuf;
+		if (ret < 0)
+			log_err(_("Unable to read block %"PRIu64" (0x%"PRIx64"): %s\n"),
+			        dw->ibuf[idx], dw->ibuf[idx], strerror(errno));
+		dw->bh[idx % PASS1_READ_DEPTH] = bh;
+		dw->done[idx % PASS1_READ_DEPTH] = 1;
+	}
+	bh = dw->bh[slot];
+	dw->bh[slot] = NULL;
+	dw->done[slot] = 0;
+	return bh;
+}
+
+static void dinode_window_free(struct dinode_window *dw)
+{
+	for (unsigned i = 0; i < PASS1_READ_DEPTH; i++)
+		if (dw->bh[i] != NULL)
+			lgfs2_brelse(dw->bh[i]);
+	lgfs2_ioq_free(&dw->ioq);
+}
+
+/*
+ * State for queueing dinodes to the prefetch threads. The dinodes are queued
+ * in batches, in the order they are checked, so that the dense resource
+ * groups are prefetched in full and shared out between the threads. Each
+ * dinode is numbered by its position in that order.
+ */
+struct pass1_prefetch {
+	struct prefetcher *pf;
+	struct osi_node *next; /* The resource group being queued */
+	unsigned bitmap;       /* Its next bitmap block to be scanned */
+	uint64_t *ibuf;        /* Dinodes scanned but not yet queued */
+	unsigned n;
+	unsigned pos;
+	uint64_t queued;       /* The number of the next dinode to be queued */
+	uint64_t checked;      /* The number of the next dinode to be checked */
+	unsigned batch;        /* Dinodes per batch */
+};
+
+static void pass1_prefetch_start(struct lgfs2_sbd *sdp, struct pass1_prefetch *pp)
+{
+	unsigned nthreads = prefetch_nthreads();
+	/* Leave half of the cache for the checker's own reads and writes */
+	uint64_t cache_blocks = FSCK_BCACHE_BUDGET / sdp->sd_bsize / 2;
+	uint64_t max_blocks;
+
+	memset(pp, 0, sizeof(*pp));
+	if (nthreads == 0)
+		return;
+	/* A batch per thread being read and one queued for each thread */
+	max_blocks = cache_blocks / (2 * nthreads);
+	/* Allow for the indirect blocks, leaves and extended attributes */
+	pp->batch = max_blocks / 4;
+	if (pp->batch == 0)
+		return;
+	pp->ibuf = malloc(sdp->sd_bsize * GFS2_NBBY * sizeof(uint64_t));
+	if (pp->ibuf == NULL)
+		return;
+	pp->pf = prefetch_start(sdp, nthreads, nthreads, max_blocks);
+	if (pp->pf == NULL) {
+		free(pp->ibuf);
+		pp->ibuf = NULL;
+		return;
+	}
+	pp->next = osi_first(&sdp->rgtree);
+}
+
+/* Queue batches of dinodes until the queue is full */
+static void pass1_prefetch_queue(struct pass1_prefetch *pp)
+{
+	while (pp->next != NULL) {
+		struct lgfs2_rgrp_tree *rgd = (struct lgfs2_rgrp_tree *)pp->next;
+		unsigned len = pp->n - pp->pos;
+		uint64_t *blks;
+
+		if (len == 0) {
+			if (pp->bitmap == rgd->rt_length) {
+				pp->next = osi_next(pp->next);
+				pp->bitmap = 0;
+				continue;
+			}
+			pp->n = lgfs2_bm_scan(rgd, pp->bitmap++, pp->ibuf, GFS2_BLKST_DINODE);
+			pp->pos = 0;
+			continue;
+		}
+		if (len > pp->batch)
+			len = pp->batch;
+		blks = malloc(len * sizeof(*blks));
+		if (blks == NULL)
+			return;
+		memcpy(blks, pp->ibuf + pp->pos, len * sizeof(*blks));
+		/* A batch is dropped once the checker has passed its last dinode */
+		if (prefetch_dinodes(pp->pf, pp->queued + len - 1, blks, len) != 0) {
+			free(blks);
+			return;
+		}
+		pp->pos += len;
+		pp->queued += len;
+	}
+}
+
+/**
+ * pass1_prefetch_advance - count a dinode about to be checked and, at the
+ *                          start of each batch, top up the queue
+ */
+static void pass1_prefetch_advance(struct pass1_prefetch *pp)
+{
+	if (pp->pf == NULL || pp->checked++ % pp->batch != 0)
+		return;
+	prefetch_advance(pp->pf, pp->checked - 1);
+	pass1_prefetch_queue(pp);
+}
+
+static void pass1_prefetch_stop(struct pass1_prefetch *pp)
 {
+	prefetch_stop(&pp->pf);
+	free(pp->ibuf);
+	pp->ibuf = NULL;
+}
+
+static int pass1_process_bitmap(struct fsck_cx *cx, struct lgfs2_rgrp_tree *rgd,
+                                struct pass1_prefetch *pp, uint64_t *ibuf, unsigned n)
+{
+	struct dinode_window dw = { .ibuf = ibuf, .n = n };
 	struct lgfs2_buffer_head *bh;
 	struct lgfs2_sbd *sdp = cx->sdp;
 	unsigned i;
@@ -1664,13 +1841,19 @@ static int pass1_process_bitmap(struct fsck_cx *cx, struct lgfs2_rgrp_tree *rgd,
 	unsigned rawin = 50;
 	unsigned ralen = 100 * sdp->sd_bsize;
 	unsigned r = 0;
+	int ret = 0;
+
+	dw.ioq = lgfs2_ioq_new(sdp, PASS1_READ_DEPTH);
+	if (dw.ioq == NULL)
+		return FSCK_ERROR;
 
 	for (i = 0; i < n; i++) {
 		int is_inode;
 
 		block = ibuf[i];
+		pass1_prefetch_advance(pp);
 
-		if (r++ == rawin) {
+		if (!lgfs2_ioq_async(dw.ioq) && r++ == rawin) {
 			(void)posix_fadvise(sdp->device_fd, block * sdp->sd_bsize, ralen, POSIX_FADV_WILLNEED);
 			r = 0;
 		}
@@ -1678,7 +1861,7 @@ static int pass1_process_bitmap(struct fsck_cx *cx, struct lgfs2_rgrp_tree *rgd,
 		display_progress(block);
 
 		if (fsck_abort)
-			return FSCK_OK;
+			goto out;
 
 		if (skip_this_pass) {
 			printf( _("Skipping pass 1 is not a good idea.\n"));
@@ -1691,7 +1874,9 @@ static int pass1_process_bitmap(struct fsck_cx *cx, struct lgfs2_rgrp_tree *rgd,
 			continue;
 		}
 
-		bh = lgfs2_bread(sdp, block);
+		bh = dinode_window_get(sdp, &dw, i);
+		if (bh == NULL)
+			continue;
 
 		is_inode = 0;
 		if (lgfs2_check_meta(bh->b_data, GFS2_METATYPE_DI) == 0)
@@ -1722,7 +1907,8 @@ static int pass1_process_bitmap(struct fsck_cx *cx, struct lgfs2_rgrp_tree *rgd,
 		} else if (handle_di(cx, rgd, bh) < 0) {
 			stack;
 			lgfs2_brelse(bh);
-			return FSCK_ERROR;
+			ret = FSCK_ERROR;
+			goto out;
 		}
 		/* Ignore everything else - they should be hit by the
 		   handle_di step.  Don't check NONE either, because
@@ -1733,11 +1919,13 @@ static int pass1_process_bitmap(struct fsck_cx *cx, struct lgfs2_rgrp_tree *rgd,
 		   caught in pass5. */
 		lgfs2_brelse(bh);
 	}
-
-	return 0;
+out:
+	dinode_window_free(&dw);
+	return ret;
 }
 
-static int pass1_process_rgrp(struct fsck_cx *cx, struct lgfs2_rgrp_tree *rgd)
+static int pass1_process_rgrp(struct fsck_cx *cx, struct lgfs2_rgrp_tree *rgd,
+                              struct pass1_prefetch *pp)
 {
 	unsigned k, n;
 	uint64_t *ibuf = malloc(cx->sdp->sd_bsize * GFS2_NBBY * sizeof(uint64_t));
@@ -1750,7 +1938,7 @@ static int pass1_process_rgrp(struct fsck_cx *cx, struct lgfs2_rgrp_tree *rgd)
 		n = lgfs2_bm_scan(rgd, k, ibuf, GFS2_BLKST_DINODE);
 
 		if (n) {
-			ret = pass1_process_bitmap(cx, rgd, ibuf, n);
+			ret = pass1_process_bitmap(cx, rgd, pp, ibuf, n);
 			if (ret)
 				goto out;
 		}
@@ -1764,69 +1952,6 @@ out:
 	return ret;
 }
 
-static int blockmap_create(struct bmap *bmap, uint64_t size)
-{
-	bmap->size = size;
-
-	/* Have to add 1 to BLOCKMAP_SIZE since it's 0-based and mallocs
-	 * must be 1-based */
-	bmap->mapsize = BLOCKMAP_SIZE2(size) + 1;
-
-	if (!(bmap->map = calloc(bmap->mapsize, sizeof(char))))
-		return -ENOMEM;
-	return 0;
-}
-
-
-static int link1_create(struct bmap *bmap, uint64_t size)
-{
-	bmap->size = size;
-
-	/* Have to add 1 to BLOCKMAP_SIZE since it's 0-based and mallocs
-	 * must be 1-based */
-	bmap->mapsize = BLOCKMAP_SIZE1(size) + 1;
-
-	if (!(bmap->map = calloc(bmap->mapsize, sizeof(char))))
-		return -ENOMEM;
-	return 0;
-}
-
-static struct bmap *bmap_create(struct lgfs2_sbd *sdp, uint64_t size,
-					  uint64_t *addl_mem_needed)
-{
-	struct bmap *il;
-
-	*addl_mem_needed = 0L;
-	il = calloc(1, sizeof(*il));
-	if (!il)
-		return NULL;
-
-	if (blockmap_create(il, size)) {
-		*addl_mem_needed = il->mapsize;
-		free(il);
-		il = NULL;
-	}
-	return il;
-}
-
-static void blockmap_destroy(struct bmap *bmap)
-{
-	if (bmap->map)
-		free(bmap->map);
-	bmap->size = 0;
-	bmap->mapsize = 0;
-}
-
-static void *bmap_destroy(struct lgfs2_sbd *sdp, struct bmap *il)
-{
-	if (il) {
-		blockmap_destroy(il);
-		free(il);
-		il = NULL;
-	}
-	return il;
-}
-
 static void enomem(uint64_t addl_mem_needed)
 {
 	log_crit( _("This system doesn't have enough memory and swap space to fsck this file system.\n"));
@@ -1852,29 +1977,41 @@ int pass1(struct fsck_cx *cx)
 {
 	struct lgfs2_sbd *sdp = cx->sdp;
 	struct osi_node *n, *next = NULL;
+	struct pass1_prefetch pp;
 	struct lgfs2_rgrp_tree *rgd;
 	uint64_t i;
 	uint64_t rg_count = 0;
 	struct timeval timer;
 	int ret = FSCK_OK;
 	uint64_t addl_mem_needed;
-
-	bl = bmap_create(sdp, last_fs_block+1, &addl_mem_needed);
+	uint64_t nblocks = last_fs_block + 1;
+	uint64_t budget = bmap_mem_budget();
+	uint64_t bl_budget = UINT64_MAX;
+	uint64_t link_budget = UINT64_MAX;
+
+	/* The blockmap uses 2 bits per block and the link maps 1 bit each. If
+	   they don't fit in the budget together, use chunked maps and share the
+	   budget between them in the same proportions. */
+	if (BLOCKMAP_SIZE1(nblocks) > budget / 4) {
+		log_notice(_("Using compacted block maps to save memory.\n"));
+		bl_budget = budget / 2;
+		link_budget = budget / 4;
+	}
+	owner_index_init(&cx->owners, FSCK_OWNERS_BUDGET);
+	bl = bmap_create(nblocks, bl_budget, &addl_mem_needed);
 	if (!bl) {
 		enomem(addl_mem_needed);
 		return FSCK_ERROR;
 	}
-	addl_mem_needed = link1_create(&nlink1map, last_fs_block+1);
-	if (addl_mem_needed) {
-		enomem(addl_mem_needed);
-		bmap_destroy(sdp, bl);
+	if (link1_create(&nlink1map, nblocks, link_budget)) {
+		enomem(BLOCKMAP_SIZE1(nblocks));
+		bmap_destroy(bl);
 		return FSCK_ERROR;
 	}
-	addl_mem_needed = link1_create(&clink1map, last_fs_block+1);
-	if (addl_mem_needed) {
-		enomem(addl_mem_needed);
+	if (link1_create(&clink1map, nblocks, link_budget)) {
+		enomem(BLOCKMAP_SIZE1(nblocks));
 		link1_destroy(&nlink1map);
-		bmap_destroy(sdp, bl);
+		bmap_destroy(bl);
 		return FSCK_ERROR;
 	}
 
@@ -1895,7 +2032,12 @@ int pass1(struct fsck_cx *cx)
 	 * things will probably be intolerably slow.  The current fsck
 	 * uses the rg bitmaps, so maybe that's the best way to start
 	 * things - we can change the method later if necessary.
+	 *
+	 * The checks are done in order in this thread, as repairs depend on
+	 * which inode is found to reference a block first, but helper threads
+	 * read the metadata of the dinodes ahead into the block cache.
 	 */
+	pass1_prefetch_start(sdp, &pp);
 	for (n = osi_first(&sdp->rgtree); n; n = next, rg_count++) {
 		if (fsck_abort) {
 			ret = FSCK_CANCELED;
@@ -1918,17 +2060,22 @@ int pass1(struct fsck_cx *cx)
 			gfs2_meta_rgrp);*/
 		}
 
-		ret = pass1_process_rgrp(cx, rgd);
+		ret = pass1_process_rgrp(cx, rgd, &pp);
 		if (ret)
 			goto out;
+		bmap_compact(bl, 0);
+		bmap_compact(&nlink1map, 0);
+		bmap_compact(&clink1map, 0);
 	}
+	pass1_prefetch_stop(&pp);
 	log_notice(_("Reconciling bitmaps.\n"));
 	gettimeofday(&timer, NULL);
 	pass5(cx, bl);
 	print_pass_duration("reconcile_bitmaps", &timer);
 out:
+	pass1_prefetch_stop(&pp);
 	if (bl)
-		bmap_destroy(sdp, bl);
+		bmap_destroy(bl);
 	return ret;
 }
 
@@ -848,6 +848,109 @@ out:
 	return error;
 }
 
+static int cmp_u64(const void *a, const void *b)
+{
+	const uint64_t *x = a, *y = b;
+
+	if (*x < *y)
+		return -1;
+	return *x > *y;
+}
+
+/* Find the first duplicate block at or after a block */
+static struct duptree *dup_lower_bound(struct fsck_cx *cx, uint64_t block)
+{
+	struct osi_node *node = cx->dup_blocks.osi_node;
+	struct duptree *found = NULL;
+
+	while (node) {
+		struct duptree *dt = (struct duptree *)node;
+
+		if (block <= dt->block) {
+			found = dt;
+			node = node->osi_left;
+		} else {
+			node = node->osi_right;
+		}
+	}
+	return found;
+}
+
+static int add_candidate(uint64_t **list, uint64_t *n, uint64_t *alloc, uint64_t blk)
+{
+	if (*n == *alloc) {
+		uint64_t newalloc = *alloc ? *alloc * 2 : 256;
+		uint64_t *l = realloc(*list, newalloc * sizeof(**list));
+
+		if (l == NULL)
+			return -1;
+		*list = l;
+		*alloc = newalloc;
+	}
+	(*list)[(*n)++] = blk;
+	return 0;
+}
+
+/**
+ * dup_owner_candidates - list the inodes which may reference duplicate blocks
+ *
+ * These are the inodes which pass1 found referencing the duplicate blocks
+ * first, according to the owner index, and the ones which referenced them
+ * again. Checking only these, in block order, finds the same references as
+ * scanning every inode.
+ * Returns the sorted list of inode addresses, or NULL if the owner index is
+ * not available.
+ */
+static uint64_t *dup_owner_candidates(struct fsck_cx *cx, uint64_t *count)
+{
+	struct owner_index *oi = &cx->owners;
+	uint64_t *list = NULL;
+	uint64_t n = 0, alloc = 0;
+	struct osi_node *node;
+
+	if (!oi->enabled)
+		return NULL;
+	for (uint64_t i = 0; i < oi->count; i++) {
+		struct owner_extent *ext = &oi->ext[i];
+		struct duptree *dt = dup_lower_bound(cx, ext->start);
+
+		if (dt == NULL || dt->block >= ext->start + ext->len)
+			continue;
+		if (add_candidate(&list, &n, &alloc, ext->owner))
+			goto fail;
+	}
+	for (node = osi_first(&cx->dup_blocks); node; node = osi_next(node)) {
+		struct duptree *dt = (struct duptree *)node;
+		osi_list_t *tmp;
+
+		osi_list_foreach(tmp, &dt->ref_invinode_list) {
+			struct inode_with_dups *id = osi_list_entry(tmp, struct inode_with_dups, list);
+
+			if (add_candidate(&list, &n, &alloc, id->block_no))
+				goto fail;
+		}
+		osi_list_foreach(tmp, &dt->ref_inode_list) {
+			struct inode_with_dups *id = osi_list_entry(tmp, struct inode_with_dups, list);
+
+			if (add_candidate(&list, &n, &alloc, id->block_no))
+				goto fail;
+		}
+	}
+	if (n == 0) {
+		*count = 0;
+		return list;
+	}
+	qsort(list, n, sizeof(*list), cmp_u64);
+	*count = 1;
+	for (uint64_t i = 1; i < n; i++)
+		if (list[i] != list[*count - 1])
+			list[(*count)++] = list[i];
+	return list;
+fail:
+	free(list);
+	return NULL;
+}
+
 /* Pass 1b handles finding the previous inode for a duplicate block
  * When found, store the inodes pointing to the duplicate block for
  * use in pass2 */
@@ -855,7 +958,8 @@ int pass1b(struct fsck_cx *cx)
 {
 	struct lgfs2_sbd *sdp = cx->sdp;
 	struct duptree *dt;
-	uint64_t i;
+	uint64_t i, idx, ncand = 0;
+	uint64_t *cand;
 	int q;
 	struct osi_node *n;
 	int rc = FSCK_OK;
@@ -865,6 +969,7 @@ int pass1b(struct fsck_cx *cx)
 	/* If there were no dups in the bitmap, we don't need to do anymore */
 	if (cx->dup_blocks.osi_node == NULL) {
 		log_info( _("No duplicate blocks found\n"));
+		owner_index_free(&cx->owners);
 		return FSCK_OK;
 	}
 
@@ -873,7 +978,19 @@ int pass1b(struct fsck_cx *cx)
 	log_info( _("Scanning filesystem for inodes containing duplicate blocks...\n"));
 	log_debug(_("Filesystem has %"PRIu64" (0x%"PRIx64") blocks total\n"),
 	          last_fs_block, last_fs_block);
-	for (i = 0; i < last_fs_block; i++) {
+	cand = dup_owner_candidates(cx, &ncand);
+	owner_index_free(&cx->owners);
+	if (cand != NULL)
+		log_debug(_("Checking %"PRIu64" inodes which may reference duplicates\n"), ncand);
+	for (idx = 0; ; idx++) {
+		if (cand == NULL)
+			i = idx;
+		else if (idx < ncand)
+			i = cand[idx];
+		else
+			break;
+		if (i >= last_fs_block)
+			break;
 		if (skip_this_pass || fsck_abort) /* if asked to skip the rest */
 			goto out;
 
@@ -890,6 +1007,7 @@ int pass1b(struct fsck_cx *cx)
 		if (q == GFS2_BLKST_UNLINKED) {
 			log_debug(_("Error: block %"PRIu64" (0x%"PRIx64") is still marked UNLINKED.\n"),
 			          i, i);
+			free(cand);
 			return FSCK_ERROR;
 		}
 
@@ -905,6 +1023,7 @@ int pass1b(struct fsck_cx *cx)
 	 * it later */
 	log_info( _("Handling duplicate blocks\n"));
 out:
+	free(cand);
 	/* Resolve all duplicates by clearing out the dup tree */
         while ((n = osi_first(&cx->dup_blocks))) {
                 dt = (struct duptree *)n;
@@ -19,6 +19,7 @@
 #include "inode_hash.h"
 #include "afterpass1_common.h"
 #include "fs_recovery.h"
+#include "prefetch.h"
 
 #define MAX_FILENAME 256
 
@@ -2062,6 +2063,132 @@ static int pass2_check_dir(struct fsck_cx *cx, struct lgfs2_inode *ip)
 	return FSCK_OK;
 }
 
+/* A directory queued for prefetching which the checker hasn't reached */
+struct pass2_prefetch_dir {
+	uint64_t addr;
+	uint64_t blocks;
+};
+
+/*
+ * The directories are queued one at a time, each with its size as found by
+ * pass1, and as many are queued ahead of the checker as fit in the block
+ * budget. A single large directory can then use the whole budget, and its
+ * leaves are shared out between the threads.
+ */
+struct pass2_prefetch {
+	struct prefetcher *pf;
+	uint64_t next_addr;    /* The first directory which hasn't been queued */
+	uint64_t max_blocks;   /* The most blocks to queue ahead of the checker */
+	uint64_t blocks;       /* The blocks of the directories in dirs[] */
+	struct pass2_prefetch_dir *dirs; /* A ring of the directories queued */
+	unsigned first;
+	unsigned n;
+	unsigned max_dirs;
+};
+
+/* Find the first directory at or after a block */
+static struct dir_info *dirtree_lower_bound(struct fsck_cx *cx, uint64_t block)
+{
+	struct osi_node *node = cx->dirtree.osi_node;
+	struct dir_info *found = NULL;
+
+	while (node) {
+		struct dir_info *di = (struct dir_info *)node;
+
+		if (block <= di->dinode.in_addr) {
+			found = di;
+			node = node->osi_left;
+		} else {
+			node = node->osi_right;
+		}
+	}
+	return found;
+}
+
+static void pass2_prefetch_start(struct lgfs2_sbd *sdp, struct pass2_prefetch *pp)
+{
+	unsigned nthreads = prefetch_nthreads();
+
+	memset(pp, 0, sizeof(*pp));
+	if (nthreads == 0)
+		return;
+	/* Leave half of the cache for the checker's own reads and writes */
+	pp->max_blocks = FSCK_BCACHE_BUDGET / sdp->sd_bsize / 2;
+	/* Enough small directories to keep each thread busy with one while
+	   another is queued for it */
+	pp->max_dirs = 4 * nthreads;
+	pp->dirs = calloc(pp->max_dirs, sizeof(*pp->dirs));
+	if (pp->dirs == NULL)
+		return;
+	pp->pf = prefetch_start(sdp, nthreads, pp->max_dirs, pp->max_blocks);
+	if (pp->pf == NULL) {
+		free(pp->dirs);
+		pp->dirs = NULL;
+		return;
+	}
+	pp->next_addr = 1;
+}
+
+/**
+ * pass2_prefetch_dirs - queue the directories which follow the one being
+ *                       checked so that the helper threads read their hash
+ *                       tables and leaves ahead of the checker.
+ * @dirblk: The directory about to be checked
+ *
+ * Each directory is given its address as its sequence number so that it is
+ * dropped once the checker has moved past it.
+ */
+static void pass2_prefetch_dirs(struct fsck_cx *cx, struct pass2_prefetch *pp, uint64_t dirblk)
+{
+	if (pp->pf == NULL)
+		return;
+	prefetch_advance(pp->pf, dirblk);
+	/* The blocks of the directories already checked are no longer needed */
+	while (pp->n > 0 && pp->dirs[pp->first].addr < dirblk) {
+		pp->blocks -= pp->dirs[pp->first].blocks;
+		pp->first = (pp->first + 1) % pp->max_dirs;
+		pp->n--;
+	}
+	while (pp->next_addr != 0 && pp->n < pp->max_dirs) {
+		struct dir_info *di = dirtree_lower_bound(cx, pp->next_addr);
+		struct pass2_prefetch_dir *pd;
+		uint64_t addr, blocks;
+		uint64_t *blk;
+
+		if (di == NULL) {
+			pp->next_addr = 0;
+			return;
+		}
+		blocks = di->di_blocks ? di->di_blocks : 1;
+		if (blocks > pp->max_blocks)
+			blocks = pp->max_blocks;
+		if (pp->n > 0 && pp->blocks + blocks > pp->max_blocks)
+			return;
+		addr = di->dinode.in_addr;
+		blk = malloc(sizeof(*blk));
+		if (blk == NULL)
+			return;
+		*blk = addr;
+		if (prefetch_dinodes(pp->pf, addr, blk, 1) != 0) {
+			free(blk);
+			return;
+		}
+		pd = &pp->dirs[(pp->first + pp->n++) % pp->max_dirs];
+		pd->addr = addr;
+		pd->blocks = blocks;
+		pp->blocks += blocks;
+		di = (struct dir_info *)osi_next(&di->node);
+		pp->next_addr = di ? di->dinode.in_addr : 0;
+	}
+}
+
+static void pass2_prefetch_stop(struct pass2_prefetch *pp)
+{
+	prefetch_stop(&pp->pf);
+	free(pp->dirs);
+	pp->dirs = NULL;
+}
+
 /* What i need to do in this pass is check that the dentries aren't
  * pointing to invalid blocks...and verify the contents of each
  * directory. and start filling in the directory info structure*/
@@ -2079,8 +2206,9 @@ int pass2(struct fsck_cx *cx)
 	struct osi_node *tmp, *next = NULL;
 	struct lgfs2_inode *ip;
 	struct dir_info *dt;
+	struct pass2_prefetch pp;
 	uint64_t dirblk;
-	int error;
+	int error = FSCK_OK;
 
 	/* Check all the system directory inodes. */
 	if (check_system_dir(cx, sdp->md.jiinode, "jindex", build_jindex)) {
@@ -2108,6 +2236,9 @@ int pass2(struct fsck_cx *cx)
 	if (skip_this_pass || fsck_abort) /* if asked to skip the rest */
 		return FSCK_OK;
 	log_info( _("Checking directory inodes.\n"));
+	/* The directories are checked one at a time, in order, but with their
+	   metadata read ahead by a pool of threads */
+	pass2_prefetch_start(sdp, &pp);
 	/* Grab each directory inode, and run checks on it */
 	for (tmp = osi_first(&cx->dirtree); tmp; tmp = next) {
 		next = osi_next(tmp);
@@ -2116,7 +2247,8 @@ int pass2(struct fsck_cx *cx)
 		dirblk = dt->dinode.in_addr;
 		display_progress(dirblk);
 		if (skip_this_pass || fsck_abort) /* if asked to skip the rest */
-			return FSCK_OK;
+			break;
+		pass2_prefetch_dirs(cx, &pp, dirblk);
 
 		/* Skip the system inodes - they're checked above */
 		if (is_system_dir(sdp, dirblk))
@@ -2135,18 +2267,21 @@ int pass2(struct fsck_cx *cx)
 		ip = fsck_load_inode(sdp, dirblk);
 		if (ip == NULL) {
 			stack;
-			return FSCK_ERROR;
+			error = FSCK_ERROR;
+			break;
 		}
 		error = pass2_check_dir(cx, ip);
 		fsck_inode_put(&ip);
 
-		if (skip_this_pass || fsck_abort)
-			return FSCK_OK;
-
+		if (skip_this_pass || fsck_abort) {
+			error = FSCK_OK;
+			break;
+		}
 		if (error != FSCK_OK) {
 			stack;
-			return error;
+			break;
 		}
 	}
-	return FSCK_OK;
+	pass2_prefetch_stop(&pp);
+	return error;
 }
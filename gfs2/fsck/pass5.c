@@ -14,89 +14,112 @@
 
 #define GFS1_BLKST_USEDMETA 4
 
-static int check_block_status(struct fsck_cx *cx,  struct bmap *bl,
-			      char *buffer, unsigned int buflen,
-			      uint64_t *rg_block, uint64_t rg_data,
-			      uint32_t *count)
+static void check_block(struct fsck_cx *cx, uint64_t block, unsigned char rg_status,
+                        int q, uint32_t *count)
 {
 	struct lgfs2_sbd *sdp = cx->sdp;
-	unsigned char *byte, *end;
-	unsigned int bit;
-	unsigned char rg_status;
-	int q;
-	uint64_t block;
-
-	/* FIXME verify cast */
-	byte = (unsigned char *) buffer;
-	bit = 0;
-	end = (unsigned char *) buffer + buflen;
-
-	while (byte < end) {
-		rg_status = ((*byte >> bit) & GFS2_BIT_MASK);
-		block = rg_data + *rg_block;
-		display_progress(block);
-		if (skip_this_pass || fsck_abort) /* if asked to skip the rest */
-			return 0;
-
-		q = block_type(bl, block);
-		count[q]++;
-
-		/* If one node opens a file and another node deletes it, we
-		   may be left with a block that appears to be "unlinked" in
-		   the bitmap, but nothing links to it. This is a valid case
-		   and should be cleaned up by the file system eventually.
-		   So we ignore it. */
-		if (q == GFS2_BLKST_UNLINKED) {
-			log_err(_("Unlinked inode found at block %"PRIu64" (0x%"PRIx64").\n"),
-			        block, block);
-			if (query(cx, _("Do you want to reclaim the block? (y/n) "))) {
-				lgfs2_rgrp_t rg = lgfs2_blk2rgrpd(sdp, block);
-				if (lgfs2_set_bitmap(rg, block, GFS2_BLKST_FREE))
-					log_err(_("Unlinked block %"PRIu64" (0x%"PRIx64") bitmap not fixed.\n"),
-					        block, block);
-				else {
-					log_err(_("Unlinked block %"PRIu64" (0x%"PRIx64") bitmap fixed.\n"),
-					        block, block);
-					count[GFS2_BLKST_UNLINKED]--;
-					count[GFS2_BLKST_FREE]++;
-				}
-			} else {
-				log_info(_("Unlinked block found at block %"PRIu64" (0x%"PRIx64"), left unchanged.\n"),
-				         block, block);
-			}
-		} else if (rg_status != q) {
-			log_err(_("Block %"PRIu64" (0x%"PRIx64") bitmap says %u (%s) but FSCK saw %u (%s)\n"),
-				 block, block, rg_status,
-				 block_type_string(rg_status), q,
-				 block_type_string(q));
-			if (q) /* Don't print redundant "free" */
-				log_err( _("Metadata type is %u (%s)\n"), q,
-					 block_type_string(q));
-
-			if (query(cx, _("Fix bitmap for block %"PRIu64" (0x%"PRIx64")? (y/n) "),
-			          block, block)) {
-				lgfs2_rgrp_t rg = lgfs2_blk2rgrpd(sdp, block);
-				if (lgfs2_set_bitmap(rg, block, q))
-					log_err( _("Repair failed.\n"));
-				else
-					log_err( _("Fixed.\n"));
-			} else
-				log_err(_("Bitmap at block %"PRIu64" (0x%"PRIx64") left inconsistent\n"),
+
+	/* If one node opens a file and another node deletes it, we
+	   may be left with a block that appears to be "unlinked" in
+	   the bitmap, but nothing links to it. This is a valid case
+	   and should be cleaned up by the file system eventually.
+	   So we ignore it. */
+	if (q == GFS2_BLKST_UNLINKED) {
+		log_err(_("Unlinked inode found at block %"PRIu64" (0x%"PRIx64").\n"),
+		        block, block);
+		if (query(cx, _("Do you want to reclaim the block? (y/n) "))) {
+			lgfs2_rgrp_t rg = lgfs2_blk2rgrpd(sdp, block);
+			if (lgfs2_set_bitmap(rg, block, GFS2_BLKST_FREE))
+				log_err(_("Unlinked block %"PRIu64" (0x%"PRIx64") bitmap not fixed.\n"),
 				        block, block);
+			else {
+				log_err(_("Unlinked block %"PRIu64" (0x%"PRIx64") bitmap fixed.\n"),
+				        block, block);
+				count[GFS2_BLKST_UNLINKED]--;
+				count[GFS2_BLKST_FREE]++;
+			}
+		} else {
+			log_info(_("Unlinked block found at block %"PRIu64" (0x%"PRIx64"), left unchanged.\n"),
+			         block, block);
 		}
-		(*rg_block)++;
-		bit += GFS2_BIT_SIZE;
-		if (bit >= 8){
-			bit = 0;
-			byte++;
-		}
+	} else if (rg_status != q) {
+		log_err(_("Block %"PRIu64" (0x%"PRIx64") bitmap says %u (%s) but FSCK saw %u (%s)\n"),
+			 block, block, rg_status,
+			 block_type_string(rg_status), q,
+			 block_type_string(q));
+		if (q) /* Don't print redundant "free" */
+			log_err( _("Metadata type is %u (%s)\n"), q,
+				 block_type_string(q));
+
+		if (query(cx, _("Fix bitmap for block %"PRIu64" (0x%"PRIx64")? (y/n) "),
+		          block, block)) {
+			lgfs2_rgrp_t rg = lgfs2_blk2rgrpd(sdp, block);
+			if (lgfs2_set_bitmap(rg, block, q))
+				log_err( _("Repair failed.\n"));
+			else
+				log_err( _("Fixed.\n"));
+		} else
+			log_err(_("Bitmap at block %"PRIu64" (0x%"PRIx64") left inconsistent\n"),
+			        block, block);
 	}
+}
 
+/*
+ * Compare a bitmap with the states fsck found for its blocks, a 64-bit word
+ * (32 blocks) at a time. The blockmap uses the same 2-bit encoding as the
+ * bitmaps, so the words can be xor'd and only the blocks which differ, or which
+ * fsck found to be unlinked, need to be looked at individually. @want is
+ * scratch space for the blockmap states, at least buflen + 8 bytes long.
+ */
+static int check_block_status(struct fsck_cx *cx,  struct bmap *bl,
+			      char *buffer, unsigned int buflen,
+			      uint64_t *rg_block, uint64_t rg_data,
+			      uint32_t *count, unsigned char *want)
+{
+	const uint64_t mask = 0x5555555555555555ULL;
+	const unsigned char *bits = (unsigned char *)buffer;
+	uint64_t start = rg_data + *rg_block;
+	uint32_t states[4];
+
+	display_progress(start);
+	if (skip_this_pass || fsck_abort) /* if asked to skip the rest */
+		return 0;
+
+	memset(want + buflen, 0, sizeof(uint64_t));
+	blockmap_states(bl, start, buflen, want);
+	lgfs2_bitmap_count(want, buflen, states);
+	for (int i = 0; i < 4; i++)
+		count[i] += states[i];
+
+	for (unsigned x = 0; x < buflen; x += sizeof(uint64_t)) {
+		unsigned len = buflen - x < sizeof(uint64_t) ? buflen - x : sizeof(uint64_t);
+		uint64_t disk = 0, fsck, diff, unlinked;
+
+		memcpy(&disk, bits + x, len);
+		memcpy(&fsck, want + x, sizeof(fsck));
+		disk = le64_to_cpu(disk);
+		fsck = le64_to_cpu(fsck);
+		diff = disk ^ fsck;
+		diff = (diff | (diff >> 1)) & mask;
+		unlinked = (fsck >> 1) & ~fsck & mask;
+		diff |= unlinked;
+		while (diff) {
+			unsigned bit = __builtin_ctzll(diff);
+			uint64_t block = start + x * GFS2_NBBY + bit / 2;
+
+			check_block(cx, block, (disk >> bit) & GFS2_BIT_MASK,
+			            (fsck >> bit) & GFS2_BIT_MASK, count);
+			if (skip_this_pass || fsck_abort)
+				return 0;
+			diff &= diff - 1;
+		}
+	}
+	*rg_block += buflen * GFS2_NBBY;
 	return 0;
 }
 
 static void update_rgrp(struct fsck_cx *cx, struct lgfs2_rgrp_tree *rgp,
-			struct bmap *bl, uint32_t *count)
+			struct bmap *bl, uint32_t *count, unsigned char *want)
 {
 	uint32_t i;
 	struct lgfs2_bitmap *bits;
@@ -108,7 +131,7 @@ static void update_rgrp(struct fsck_cx *cx, struct lgfs2_rgrp_tree *rgp,
 
 		/* update the bitmaps */
 		if (check_block_status(cx, bl, bits->bi_data + bits->bi_offset,
-		                       bits->bi_len, &rg_block, rgp->rt_data0, count))
+		                       bits->bi_len, &rg_block, rgp->rt_data0, count, want))
 			return;
 		if (skip_this_pass || fsck_abort) /* if asked to skip the rest */
 			return;
@@ -165,20 +188,29 @@ int pass5(struct fsck_cx *cx, struct bmap *bl)
 	struct lgfs2_rgrp_tree *rgp = NULL;
 	uint32_t count[5]; /* we need 5 because of GFS1 usedmeta */
 	uint64_t rg_count = 0;
+	unsigned char *want;
 
+	want = malloc(sdp->sd_bsize + sizeof(uint64_t));
+	if (want == NULL) {
+		log_crit(_("Unable to allocate memory for pass 5.\n"));
+		return FSCK_ERROR;
+	}
 	/* Reconcile RG bitmaps with fsck bitmap */
 	for (n = osi_first(&sdp->rgtree); n; n = next) {
 		next = osi_next(n);
-		if (skip_this_pass || fsck_abort) /* if asked to skip the rest */
+		if (skip_this_pass || fsck_abort) { /* if asked to skip the rest */
+			free(want);
 			return FSCK_OK;
+		}
 		log_info(_("Verifying resource group %"PRIu64"\n"), rg_count);
 		memset(count, 0, sizeof(count));
 		rgp = (struct lgfs2_rgrp_tree *)n;
 
 		rg_count++;
 		/* Compare the bitmaps and report the differences */
-		update_rgrp(cx, rgp, bl, count);
+		update_rgrp(cx, rgp, bl, count, want);
 	}
+	free(want);
 	/* Fix up superblock info based on this - don't think there's
 	 * anything to do here... */
 
@@ -0,0 +1,428 @@
+#include "clusterautoconfig.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <libintl.h>
+#define _(String) gettext(String)
+
+#include <logging.h>
+#include "libgfs2.h"
+#include "prefetch.h"
+
+/* The most blocks read by one lgfs2_bcache_prefetch() call */
+#define PREFETCH_CHUNK (64)
+#define PREFETCH_MAX_THREADS (16)
+/* Levels with more blocks than this are shared with the other threads */
+#define PREFETCH_SPLIT (4 * PREFETCH_CHUNK)
+
+/* A block to be prefetched and the number of metadata levels below it */
+struct prefetch_blk {
+	uint64_t blk;
+	unsigned depth;
+};
+
+/*
+ * A list of dinodes to prefetch along with their metadata or, if pblks is
+ * set, a part of one level of metadata below some dinodes which was split off
+ * for another thread to read.
+ */
+struct prefetch_item {
+	struct prefetch_item *next;
+	uint64_t seq;
+	uint64_t *blks;
+	struct prefetch_blk *pblks;
+	unsigned n;
+	uint64_t max_blocks;
+};
+
+struct prefetcher {
+	struct lgfs2_sbd *sdp;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct prefetch_item *head;
+	struct prefetch_item **tail;
+	unsigned queued;
+	unsigned max_queued;
+	uint64_t max_blocks;  /* The most blocks to read for one item */
+	uint64_t cur_seq;     /* Items with a lower seq are no longer useful */
+	int stop;
+	unsigned nthreads;
+	pthread_t *threads;
+	uint64_t nblocks;     /* Blocks read */
+	uint64_t nstale;      /* Items dropped because the checker overtook them */
+	uint64_t nsplit;      /* Items split off to share large levels */
+};
+
+/**
+ * prefetch_nthreads - the number of helper threads to use by default
+ */
+unsigned prefetch_nthreads(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n < 1)
+		return 1;
+	if (n > PREFETCH_MAX_THREADS)
+		return PREFETCH_MAX_THREADS;
+	return n;
+}
+
+static int is_stale(struct prefetcher *pf, uint64_t seq)
+{
+	return __atomic_load_n(&pf->stop, __ATOMIC_RELAXED) ||
+	       seq < __atomic_load_n(&pf->cur_seq, __ATOMIC_RELAXED);
+}
+
+static int cmp_pblk(const void *a, const void *b)
+{
+	const struct prefetch_blk *pa = a;
+	const struct prefetch_blk *pb = b;
+
+	if (pa->blk < pb->blk)
+		return -1;
+	return pa->blk > pb->blk;
+}
+
+static unsigned uniq_pblk(struct prefetch_blk *blks, unsigned n)
+{
+	unsigned out = 0;
+
+	for (unsigned i = 0; i < n; i++)
+		if (out == 0 || blks[i].blk != blks[out - 1].blk)
+			blks[out++] = blks[i];
+	return out;
+}
+
+/* Add the pointers in a metadata block to the list of blocks to read next */
+static unsigned add_ptrs(struct lgfs2_sbd *sdp, const char *buf, unsigned hdr, unsigned depth,
+                         struct prefetch_blk *next, unsigned n, unsigned max)
+{
+	const __be64 *p;
+
+	for (p = (const __be64 *)(buf + hdr); p < (const __be64 *)(buf + sdp->sd_bsize); p++) {
+		uint64_t blk = be64_to_cpu(*p);
+
+		if (n == max)
+			break;
+		if (blk == 0 || blk >= sdp->fssize)
+			continue;
+		/* Runs of hash table pointers to the same leaf */
+		if (n > 0 && next[n - 1].blk == blk)
+			continue;
+		next[n].blk = blk;
+		next[n].depth = depth;
+		n++;
+	}
+	return n;
+}
+
+static void queue_item(struct prefetcher *pf, struct prefetch_item *item)
+{
+	pthread_mutex_lock(&pf->lock);
+	*pf->tail = item;
+	pf->tail = &item->next;
+	pf->queued++;
+	pthread_cond_signal(&pf->cond);
+	pthread_mutex_unlock(&pf->lock);
+}
+
+/**
+ * Hand all but the first PREFETCH_SPLIT blocks of a level to the other
+ * threads, in ranges of PREFETCH_SPLIT blocks, so that the metadata of a large
+ * file or directory (e.g. the leaves of a big hash table) is read in parallel.
+ * Each range gets a share of the remaining block budget.
+ * Returns the number of blocks left for the calling thread.
+ */
+static unsigned split_level(struct prefetcher *pf, uint64_t seq, struct prefetch_blk *blks,
+                            unsigned n, uint64_t *budget)
+{
+	unsigned nranges = (n + PREFETCH_SPLIT - 1) / PREFETCH_SPLIT;
+	uint64_t share = *budget / nranges;
+
+	if (pf->nthreads < 2 || n <= PREFETCH_SPLIT || share == 0)
+		return n;
+	for (unsigned i = PREFETCH_SPLIT; i < n; i += PREFETCH_SPLIT) {
+		unsigned len = n - i < PREFETCH_SPLIT ? n - i : PREFETCH_SPLIT;
+		struct prefetch_item *item = malloc(sizeof(*item));
+
+		if (item != NULL)
+			item->pblks = malloc(len * sizeof(*item->pblks));
+		if (item == NULL || item->pblks == NULL) {
+			/* Keep the blocks which weren't handed over */
+			free(item);
+			memmove(blks + PREFETCH_SPLIT, blks + i, (n - i) * sizeof(*blks));
+			return PREFETCH_SPLIT + (n - i);
+		}
+		memcpy(item->pblks, blks + i, len * sizeof(*item->pblks));
+		item->next = NULL;
+		item->seq = seq;
+		item->blks = NULL;
+		item->n = len;
+		item->max_blocks = share;
+		queue_item(pf, item);
+		*budget -= share;
+		__atomic_fetch_add(&pf->nsplit, 1, __ATOMIC_RELAXED);
+	}
+	return PREFETCH_SPLIT;
+}
+
+/**
+ * Read the dinodes in an item and then, level by level, the indirect blocks
+ * and directory hash table blocks below them. The checking code reads the
+ * same blocks in pass1's metadata walk and in pass2's directory checks.
+ */
+static void prefetch_item(struct prefetcher *pf, struct prefetch_item *item,
+                          char *buf, uint64_t *blks)
+{
+	struct lgfs2_sbd *sdp = pf->sdp;
+	uint64_t limit = item->max_blocks < pf->max_blocks ? item->max_blocks : pf->max_blocks;
+	unsigned max = limit < UINT32_MAX ? limit : UINT32_MAX;
+	struct prefetch_blk *cur, *next;
+	unsigned ncur, nnext = 0;
+	uint64_t total = 0;
+	int level = item->pblks ? 1 : 0;
+
+	cur = calloc(2 * max, sizeof(*cur));
+	if (cur == NULL)
+		return;
+	next = cur + max;
+	ncur = item->n < max ? item->n : max;
+	for (unsigned i = 0; i < ncur; i++) {
+		if (item->pblks)
+			cur[i] = item->pblks[i];
+		else
+			cur[i].blk = item->blks[i];
+	}
+
+	while (ncur > 0 && !is_stale(pf, item->seq)) {
+		for (unsigned i = 0; i < ncur; i += PREFETCH_CHUNK) {
+			unsigned n = ncur - i < PREFETCH_CHUNK ? ncur - i : PREFETCH_CHUNK;
+
+			if (is_stale(pf, item->seq) || total + n > limit)
+				goto out;
+			for (unsigned j = 0; j < n; j++)
+				blks[j] = cur[i + j].blk;
+			if (lgfs2_bcache_prefetch(sdp, blks, n, buf) != 0)
+				continue;
+			total += n;
+			for (unsigned j = 0; j < n; j++) {
+				const char *b = buf + ((size_t)j * sdp->sd_bsize);
+				const struct gfs2_dinode *di = (const void *)b;
+				unsigned depth;
+
+				if (level == 0) {
+					if (lgfs2_check_meta(b, GFS2_METATYPE_DI))
+						continue;
+					depth = be16_to_cpu(di->di_height);
+					if (depth > GFS2_MAX_META_HEIGHT)
+						continue;
+					/* The hash table of a directory is one more level of
+					   pointers, to the leaves, below the indirect blocks.
+					   The data blocks of other files aren't read. */
+					if (S_ISDIR(be32_to_cpu(di->di_mode))) {
+						if (be32_to_cpu(di->di_flags) & GFS2_DIF_EXHASH)
+							nnext = add_ptrs(sdp, b, sizeof(*di), depth,
+							                 next, nnext, max);
+					} else if (depth > 1) {
+						nnext = add_ptrs(sdp, b, sizeof(*di), depth - 2,
+						                 next, nnext, max);
+					}
+					if (di->di_eattr != 0 && be64_to_cpu(di->di_eattr) < sdp->fssize &&
+					    nnext < max) {
+						next[nnext].blk = be64_to_cpu(di->di_eattr);
+						next[nnext++].depth = 0;
+					}
+					continue;
+				}
+				depth = cur[i + j].depth;
+				if (depth == 0 || lgfs2_get_block_type(b) == 0)
+					continue;
+				nnext = add_ptrs(sdp, b, sizeof(struct gfs2_meta_header), depth - 1,
+				                 next, nnext, max);
+			}
+		}
+		/* The next level becomes the current one, in block order. A hash
+		   table points to most leaves several times. */
+		qsort(next, nnext, sizeof(*next), cmp_pblk);
+		nnext = uniq_pblk(next, nnext);
+		if (total < limit) {
+			uint64_t budget = limit - total;
+
+			nnext = split_level(pf, item->seq, next, nnext, &budget);
+			limit = total + budget;
+		}
+		memcpy(cur, next, nnext * sizeof(*next));
+		ncur = nnext;
+		nnext = 0;
+		level++;
+	}
+out:
+	free(cur);
+	pthread_mutex_lock(&pf->lock);
+	pf->nblocks += total;
+	pthread_mutex_unlock(&pf->lock);
+}
+
+static void *prefetch_worker(void *arg)
+{
+	struct prefetcher *pf = arg;
+	char *buf = malloc(PREFETCH_CHUNK * pf->sdp->sd_bsize);
+	uint64_t blks[PREFETCH_CHUNK];
+
+	for (;;) {
+		struct prefetch_item *item;
+		int stale;
+
+		pthread_mutex_lock(&pf->lock);
+		while (!pf->stop && pf->head == NULL)
+			pthread_cond_wait(&pf->cond, &pf->lock);
+		if (pf->stop) {
+			pthread_mutex_unlock(&pf->lock);
+			break;
+		}
+		item = pf->head;
+		pf->head = item->next;
+		if (pf->head == NULL)
+			pf->tail = &pf->head;
+		pf->queued--;
+		stale = (item->seq < __atomic_load_n(&pf->cur_seq, __ATOMIC_RELAXED));
+		if (stale)
+			pf->nstale++;
+		pthread_mutex_unlock(&pf->lock);
+
+		if (!stale && buf != NULL)
+			prefetch_item(pf, item, buf, blks);
+		free(item->blks);
+		free(item->pblks);
+		free(item);
+	}
+	free(buf);
+	return NULL;
+}
+
+/**
+ * prefetch_start - start the prefetch helper threads
+ * @sdp: The superblock, which must have the block cache enabled
+ * @nthreads: The number of threads to start
+ * @max_queued: The most items which may be waiting to be prefetched
+ * @max_blocks: The most blocks to read for each item, to avoid flushing
+ *              blocks from the cache before they are used
+ * Returns the prefetcher or NULL if it could not be started, in which case
+ * fsck should carry on without it.
+ */
+struct prefetcher *prefetch_start(struct lgfs2_sbd *sdp, unsigned nthreads,
+                                  unsigned max_queued, uint64_t max_blocks)
+{
+	struct prefetcher *pf;
+
+	if (sdp->bcache == NULL || nthreads == 0 || max_blocks == 0)
+		return NULL;
+	pf = calloc(1, sizeof(*pf));
+	if (pf == NULL)
+		return NULL;
+	pf->threads = calloc(nthreads, sizeof(*pf->threads));
+	if (pf->threads == NULL) {
+		free(pf);
+		return NULL;
+	}
+	pthread_mutex_init(&pf->lock, NULL);
+	pthread_cond_init(&pf->cond, NULL);
+	pf->sdp = sdp;
+	pf->tail = &pf->head;
+	pf->max_queued = max_queued;
+	pf->max_blocks = max_blocks;
+	for (pf->nthreads = 0; pf->nthreads < nthreads; pf->nthreads++) {
+		int err = pthread_create(&pf->threads[pf->nthreads], NULL, prefetch_worker, pf);
+
+		if (err != 0) {
+			log_debug(_("Unable to start prefetch thread: %s\n"), strerror(err));
+			break;
+		}
+	}
+	if (pf->nthreads == 0) {
+		prefetch_stop(&pf);
+		return NULL;
+	}
+	return pf;
+}
+
+/**
+ * prefetch_dinodes - queue a list of dinodes to be prefetched
+ * @pf: The prefetcher
+ * @seq: A sequence number for the list. The list is dropped if
+ *       prefetch_advance() moves past it before it is prefetched.
+ * @blks: The dinode block addresses, in ascending order. This is freed when
+ *        the list has been handled, unless an error is returned.
+ * @n: The number of addresses in blks
+ * Returns 0 if the list was queued or -1 if the queue is full.
+ */
+int prefetch_dinodes(struct prefetcher *pf, uint64_t seq, uint64_t *blks, unsigned n)
+{
+	struct prefetch_item *item;
+
+	pthread_mutex_lock(&pf->lock);
+	if (pf->queued >= pf->max_queued) {
+		pthread_mutex_unlock(&pf->lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&pf->lock);
+
+	item = malloc(sizeof(*item));
+	if (item == NULL)
+		return -1;
+	item->next = NULL;
+	item->seq = seq;
+	item->blks = blks;
+	item->pblks = NULL;
+	item->n = n;
+	item->max_blocks = pf->max_blocks;
+	queue_item(pf, item);
+	return 0;
+}
+
+/**
+ * prefetch_advance - tell the prefetcher that the checker has reached seq
+ * Queued items with a lower sequence number are no longer worth reading.
+ */
+void prefetch_advance(struct prefetcher *pf, uint64_t seq)
+{
+	__atomic_store_n(&pf->cur_seq, seq, __ATOMIC_RELAXED);
+}
+
+/**
+ * prefetch_stop - stop the helper threads and free the prefetcher
+ */
+void prefetch_stop(struct prefetcher **pfp)
+{
+	struct prefetcher *pf = *pfp;
+	struct prefetch_item *item;
+
+	if (pf == NULL)
+		return;
+	pthread_mutex_lock(&pf->lock);
+	__atomic_store_n(&pf->stop, 1, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&pf->cond);
+	pthread_mutex_unlock(&pf->lock);
+	for (unsigned i = 0; i < pf->nthreads; i++)
+		pthread_join(pf->threads[i], NULL);
+
+	while ((item = pf->head) != NULL) {
+		pf->head = item->next;
+		free(item->blks);
+		free(item->pblks);
+		free(item);
+	}
+	log_debug(_("Prefetched %"PRIu64" blocks using %u threads, %"PRIu64" batches skipped, "
+	            "%"PRIu64" split\n"), pf->nblocks, pf->nthreads, pf->nstale, pf->nsplit);
+	pthread_cond_destroy(&pf->cond);
+	pthread_mutex_destroy(&pf->lock);
+	free(pf->threads);
+	free(pf);
+	*pfp = NULL;
+}
@@ -0,0 +1,20 @@
+#ifndef _PREFETCH_H
+#define _PREFETCH_H
+
+#include "libgfs2.h"
+
+/*
+ * Helper threads which read the metadata of batches of dinodes into the block
+ * cache ahead of the (single threaded) checking code, so that fsck can keep
+ * the storage busy while it checks what has already been read.
+ */
+struct prefetcher;
+
+extern struct prefetcher *prefetch_start(struct lgfs2_sbd *sdp, unsigned nthreads,
+                                         unsigned max_queued, uint64_t max_blocks);
+extern int prefetch_dinodes(struct prefetcher *pf, uint64_t seq, uint64_t *blks, unsigned n);
+extern void prefetch_advance(struct prefetcher *pf, uint64_t seq);
+extern void prefetch_stop(struct prefetcher **pfp);
+extern unsigned prefetch_nthreads(void);
+
+#endif /* _PREFETCH_H */
@@ -7,6 +7,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <libintl.h>
 #define _(String) gettext(String)
 
@@ -25,6 +27,41 @@ static uint64_t nrgrp = 0;
 #define BAD_RG_PERCENT_TOLERANCE 11
 #define AWAY_FROM_BITMAPS 0x1000
 #define MAX_RGSEGMENTS 20
+/* The size of the reads used to look for rgrps and the threads issuing them */
+#define RGSCAN_CHUNK_SIZE (4 << 20)
+#define RGSCAN_THREADS 4
+/* The most that is read at once when searching forward for a rgrp */
+#define RGSCAN_WINDOW_SIZE (256 << 20)
+
+/* A block which looks like a rgrp header or a bitmap block */
+struct rgscan_hit {
+	uint64_t blk;
+	uint32_t type;
+};
+
+/*
+ * The rgrp and bitmap blocks found so far, in block order, and a bitmap of
+ * the chunks of the device which have been scanned to find them. These are
+ * kept between the rindex rebuild attempts as the device doesn't change
+ * until one of them succeeds.
+ */
+static struct rgscan_hit *rgscan_hits;
+static uint64_t rgscan_count;
+static uint64_t rgscan_size;
+static unsigned char *rgscan_done;
+static uint64_t rgscan_chunk_blks;
+
+struct rgscan_ctx {
+	struct lgfs2_sbd *sdp;
+	pthread_mutex_t lock;
+	uint64_t next;    /* The next block to be read */
+	uint64_t end;     /* The block after the last one to be read */
+	uint64_t chunk;   /* Blocks per read */
+	struct rgscan_hit *hits;
+	uint64_t count;
+	uint64_t size;
+	int error;
+};
 
 #define ri_compare(rg, ondisk, expected, field, fmt)	\
 	if (ondisk->field != expected->field) { \
@@ -35,6 +72,327 @@ static uint64_t nrgrp = 0;
 		rindex_modified = 1;					\
 	}
 
+static uint32_t rgscan_meta_type(const char *buf)
+{
+	const struct gfs2_meta_header *mh = (const struct gfs2_meta_header *)buf;
+	uint32_t type = be32_to_cpu(mh->mh_type);
+
+	if (be32_to_cpu(mh->mh_magic) != GFS2_MAGIC)
+		return 0;
+	if (type != GFS2_METATYPE_RG && type != GFS2_METATYPE_RB)
+		return 0;
+	return type;
+}
+
+static int rgscan_read(int fd, char *buf, size_t len, off_t off)
+{
+	while (len > 0) {
+		ssize_t ret = pread(fd, buf, len, off);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf += ret;
+		off += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * Look for rgrp and bitmap headers in n blocks starting at start, adding them
+ * to hits. If the chunk can't be read in one go, the headers are read one
+ * block at a time so that a bad sector only hides the blocks it covers.
+ */
+static unsigned rgscan_chunk(struct lgfs2_sbd *sdp, char *buf, uint64_t start, uint64_t n,
+                             struct rgscan_hit *hits)
+{
+	uint32_t bsize = sdp->sd_bsize;
+	unsigned count = 0;
+
+	if (rgscan_read(sdp->device_fd, buf, n * bsize, start * bsize) != 0) {
+		for (uint64_t i = 0; i < n; i++) {
+			char *b = buf + i * bsize;
+
+			if (rgscan_read(sdp->device_fd, b, sizeof(struct gfs2_meta_header),
+			                (start + i) * bsize) != 0)
+				memset(b, 0, sizeof(struct gfs2_meta_header));
+		}
+	}
+	for (uint64_t i = 0; i < n; i++) {
+		uint32_t type = rgscan_meta_type(buf + i * bsize);
+
+		if (type == 0)
+			continue;
+		hits[count].blk = start + i;
+		hits[count].type = type;
+		count++;
+	}
+	return count;
+}
+
+static int rgscan_add(struct rgscan_ctx *rs, const struct rgscan_hit *hits, unsigned n)
+{
+	if (rs->count + n > rs->size) {
+		uint64_t size = rs->size ? rs->size * 2 : 1024;
+		struct rgscan_hit *h;
+
+		while (size < rs->count + n)
+			size *= 2;
+		h = realloc(rs->hits, size * sizeof(*h));
+		if (h == NULL)
+			return -1;
+		rs->hits = h;
+		rs->size = size;
+	}
+	memcpy(rs->hits + rs->count, hits, n * sizeof(*hits));
+	rs->count += n;
+	return 0;
+}
+
+static void *rgscan_worker(void *arg)
+{
+	struct rgscan_ctx *rs = arg;
+	struct rgscan_hit *hits;
+	char *buf;
+
+	buf = malloc(rs->chunk * rs->sdp->sd_bsize);
+	hits = malloc(rs->chunk * sizeof(*hits));
+	if (buf == NULL || hits == NULL) {
+		pthread_mutex_lock(&rs->lock);
+		rs->error = 1;
+		pthread_mutex_unlock(&rs->lock);
+		goto out;
+	}
+	for (;;) {
+		uint64_t start, n;
+		unsigned count;
+		int error;
+
+		/* Chunks are handed out in order to keep the device reading sequentially */
+		pthread_mutex_lock(&rs->lock);
+		start = rs->next;
+		n = rs->end - start < rs->chunk ? rs->end - start : rs->chunk;
+		rs->next += n;
+		error = rs->error;
+		pthread_mutex_unlock(&rs->lock);
+		if (n == 0 || error)
+			break;
+
+		count = rgscan_chunk(rs->sdp, buf, start, n, hits);
+
+		pthread_mutex_lock(&rs->lock);
+		if (count > 0 && rgscan_add(rs, hits, count) != 0)
+			rs->error = 1;
+		pthread_mutex_unlock(&rs->lock);
+	}
+out:
+	free(hits);
+	free(buf);
+	return NULL;
+}
+
+static int rgscan_cmp(const void *a, const void *b)
+{
+	const struct rgscan_hit *x = a, *y = b;
+
+	if (x->blk < y->blk)
+		return -1;
+	return x->blk > y->blk;
+}
+
+static void rgscan_free(void)
+{
+	free(rgscan_hits);
+	free(rgscan_done);
+	rgscan_hits = NULL;
+	rgscan_done = NULL;
+	rgscan_count = 0;
+	rgscan_size = 0;
+}
+
+/* Returns the index of the first rgrp or bitmap block at or after blk */
+static uint64_t rgscan_find(uint64_t blk)
+{
+	uint64_t lo = 0, hi = rgscan_count;
+
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+
+		if (rgscan_hits[mid].blk < blk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Read the chunks first to last - 1, none of which have been scanned yet,
+ * sharing them out in order between a few threads, and add the blocks with
+ * rgrp or bitmap headers to the ones already found.
+ */
+static int rgscan_chunks(struct lgfs2_sbd *sdp, uint64_t first, uint64_t last)
+{
+	struct rgscan_ctx rs = {
+		.sdp = sdp,
+		.next = first * rgscan_chunk_blks,
+		.end = last * rgscan_chunk_blks,
+		.chunk = rgscan_chunk_blks,
+	};
+	pthread_t threads[RGSCAN_THREADS];
+	unsigned nthreads = 0;
+	uint64_t i;
+
+	if (rs.end > sdp->device.length)
+		rs.end = sdp->device.length;
+	pthread_mutex_init(&rs.lock, NULL);
+	while (nthreads < RGSCAN_THREADS && nthreads < last - first &&
+	       pthread_create(&threads[nthreads], NULL, rgscan_worker, &rs) == 0)
+		nthreads++;
+	if (nthreads == 0)
+		rgscan_worker(&rs);
+	while (nthreads > 0)
+		pthread_join(threads[--nthreads], NULL);
+	pthread_mutex_destroy(&rs.lock);
+
+	if (!rs.error && rgscan_count + rs.count > rgscan_size) {
+		struct rgscan_hit *h;
+		uint64_t size = rgscan_size ? rgscan_size : 1024;
+
+		while (size < rgscan_count + rs.count)
+			size *= 2;
+		h = realloc(rgscan_hits, size * sizeof(*h));
+		if (h == NULL)
+			rs.error = 1;
+		else {
+			rgscan_hits = h;
+			rgscan_size = size;
+		}
+	}
+	if (rs.error) {
+		free(rs.hits);
+		errno = ENOMEM;
+		return -1;
+	}
+	/* Nothing has been found in these chunks yet, so the new blocks all go
+	   in one place among the ones which have */
+	qsort(rs.hits, rs.count, sizeof(*rs.hits), rgscan_cmp);
+	i = rgscan_find(first * rgscan_chunk_blks);
+	memmove(rgscan_hits + i + rs.count, rgscan_hits + i,
+	        (rgscan_count - i) * sizeof(*rgscan_hits));
+	if (rs.count > 0)
+		memcpy(rgscan_hits + i, rs.hits, rs.count * sizeof(*rs.hits));
+	rgscan_count += rs.count;
+	free(rs.hits);
+	for (i = first; i < last; i++)
+		rgscan_done[i / 8] |= 1 << (i % 8);
+	log_debug(_("%"PRIu64" blocks look like resource groups or bitmaps in blocks "
+	            "0x%"PRIx64" to 0x%"PRIx64".\n"), rs.count,
+	          first * rgscan_chunk_blks, rs.end - 1);
+	return 0;
+}
+
+/*
+ * rgscan_range - find the blocks which look like rgrps or bitmaps in a range
+ *
+ * When the rindex can't be trusted, the rgrps have to be found by looking at
+ * the blocks themselves, and the searches below may look through gigabytes
+ * of blocks between rgrps.  Rather than reading those a block at a time, the
+ * device is read in large chunks, and the blocks with rgrp or bitmap headers
+ * are recorded so that the searches can be done in memory.  Only the chunks
+ * covering blk to end - 1 which haven't been read before are read here.
+ */
+static void rgscan_range(struct lgfs2_sbd *sdp, uint64_t blk, uint64_t end)
+{
+	uint64_t c, first;
+
+	if (end > sdp->device.length)
+		end = sdp->device.length;
+	if (blk >= end)
+		return;
+	if (rgscan_done == NULL) {
+		uint64_t nchunks;
+
+		rgscan_chunk_blks = RGSCAN_CHUNK_SIZE / sdp->sd_bsize;
+		nchunks = (sdp->device.length + rgscan_chunk_blks - 1) / rgscan_chunk_blks;
+		rgscan_done = calloc((nchunks + 7) / 8, 1);
+		if (rgscan_done == NULL)
+			goto fail;
+	}
+	c = blk / rgscan_chunk_blks;
+	end = (end + rgscan_chunk_blks - 1) / rgscan_chunk_blks;
+	while (c < end) {
+		if (rgscan_done[c / 8] & (1 << (c % 8))) {
+			c++;
+			continue;
+		}
+		first = c;
+		while (c < end && !(rgscan_done[c / 8] & (1 << (c % 8))))
+			c++;
+		/* The device is read directly, so write back any changed blocks first */
+		if (lgfs2_bcache_flush(sdp) != 0 || rgscan_chunks(sdp, first, c) != 0)
+			goto fail;
+	}
+	return;
+fail:
+	log_crit(_("Unable to scan the device for resource groups: %s\n"), strerror(errno));
+	exit(FSCK_ERROR);
+}
+
+/* Returns GFS2_METATYPE_RG or GFS2_METATYPE_RB if blk has that header, or 0 */
+static uint32_t rgscan_type(struct lgfs2_sbd *sdp, uint64_t blk)
+{
+	uint64_t i;
+
+	rgscan_range(sdp, blk, blk + 1);
+	i = rgscan_find(blk);
+	if (i < rgscan_count && rgscan_hits[i].blk == blk)
+		return rgscan_hits[i].type;
+	return 0;
+}
+
+/*
+ * Returns the index of the first rgrp or bitmap block from blk to end - 1, or
+ * rgscan_count if there isn't one. The range is read in growing steps so that
+ * little more than is needed gets read when the block is near the start.
+ */
+static uint64_t rgscan_next(struct lgfs2_sbd *sdp, uint64_t blk, uint64_t end)
+{
+	uint64_t step = RGSCAN_CHUNK_SIZE / sdp->sd_bsize;
+
+	if (end > sdp->device.length)
+		end = sdp->device.length;
+	while (blk < end) {
+		uint64_t stop = end - blk > step ? blk + step : end;
+		uint64_t i;
+
+		rgscan_range(sdp, blk, stop);
+		i = rgscan_find(blk);
+		if (i < rgscan_count && rgscan_hits[i].blk < stop)
+			return i;
+		blk = stop;
+		if (step < RGSCAN_WINDOW_SIZE / sdp->sd_bsize)
+			step *= 2;
+	}
+	return rgscan_count;
+}
+
+/* Returns the first block from blk to end - 1 with a rgrp header, or UINT64_MAX */
+static uint64_t rgscan_next_rg(struct lgfs2_sbd *sdp, uint64_t blk, uint64_t end)
+{
+	for (;;) {
+		uint64_t i = rgscan_next(sdp, blk, end);
+
+		if (i == rgscan_count)
+			return UINT64_MAX;
+		if (rgscan_hits[i].type == GFS2_METATYPE_RG)
+			return rgscan_hits[i].blk;
+		blk = rgscan_hits[i].blk + 1;
+	}
+}
+
 /*
  * find_journal_entry_rgs - find all RG blocks within all journals
  *
@@ -55,7 +413,6 @@ static void find_journaled_rgs(struct lgfs2_sbd *sdp)
 	unsigned int jblocks;
 	uint64_t b, dblock;
 	struct lgfs2_inode *ip;
-	struct lgfs2_buffer_head *bh;
 	int false_count;
 
 	osi_list_init(&false_rgrps.list);
@@ -73,13 +430,11 @@ static void find_journaled_rgs(struct lgfs2_sbd *sdp)
 			}
 			if (!dblock)
 				break;
-			bh = lgfs2_bread(sdp, dblock);
-			if (!lgfs2_check_meta(bh->b_data, GFS2_METATYPE_RG)) {
+			if (rgscan_type(sdp, dblock) == GFS2_METATYPE_RG) {
 				/* False rgrp found at block dblock */
 				false_count++;
 				special_set(&false_rgrps, dblock);
 			}
-			lgfs2_brelse(bh);
 		}
 		log_debug("\n%d false positives identified.\n", false_count);
 	}
@@ -107,7 +462,6 @@ static int find_shortest_rgdist(struct lgfs2_sbd *sdp, uint64_t *dist_array,
 				int *dist_cnt)
 {
 	uint64_t blk, block_last_rg, shortest_dist_btwn_rgs;
-	struct lgfs2_buffer_head *bh;
 	int rgs_sampled = 0;
 	uint64_t initial_first_rg_dist;
 	int gsegment = 0;
@@ -128,11 +482,8 @@ static int find_shortest_rgdist(struct lgfs2_sbd *sdp, uint64_t *dist_array,
 			is_rgrp = 1;
 		else if (is_false_rg(blk))
 			is_rgrp = 0;
-		else {
-			bh = lgfs2_bread(sdp, blk);
-			is_rgrp = (lgfs2_check_meta(bh->b_data, GFS2_METATYPE_RG) == 0);
-			lgfs2_brelse(bh);
-		}
+		else
+			is_rgrp = (rgscan_type(sdp, blk) == GFS2_METATYPE_RG);
 		if (!is_rgrp) {
 			if (rgs_sampled >= 6) {
 				uint64_t nblk;
@@ -143,14 +494,10 @@ static int find_shortest_rgdist(struct lgfs2_sbd *sdp, uint64_t *dist_array,
 				         blk, block_last_rg);
 				/* check for just a damaged rgrp */
 				nblk = blk + dist_array[gsegment];
-				if (is_false_rg(nblk)) {
+				if (is_false_rg(nblk))
 					is_rgrp = 0;
-				} else {
-					bh = lgfs2_bread(sdp, nblk);
-					is_rgrp = (((lgfs2_check_meta(bh->b_data,
-						GFS2_METATYPE_RG) == 0)));
-					lgfs2_brelse(bh);
-				}
+				else
+					is_rgrp = (rgscan_type(sdp, nblk) == GFS2_METATYPE_RG);
 				if (is_rgrp) {
 					log_info(_("Next rgrp is intact, so "
 						   "this one is damaged.\n"));
@@ -175,6 +522,15 @@ static int find_shortest_rgdist(struct lgfs2_sbd *sdp, uint64_t *dist_array,
 
 				break;
 			}
+			if (rgs_sampled < 6) {
+				/* Nothing else happens until the next block
+				   that looks like an rgrp, so skip to it, or to
+				   where we would give up looking. */
+				uint64_t stop = block_last_rg + (524288 * 2) + 1;
+				uint64_t next = rgscan_next_rg(sdp, blk + 1, stop);
+
+				blk = (next < stop ? next : stop) - 1;
+			}
 			continue;
 		}
 
@@ -265,35 +621,15 @@ static int find_shortest_rgdist(struct lgfs2_sbd *sdp, uint64_t *dist_array,
 static uint64_t count_usedspace(struct lgfs2_sbd *sdp, int first,
 				struct lgfs2_buffer_head *bh)
 {
-	int off, x, y, bytes_to_check;
-	uint32_t rg_used = 0;
-	unsigned int state;
+	uint32_t count[4];
+	int off;
 
-	/* Count up the free blocks in the bitmap */
 	if (first)
 		off = sizeof(struct gfs2_rgrp);
 	else
 		off = sizeof(struct gfs2_meta_header);
-	bytes_to_check = sdp->sd_bsize - off;
-	for (x = 0; x < bytes_to_check; x++) {
-		unsigned char *byte;
-
-		byte = (unsigned char *)&bh->b_data[off + x];
-		if (*byte == 0x55) {
-			rg_used += GFS2_NBBY;
-			continue;
-		}
-		if (*byte == 0x00)
-			continue;
-		for (y = 0; y < GFS2_NBBY; y++) {
-			state = (*byte >> (GFS2_BIT_SIZE * y)) & GFS2_BIT_MASK;
-			if (state == GFS2_BLKST_FREE ||
-			    state == GFS2_BLKST_UNLINKED)
-				continue;
-			rg_used++;
-		}
-	}
-	return rg_used;
+	lgfs2_bitmap_count((unsigned char *)bh->b_data + off, sdp->sd_bsize - off, count);
+	return count[GFS2_BLKST_USED] + count[GFS2_BLKST_DINODE];
 }
 
 /*
@@ -388,22 +724,20 @@ static uint64_t find_next_rgrp_dist(struct lgfs2_sbd *sdp, uint64_t blk,
 		next_block = prevrgd->rt_addr + rgrp_dist;
 		/* Now we account for block rounding done by mkfs.gfs2 */
 		for (b = 0; b <= length + GFS2_NBBY; b++) {
+			uint32_t type;
+
 			if (next_block + b >= sdp->device.length)
 				break;
-			bh = lgfs2_bread(sdp, next_block + b);
-			mh = (struct gfs2_meta_header *)bh->b_data;
-			if (be32_to_cpu(mh->mh_magic) == GFS2_MAGIC) {
-				if (be32_to_cpu(mh->mh_type) == GFS2_METATYPE_RG)
-					found = 1;
-				/* if the first thing we find is a bitmap,
-				   there must be a damaged rgrp on the
-				   previous block. */
-				if (be32_to_cpu(mh->mh_type) == GFS2_METATYPE_RB) {
-					found = 1;
-					rgrp_dist--;
-				}
+			type = rgscan_type(sdp, next_block + b);
+			if (type == GFS2_METATYPE_RG)
+				found = 1;
+			/* if the first thing we find is a bitmap,
+			   there must be a damaged rgrp on the
+			   previous block. */
+			if (type == GFS2_METATYPE_RB) {
+				found = 1;
+				rgrp_dist--;
 			}
-			lgfs2_brelse(bh);
 			if (found)
 				break;
 			rgrp_dist++;
@@ -426,26 +760,19 @@ static uint64_t find_next_rgrp_dist(struct lgfs2_sbd *sdp, uint64_t blk,
 static uint64_t hunt_and_peck(struct lgfs2_sbd *sdp, uint64_t blk,
 			      struct lgfs2_rgrp_tree *prevrgd, uint64_t last_bump)
 {
-	uint64_t rgrp_dist = 0, block, twogigs, last_block, last_meg;
-	struct lgfs2_buffer_head *bh;
-	struct gfs2_meta_header *mh;
-	int b, mega_in_blocks;
+	uint64_t rgrp_dist = 0, block, twogigs, last_block, last_meg, end, i;
+	int mega_in_blocks;
 
 	/* Skip ahead the previous amount: we might get lucky.
 	   If we're close to the end of the device, take the rest. */
 	if (lgfs2_check_range(sdp, blk + last_bump))
 		return sdp->fssize - blk;
 
-	bh = lgfs2_bread(sdp, blk + last_bump);
-	mh = (struct gfs2_meta_header *)bh->b_data;
-	if (be32_to_cpu(mh->mh_magic) == GFS2_MAGIC &&
-	    be32_to_cpu(mh->mh_type) == GFS2_METATYPE_RG) {
+	if (rgscan_type(sdp, blk + last_bump) == GFS2_METATYPE_RG) {
 		log_info(_("rgrp found at 0x%"PRIx64", length=%"PRIu64"\n"),
 		         blk + last_bump, last_bump);
-		lgfs2_brelse(bh);
 		return last_bump;
 	}
-	lgfs2_brelse(bh);
 
 	rgrp_dist = AWAY_FROM_BITMAPS; /* Get away from any bitmaps
 					  associated with the previous rgrp */
@@ -463,25 +790,20 @@ static uint64_t hunt_and_peck(struct lgfs2_sbd *sdp, uint64_t blk,
 		last_block = sdp->fssize - block - mega_in_blocks;
 		last_meg = mega_in_blocks;
 	}
-	for (b = AWAY_FROM_BITMAPS; b < last_block; b++) {
-		uint32_t magic, type;
-
-		bh = lgfs2_bread(sdp, block + b);
-		mh = (struct gfs2_meta_header *)bh->b_data;
-		magic = be32_to_cpu(mh->mh_magic);
-		type = be32_to_cpu(mh->mh_type);
-		lgfs2_brelse(bh);
-		if (magic == GFS2_MAGIC) {
-			if (type == GFS2_METATYPE_RG)
-				break;
-			/* if the first thing we find is a bitmap, there must
-			   be a damaged rgrp on the previous block. */
-			if (type == GFS2_METATYPE_RB) {
-				rgrp_dist--;
-				break;
-			}
-		}
-		rgrp_dist++;
+	if (last_block > AWAY_FROM_BITMAPS)
+		rgrp_dist = last_block;
+	/* The first rgrp or bitmap block in the range gives the distance */
+	if (block < sdp->device.length && last_block < sdp->device.length - block)
+		end = block + last_block;
+	else
+		end = sdp->device.length;
+	i = rgscan_next(sdp, block + AWAY_FROM_BITMAPS, end);
+	if (i < rgscan_count) {
+		rgrp_dist = rgscan_hits[i].blk - block;
+		/* if the first thing we find is a bitmap, there must
+		   be a damaged rgrp on the previous block. */
+		if (rgscan_hits[i].type == GFS2_METATYPE_RB)
+			rgrp_dist--;
 	}
 	return rgrp_dist + last_meg;
 }
@@ -518,7 +840,6 @@ static int rindex_rebuild(struct fsck_cx *cx, int *num_rgs, int gfs_grow)
 {
 	struct lgfs2_sbd *sdp = cx->sdp;
 	struct osi_node *n, *next = NULL;
-	struct lgfs2_buffer_head *bh;
 	uint64_t rg_dist[MAX_RGSEGMENTS] = {0, };
 	int rg_dcnt[MAX_RGSEGMENTS] = {0, };
 	uint64_t blk;
@@ -558,9 +879,7 @@ static int rindex_rebuild(struct fsck_cx *cx, int *num_rgs, int gfs_grow)
 	blk = LGFS2_SB_ADDR(sdp) + 1;
 	while (blk <= sdp->device.length) {
 		log_debug( _("Block 0x%"PRIx64"\n"), blk);
-		bh = lgfs2_bread(sdp, blk);
-		rg_was_fnd = (!lgfs2_check_meta(bh->b_data, GFS2_METATYPE_RG));
-		lgfs2_brelse(bh);
+		rg_was_fnd = (rgscan_type(sdp, blk) == GFS2_METATYPE_RG);
 		/* Allocate a new RG and index. */
 		calc_rgd = lgfs2_rgrp_insert(&rgcalc, blk);
 		if (!calc_rgd) {
@@ -588,9 +907,8 @@ static int rindex_rebuild(struct fsck_cx *cx, int *num_rgs, int gfs_grow)
 		/* ------------------------------------------------ */
 		for (fwd_block = blk + 1; fwd_block < sdp->device.length; fwd_block++) {
 			int bitmap_was_fnd;
-			bh = lgfs2_bread(sdp, fwd_block);
-			bitmap_was_fnd = !lgfs2_check_meta(bh->b_data, GFS2_METATYPE_RB);
-			lgfs2_brelse(bh);
+
+			bitmap_was_fnd = (rgscan_type(sdp, fwd_block) == GFS2_METATYPE_RB);
 			if (bitmap_was_fnd) /* if a bitmap */
 				calc_rgd->rt_length++;
 			else
@@ -1103,6 +1421,9 @@ int rindex_repair(struct fsck_cx *cx, int trust_lvl, int *ok)
 	/* Our rindex should be pretty predictable unless we've grown    */
 	/* so look for index problems first before looking at the rgs.   */
 	/* ------------------------------------------------------------- */
+	/* The rgrps found by scanning the device are about to be changed */
+	rgscan_free();
+	lgfs2_rgrp_index_free(sdp); /* Entries may be added or moved */
 	for (rg = 0, n = osi_first(&sdp->rgtree), e = osi_first(&rgcalc);
 	     e && !fsck_abort && rg < calc_rg_count; rg++) {
 		struct lgfs2_rgrp_tree *expected, *actual;
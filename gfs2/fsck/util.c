@@ -426,6 +426,10 @@ struct dir_info *dirtree_insert(struct fsck_cx *cx, struct lgfs2_inum inum)
 	struct osi_node **newn = &cx->dirtree.osi_node, *parent = NULL;
 	struct dir_info *data;
 
+	data = dirtree_find(cx, inum.in_addr);
+	if (data)
+		return data;
+
 	/* Figure out where to put new node */
 	while (*newn) {
 		struct dir_info *cur = (struct dir_info *)*newn;
@@ -433,15 +437,15 @@ struct dir_info *dirtree_insert(struct fsck_cx *cx, struct lgfs2_inum inum)
 		parent = *newn;
 		if (inum.in_addr < cur->dinode.in_addr)
 			newn = &((*newn)->osi_left);
-		else if (inum.in_addr > cur->dinode.in_addr)
-			newn = &((*newn)->osi_right);
 		else
-			return cur;
+			newn = &((*newn)->osi_right);
 	}
 
-	data = calloc(1, sizeof(struct dir_info));
-	if (!data) {
+	data = node_arena_alloc(&cx->dir_arena, sizeof(struct dir_info));
+	if (!data || blkhash_insert(&cx->dirindex, inum.in_addr, data)) {
 		log_crit( _("Unable to allocate dir_info structure\n"));
+		if (data)
+			node_arena_release(&cx->dir_arena, data);
 		return NULL;
 	}
 	/* Add new node and rebalance tree. */
@@ -455,19 +459,7 @@ struct dir_info *dirtree_insert(struct fsck_cx *cx, struct lgfs2_inum inum)
 
 struct dir_info *dirtree_find(struct fsck_cx *cx, uint64_t block)
 {
-	struct osi_node *node = cx->dirtree.osi_node;
-
-	while (node) {
-		struct dir_info *data = (struct dir_info *)node;
-
-		if (block < data->dinode.in_addr)
-			node = node->osi_left;
-		else if (block > data->dinode.in_addr)
-			node = node->osi_right;
-		else
-			return data;
-	}
-	return NULL;
+	return blkhash_find(&cx->dirindex, block);
 }
 
 /* get_ref_type - figure out if all duplicate references from this inode
@@ -529,7 +521,8 @@ void dup_delete(struct fsck_cx *cx, struct duptree *dt)
 void dirtree_delete(struct fsck_cx *cx, struct dir_info *b)
 {
 	osi_erase(&b->node, &cx->dirtree);
-	free(b);
+	blkhash_remove(&cx->dirindex, b->dinode.in_addr);
+	node_arena_release(&cx->dir_arena, b);
 }
 
 uint64_t find_free_blk(struct lgfs2_sbd *sdp)
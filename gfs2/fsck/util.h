@@ -32,38 +32,55 @@ struct fsck_pass {
 	int (*f)(struct fsck_cx *cx);
 };
 
-static inline int block_type(struct bmap *bl, uint64_t bblock)
+/*
+ * The blockmaps may be read and updated by more than one thread at a time.
+ * Each byte holds the state of several blocks so every access to it is atomic
+ * and updates use compare-and-swap so that they do not lose a concurrent
+ * update to a neighbouring block.
+ */
+static inline unsigned char bmap_byte(struct bmap *bl, uint64_t off)
 {
-	static unsigned char *byte;
-	static uint64_t b;
-	static int btype;
-
-	byte = bl->map + BLOCKMAP_SIZE2(bblock);
-	b = BLOCKMAP_BYTE_OFFSET2(bblock);
-	btype = (*byte & (BLOCKMAP_MASK2 << b )) >> b;
-	return btype;
+	unsigned char *chunk;
+
+	if (bl->map != NULL)
+		return __atomic_load_n(bl->map + off, __ATOMIC_RELAXED);
+	chunk = __atomic_load_n(&bl->chunks[off >> BMAP_CHUNK_SHIFT], __ATOMIC_ACQUIRE);
+	if (chunk == NULL)
+		return bl->fill[off >> BMAP_CHUNK_SHIFT];
+	return __atomic_load_n(chunk + (off & (BMAP_CHUNK_SIZE - 1)), __ATOMIC_RELAXED);
 }
 
-static inline int link1_type(struct bmap *bl, uint64_t bblock)
+static inline int block_type(struct bmap *bl, uint64_t bblock)
 {
-	static unsigned char *byte;
-	static uint64_t b;
-	static int btype;
-
-	byte = bl->map + BLOCKMAP_SIZE1(bblock);
-	b = BLOCKMAP_BYTE_OFFSET1(bblock);
-	btype = (*byte & (BLOCKMAP_MASK1 << b )) >> b;
-	return btype;
+	unsigned char byte = bmap_byte(bl, BLOCKMAP_SIZE2(bblock));
+	uint64_t b = BLOCKMAP_BYTE_OFFSET2(bblock);
+
+	return (byte >> b) & BLOCKMAP_MASK2;
 }
 
-static inline void link1_destroy(struct bmap *bmap)
+static inline int link1_type(struct bmap *bl, uint64_t bblock)
 {
-	if (bmap->map)
-		free(bmap->map);
-	bmap->size = 0;
-	bmap->mapsize = 0;
+	unsigned char byte = bmap_byte(bl, BLOCKMAP_SIZE1(bblock));
+	uint64_t b = BLOCKMAP_BYTE_OFFSET1(bblock);
+
+	return (byte >> b) & BLOCKMAP_MASK1;
 }
 
+extern uint64_t bmap_mem_budget(void);
+extern struct bmap *bmap_create(uint64_t size, uint64_t budget, uint64_t *addl_mem_needed);
+extern void bmap_destroy(struct bmap *il);
+extern int link1_create(struct bmap *bmap, uint64_t size, uint64_t budget);
+extern void link1_destroy(struct bmap *bmap);
+extern unsigned char *bmap_byte_ptr(struct bmap *bmap, uint64_t off);
+extern void bmap_compact(struct bmap *bmap, int force);
+extern int blockmap_set(struct bmap *bmap, uint64_t bblock, int mark);
+extern int blockmap_cmpxchg(struct bmap *bmap, uint64_t bblock, int old, int mark);
+extern void blockmap_states(struct bmap *bmap, uint64_t bblock, unsigned len, unsigned char *out);
+
+extern void owner_index_init(struct owner_index *oi, uint64_t budget);
+extern int owner_index_add(struct owner_index *oi, uint64_t block, uint64_t owner);
+extern void owner_index_free(struct owner_index *oi);
+
 static inline int bitmap_type(struct lgfs2_sbd *sdp, uint64_t bblock)
 {
 	struct lgfs2_rgrp_tree *rgd;
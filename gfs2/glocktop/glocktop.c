@@ -658,6 +658,7 @@ static const char *show_inode(const char *id, int fd, uint64_t block)
 	} else
 		inode_type = "file? ";
 	lgfs2_inode_put(&ip);
+	lgfs2_bpool_drain(&sbd);
 	return inode_type;
 }
 
@@ -10,6 +10,10 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 #include "libgfs2.h"
 
@@ -21,45 +25,1108 @@
   #endif
 #endif
 
+/**
+ * Take a buffer head from the superblock's pool, or allocate a new one if the
+ * pool is empty. The contents of the buffer are undefined.
+ */
+static struct lgfs2_buffer_head *bh_alloc(struct lgfs2_sbd *sdp, uint64_t num)
+{
+	struct lgfs2_bpool *bp = &sdp->bpool;
+	struct lgfs2_buffer_head *bh;
+
+	if (bp->bp_free != NULL && bp->bp_bsize == sdp->sd_bsize) {
+		bh = bp->bp_free;
+		bp->bp_free = bh->b_next_free;
+		bp->bp_count--;
+		bp->bp_hits++;
+	} else {
+		bh = malloc(sizeof(struct lgfs2_buffer_head) + sdp->sd_bsize);
+		if (bh == NULL)
+			return NULL;
+		bh->b_size = sdp->sd_bsize;
+		bp->bp_misses++;
+	}
+	bh->b_altlist.next = NULL;
+	bh->b_altlist.prev = NULL;
+	bh->b_blocknr = num;
+	bh->sdp = sdp;
+	bh->b_data = (char *)bh + sizeof(struct lgfs2_buffer_head);
+	bh->b_next_free = NULL;
+	bh->b_modified = 0;
+	return bh;
+}
+
+/**
+ * Return a buffer head to its superblock's pool, or free it if the pool is
+ * full or the block size has changed since it was allocated.
+ */
+static void bh_recycle(struct lgfs2_buffer_head *bh)
+{
+	struct lgfs2_sbd *sdp = bh->sdp;
+	struct lgfs2_bpool *bp = &sdp->bpool;
+	unsigned max = bp->bp_max ? bp->bp_max : LGFS2_BPOOL_DEFAULT_MAX;
+
+	if (bh->b_size != sdp->sd_bsize) {
+		free(bh);
+		return;
+	}
+	if (bp->bp_bsize != sdp->sd_bsize) {
+		lgfs2_bpool_drain(sdp);
+		bp->bp_bsize = sdp->sd_bsize;
+	}
+	if (bp->bp_count >= max) {
+		free(bh);
+		return;
+	}
+	bh->b_next_free = bp->bp_free;
+	bp->bp_free = bh;
+	bp->bp_count++;
+}
+
+/**
+ * Free the idle buffers held in a superblock's buffer pool. The hit and miss
+ * counters are left intact.
+ */
+void lgfs2_bpool_drain(struct lgfs2_sbd *sdp)
+{
+	struct lgfs2_bpool *bp = &sdp->bpool;
+
+	while (bp->bp_free != NULL) {
+		struct lgfs2_buffer_head *bh = bp->bp_free;
+
+		bp->bp_free = bh->b_next_free;
+		free(bh);
+	}
+	bp->bp_count = 0;
+}
+
+struct bcache_entry {
+	osi_list_t ce_lru;   /* LRU list, most recently used first */
+	osi_list_t ce_dirty; /* Dirty list, empty if the block is clean */
+	struct bcache_entry *ce_hnext; /* Hash chain */
+	uint64_t ce_blk;
+	char ce_data[];
+};
+
+/*
+ * The cache is protected by bc_lock so that lgfs2_bcache_prefetch() can be
+ * called from helper threads. Everything else is expected to be called from
+ * one thread at a time.
+ */
+struct lgfs2_bcache {
+	pthread_mutex_t bc_lock;
+	struct bcache_entry **bc_hash;
+	uint64_t bc_hmask;
+	osi_list_t bc_lru;
+	osi_list_t bc_dirty;
+	uint32_t bc_bsize;
+	unsigned bc_count;     /* Blocks in the cache */
+	unsigned bc_max;       /* Capacity of the cache in blocks */
+	unsigned bc_ndirty;    /* Dirty blocks in the cache */
+	unsigned bc_dirty_max; /* Start write-back at this many dirty blocks */
+	struct bcache_entry **bc_batch; /* Scratch space for sorting write-back */
+	uint64_t bc_wgen;      /* Bumped whenever blocks are written to the device */
+	struct lgfs2_bcache_stats bc_stats;
+};
+
+static inline struct bcache_entry **bcache_bucket(struct lgfs2_bcache *bc, uint64_t blk)
+{
+	return &bc->bc_hash[(blk * 0x9E3779B97F4A7C15ULL >> 32) & bc->bc_hmask];
+}
+
+static struct bcache_entry *bcache_find(struct lgfs2_bcache *bc, uint64_t blk)
+{
+	struct bcache_entry *ce;
+
+	for (ce = *bcache_bucket(bc, blk); ce != NULL; ce = ce->ce_hnext)
+		if (ce->ce_blk == blk)
+			return ce;
+	return NULL;
+}
+
+static void bcache_unhash(struct lgfs2_bcache *bc, struct bcache_entry *ce)
+{
+	struct bcache_entry **cep = bcache_bucket(bc, ce->ce_blk);
+
+	while (*cep != ce)
+		cep = &(*cep)->ce_hnext;
+	*cep = ce->ce_hnext;
+}
+
+/**
+ * Is the cache usable for this superblock? The cache is bypassed if the block
+ * size has changed since it was set up.
+ */
+static inline struct lgfs2_bcache *bcache_get(const struct lgfs2_sbd *sdp)
+{
+	struct lgfs2_bcache *bc = sdp->bcache;
+
+	if (bc == NULL || bc->bc_bsize != sdp->sd_bsize)
+		return NULL;
+	return bc;
+}
+
+static int ce_cmp(const void *a, const void *b)
+{
+	const struct bcache_entry *ce_a = *(struct bcache_entry * const *)a;
+	const struct bcache_entry *ce_b = *(struct bcache_entry * const *)b;
+
+	if (ce_a->ce_blk < ce_b->ce_blk)
+		return -1;
+	if (ce_a->ce_blk > ce_b->ce_blk)
+		return 1;
+	return 0;
+}
+
+/**
+ * Write back all of the dirty blocks in the cache. The blocks are sorted and
+ * runs of contiguous blocks are written with one pwritev() call each.
+ * Returns 0 on success or -1 on error with errno set. Blocks which could not
+ * be written remain dirty.
+ */
+static int bcache_writeback(struct lgfs2_bcache *bc, int fd)
+{
+	struct iovec iov[IOV_MAX];
+	osi_list_t *tmp;
+	unsigned n = 0;
+	unsigned i, j;
+
+	if (bc->bc_ndirty == 0)
+		return 0;
+
+	osi_list_foreach(tmp, &bc->bc_dirty)
+		bc->bc_batch[n++] = osi_list_entry(tmp, struct bcache_entry, ce_dirty);
+	qsort(bc->bc_batch, n, sizeof(*bc->bc_batch), ce_cmp);
+
+	for (i = 0; i < n; i = j) {
+		uint64_t start = bc->bc_batch[i]->ce_blk;
+		size_t len = 0;
+		ssize_t ret;
+
+		for (j = i; j < n && j - i < IOV_MAX &&
+		     bc->bc_batch[j]->ce_blk == start + (j - i); j++) {
+			iov[j - i].iov_base = bc->bc_batch[j]->ce_data;
+			iov[j - i].iov_len = bc->bc_bsize;
+			len += bc->bc_bsize;
+		}
+		ret = pwritev(fd, iov, j - i, start * bc->bc_bsize);
+		if (ret != len) {
+			if (ret >= 0)
+				errno = EIO;
+			return -1;
+		}
+		bc->bc_wgen++;
+		bc->bc_stats.bs_batches++;
+		bc->bc_stats.bs_writes += j - i;
+		for (; i < j; i++) {
+			osi_list_del_init(&bc->bc_batch[i]->ce_dirty);
+			bc->bc_ndirty--;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Look up a block in the cache, adding an entry for it if it isn't present.
+ * The least recently used block is recycled if the cache is full. The caller
+ * must fill in the data of a new entry.
+ * Returns the entry or NULL on error, with *found set to 1 if the block was
+ * already cached.
+ */
+static struct bcache_entry *bcache_lookup(struct lgfs2_bcache *bc, int fd, uint64_t blk, int *found)
+{
+	struct bcache_entry *ce = bcache_find(bc, blk);
+	struct bcache_entry **bucket;
+
+	*found = (ce != NULL);
+	if (ce != NULL) {
+		osi_list_del(&ce->ce_lru);
+		osi_list_add(&ce->ce_lru, &bc->bc_lru);
+		return ce;
+	}
+	if (bc->bc_count < bc->bc_max) {
+		ce = malloc(sizeof(*ce) + bc->bc_bsize);
+		if (ce != NULL) {
+			osi_list_init(&ce->ce_dirty);
+			bc->bc_count++;
+		}
+	}
+	if (ce == NULL) {
+		if (osi_list_empty(&bc->bc_lru))
+			return NULL;
+		ce = osi_list_entry(bc->bc_lru.prev, struct bcache_entry, ce_lru);
+		if (!osi_list_empty(&ce->ce_dirty) && bcache_writeback(bc, fd) != 0)
+			return NULL;
+		osi_list_del(&ce->ce_lru);
+		bcache_unhash(bc, ce);
+		bc->bc_stats.bs_evictions++;
+	}
+	ce->ce_blk = blk;
+	bucket = bcache_bucket(bc, blk);
+	ce->ce_hnext = *bucket;
+	*bucket = ce;
+	osi_list_add(&ce->ce_lru, &bc->bc_lru);
+	return ce;
+}
+
+static void bcache_drop(struct lgfs2_bcache *bc, struct bcache_entry *ce)
+{
+	bcache_unhash(bc, ce);
+	osi_list_del(&ce->ce_lru);
+	if (!osi_list_empty(&ce->ce_dirty)) {
+		osi_list_del(&ce->ce_dirty);
+		bc->bc_ndirty--;
+	}
+	bc->bc_count--;
+	free(ce);
+}
+
+/**
+ * Copy a block out of the cache if it is present. *gen is set to the write
+ * generation to pass to bcache_fill() if the block has to be read instead.
+ * Returns 1 if the block was cached or 0 otherwise.
+ */
+static int bcache_fetch(struct lgfs2_bcache *bc, uint64_t blk, char *buf, uint64_t *gen)
+{
+	struct bcache_entry *ce;
+
+	if (bc == NULL)
+		return 0;
+	pthread_mutex_lock(&bc->bc_lock);
+	ce = bcache_find(bc, blk);
+	if (ce != NULL) {
+		osi_list_del(&ce->ce_lru);
+		osi_list_add(&ce->ce_lru, &bc->bc_lru);
+		memcpy(buf, ce->ce_data, bc->bc_bsize);
+		bc->bc_stats.bs_hits++;
+	}
+	*gen = bc->bc_wgen;
+	pthread_mutex_unlock(&bc->bc_lock);
+	return ce != NULL;
+}
+
+static int bcache_contains(struct lgfs2_bcache *bc, uint64_t blk)
+{
+	int ret;
+
+	pthread_mutex_lock(&bc->bc_lock);
+	ret = (bcache_find(bc, blk) != NULL);
+	pthread_mutex_unlock(&bc->bc_lock);
+	return ret;
+}
+
+/**
+ * Add a block which has been read from the device to the cache. If another
+ * copy was cached while the block was being read, that copy is returned in
+ * buf instead as it may be newer. The block is not cached if anything was
+ * written to the device since gen was sampled, as the read may be stale.
+ * Returns 1 if the data in buf may be stale or 0 otherwise.
+ */
+static int bcache_fill(struct lgfs2_bcache *bc, int fd, uint64_t blk, char *buf, uint64_t gen)
+{
+	struct bcache_entry *ce;
+	int stale = 0;
+	int found;
+
+	if (bc == NULL)
+		return 0;
+	pthread_mutex_lock(&bc->bc_lock);
+	ce = bcache_find(bc, blk);
+	if (ce != NULL) {
+		memcpy(buf, ce->ce_data, bc->bc_bsize);
+	} else {
+		bc->bc_stats.bs_misses++;
+		if (gen == bc->bc_wgen) {
+			ce = bcache_lookup(bc, fd, blk, &found);
+			if (ce != NULL)
+				memcpy(ce->ce_data, buf, bc->bc_bsize);
+		} else {
+			stale = 1;
+		}
+	}
+	pthread_mutex_unlock(&bc->bc_lock);
+	return stale;
+}
+
+/**
+ * Enable a write-back block cache for lgfs2_bread() and lgfs2_bwrite().
+ * Blocks written with lgfs2_bwrite() are kept dirty in memory and written
+ * back in sorted batches when the cache needs space or when
+ * lgfs2_bcache_flush() is called. The cache must be set up after the block
+ * size is known and is bypassed if sd_bsize changes afterwards.
+ * @sdp: The superblock
+ * @budget: The maximum amount of memory to use for cached blocks, in bytes
+ * Returns 0 on success or -1 on error with errno set.
+ */
+int lgfs2_bcache_init(struct lgfs2_sbd *sdp, uint64_t budget)
+{
+	struct lgfs2_bcache *bc;
+	uint64_t max = budget / (sizeof(struct bcache_entry) + sdp->sd_bsize);
+	uint64_t hsize = 1;
+
+	errno = EINVAL;
+	if (sdp->bcache != NULL || sdp->sd_bsize == 0)
+		return -1;
+	if (max < LGFS2_BCACHE_MIN_BLOCKS)
+		max = LGFS2_BCACHE_MIN_BLOCKS;
+	if (max > UINT32_MAX)
+		max = UINT32_MAX;
+	while (hsize < max)
+		hsize <<= 1;
+
+	bc = calloc(1, sizeof(*bc));
+	if (bc == NULL)
+		return -1;
+	bc->bc_hash = calloc(hsize, sizeof(*bc->bc_hash));
+	bc->bc_batch = calloc(max, sizeof(*bc->bc_batch));
+	if (bc->bc_hash == NULL || bc->bc_batch == NULL) {
+		free(bc->bc_hash);
+		free(bc->bc_batch);
+		free(bc);
+		return -1;
+	}
+	pthread_mutex_init(&bc->bc_lock, NULL);
+	bc->bc_hmask = hsize - 1;
+	osi_list_init(&bc->bc_lru);
+	osi_list_init(&bc->bc_dirty);
+	bc->bc_bsize = sdp->sd_bsize;
+	bc->bc_max = max;
+	bc->bc_dirty_max = max / 4;
+	sdp->bcache = bc;
+	return 0;
+}
+
+/**
+ * Write back all dirty blocks held in the block cache.
+ * Returns 0 on success or -1 on error with errno set.
+ */
+int lgfs2_bcache_flush(struct lgfs2_sbd *sdp)
+{
+	struct lgfs2_bcache *bc = sdp->bcache;
+	int ret;
+
+	if (bc == NULL)
+		return 0;
+	pthread_mutex_lock(&bc->bc_lock);
+	ret = bcache_writeback(bc, sdp->device_fd);
+	pthread_mutex_unlock(&bc->bc_lock);
+	return ret;
+}
+
+/**
+ * Write back and forget any cached copies of a range of blocks. This must be
+ * called before the range is read or written without using the buffer
+ * functions, to keep the cache coherent with the device.
+ * @sdp: The superblock
+ * @blk: The first block of the range
+ * @len: The number of blocks in the range
+ * Returns 0 on success or -1 on error with errno set.
+ */
+int lgfs2_bcache_sync(struct lgfs2_sbd *sdp, uint64_t blk, uint64_t len)
+{
+	struct lgfs2_bcache *bc = sdp->bcache;
+	osi_list_t *tmp, *x;
+	int ret = 0;
+
+	if (bc == NULL)
+		return 0;
+	pthread_mutex_lock(&bc->bc_lock);
+	/* Stop in-flight prefetches of the range from being cached */
+	bc->bc_wgen++;
+	if (bc->bc_count == 0)
+		goto out;
+	if (bc->bc_ndirty > 0 && bcache_writeback(bc, sdp->device_fd) != 0) {
+		ret = -1;
+		goto out;
+	}
+	if (len < bc->bc_count) {
+		for (uint64_t b = blk; b < blk + len; b++) {
+			struct bcache_entry *ce = bcache_find(bc, b);
+
+			if (ce != NULL)
+				bcache_drop(bc, ce);
+		}
+		goto out;
+	}
+	osi_list_foreach_safe(tmp, &bc->bc_lru, x) {
+		struct bcache_entry *ce = osi_list_entry(tmp, struct bcache_entry, ce_lru);
+
+		if (ce->ce_blk >= blk && ce->ce_blk - blk < len)
+			bcache_drop(bc, ce);
+	}
+out:
+	pthread_mutex_unlock(&bc->bc_lock);
+	return ret;
+}
+
+/**
+ * Write back the dirty blocks in the block cache and free it.
+ * Returns 0 on success or -1 if write-back failed, with errno set. The cache
+ * is freed in either case.
+ */
+int lgfs2_bcache_free(struct lgfs2_sbd *sdp)
+{
+	struct lgfs2_bcache *bc = sdp->bcache;
+	osi_list_t *tmp, *x;
+	int err;
+
+	if (bc == NULL)
+		return 0;
+	err = bcache_writeback(bc, sdp->device_fd);
+	osi_list_foreach_safe(tmp, &bc->bc_lru, x)
+		free(osi_list_entry(tmp, struct bcache_entry, ce_lru));
+	pthread_mutex_destroy(&bc->bc_lock);
+	free(bc->bc_hash);
+	free(bc->bc_batch);
+	free(bc);
+	sdp->bcache = NULL;
+	return err;
+}
+
+/**
+ * Fetch the block cache counters. They are all zero if the cache is not in use.
+ */
+void lgfs2_bcache_stats(const struct lgfs2_sbd *sdp, struct lgfs2_bcache_stats *stats)
+{
+	struct lgfs2_bcache *bc = sdp->bcache;
+
+	if (bc == NULL) {
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+	pthread_mutex_lock(&bc->bc_lock);
+	*stats = bc->bc_stats;
+	pthread_mutex_unlock(&bc->bc_lock);
+}
+
 struct lgfs2_buffer_head *lgfs2_bget(struct lgfs2_sbd *sdp, uint64_t num)
 {
 	struct lgfs2_buffer_head *bh;
 
-	bh = calloc(1, sizeof(struct lgfs2_buffer_head) + sdp->sd_bsize);
+	bh = bh_alloc(sdp, num);
 	if (bh == NULL)
 		return NULL;
 
-	bh->b_blocknr = num;
-	bh->sdp = sdp;
-	bh->b_data = (char *)bh + sizeof(struct lgfs2_buffer_head);
+	memset(bh->b_data, 0, sdp->sd_bsize);
 	return bh;
 }
 
 struct lgfs2_buffer_head *__lgfs2_bread(struct lgfs2_sbd *sdp, uint64_t num, int line,
 				 const char *caller)
 {
+	struct lgfs2_bcache *bc = bcache_get(sdp);
 	struct lgfs2_buffer_head *bh;
+	uint64_t gen = 0;
 	ssize_t ret;
 
-	bh = lgfs2_bget(sdp, num);
+	/* No need to zero the buffer as it's about to be filled */
+	bh = bh_alloc(sdp, num);
 	if (bh == NULL)
 		return NULL;
 
+	if (bcache_fetch(bc, num, bh->b_data, &gen))
+		return bh;
 	ret = pread(sdp->device_fd, bh->b_data, sdp->sd_bsize, num * sdp->sd_bsize);
 	if (ret != sdp->sd_bsize) {
 		fprintf(stderr, "%s:%d: Error reading block %"PRIu64": %s\n",
 		                caller, line, num, strerror(errno));
-		free(bh);
-		bh = NULL;
+		bh_recycle(bh);
+		return NULL;
 	}
+	bcache_fill(bc, sdp->device_fd, num, bh->b_data, gen);
 	return bh;
 }
 
+static inline uint64_t blk_at(const uint64_t *blks, uint64_t start, unsigned i)
+{
+	return blks != NULL ? blks[i] : start + i;
+}
+
+static inline char *blk_data(struct lgfs2_buffer_head **bhs, char *buf, uint32_t bsize, unsigned i)
+{
+	return bhs != NULL ? bhs[i]->b_data : buf + ((size_t)i * bsize);
+}
+
+/**
+ * Read n blocks, either listed in blks or, if blks is NULL, starting at start.
+ * The blocks are read into the buffer heads in bhs, or into buf if bhs is
+ * NULL. Runs of contiguous blocks which are not in the block cache are read
+ * with one preadv() call each.
+ */
+static int read_blocks(struct lgfs2_sbd *sdp, const uint64_t *blks, uint64_t start,
+                       unsigned n, struct lgfs2_buffer_head **bhs, char *buf)
+{
+	struct lgfs2_bcache *bc = bcache_get(sdp);
+	uint32_t bsize = sdp->sd_bsize;
+	struct iovec iov[IOV_MAX];
+	unsigned i, j;
+
+	for (i = 0; i < n; i = j) {
+		uint64_t first = blk_at(blks, start, i);
+		uint64_t gen = 0;
+		size_t len = 0;
+		ssize_t ret;
+
+		j = i + 1;
+		if (bcache_fetch(bc, first, blk_data(bhs, buf, bsize, i), &gen))
+			continue;
+		/* Duplicates are adjacent and the first copy has been read already */
+		if (i > 0 && first == blk_at(blks, start, i - 1)) {
+			memcpy(blk_data(bhs, buf, bsize, i), blk_data(bhs, buf, bsize, i - 1), bsize);
+			continue;
+		}
+		for (j = i; j < n && j - i < IOV_MAX && blk_at(blks, start, j) == first + (j - i); j++) {
+			if (j > i && bc != NULL && bcache_contains(bc, first + (j - i)))
+				break;
+			iov[j - i].iov_base = blk_data(bhs, buf, bsize, j);
+			iov[j - i].iov_len = bsize;
+			len += bsize;
+		}
+		ret = preadv(sdp->device_fd, iov, j - i, first * bsize);
+		if (ret != len) {
+			if (ret >= 0)
+				errno = EIO;
+			return -1;
+		}
+		for (unsigned k = i; k < j; k++)
+			bcache_fill(bc, sdp->device_fd, first + (k - i), blk_data(bhs, buf, bsize, k), gen);
+	}
+	return 0;
+}
+
+static int bread_blocks(struct lgfs2_sbd *sdp, const uint64_t *blks, uint64_t start,
+                        unsigned n, struct lgfs2_buffer_head **bhs)
+{
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		bhs[i] = bh_alloc(sdp, blk_at(blks, start, i));
+		if (bhs[i] == NULL)
+			goto out_free;
+	}
+	if (read_blocks(sdp, blks, start, n, bhs, NULL) == 0)
+		return 0;
+out_free:
+	while (i-- > 0) {
+		bh_recycle(bhs[i]);
+		bhs[i] = NULL;
+	}
+	return -1;
+}
+
+/**
+ * Read a list of blocks into buffer heads using one preadv() call for each
+ * run of contiguous blocks. Blocks which are held in the block cache are
+ * copied from it instead.
+ * @sdp: The superblock
+ * @blks: The block numbers to read, in ascending order. Duplicates are allowed.
+ * @n: The number of blocks in blks
+ * @bhs: An array of n pointers to receive the buffer heads, in the same order as blks
+ * Returns 0 on success or -1 on error with errno set, in which case no buffer
+ * heads are returned.
+ */
+int lgfs2_bread_vec(struct lgfs2_sbd *sdp, const uint64_t *blks, unsigned n,
+                    struct lgfs2_buffer_head **bhs)
+{
+	for (unsigned i = 1; i < n; i++) {
+		if (blks[i] < blks[i - 1]) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	return bread_blocks(sdp, blks, 0, n, bhs);
+}
+
+/**
+ * Read a range of contiguous blocks into buffer heads. See lgfs2_bread_vec().
+ * @sdp: The superblock
+ * @start: The first block of the range
+ * @n: The number of blocks in the range
+ * @bhs: An array of n pointers to receive the buffer heads
+ * Returns 0 on success or -1 on error with errno set.
+ */
+int lgfs2_bread_range(struct lgfs2_sbd *sdp, uint64_t start, unsigned n,
+                      struct lgfs2_buffer_head **bhs)
+{
+	return bread_blocks(sdp, NULL, start, n, bhs);
+}
+
+/**
+ * Read a list of blocks into the block cache ahead of their use, and into a
+ * buffer so that the caller can look for further blocks to prefetch. Unlike
+ * the other buffer functions, this may be called from several threads while
+ * one other thread uses the buffer functions on the same superblock. Blocks
+ * are not cached if they may have been written while they were being read.
+ * @sdp: The superblock
+ * @blks: The block numbers to read, in ascending order
+ * @n: The number of blocks in blks
+ * @buf: A buffer of n * sd_bsize bytes which receives the blocks
+ * Returns 0 on success or -1 on error with errno set.
+ */
+int lgfs2_bcache_prefetch(struct lgfs2_sbd *sdp, const uint64_t *blks, unsigned n, char *buf)
+{
+	for (unsigned i = 1; i < n; i++) {
+		if (blks[i] < blks[i - 1]) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	return read_blocks(sdp, blks, 0, n, NULL, buf);
+}
+
+#ifdef __NR_io_uring_setup
+#define IOQ_URING
+
+/*
+ * The parts of the io_uring ABI used by lgfs2_ioq. <linux/io_uring.h> can't be
+ * used here as it needs the kernel's <linux/types.h>, which gfs2/include
+ * overrides.
+ */
+#define IOQ_OFF_SQ_RING    (0ULL)
+#define IOQ_OFF_CQ_RING    (0x8000000ULL)
+#define IOQ_OFF_SQES       (0x10000000ULL)
+#define IOQ_ENTER_GETEVENTS (1U << 0)
+#define IOQ_OP_READV       (1)
+
+struct ioq_sqring_offsets {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t ring_mask;
+	uint32_t ring_entries;
+	uint32_t flags;
+	uint32_t dropped;
+	uint32_t array;
+	uint32_t resv1;
+	uint64_t user_addr;
+};
+
+struct ioq_cqring_offsets {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t ring_mask;
+	uint32_t ring_entries;
+	uint32_t overflow;
+	uint32_t cqes;
+	uint32_t flags;
+	uint32_t resv1;
+	uint64_t user_addr;
+};
+
+struct ioq_uring_params {
+	uint32_t sq_entries;
+	uint32_t cq_entries;
+	uint32_t flags;
+	uint32_t sq_thread_cpu;
+	uint32_t sq_thread_idle;
+	uint32_t features;
+	uint32_t wq_fd;
+	uint32_t resv[3];
+	struct ioq_sqring_offsets sq_off;
+	struct ioq_cqring_offsets cq_off;
+};
+
+struct ioq_sqe {
+	uint8_t opcode;
+	uint8_t flags;
+	uint16_t ioprio;
+	int32_t fd;
+	uint64_t off;
+	uint64_t addr;
+	uint32_t len;
+	uint32_t rw_flags;
+	uint64_t user_data;
+	uint16_t buf_index;
+	uint16_t personality;
+	int32_t splice_fd_in;
+	uint64_t pad[2];
+};
+
+struct ioq_cqe {
+	uint64_t user_data;
+	int32_t res;
+	uint32_t flags;
+};
+#endif /* __NR_io_uring_setup */
+
+struct ioq_req {
+	struct ioq_req *r_next;
+	struct lgfs2_buffer_head *r_bh;
+	void *r_priv;
+	struct iovec r_iov;
+	int r_res;    /* Bytes read or -errno */
+	int r_done;   /* The read has completed. Always 0 for synchronous queues */
+	int r_hit;    /* The block was copied from the block cache */
+	uint64_t r_gen; /* Block cache write generation when the read was queued */
+};
+
+struct lgfs2_ioq {
+	struct lgfs2_sbd *q_sdp;
+	struct ioq_req *q_reqs;
+	struct ioq_req *q_free;       /* Unused requests */
+	struct ioq_req *q_ready;      /* Requests which can be reaped without waiting */
+	struct ioq_req **q_ready_end;
+	unsigned q_depth;
+	unsigned q_inflight;          /* Submitted to the kernel but not completed */
+	unsigned q_unsubmitted;       /* Queued in the SQ ring but not yet submitted */
+	int q_ring_fd;                /* -1 for a synchronous queue */
+#ifdef IOQ_URING
+	void *q_sq_ring;
+	size_t q_sq_ring_sz;
+	void *q_cq_ring;
+	size_t q_cq_ring_sz;
+	struct ioq_sqe *q_sqes;
+	size_t q_sqes_sz;
+	unsigned *q_sq_tail;
+	unsigned q_sq_mask;
+	unsigned *q_sq_array;
+	unsigned *q_cq_head;
+	unsigned *q_cq_tail;
+	unsigned q_cq_mask;
+	struct ioq_cqe *q_cqes;
+#endif
+};
+
+static void ioq_ready(struct lgfs2_ioq *q, struct ioq_req *r)
+{
+	r->r_next = NULL;
+	*q->q_ready_end = r;
+	q->q_ready_end = &r->r_next;
+}
+
+#ifdef IOQ_URING
+static void *ioq_mmap(int fd, size_t size, off_t off)
+{
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, off);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+static void ioq_ring_exit(struct lgfs2_ioq *q)
+{
+	if (q->q_sqes != NULL)
+		munmap(q->q_sqes, q->q_sqes_sz);
+	if (q->q_cq_ring != NULL)
+		munmap(q->q_cq_ring, q->q_cq_ring_sz);
+	if (q->q_sq_ring != NULL)
+		munmap(q->q_sq_ring, q->q_sq_ring_sz);
+	close(q->q_ring_fd);
+	q->q_ring_fd = -1;
+}
+
+/**
+ * Set up an io_uring instance using the raw system calls, which avoids a
+ * dependency on liburing. Returns 0 on success or -1 if io_uring is not
+ * available, in which case the queue is left synchronous.
+ */
+static int ioq_ring_init(struct lgfs2_ioq *q)
+{
+	struct ioq_uring_params p;
+	char *sq, *cq;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = syscall(__NR_io_uring_setup, q->q_depth, &p);
+	if (fd < 0)
+		return -1;
+	q->q_ring_fd = fd;
+	q->q_sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	q->q_cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct ioq_cqe);
+	q->q_sqes_sz = p.sq_entries * sizeof(struct ioq_sqe);
+	q->q_sq_ring = ioq_mmap(fd, q->q_sq_ring_sz, IOQ_OFF_SQ_RING);
+	q->q_cq_ring = ioq_mmap(fd, q->q_cq_ring_sz, IOQ_OFF_CQ_RING);
+	q->q_sqes = ioq_mmap(fd, q->q_sqes_sz, IOQ_OFF_SQES);
+	if (q->q_sq_ring == NULL || q->q_cq_ring == NULL || q->q_sqes == NULL) {
+		ioq_ring_exit(q);
+		return -1;
+	}
+	sq = q->q_sq_ring;
+	cq = q->q_cq_ring;
+	q->q_sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	q->q_sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	q->q_sq_array = (unsigned *)(sq + p.sq_off.array);
+	q->q_cq_head = (unsigned *)(cq + p.cq_off.head);
+	q->q_cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	q->q_cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	q->q_cqes = (struct ioq_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+}
+
+static void ioq_ring_queue(struct lgfs2_ioq *q, struct ioq_req *r)
+{
+	struct lgfs2_sbd *sdp = q->q_sdp;
+	unsigned tail = *q->q_sq_tail;
+	unsigned idx = tail & q->q_sq_mask;
+	struct ioq_sqe *sqe = &q->q_sqes[idx];
+
+	r->r_iov.iov_base = r->r_bh->b_data;
+	r->r_iov.iov_len = sdp->sd_bsize;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IOQ_OP_READV;
+	sqe->fd = sdp->device_fd;
+	sqe->addr = (uintptr_t)&r->r_iov;
+	sqe->len = 1;
+	sqe->off = r->r_bh->b_blocknr * sdp->sd_bsize;
+	sqe->user_data = (uintptr_t)r;
+	q->q_sq_array[idx] = idx;
+	__atomic_store_n(q->q_sq_tail, tail + 1, __ATOMIC_RELEASE);
+	q->q_unsubmitted++;
+	q->q_inflight++;
+}
+
+/**
+ * Submit queued reads and move any completions onto the ready list, waiting
+ * for at least one completion if wait is set.
+ */
+static int ioq_ring_poll(struct lgfs2_ioq *q, int wait)
+{
+	unsigned head, tail;
+
+	head = *q->q_cq_head;
+	tail = __atomic_load_n(q->q_cq_tail, __ATOMIC_ACQUIRE);
+	if (q->q_unsubmitted > 0 || (wait && head == tail)) {
+		unsigned flags = 0;
+		unsigned min = 0;
+		int ret;
+
+		if (wait && head == tail) {
+			flags = IOQ_ENTER_GETEVENTS;
+			min = 1;
+		}
+		ret = syscall(__NR_io_uring_enter, q->q_ring_fd, q->q_unsubmitted, min, flags, NULL, 0);
+		if (ret < 0 && errno != EINTR)
+			return -1;
+		if (ret > 0)
+			q->q_unsubmitted -= ret;
+		tail = __atomic_load_n(q->q_cq_tail, __ATOMIC_ACQUIRE);
+	}
+	for (; head != tail; head++) {
+		struct ioq_cqe *cqe = &q->q_cqes[head & q->q_cq_mask];
+		struct ioq_req *r = (struct ioq_req *)(uintptr_t)cqe->user_data;
+
+		r->r_res = cqe->res;
+		r->r_done = 1;
+		q->q_inflight--;
+		ioq_ready(q, r);
+	}
+	__atomic_store_n(q->q_cq_head, head, __ATOMIC_RELEASE);
+	return 0;
+}
+#endif /* IOQ_URING */
+
+/**
+ * Create a queue for submitting batches of block reads and consuming their
+ * completions. io_uring is used when it is available and the block cache is
+ * enabled, otherwise the queue falls back to reading each block with pread()
+ * as it is reaped. The block cache is required for asynchronous reads so that
+ * blocks written with lgfs2_bwrite() while a read is in flight are not lost.
+ * @sdp: The superblock
+ * @depth: The maximum number of reads which can be queued at once. A depth of
+ *         1 or less gives a synchronous queue.
+ * Returns the queue or NULL on error with errno set.
+ */
+struct lgfs2_ioq *lgfs2_ioq_new(struct lgfs2_sbd *sdp, unsigned depth)
+{
+	struct lgfs2_ioq *q;
+
+	if (depth == 0)
+		depth = 1;
+	q = calloc(1, sizeof(*q));
+	if (q == NULL)
+		return NULL;
+	q->q_reqs = calloc(depth, sizeof(*q->q_reqs));
+	if (q->q_reqs == NULL) {
+		free(q);
+		return NULL;
+	}
+	for (unsigned i = 0; i < depth; i++) {
+		q->q_reqs[i].r_next = q->q_free;
+		q->q_free = &q->q_reqs[i];
+	}
+	q->q_sdp = sdp;
+	q->q_depth = depth;
+	q->q_ready_end = &q->q_ready;
+	q->q_ring_fd = -1;
+#ifdef IOQ_URING
+	if (depth > 1 && bcache_get(sdp) != NULL)
+		ioq_ring_init(q);
+#endif
+	return q;
+}
+
+/**
+ * Returns 1 if the queue reads blocks asynchronously or 0 if it falls back to
+ * synchronous reads.
+ */
+int lgfs2_ioq_async(const struct lgfs2_ioq *q)
+{
+	return q->q_ring_fd >= 0;
+}
+
+/**
+ * Queue a block to be read.
+ * @q: The queue
+ * @blk: The block to read
+ * @priv: A pointer which is passed back by lgfs2_ioq_reap() with the block
+ * Returns 0 on success or -1 with errno set. errno is EBUSY if the queue is
+ * full, in which case the caller should reap some completions first.
+ */
+int lgfs2_ioq_submit(struct lgfs2_ioq *q, uint64_t blk, void *priv)
+{
+	struct lgfs2_sbd *sdp = q->q_sdp;
+	struct ioq_req *r = q->q_free;
+
+	if (r == NULL) {
+		errno = EBUSY;
+		return -1;
+	}
+	r->r_bh = bh_alloc(sdp, blk);
+	if (r->r_bh == NULL)
+		return -1;
+	q->q_free = r->r_next;
+	r->r_priv = priv;
+	r->r_res = sdp->sd_bsize;
+	r->r_done = 0;
+	r->r_hit = bcache_fetch(bcache_get(sdp), blk, r->r_bh->b_data, &r->r_gen);
+	if (r->r_hit) {
+		r->r_done = 1;
+		ioq_ready(q, r);
+		return 0;
+	}
+#ifdef IOQ_URING
+	if (q->q_ring_fd >= 0) {
+		ioq_ring_queue(q, r);
+		if (q->q_unsubmitted >= (q->q_depth + 7) / 8)
+			return ioq_ring_poll(q, 0);
+		return 0;
+	}
+#endif
+	ioq_ready(q, r);
+	return 0;
+}
+
+/**
+ * Wait for a queued read to complete. Completions are not necessarily returned
+ * in the order the reads were submitted.
+ * @q: The queue
+ * @bhp: Set to the buffer head of the block, or NULL if the read failed
+ * @privp: Set to the priv pointer given to lgfs2_ioq_submit() for the block
+ * Returns 0 on success, 1 if there are no reads queued or -1 if the read failed
+ * or on error, with errno set.
+ */
+int lgfs2_ioq_reap(struct lgfs2_ioq *q, struct lgfs2_buffer_head **bhp, void **privp)
+{
+	struct lgfs2_sbd *sdp = q->q_sdp;
+	struct lgfs2_bcache *bc = bcache_get(sdp);
+	struct lgfs2_buffer_head *bh;
+	struct ioq_req *r;
+
+	*bhp = NULL;
+#ifdef IOQ_URING
+	if (q->q_ring_fd >= 0 && q->q_ready == NULL && q->q_inflight > 0 &&
+	    ioq_ring_poll(q, 1) != 0)
+		return -1;
+#endif
+	r = q->q_ready;
+	if (r == NULL)
+		return 1;
+	q->q_ready = r->r_next;
+	if (q->q_ready == NULL)
+		q->q_ready_end = &q->q_ready;
+	bh = r->r_bh;
+	*privp = r->r_priv;
+	r->r_bh = NULL;
+	r->r_next = q->q_free;
+	q->q_free = r;
+
+	if (!r->r_done) {
+		r->r_hit = bcache_fetch(bc, bh->b_blocknr, bh->b_data, &r->r_gen);
+		if (!r->r_hit)
+			r->r_res = pread(sdp->device_fd, bh->b_data, sdp->sd_bsize,
+			                 bh->b_blocknr * sdp->sd_bsize);
+	} else if (r->r_res < 0) {
+		errno = -r->r_res;
+	}
+	if (r->r_res != sdp->sd_bsize) {
+		if (r->r_res >= 0)
+			errno = EIO;
+		bh_recycle(bh);
+		return -1;
+	}
+	/* If the block was written while the read was in flight, read it again */
+	if (!r->r_hit && bcache_fill(bc, sdp->device_fd, bh->b_blocknr, bh->b_data, r->r_gen) &&
+	    pread(sdp->device_fd, bh->b_data, sdp->sd_bsize,
+	          bh->b_blocknr * sdp->sd_bsize) != sdp->sd_bsize) {
+		bh_recycle(bh);
+		return -1;
+	}
+	*bhp = bh;
+	return 0;
+}
+
+/**
+ * Free a read queue. Reads which are still queued are waited for and their
+ * buffers are released.
+ */
+void lgfs2_ioq_free(struct lgfs2_ioq **qp)
+{
+	struct lgfs2_ioq *q = *qp;
+
+	if (q == NULL)
+		return;
+#ifdef IOQ_URING
+	if (q->q_ring_fd >= 0) {
+		while (q->q_inflight > 0 && ioq_ring_poll(q, 1) == 0)
+			;
+		/* On error the buffers may still be targeted by the kernel */
+		if (q->q_inflight > 0)
+			for (unsigned i = 0; i < q->q_depth; i++)
+				if (q->q_reqs[i].r_bh != NULL && !q->q_reqs[i].r_done)
+					q->q_reqs[i].r_bh = NULL;
+		ioq_ring_exit(q);
+	}
+#endif
+	for (unsigned i = 0; i < q->q_depth; i++)
+		if (q->q_reqs[i].r_bh != NULL)
+			bh_recycle(q->q_reqs[i].r_bh);
+	free(q->q_reqs);
+	free(q);
+	*qp = NULL;
+}
+
 int lgfs2_bwrite(struct lgfs2_buffer_head *bh)
 {
 	struct lgfs2_sbd *sdp = bh->sdp;
+	struct lgfs2_bcache *bc = bcache_get(sdp);
 	off_t offset = sdp->sd_bsize * bh->b_blocknr;
 
+	if (bc != NULL) {
+		struct bcache_entry *ce;
+		int found;
+		int ret = 0;
+
+		pthread_mutex_lock(&bc->bc_lock);
+		ce = bcache_lookup(bc, sdp->device_fd, bh->b_blocknr, &found);
+		if (ce != NULL) {
+			memcpy(ce->ce_data, bh->b_data, sdp->sd_bsize);
+			if (osi_list_empty(&ce->ce_dirty)) {
+				osi_list_add_prev(&ce->ce_dirty, &bc->bc_dirty);
+				bc->bc_ndirty++;
+			}
+			bh->b_modified = 0;
+			if (bc->bc_ndirty >= bc->bc_dirty_max)
+				ret = bcache_writeback(bc, sdp->device_fd);
+		} else {
+			/* Write around the cache, keeping prefetches out until it's done */
+			ret = -1;
+			if (pwrite(sdp->device_fd, bh->b_data, sdp->sd_bsize, offset) == sdp->sd_bsize) {
+				bh->b_modified = 0;
+				ret = 0;
+			}
+			bc->bc_wgen++;
+		}
+		pthread_mutex_unlock(&bc->bc_lock);
+		return ret;
+	}
 	if (pwrite(sdp->device_fd, bh->b_data, sdp->sd_bsize, offset) != sdp->sd_bsize)
 		return -1;
 	bh->b_modified = 0;
@@ -77,7 +1144,7 @@ int lgfs2_brelse(struct lgfs2_buffer_head *bh)
 	bh->b_blocknr = -1;
 	if (bh->b_altlist.next && !osi_list_empty(&bh->b_altlist))
 		osi_list_del(&bh->b_altlist);
-	free(bh);
+	bh_recycle(bh);
 	return error;
 }
 
@@ -87,7 +1154,8 @@ int lgfs2_brelse(struct lgfs2_buffer_head *bh)
  */
 void lgfs2_bfree(struct lgfs2_buffer_head **bhp)
 {
-	free(*bhp);
+	if (*bhp != NULL)
+		bh_recycle(*bhp);
 	*bhp = NULL;
 }
 
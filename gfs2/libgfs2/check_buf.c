@@ -0,0 +1,430 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <check.h>
+#include "libgfs2.h"
+
+Suite *suite_buf(void);
+
+#define MOCK_BSIZE (4096)
+#define MOCK_BLOCKS (64)
+
+static struct lgfs2_sbd *mock_sdp;
+
+static void mockup_dev(void)
+{
+	struct lgfs2_sbd *sdp;
+	char tmpnam[] = "mockdev-XXXXXX";
+
+	sdp = calloc(1, sizeof(*sdp));
+	ck_assert(sdp != NULL);
+
+	sdp->device_fd = mkstemp(tmpnam);
+	ck_assert(sdp->device_fd >= 0);
+	ck_assert(unlink(tmpnam) == 0);
+	ck_assert(ftruncate(sdp->device_fd, MOCK_BSIZE * MOCK_BLOCKS) == 0);
+
+	sdp->sd_bsize = MOCK_BSIZE;
+	mock_sdp = sdp;
+}
+
+static void teardown_dev(void)
+{
+	lgfs2_bpool_drain(mock_sdp);
+	ck_assert(mock_sdp->bpool.bp_count == 0);
+	close(mock_sdp->device_fd);
+	free(mock_sdp);
+}
+
+START_TEST(test_bget_zeroed)
+{
+	struct lgfs2_buffer_head *bh;
+	unsigned i;
+
+	bh = lgfs2_bget(mock_sdp, 1);
+	ck_assert(bh != NULL);
+	memset(bh->b_data, 0xff, MOCK_BSIZE);
+	lgfs2_bfree(&bh);
+	ck_assert(bh == NULL);
+	ck_assert(mock_sdp->bpool.bp_count == 1);
+
+	/* A recycled buffer must still come back zeroed from lgfs2_bget() */
+	bh = lgfs2_bget(mock_sdp, 2);
+	ck_assert(bh != NULL);
+	ck_assert(mock_sdp->bpool.bp_hits == 1);
+	ck_assert(bh->b_blocknr == 2);
+	ck_assert(bh->b_modified == 0);
+	for (i = 0; i < MOCK_BSIZE; i++)
+		ck_assert(bh->b_data[i] == 0);
+	lgfs2_bfree(&bh);
+}
+END_TEST
+
+START_TEST(test_bread_reuse)
+{
+	struct lgfs2_buffer_head *bh;
+	char buf[MOCK_BSIZE];
+
+	memset(buf, 0x5a, sizeof(buf));
+	ck_assert(pwrite(mock_sdp->device_fd, buf, MOCK_BSIZE, 3 * MOCK_BSIZE) == MOCK_BSIZE);
+
+	bh = lgfs2_bread(mock_sdp, 2);
+	ck_assert(bh != NULL);
+	ck_assert(mock_sdp->bpool.bp_misses == 1);
+	memset(bh->b_data, 0xff, MOCK_BSIZE);
+	ck_assert(lgfs2_brelse(bh) == 0);
+
+	bh = lgfs2_bread(mock_sdp, 3);
+	ck_assert(bh != NULL);
+	ck_assert(mock_sdp->bpool.bp_hits == 1);
+	ck_assert(mock_sdp->bpool.bp_misses == 1);
+	ck_assert(memcmp(bh->b_data, buf, MOCK_BSIZE) == 0);
+
+	/* Modified buffers are written back before being recycled */
+	bh->b_data[0] = 0x11;
+	lgfs2_bmodified(bh);
+	ck_assert(lgfs2_brelse(bh) == 0);
+	ck_assert(pread(mock_sdp->device_fd, buf, MOCK_BSIZE, 3 * MOCK_BSIZE) == MOCK_BSIZE);
+	ck_assert(buf[0] == 0x11);
+
+	/* Reads beyond the end of the device fail and don't leak the buffer */
+	bh = lgfs2_bread(mock_sdp, MOCK_BLOCKS);
+	ck_assert(bh == NULL);
+	ck_assert(mock_sdp->bpool.bp_count == 1);
+}
+END_TEST
+
+START_TEST(test_bpool_limits)
+{
+	struct lgfs2_buffer_head *bhs[8];
+	unsigned i;
+
+	mock_sdp->bpool.bp_max = 4;
+	for (i = 0; i < 8; i++) {
+		bhs[i] = lgfs2_bget(mock_sdp, i);
+		ck_assert(bhs[i] != NULL);
+	}
+	for (i = 0; i < 8; i++)
+		lgfs2_bfree(&bhs[i]);
+	ck_assert(mock_sdp->bpool.bp_count == 4);
+
+	/* Buffers of the old size must not be handed out after a change */
+	mock_sdp->sd_bsize = MOCK_BSIZE / 2;
+	bhs[0] = lgfs2_bget(mock_sdp, 0);
+	ck_assert(bhs[0] != NULL);
+	ck_assert(bhs[0]->b_size == MOCK_BSIZE / 2);
+	lgfs2_bfree(&bhs[0]);
+	ck_assert(mock_sdp->bpool.bp_count == 1);
+	ck_assert(mock_sdp->bpool.bp_bsize == MOCK_BSIZE / 2);
+}
+END_TEST
+
+START_TEST(test_bcache_writeback)
+{
+	struct lgfs2_bcache_stats st;
+	struct lgfs2_buffer_head *bh;
+	char buf[MOCK_BSIZE];
+	uint64_t blk;
+
+	ck_assert(lgfs2_bcache_init(mock_sdp, 2 * MOCK_BLOCKS * MOCK_BSIZE) == 0);
+
+	/* Writes are held back until flushed, and then coalesced */
+	for (blk = 8; blk > 0; blk--) {
+		bh = lgfs2_bget(mock_sdp, blk);
+		ck_assert(bh != NULL);
+		memset(bh->b_data, (int)blk, MOCK_BSIZE);
+		lgfs2_bmodified(bh);
+		ck_assert(lgfs2_brelse(bh) == 0);
+	}
+	ck_assert(pread(mock_sdp->device_fd, buf, MOCK_BSIZE, 8 * MOCK_BSIZE) == MOCK_BSIZE);
+	ck_assert(buf[0] == 0);
+
+	bh = lgfs2_bread(mock_sdp, 8);
+	ck_assert(bh != NULL);
+	ck_assert(bh->b_data[0] == 8);
+	lgfs2_brelse(bh);
+
+	ck_assert(lgfs2_bcache_flush(mock_sdp) == 0);
+	lgfs2_bcache_stats(mock_sdp, &st);
+	ck_assert(st.bs_hits == 1);
+	ck_assert(st.bs_writes == 8);
+	ck_assert(st.bs_batches == 1);
+	for (blk = 1; blk <= 8; blk++) {
+		ck_assert(pread(mock_sdp->device_fd, buf, MOCK_BSIZE, blk * MOCK_BSIZE) == MOCK_BSIZE);
+		ck_assert(buf[0] == (char)blk);
+	}
+	ck_assert(lgfs2_bcache_free(mock_sdp) == 0);
+	ck_assert(mock_sdp->bcache == NULL);
+}
+END_TEST
+
+START_TEST(test_bcache_evict)
+{
+	struct lgfs2_bcache_stats st;
+	struct lgfs2_buffer_head *bh;
+	char buf[MOCK_BSIZE];
+	uint64_t blk;
+
+	ck_assert(lgfs2_bcache_init(mock_sdp, 0) == 0);
+
+	/* Dirty every block on the device, more than the cache can hold */
+	for (blk = 0; blk < MOCK_BLOCKS; blk++) {
+		bh = lgfs2_bget(mock_sdp, blk);
+		ck_assert(bh != NULL);
+		memset(bh->b_data, (int)blk, MOCK_BSIZE);
+		lgfs2_bmodified(bh);
+		ck_assert(lgfs2_brelse(bh) == 0);
+	}
+	lgfs2_bcache_stats(mock_sdp, &st);
+	ck_assert(st.bs_writes > 0);
+	ck_assert(st.bs_evictions == MOCK_BLOCKS - LGFS2_BCACHE_MIN_BLOCKS);
+
+	for (blk = 0; blk < MOCK_BLOCKS; blk++) {
+		bh = lgfs2_bread(mock_sdp, blk);
+		ck_assert(bh != NULL);
+		ck_assert(bh->b_data[0] == (char)blk);
+		lgfs2_brelse(bh);
+	}
+
+	/* Writing behind the cache's back needs a sync first */
+	ck_assert(lgfs2_bcache_sync(mock_sdp, MOCK_BLOCKS - 1, 1) == 0);
+	memset(buf, 0x77, sizeof(buf));
+	ck_assert(pwrite(mock_sdp->device_fd, buf, MOCK_BSIZE,
+	                 (MOCK_BLOCKS - 1) * MOCK_BSIZE) == MOCK_BSIZE);
+	bh = lgfs2_bread(mock_sdp, MOCK_BLOCKS - 1);
+	ck_assert(bh != NULL);
+	ck_assert(bh->b_data[0] == 0x77);
+	lgfs2_brelse(bh);
+	ck_assert(lgfs2_bcache_free(mock_sdp) == 0);
+}
+END_TEST
+
+static void fill_dev(void)
+{
+	char buf[MOCK_BSIZE];
+
+	for (unsigned i = 0; i < MOCK_BLOCKS; i++) {
+		memset(buf, (int)i, sizeof(buf));
+		ck_assert(pwrite(mock_sdp->device_fd, buf, MOCK_BSIZE, i * MOCK_BSIZE) == MOCK_BSIZE);
+	}
+}
+
+START_TEST(test_bread_vec)
+{
+	uint64_t blks[] = { 2, 3, 4, 4, 9, 10, 63 };
+	uint64_t unsorted[] = { 3, 2 };
+	unsigned n = sizeof(blks) / sizeof(blks[0]);
+	struct lgfs2_buffer_head *bhs[sizeof(blks) / sizeof(blks[0])];
+
+	fill_dev();
+	ck_assert(lgfs2_bread_vec(mock_sdp, blks, n, bhs) == 0);
+	for (unsigned i = 0; i < n; i++) {
+		ck_assert(bhs[i]->b_blocknr == blks[i]);
+		ck_assert(bhs[i]->b_data[0] == (char)blks[i]);
+		ck_assert(bhs[i]->b_data[MOCK_BSIZE - 1] == (char)blks[i]);
+		lgfs2_brelse(bhs[i]);
+	}
+	ck_assert(lgfs2_bread_vec(mock_sdp, unsorted, 2, bhs) == -1);
+
+	/* Reading past the end of the device fails without leaking buffers */
+	ck_assert(lgfs2_bread_range(mock_sdp, MOCK_BLOCKS - 2, 3, bhs) == -1);
+	ck_assert(mock_sdp->bpool.bp_count == n);
+}
+END_TEST
+
+START_TEST(test_bread_range_cached)
+{
+	struct lgfs2_bcache_stats st;
+	struct lgfs2_buffer_head *bhs[8];
+	struct lgfs2_buffer_head *bh;
+
+	fill_dev();
+	ck_assert(lgfs2_bcache_init(mock_sdp, 2 * MOCK_BLOCKS * MOCK_BSIZE) == 0);
+
+	/* A dirty cached block must be returned in preference to the disk copy */
+	bh = lgfs2_bread(mock_sdp, 12);
+	ck_assert(bh != NULL);
+	bh->b_data[0] = 'x';
+	lgfs2_bmodified(bh);
+	lgfs2_brelse(bh);
+
+	ck_assert(lgfs2_bread_range(mock_sdp, 8, 8, bhs) == 0);
+	for (unsigned i = 0; i < 8; i++) {
+		ck_assert(bhs[i]->b_blocknr == 8 + i);
+		if (i == 4)
+			ck_assert(bhs[i]->b_data[0] == 'x');
+		else
+			ck_assert(bhs[i]->b_data[0] == (char)(8 + i));
+		lgfs2_brelse(bhs[i]);
+	}
+	lgfs2_bcache_stats(mock_sdp, &st);
+	ck_assert(st.bs_hits == 1);
+	ck_assert(st.bs_misses == 8);
+
+	/* Now it should all come from the cache */
+	ck_assert(lgfs2_bread_range(mock_sdp, 8, 8, bhs) == 0);
+	for (unsigned i = 0; i < 8; i++)
+		lgfs2_brelse(bhs[i]);
+	lgfs2_bcache_stats(mock_sdp, &st);
+	ck_assert(st.bs_hits == 9);
+	ck_assert(st.bs_misses == 8);
+	ck_assert(lgfs2_bcache_free(mock_sdp) == 0);
+}
+END_TEST
+
+static void read_through_ioq(unsigned depth)
+{
+	struct lgfs2_buffer_head *bh;
+	struct lgfs2_ioq *q;
+	int seen[MOCK_BLOCKS] = {0};
+	uint64_t next = 0;
+	unsigned reaped = 0;
+	void *priv;
+	int ret;
+
+	fill_dev();
+	q = lgfs2_ioq_new(mock_sdp, depth);
+	ck_assert(q != NULL);
+	while (reaped < MOCK_BLOCKS) {
+		while (next < MOCK_BLOCKS &&
+		       lgfs2_ioq_submit(q, next, &seen[next]) == 0)
+			next++;
+		if (next < MOCK_BLOCKS)
+			ck_assert(errno == EBUSY);
+		ret = lgfs2_ioq_reap(q, &bh, &priv);
+		ck_assert(ret == 0);
+		ck_assert(bh != NULL);
+		ck_assert(priv == &seen[bh->b_blocknr]);
+		ck_assert(bh->b_data[0] == (char)bh->b_blocknr);
+		seen[bh->b_blocknr]++;
+		lgfs2_brelse(bh);
+		reaped++;
+	}
+	for (unsigned i = 0; i < MOCK_BLOCKS; i++)
+		ck_assert(seen[i] == 1);
+	ck_assert(lgfs2_ioq_reap(q, &bh, &priv) == 1);
+
+	/* Reads past the end of the device fail */
+	ck_assert(lgfs2_ioq_submit(q, MOCK_BLOCKS, &seen[0]) == 0);
+	ck_assert(lgfs2_ioq_reap(q, &bh, &priv) == -1);
+	ck_assert(bh == NULL);
+	ck_assert(priv == &seen[0]);
+
+	/* Freeing the queue releases anything left in it */
+	ck_assert(lgfs2_ioq_submit(q, 3, NULL) == 0);
+	lgfs2_ioq_free(&q);
+	ck_assert(q == NULL);
+}
+
+START_TEST(test_ioq_sync)
+{
+	struct lgfs2_ioq *q = lgfs2_ioq_new(mock_sdp, 8);
+
+	/* Without the block cache the queue should fall back to pread() */
+	ck_assert(q != NULL);
+	ck_assert(!lgfs2_ioq_async(q));
+	lgfs2_ioq_free(&q);
+	read_through_ioq(8);
+}
+END_TEST
+
+START_TEST(test_ioq_cached)
+{
+	struct lgfs2_buffer_head *bh;
+	struct lgfs2_ioq *q;
+	void *priv;
+
+	ck_assert(lgfs2_bcache_init(mock_sdp, 0) == 0);
+	read_through_ioq(8);
+	read_through_ioq(1);
+
+	/* A block written to the cache must be seen by queued reads */
+	bh = lgfs2_bget(mock_sdp, 5);
+	ck_assert(bh != NULL);
+	bh->b_data[0] = 'x';
+	lgfs2_bmodified(bh);
+	lgfs2_brelse(bh);
+	q = lgfs2_ioq_new(mock_sdp, 8);
+	ck_assert(q != NULL);
+	ck_assert(lgfs2_ioq_submit(q, 5, NULL) == 0);
+	ck_assert(lgfs2_ioq_reap(q, &bh, &priv) == 0);
+	ck_assert(bh->b_data[0] == 'x');
+	lgfs2_brelse(bh);
+	lgfs2_ioq_free(&q);
+	ck_assert(lgfs2_bcache_free(mock_sdp) == 0);
+}
+END_TEST
+
+START_TEST(test_bcache_prefetch)
+{
+	uint64_t blks[] = { 3, 4, 5, 20 };
+	struct lgfs2_bcache_stats st;
+	struct lgfs2_buffer_head *bh;
+	char buf[4 * MOCK_BSIZE];
+
+	fill_dev();
+	/* Without a cache the blocks are still read */
+	ck_assert(lgfs2_bcache_prefetch(mock_sdp, blks, 4, buf) == 0);
+	ck_assert(buf[3 * MOCK_BSIZE] == 20);
+
+	ck_assert(lgfs2_bcache_init(mock_sdp, 0) == 0);
+	bh = lgfs2_bget(mock_sdp, 4);
+	ck_assert(bh != NULL);
+	bh->b_data[0] = 'x';
+	lgfs2_bmodified(bh);
+	lgfs2_brelse(bh);
+
+	ck_assert(lgfs2_bcache_prefetch(mock_sdp, blks, 4, buf) == 0);
+	ck_assert(buf[0] == 3);
+	ck_assert(buf[MOCK_BSIZE] == 'x');
+	ck_assert(buf[2 * MOCK_BSIZE] == 5);
+	lgfs2_bcache_stats(mock_sdp, &st);
+	ck_assert(st.bs_hits == 1);
+	ck_assert(st.bs_misses == 3);
+
+	/* The prefetched blocks are now cached */
+	bh = lgfs2_bread(mock_sdp, 20);
+	ck_assert(bh != NULL);
+	ck_assert(bh->b_data[0] == 20);
+	lgfs2_brelse(bh);
+	lgfs2_bcache_stats(mock_sdp, &st);
+	ck_assert(st.bs_hits == 2);
+	ck_assert(lgfs2_bcache_free(mock_sdp) == 0);
+}
+END_TEST
+
+Suite *suite_buf(void)
+{
+	Suite *s = suite_create("buf.c");
+	TCase *tc;
+
+	tc = tcase_create("Buffer pool");
+	tcase_add_checked_fixture(tc, mockup_dev, teardown_dev);
+	tcase_add_test(tc, test_bget_zeroed);
+	tcase_add_test(tc, test_bread_reuse);
+	tcase_add_test(tc, test_bpool_limits);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("Block cache");
+	tcase_add_checked_fixture(tc, mockup_dev, teardown_dev);
+	tcase_add_test(tc, test_bcache_writeback);
+	tcase_add_test(tc, test_bcache_evict);
+	tcase_add_test(tc, test_bcache_prefetch);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("Vectored reads");
+	tcase_add_checked_fixture(tc, mockup_dev, teardown_dev);
+	tcase_add_test(tc, test_bread_vec);
+	tcase_add_test(tc, test_bread_range_cached);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("Read queues");
+	tcase_add_checked_fixture(tc, mockup_dev, teardown_dev);
+	tcase_add_test(tc, test_ioq_sync);
+	tcase_add_test(tc, test_ioq_cached);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
@@ -5,6 +5,8 @@ extern Suite *suite_meta(void);
 extern Suite *suite_ondisk(void);
 extern Suite *suite_rgrp(void);
 extern Suite *suite_fs_ops(void);
+extern Suite *suite_buf(void);
+extern Suite *suite_recovery(void);
 
 int main(void)
 {
@@ -14,6 +16,8 @@ int main(void)
 	srunner_add_suite(runner, suite_ondisk());
 	srunner_add_suite(runner, suite_rgrp());
 	srunner_add_suite(runner, suite_fs_ops());
+	srunner_add_suite(runner, suite_buf());
+	srunner_add_suite(runner, suite_recovery());
 
 	srunner_run_all(runner, CK_ENV);
 	failures = srunner_ntests_failed(runner);
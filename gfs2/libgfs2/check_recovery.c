@@ -0,0 +1,88 @@
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include "libgfs2.h"
+#include "crc32c.h"
+
+Suite *suite_recovery(void);
+
+#define MOCK_BSIZE (4096)
+#define MOCK_JBLOCKS (16)
+
+static char mock_buf[MOCK_BSIZE];
+
+static void mock_lh(char *buf, uint64_t seq, uint32_t blkno, uint32_t flags)
+{
+	struct gfs2_log_header *lh = (void *)buf;
+
+	memset(buf, 0, MOCK_BSIZE);
+	lh->lh_header.mh_magic = cpu_to_be32(GFS2_MAGIC);
+	lh->lh_header.mh_type = cpu_to_be32(GFS2_METATYPE_LH);
+	lh->lh_header.mh_format = cpu_to_be32(GFS2_FORMAT_LH);
+	lh->lh_sequence = cpu_to_be64(seq);
+	lh->lh_flags = cpu_to_be32(flags);
+	lh->lh_blkno = cpu_to_be32(blkno);
+	lh->lh_hash = cpu_to_be32(lgfs2_log_header_hash(buf));
+	lh->lh_crc = cpu_to_be32(lgfs2_log_header_crc(buf, MOCK_BSIZE));
+}
+
+START_TEST(test_check_log_header)
+{
+	struct lgfs2_log_header lh;
+
+	crc32c_optimization_init();
+	mock_lh(mock_buf, 42, 3, GFS2_LOG_HEAD_UNMOUNT);
+	ck_assert(lgfs2_check_log_header(mock_buf, 3, MOCK_BSIZE, &lh) == 0);
+	ck_assert(lh.lh_sequence == 42);
+	ck_assert(lh.lh_blkno == 3);
+	ck_assert(lh.lh_flags == GFS2_LOG_HEAD_UNMOUNT);
+
+	/* The header must be for the block it is found in */
+	ck_assert(lgfs2_check_log_header(mock_buf, 4, MOCK_BSIZE, &lh) == 1);
+
+	/* The hash and crc cover the header and the rest of the block */
+	mock_buf[MOCK_BSIZE - 1] = 1;
+	ck_assert(lgfs2_check_log_header(mock_buf, 3, MOCK_BSIZE, &lh) == 1);
+	mock_lh(mock_buf, 42, 3, GFS2_LOG_HEAD_UNMOUNT);
+	((struct gfs2_log_header *)mock_buf)->lh_sequence = cpu_to_be64(43);
+	ck_assert(lgfs2_check_log_header(mock_buf, 3, MOCK_BSIZE, &lh) == 1);
+}
+END_TEST
+
+/* A journal whose log wraps after block 9, with no header in block 5 */
+static int mock_get_lh(void *priv, unsigned int blk, struct lgfs2_log_header *head)
+{
+	unsigned *reads = priv;
+
+	(*reads)++;
+	if (blk == 5)
+		return 1;
+	mock_lh(mock_buf, blk <= 9 ? blk + 100 : blk + 80, blk, GFS2_LOG_HEAD_UNMOUNT);
+	return lgfs2_check_log_header(mock_buf, blk, MOCK_BSIZE, head);
+}
+
+START_TEST(test_find_jhead_with)
+{
+	struct lgfs2_log_header head;
+	unsigned reads = 0;
+
+	crc32c_optimization_init();
+	ck_assert(lgfs2_find_jhead_with(MOCK_JBLOCKS, mock_get_lh, &reads, &head) == 0);
+	ck_assert(head.lh_blkno == 9);
+	ck_assert(head.lh_sequence == 109);
+	ck_assert(reads > 0);
+	ck_assert(reads < MOCK_JBLOCKS * 2);
+}
+END_TEST
+
+Suite *suite_recovery(void)
+{
+	Suite *s = suite_create("recovery.c");
+
+	TCase *tc = tcase_create("Journal log headers");
+	tcase_add_test(tc, test_check_log_header);
+	tcase_add_test(tc, test_find_jhead_with);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/types.h>
 #include <check.h>
 #include "libgfs2.h"
@@ -158,6 +159,263 @@ START_TEST(test_rgrps_write_final)
 }
 END_TEST
 
+/* The way lgfs2_bm_scan() found blocks before lgfs2_bitmap_scan() */
+static unsigned bm_scan_bitfit(const unsigned char *buf, unsigned len, uint8_t state,
+                               uint64_t base, uint64_t *out)
+{
+	unsigned long blk = 0;
+	unsigned n = 0;
+
+	while (blk < len * GFS2_NBBY) {
+		blk = lgfs2_bitfit(buf, len, blk, state);
+		if (blk == LGFS2_BFITNOENT)
+			break;
+		out[n++] = base + blk;
+		blk++;
+	}
+	return n;
+}
+
+static unsigned bm_scan_bytes(const unsigned char *buf, unsigned len, uint8_t state,
+                              uint64_t base, uint64_t *out)
+{
+	unsigned n = 0;
+
+	for (unsigned long blk = 0; blk < len * GFS2_NBBY; blk++) {
+		uint8_t st = (buf[blk / GFS2_NBBY] >> ((blk % GFS2_NBBY) * GFS2_BIT_SIZE)) & GFS2_BIT_MASK;
+
+		if (st == state)
+			out[n++] = base + blk;
+	}
+	return n;
+}
+
+/* Fill a bitmap where blocks in state are rare, common or everywhere */
+static void fill_bitmap(unsigned char *buf, unsigned len, uint8_t state, unsigned density)
+{
+	for (unsigned i = 0; i < len * GFS2_NBBY; i++) {
+		uint8_t st = (random() % 1000) < density ? state : (state + 1 + random() % 3) & 3;
+
+		buf[i / GFS2_NBBY] &= ~(GFS2_BIT_MASK << ((i % GFS2_NBBY) * GFS2_BIT_SIZE));
+		buf[i / GFS2_NBBY] |= st << ((i % GFS2_NBBY) * GFS2_BIT_SIZE);
+	}
+}
+
+START_TEST(test_bitmap_scan)
+{
+	const unsigned densities[] = { 0, 1, 50, 500, 1000 };
+	unsigned char *buf = malloc(4096 + 8);
+	uint64_t *expect = malloc(4096 * GFS2_NBBY * sizeof(uint64_t));
+	uint64_t *found = malloc(4096 * GFS2_NBBY * sizeof(uint64_t));
+
+	ck_assert(buf != NULL && expect != NULL && found != NULL);
+	srandom(1);
+	for (uint8_t state = 0; state < 4; state++) {
+		for (unsigned d = 0; d < sizeof(densities) / sizeof(densities[0]); d++) {
+			fill_bitmap(buf, 4096 + 8, state, densities[d]);
+			/* Unaligned starts and lengths which leave partial words and
+			   partial SIMD chunks at the end of the bitmap */
+			for (unsigned off = 0; off < 8; off += 3) {
+				for (unsigned len = 0; len <= 4096; len += (len < 200 ? 1 : 397)) {
+					unsigned n = bm_scan_bytes(buf + off, len, state, 17, expect);
+
+					ck_assert_uint_eq(lgfs2_bitmap_scan(buf + off, len, state, 17, found), n);
+					ck_assert(memcmp(found, expect, n * sizeof(*found)) == 0);
+					ck_assert_uint_eq(bm_scan_bitfit(buf + off, len, state, 17, found), n);
+					ck_assert(memcmp(found, expect, n * sizeof(*found)) == 0);
+				}
+			}
+		}
+	}
+	free(found);
+	free(expect);
+	free(buf);
+}
+END_TEST
+
+START_TEST(test_bitmap_count)
+{
+	const unsigned densities[] = { 0, 1, 500, 1000 };
+	unsigned char *buf = malloc(4096 + 8);
+
+	ck_assert(buf != NULL);
+	srandom(4);
+	for (unsigned d = 0; d < sizeof(densities) / sizeof(densities[0]); d++) {
+		fill_bitmap(buf, 4096 + 8, GFS2_BLKST_DINODE, densities[d]);
+		for (unsigned off = 0; off < 8; off += 3) {
+			for (unsigned len = 0; len <= 4096; len += (len < 40 ? 1 : 397)) {
+				uint32_t count[4];
+
+				lgfs2_bitmap_count(buf + off, len, count);
+				for (uint8_t state = 0; state < 4; state++) {
+					uint32_t n = 0;
+
+					for (unsigned i = 0; i < len * GFS2_NBBY; i++)
+						n += ((buf[off + i / GFS2_NBBY] >> ((i % GFS2_NBBY) * GFS2_BIT_SIZE)) &
+						      GFS2_BIT_MASK) == state;
+					ck_assert_uint_eq(count[state], n);
+				}
+			}
+		}
+	}
+	free(buf);
+}
+END_TEST
+
+START_TEST(test_bm_scan)
+{
+	lgfs2_rgrp_t rg = lgfs2_rgrp_first(tc_rgrps);
+	uint64_t *expect = malloc(tc_rgrps->rgs_sdp->sd_bsize * GFS2_NBBY * sizeof(uint64_t));
+	uint64_t *found = malloc(tc_rgrps->rgs_sdp->sd_bsize * GFS2_NBBY * sizeof(uint64_t));
+
+	ck_assert(expect != NULL && found != NULL);
+	srandom(2);
+	for (unsigned i = 0; i < rg->rt_length; i++) {
+		struct lgfs2_bitmap *bi = &rg->rt_bits[i];
+		unsigned char *buf = (unsigned char *)bi->bi_data + bi->bi_offset;
+		uint64_t base = rg->rt_data0 + bi->bi_start * GFS2_NBBY;
+
+		fill_bitmap(buf, bi->bi_len, GFS2_BLKST_DINODE, 20);
+		for (uint8_t state = 0; state < 4; state++) {
+			unsigned n = bm_scan_bitfit(buf, bi->bi_len, state, base, expect);
+
+			ck_assert_uint_eq(lgfs2_bm_scan(rg, i, found, state), n);
+			ck_assert(memcmp(found, expect, n * sizeof(*found)) == 0);
+		}
+	}
+	free(found);
+	free(expect);
+}
+END_TEST
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Not a pass/fail test, reports the scan rate of the old and new methods */
+START_TEST(test_bitmap_scan_bench)
+{
+	const size_t len = 1 << 20;
+	const unsigned densities[] = { 0, 1, 50, 500 };
+	unsigned char *buf = malloc(len);
+	uint64_t *out = malloc(len * GFS2_NBBY * sizeof(uint64_t));
+	unsigned rounds = 16;
+
+	ck_assert(buf != NULL && out != NULL);
+	srandom(3);
+	printf("\nbitmap scan MB/s   density/1000   bitfit     scan\n");
+	for (unsigned d = 0; d < sizeof(densities) / sizeof(densities[0]); d++) {
+		double start, old, new;
+		unsigned n1 = 0, n2 = 0;
+
+		fill_bitmap(buf, len, GFS2_BLKST_DINODE, densities[d]);
+		start = now();
+		for (unsigned r = 0; r < rounds; r++)
+			n1 += bm_scan_bitfit(buf, len, GFS2_BLKST_DINODE, 0, out);
+		old = now() - start;
+		start = now();
+		for (unsigned r = 0; r < rounds; r++)
+			n2 += lgfs2_bitmap_scan(buf, len, GFS2_BLKST_DINODE, 0, out);
+		new = now() - start;
+		ck_assert_uint_eq(n1, n2);
+		printf("%30u %8.0f %8.0f\n", densities[d],
+		       rounds * (len / 1048576.0) / old, rounds * (len / 1048576.0) / new);
+	}
+	fflush(stdout);
+	free(out);
+	free(buf);
+}
+END_TEST
+
+#define INDEX_RGRPS (200000)
+#define INDEX_SAMPLES (1 << 20)
+
+/* Resource groups like mkfs lays them out, or with random sizes and gaps */
+static struct lgfs2_sbd *mockup_rgtree(int uneven)
+{
+	struct lgfs2_sbd *sdp = calloc(1, sizeof(*sdp));
+	uint64_t addr = 20;
+
+	ck_assert(sdp != NULL);
+	srandom(5);
+	for (unsigned i = 0; i < INDEX_RGRPS; i++) {
+		struct lgfs2_rgrp_tree *rgd = lgfs2_rgrp_insert(&sdp->rgtree, addr);
+		uint64_t next = (i == 0) ? 65536 : addr + 65536;
+
+		ck_assert(rgd != NULL);
+		if (uneven)
+			next = addr + 1000 + random() % 100000;
+		rgd->rt_length = 4;
+		rgd->rt_data0 = addr + 4;
+		rgd->rt_data = next - rgd->rt_data0 - (uneven ? random() % 4 : 0);
+		addr = next;
+	}
+	return sdp;
+}
+
+static uint64_t *index_samples(struct lgfs2_sbd *sdp)
+{
+	struct lgfs2_rgrp_tree *last = (struct lgfs2_rgrp_tree *)osi_last(&sdp->rgtree);
+	uint64_t end = last->rt_data0 + last->rt_data + 10;
+	uint64_t *blks = malloc(INDEX_SAMPLES * sizeof(*blks));
+
+	ck_assert(blks != NULL);
+	for (unsigned i = 0; i < INDEX_SAMPLES; i++)
+		blks[i] = ((uint64_t)random() << 31 ^ random()) % end;
+	blks[0] = 0;
+	blks[1] = 20;
+	blks[2] = end - 11;
+	blks[3] = end - 10;
+	return blks;
+}
+
+static double rgrp_lookups(struct lgfs2_sbd *sdp, const uint64_t *blks,
+                           struct lgfs2_rgrp_tree **found)
+{
+	double start = now();
+
+	for (unsigned i = 0; i < INDEX_SAMPLES; i++)
+		found[i] = lgfs2_blk2rgrpd(sdp, blks[i]);
+	return INDEX_SAMPLES / (now() - start) / 1e6;
+}
+
+START_TEST(test_rgrp_index)
+{
+	struct lgfs2_rgrp_tree **expect = malloc(INDEX_SAMPLES * sizeof(*expect));
+	struct lgfs2_rgrp_tree **found = malloc(INDEX_SAMPLES * sizeof(*found));
+
+	ck_assert(expect != NULL && found != NULL);
+	printf("\nlgfs2_blk2rgrpd Mlookups/s, %u rgrps   tree    index\n", INDEX_RGRPS);
+	for (int uneven = 0; uneven < 2; uneven++) {
+		struct lgfs2_sbd *sdp = mockup_rgtree(uneven);
+		uint64_t *blks = index_samples(sdp);
+		double tree, index;
+
+		tree = rgrp_lookups(sdp, blks, expect);
+		ck_assert(lgfs2_rgrp_index_build(sdp) == 0);
+		ck_assert(sdp->rgindex != NULL);
+		index = rgrp_lookups(sdp, blks, found);
+		ck_assert(memcmp(found, expect, INDEX_SAMPLES * sizeof(*found)) == 0);
+		ck_assert(expect[0] == NULL);
+		ck_assert(expect[1] != NULL && expect[1]->rt_addr == 20);
+		ck_assert(expect[2] != NULL && expect[3] == NULL);
+		printf("%-37s %8.1f %8.1f\n", uneven ? "uneven" : "mkfs layout", tree, index);
+		fflush(stdout);
+
+		lgfs2_rgrp_free(sdp, &sdp->rgtree);
+		ck_assert(sdp->rgindex == NULL);
+		free(blks);
+		free(sdp);
+	}
+	free(found);
+	free(expect);
+}
+END_TEST
+
 Suite *suite_rgrp(void)
 {
 
@@ -172,6 +430,23 @@ Suite *suite_rgrp(void)
 	tcase_set_timeout(tc, 0);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("lgfs2_bitmap_scan");
+	tcase_add_test(tc, test_bitmap_scan);
+	tcase_add_test(tc, test_bitmap_count);
+	tcase_add_test(tc, test_bitmap_scan_bench);
+	tcase_set_timeout(tc, 0);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("lgfs2_bm_scan");
+	tcase_add_checked_fixture(tc, mockup_rgrps, teardown_rgrps);
+	tcase_add_test(tc, test_bm_scan);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("lgfs2_blk2rgrpd");
+	tcase_add_test(tc, test_rgrp_index);
+	tcase_set_timeout(tc, 0);
+	suite_add_tcase(s, tc);
+
 	tc = tcase_create("lgfs2_rgrps_write_final");
 	tcase_add_checked_fixture(tc, mockup_rgrps, teardown_rgrps);
 	tcase_add_test(tc, test_rgrps_write_final);
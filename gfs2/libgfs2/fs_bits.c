@@ -8,6 +8,14 @@
 
 #include "libgfs2.h"
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define BITS_X86 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define BITS_NEON 1
+#endif
+
 #if BITS_PER_LONG == 32
 #define LBITMASK   (0x55555555UL)
 #define LBITSKIP55 (0x55555555UL)
@@ -71,6 +79,136 @@ static inline uint64_t bit_search(const __le64 *ptr,
 	return tmp;
 }
 
+/*
+ * The bitmap skip functions return the first word at or after ptr which may
+ * contain a block in the given state. They look at BITS_SKIP_BYTES (256
+ * blocks) at a time and stop short of end when less than that remains, so
+ * the caller always checks the last few words itself. Whole words are tested,
+ * including any bytes beyond the length of the bitmap in the last word, so
+ * they never skip a word which the caller would find a match in.
+ */
+#define BITS_SKIP_BYTES (64)
+#define BITS_SKIP_WORDS (BITS_SKIP_BYTES / sizeof(uint64_t))
+
+typedef const __le64 *(*bits_skip_fn)(const __le64 *ptr, const __le64 *end, uint8_t state);
+
+/* The byte which bit_search() xors with the bitmap, for each state */
+static const uint8_t search_byte[] = { 0xff, 0xaa, 0x55, 0x00 };
+
+static const __le64 *bits_skip_scalar(const __le64 *ptr, const __le64 *end, uint8_t state)
+{
+	const uint64_t mask = 0x5555555555555555ULL;
+
+	while (end - ptr >= (ptrdiff_t)BITS_SKIP_WORDS) {
+		uint64_t acc = 0;
+
+		for (unsigned i = 0; i < BITS_SKIP_WORDS; i++)
+			acc |= bit_search(ptr + i, mask, state);
+		if (acc)
+			break;
+		ptr += BITS_SKIP_WORDS;
+	}
+	return ptr;
+}
+
+#ifdef BITS_X86
+static const __le64 *bits_skip_sse2(const __le64 *ptr, const __le64 *end, uint8_t state)
+{
+	const __m128i pat = _mm_set1_epi8((char)search_byte[state]);
+	const __m128i m55 = _mm_set1_epi8(0x55);
+
+	while (end - ptr >= (ptrdiff_t)BITS_SKIP_WORDS) {
+		const __m128i *p = (const __m128i *)ptr;
+		__m128i acc = _mm_setzero_si128();
+
+		for (unsigned i = 0; i < BITS_SKIP_BYTES / sizeof(__m128i); i++) {
+			__m128i v = _mm_xor_si128(_mm_loadu_si128(p + i), pat);
+
+			v = _mm_and_si128(v, _mm_srli_epi64(v, 1));
+			acc = _mm_or_si128(acc, _mm_and_si128(v, m55));
+		}
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff)
+			break;
+		ptr += BITS_SKIP_WORDS;
+	}
+	return ptr;
+}
+
+__attribute__((target("avx2")))
+static const __le64 *bits_skip_avx2(const __le64 *ptr, const __le64 *end, uint8_t state)
+{
+	const __m256i pat = _mm256_set1_epi8((char)search_byte[state]);
+	const __m256i m55 = _mm256_set1_epi8(0x55);
+
+	while (end - ptr >= (ptrdiff_t)BITS_SKIP_WORDS) {
+		const __m256i *p = (const __m256i *)ptr;
+		__m256i v0 = _mm256_xor_si256(_mm256_loadu_si256(p), pat);
+		__m256i v1 = _mm256_xor_si256(_mm256_loadu_si256(p + 1), pat);
+		__m256i acc;
+
+		v0 = _mm256_and_si256(v0, _mm256_srli_epi64(v0, 1));
+		v1 = _mm256_and_si256(v1, _mm256_srli_epi64(v1, 1));
+		acc = _mm256_and_si256(_mm256_or_si256(v0, v1), m55);
+		if (!_mm256_testz_si256(acc, acc))
+			break;
+		ptr += BITS_SKIP_WORDS;
+	}
+	return ptr;
+}
+#endif /* BITS_X86 */
+
+#ifdef BITS_NEON
+static const __le64 *bits_skip_neon(const __le64 *ptr, const __le64 *end, uint8_t state)
+{
+	const uint8x16_t pat = vdupq_n_u8(search_byte[state]);
+	const uint8x16_t m55 = vdupq_n_u8(0x55);
+
+	while (end - ptr >= (ptrdiff_t)BITS_SKIP_WORDS) {
+		const uint8_t *p = (const uint8_t *)ptr;
+		uint8x16_t acc = vdupq_n_u8(0);
+
+		for (unsigned i = 0; i < BITS_SKIP_BYTES / 16; i++) {
+			uint8x16_t v = veorq_u8(vld1q_u8(p + 16 * i), pat);
+			uint8x16_t sh = vreinterpretq_u8_u64(vshrq_n_u64(vreinterpretq_u64_u8(v), 1));
+
+			acc = vorrq_u8(acc, vandq_u8(vandq_u8(v, sh), m55));
+		}
+		if (vmaxvq_u8(acc) != 0)
+			break;
+		ptr += BITS_SKIP_WORDS;
+	}
+	return ptr;
+}
+#endif /* BITS_NEON */
+
+static const __le64 *bits_skip_select(const __le64 *ptr, const __le64 *end, uint8_t state);
+
+static bits_skip_fn bits_skip = bits_skip_select;
+
+/* Pick the fastest skip function for this CPU on first use */
+static const __le64 *bits_skip_select(const __le64 *ptr, const __le64 *end, uint8_t state)
+{
+	bits_skip_fn fn = bits_skip_scalar;
+
+#if defined(BITS_X86)
+	fn = bits_skip_sse2;
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		fn = bits_skip_avx2;
+#elif defined(BITS_NEON)
+	fn = bits_skip_neon;
+#endif
+	__atomic_store_n(&bits_skip, fn, __ATOMIC_RELAXED);
+	return fn(ptr, end, state);
+}
+
+static inline const __le64 *skip_words(const __le64 *ptr, const __le64 *end, uint8_t state)
+{
+	bits_skip_fn fn = __atomic_load_n(&bits_skip, __ATOMIC_RELAXED);
+
+	return fn(ptr, end, state);
+}
+
 /**
  * lgfs2_bitfit - Find a free block in the bitmaps
  * @buffer: the buffer that holds the bitmaps
@@ -98,6 +236,9 @@ unsigned long lgfs2_bitfit(const unsigned char *buf, const unsigned int len,
 	tmp = bit_search(ptr, mask, state);
 	ptr++;
 	while(tmp == 0 && ptr < end) {
+		ptr = skip_words(ptr, end, state);
+		if (ptr == end)
+			break;
 		tmp = bit_search(ptr, 0x5555555555555555ULL, state);
 		ptr++;
 	}
@@ -114,6 +255,143 @@ unsigned long lgfs2_bitfit(const unsigned char *buf, const unsigned int len,
 	return (((const unsigned char *)ptr - buf) * GFS2_NBBY) + bit;
 }
 
+/**
+ * lgfs2_bitmap_scan - Find all the blocks in a bitmap which have a state
+ * @buf: The bitmap
+ * @len: The length of the bitmap in bytes
+ * @state: The block state to look for
+ * @base: The address of the block described by the first bits of the bitmap
+ * @out: The addresses of the matching blocks are written here, so it must be
+ *       able to hold len * GFS2_NBBY addresses
+ *
+ * Returns: The number of matching blocks
+ */
+unsigned lgfs2_bitmap_scan(const unsigned char *buf, unsigned len, uint8_t state,
+                           uint64_t base, uint64_t *out)
+{
+	const __le64 *ptr = (const __le64 *)buf;
+	const __le64 *end = (const __le64 *)(buf + ALIGN(len, sizeof(uint64_t)));
+	unsigned n = 0;
+
+	if (state > 3)
+		return 0;
+	while (ptr < end) {
+		uint64_t tmp;
+		uint64_t blk;
+
+		ptr = skip_words(ptr, end, state);
+		if (ptr == end)
+			break;
+		tmp = bit_search(ptr, 0x5555555555555555ULL, state);
+		/* Mask off any bits which are more than len bytes from the start */
+		if (ptr + 1 == end && (len & (sizeof(uint64_t) - 1)))
+			tmp &= (((uint64_t)~0) >>
+				(64 - 8 * (len & (sizeof(uint64_t) - 1))));
+		blk = base + (((const unsigned char *)ptr - buf) * GFS2_NBBY);
+		while (tmp) {
+			out[n++] = blk + (__builtin_ctzll(tmp) / 2);
+			tmp &= tmp - 1;
+		}
+		ptr++;
+	}
+	return n;
+}
+
+/*
+ * Count the blocks in each state in whole 64-bit words. With the low and high
+ * bits of each block's state split into separate masks, the dinode blocks
+ * have both bits set, used blocks only the low bit and unlinked blocks only
+ * the high bit, so three population counts per word are enough. The caller
+ * deals with the remaining bytes. Instantiated once with the popcnt
+ * instruction enabled so that it can be chosen on CPUs which have it.
+ */
+static inline void bits_count_words(const unsigned char *buf, unsigned nwords, uint64_t *lo,
+                                    uint64_t *hi, uint64_t *both)
+{
+	const uint64_t mask = 0x5555555555555555ULL;
+	uint64_t nlo = 0, nhi = 0, nboth = 0;
+
+	for (unsigned i = 0; i < nwords; i++) {
+		uint64_t w, l, h;
+
+		memcpy(&w, buf + i * sizeof(w), sizeof(w));
+		w = le64_to_cpu(w);
+		l = w & mask;
+		h = (w >> 1) & mask;
+		nlo += __builtin_popcountll(l);
+		nhi += __builtin_popcountll(h);
+		nboth += __builtin_popcountll(l & h);
+	}
+	*lo = nlo;
+	*hi = nhi;
+	*both = nboth;
+}
+
+typedef void (*bits_count_fn)(const unsigned char *buf, unsigned nwords, uint64_t *lo,
+                              uint64_t *hi, uint64_t *both);
+
+static void bits_count_generic(const unsigned char *buf, unsigned nwords, uint64_t *lo,
+                               uint64_t *hi, uint64_t *both)
+{
+	bits_count_words(buf, nwords, lo, hi, both);
+}
+
+#ifdef BITS_X86
+__attribute__((target("popcnt")))
+static void bits_count_popcnt(const unsigned char *buf, unsigned nwords, uint64_t *lo,
+                              uint64_t *hi, uint64_t *both)
+{
+	bits_count_words(buf, nwords, lo, hi, both);
+}
+#endif
+
+static void bits_count_select(const unsigned char *buf, unsigned nwords, uint64_t *lo,
+                              uint64_t *hi, uint64_t *both);
+
+static bits_count_fn bits_count = bits_count_select;
+
+static void bits_count_select(const unsigned char *buf, unsigned nwords, uint64_t *lo,
+                              uint64_t *hi, uint64_t *both)
+{
+	bits_count_fn fn = bits_count_generic;
+
+#ifdef BITS_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("popcnt"))
+		fn = bits_count_popcnt;
+#endif
+	__atomic_store_n(&bits_count, fn, __ATOMIC_RELAXED);
+	fn(buf, nwords, lo, hi, both);
+}
+
+/**
+ * lgfs2_bitmap_count - Count the blocks in each state in a bitmap
+ * @buf: The bitmap
+ * @len: The length of the bitmap in bytes
+ * @count: Set to the number of blocks in each state, indexed by GFS2_BLKST_*
+ */
+void lgfs2_bitmap_count(const unsigned char *buf, unsigned len, uint32_t count[4])
+{
+	unsigned nwords = len / sizeof(uint64_t);
+	uint64_t lo, hi, both;
+	bits_count_fn fn = __atomic_load_n(&bits_count, __ATOMIC_RELAXED);
+
+	fn(buf, nwords, &lo, &hi, &both);
+	for (unsigned i = nwords * sizeof(uint64_t); i < len; i++) {
+		for (unsigned bit = 0; bit < 8; bit += GFS2_BIT_SIZE) {
+			uint8_t state = (buf[i] >> bit) & GFS2_BIT_MASK;
+
+			lo += state & 1;
+			hi += state >> 1;
+			both += state == GFS2_BLKST_DINODE;
+		}
+	}
+	count[GFS2_BLKST_DINODE] = both;
+	count[GFS2_BLKST_USED] = lo - both;
+	count[GFS2_BLKST_UNLINKED] = hi - both;
+	count[GFS2_BLKST_FREE] = (uint64_t)len * GFS2_NBBY - lo - hi + both;
+}
+
 /*
  * lgfs2_check_range - check if blkno is within FS limits
  * @sdp: super block
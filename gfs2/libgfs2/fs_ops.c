@@ -115,7 +115,7 @@ void lgfs2_inode_free(struct lgfs2_inode **ipp)
 {
 	struct lgfs2_inode *ip = *ipp;
 
-	free(ip->i_bh);
+	lgfs2_bfree(&ip->i_bh);
 	free(ip);
 	*ipp = NULL;
 }
@@ -1480,13 +1480,13 @@ int lgfs2_write_filemeta(struct lgfs2_inode *ip)
 			}
 			lgfs2_fill_indir(start, bh->b_data + sdp->sd_bsize, ptr0, ptrs, &p);
 			if (lgfs2_bwrite(bh)) {
-				free(bh);
+				lgfs2_bfree(&bh);
 				return 1;
 			}
 		}
 		ptr0 += ptrs;
 	}
-	free(bh);
+	lgfs2_bfree(&bh);
 	return 0;
 }
 
@@ -226,9 +226,22 @@ struct lgfs2_buffer_head {
 	uint64_t b_blocknr;
 	char *b_data;
 	struct lgfs2_sbd *sdp;
+	struct lgfs2_buffer_head *b_next_free; /* Buffer pool free list */
+	uint32_t b_size; /* Allocated size of b_data */
 	int b_modified;
 };
 
+/* Idle buffer heads kept for reuse by lgfs2_bget() and lgfs2_bread() */
+#define LGFS2_BPOOL_DEFAULT_MAX (1024)
+struct lgfs2_bpool {
+	struct lgfs2_buffer_head *bp_free; /* Idle buffers */
+	uint32_t bp_bsize; /* Block size of the idle buffers */
+	unsigned bp_count; /* Number of idle buffers */
+	unsigned bp_max;   /* Limit on idle buffers, 0 for LGFS2_BPOOL_DEFAULT_MAX */
+	uint64_t bp_hits;   /* Allocations satisfied from the pool */
+	uint64_t bp_misses; /* Allocations which needed a new buffer */
+};
+
 struct lgfs2_inum {
 	uint64_t in_formal_ino;
 	uint64_t in_addr;
@@ -287,6 +300,24 @@ struct lgfs2_meta_dir
 	uint32_t journals;                /* Journal count */
 };
 
+/* Lookup table for lgfs2_blk2rgrpd(), see lgfs2_rgrp_index_build() */
+struct lgfs2_rgrp_index;
+
+/* Optional block cache, see lgfs2_bcache_init() */
+#define LGFS2_BCACHE_MIN_BLOCKS (16)
+struct lgfs2_bcache;
+
+struct lgfs2_bcache_stats {
+	uint64_t bs_hits;      /* Reads satisfied from the cache */
+	uint64_t bs_misses;    /* Reads which went to the device */
+	uint64_t bs_evictions; /* Blocks recycled to make space */
+	uint64_t bs_writes;    /* Dirty blocks written back */
+	uint64_t bs_batches;   /* pwritev() calls made for write-back */
+};
+
+/* A queue of block reads, which may be serviced asynchronously */
+struct lgfs2_ioq;
+
 #define LGFS2_SB_ADDR(sdp) (GFS2_SB_ADDR >> (sdp)->sd_fsb2bb_shift)
 struct lgfs2_sbd {
 	/* CPU-endian counterparts to the on-disk superblock fields */
@@ -329,6 +360,9 @@ struct lgfs2_sbd {
 	uint64_t dinodes_alloced;
 
 	struct osi_root rgtree;
+	struct lgfs2_rgrp_index *rgindex;
+	struct lgfs2_bpool bpool;
+	struct lgfs2_bcache *bcache;
 
 	struct lgfs2_inode *master_dir;
 	struct lgfs2_meta_dir md;
@@ -412,9 +446,25 @@ extern int lgfs2_field_assign(char *blk, const struct lgfs2_metafield *field, co
 extern struct lgfs2_buffer_head *lgfs2_bget(struct lgfs2_sbd *sdp, uint64_t num);
 extern struct lgfs2_buffer_head *__lgfs2_bread(struct lgfs2_sbd *sdp, uint64_t num,
 					int line, const char *caller);
+extern int lgfs2_bread_vec(struct lgfs2_sbd *sdp, const uint64_t *blks, unsigned n,
+                           struct lgfs2_buffer_head **bhs);
+extern int lgfs2_bread_range(struct lgfs2_sbd *sdp, uint64_t start, unsigned n,
+                             struct lgfs2_buffer_head **bhs);
+extern struct lgfs2_ioq *lgfs2_ioq_new(struct lgfs2_sbd *sdp, unsigned depth);
+extern int lgfs2_ioq_async(const struct lgfs2_ioq *q);
+extern int lgfs2_ioq_submit(struct lgfs2_ioq *q, uint64_t blk, void *priv);
+extern int lgfs2_ioq_reap(struct lgfs2_ioq *q, struct lgfs2_buffer_head **bhp, void **privp);
+extern void lgfs2_ioq_free(struct lgfs2_ioq **qp);
 extern int lgfs2_bwrite(struct lgfs2_buffer_head *bh);
 extern int lgfs2_brelse(struct lgfs2_buffer_head *bh);
 extern void lgfs2_bfree(struct lgfs2_buffer_head **bhp);
+extern void lgfs2_bpool_drain(struct lgfs2_sbd *sdp);
+extern int lgfs2_bcache_init(struct lgfs2_sbd *sdp, uint64_t budget);
+extern int lgfs2_bcache_flush(struct lgfs2_sbd *sdp);
+extern int lgfs2_bcache_sync(struct lgfs2_sbd *sdp, uint64_t blk, uint64_t len);
+extern int lgfs2_bcache_free(struct lgfs2_sbd *sdp);
+extern void lgfs2_bcache_stats(const struct lgfs2_sbd *sdp, struct lgfs2_bcache_stats *stats);
+extern int lgfs2_bcache_prefetch(struct lgfs2_sbd *sdp, const uint64_t *blks, unsigned n, char *buf);
 extern uint32_t lgfs2_get_block_type(const char *buf);
 
 #define lgfs2_bmodified(bh) do { bh->b_modified = 1; } while(0)
@@ -432,6 +482,9 @@ extern void lgfs2_fix_device_geometry(struct lgfs2_sbd *sdp);
 extern unsigned long lgfs2_bitfit(const unsigned char *buffer,
 				 const unsigned int buflen,
 				 unsigned long goal, unsigned char old_state);
+extern unsigned lgfs2_bitmap_scan(const unsigned char *buf, unsigned len, uint8_t state,
+                                  uint64_t base, uint64_t *out);
+extern void lgfs2_bitmap_count(const unsigned char *buf, unsigned len, uint32_t count[4]);
 
 /* functions with blk #'s that are rgrp relative */
 extern int lgfs2_check_range(struct lgfs2_sbd *sdp, uint64_t blkno);
@@ -507,11 +560,16 @@ extern int lgfs2_open_mnt_dev(const char *path, int flags, struct mntent **mnt);
 extern int lgfs2_open_mnt_dir(const char *path, int flags, struct mntent **mnt);
 
 /* recovery.c */
+typedef int (*lgfs2_get_lh_t)(void *priv, unsigned int blk, struct lgfs2_log_header *head);
 extern void lgfs2_replay_incr_blk(struct lgfs2_inode *ip, unsigned int *blk);
 extern int lgfs2_replay_read_block(struct lgfs2_inode *ip, unsigned int blk,
 				  struct lgfs2_buffer_head **bh);
+extern int lgfs2_check_log_header(char *buf, unsigned int blk, unsigned int bsize,
+                                  struct lgfs2_log_header *head);
 extern int lgfs2_get_log_header(struct lgfs2_inode *ip, unsigned int blk,
                                 struct lgfs2_log_header *head);
+extern int lgfs2_find_jhead_with(uint32_t jd_blocks, lgfs2_get_lh_t get_lh, void *priv,
+                                 struct lgfs2_log_header *head);
 extern int lgfs2_find_jhead(struct lgfs2_inode *ip, struct lgfs2_log_header *head);
 extern int lgfs2_clean_journal(struct lgfs2_inode *ip, struct lgfs2_log_header *head);
 
@@ -527,6 +585,8 @@ extern void lgfs2_rgrp_relse(struct lgfs2_sbd *sdp, struct lgfs2_rgrp_tree *rgd)
 extern struct lgfs2_rgrp_tree *lgfs2_rgrp_insert(struct osi_root *rgtree,
 				     uint64_t rgblock);
 extern void lgfs2_rgrp_free(struct lgfs2_sbd *sdp, struct osi_root *rgrp_tree);
+extern int lgfs2_rgrp_index_build(struct lgfs2_sbd *sdp);
+extern void lgfs2_rgrp_index_free(struct lgfs2_sbd *sdp);
 
 /* structures.c */
 extern int lgfs2_build_master(struct lgfs2_sbd *sdp);
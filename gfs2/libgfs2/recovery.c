@@ -52,6 +52,43 @@ static void log_header_in(struct lgfs2_log_header *lh, char *buf)
 	lh->lh_local_dinodes = be64_to_cpu(lhd->lh_local_dinodes);
 }
 
+/**
+ * lgfs2_check_log_header - check the log header in a journal block
+ * @buf: the journal block, which is briefly modified to compute the hash
+ * @blk: the position of the block in the journal
+ * @bsize: the block size
+ * @head: the log header to return
+ *
+ * Returns: 0 on success,
+ *          1 if the header was invalid or incomplete
+ */
+int lgfs2_check_log_header(char *buf, unsigned int blk, unsigned int bsize,
+                           struct lgfs2_log_header *head)
+{
+	struct lgfs2_log_header lh;
+	struct gfs2_log_header *tmp;
+	__be32 saved_hash;
+	uint32_t hash;
+	uint32_t crc;
+
+	tmp = (struct gfs2_log_header *)buf;
+	saved_hash = tmp->lh_hash;
+	tmp->lh_hash = 0;
+	hash = lgfs2_log_header_hash(buf);
+	tmp->lh_hash = saved_hash;
+	crc = lgfs2_log_header_crc(buf, bsize);
+	log_header_in(&lh, buf);
+	if (lh.lh_blkno != blk || lh.lh_hash != hash)
+		return 1;
+	/* Don't check the crc if it's zero, as it is in pre-v2 log headers */
+	if (lh.lh_crc != 0 && lh.lh_crc != crc)
+		return 1;
+
+	*head = lh;
+
+	return 0;
+}
+
 /**
  * get_log_header - read the log header for a given segment
  * @ip: the journal incore inode
@@ -70,36 +107,20 @@ int lgfs2_get_log_header(struct lgfs2_inode *ip, unsigned int blk,
                          struct lgfs2_log_header *head)
 {
 	struct lgfs2_buffer_head *bh;
-	struct lgfs2_log_header lh;
-	struct gfs2_log_header *tmp;
-	__be32 saved_hash;
-	uint32_t hash;
-	uint32_t lh_crc = 0;
-	uint32_t crc;
 	int error;
 
 	error = lgfs2_replay_read_block(ip, blk, &bh);
 	if (error)
 		return error;
 
-	tmp = (struct gfs2_log_header *)bh->b_data;
-	saved_hash = tmp->lh_hash;
-	tmp->lh_hash = 0;
-	hash = lgfs2_log_header_hash(bh->b_data);
-	tmp->lh_hash = saved_hash;
-	crc = lgfs2_log_header_crc(bh->b_data, ip->i_sbd->sd_bsize);
-	log_header_in(&lh, bh->b_data);
+	error = lgfs2_check_log_header(bh->b_data, blk, ip->i_sbd->sd_bsize, head);
 	lgfs2_brelse(bh);
-	lh_crc = lh.lh_crc;
-	if (error || lh.lh_blkno != blk || lh.lh_hash != hash)
-		return 1;
-	/* Don't check the crc if it's zero, as it is in pre-v2 log headers */
-	if (lh_crc != 0 && lh_crc != crc)
-		return 1;
-
-	*head = lh;
+	return error;
+}
 
-	return 0;
+static int get_log_header(void *priv, unsigned int blk, struct lgfs2_log_header *head)
+{
+	return lgfs2_get_log_header(priv, blk, head);
 }
 
 /**
@@ -114,14 +135,14 @@ int lgfs2_get_log_header(struct lgfs2_inode *ip, unsigned int blk,
  *
  * Returns: errno
  */
-static int find_good_lh(struct lgfs2_inode *ip, unsigned int *blk, struct lgfs2_log_header *head)
+static int find_good_lh(uint32_t jd_blocks, lgfs2_get_lh_t get_lh, void *priv,
+                        unsigned int *blk, struct lgfs2_log_header *head)
 {
 	unsigned int orig_blk = *blk;
 	int error;
-	uint32_t jd_blocks = ip->i_size / ip->i_sbd->sd_bsize;
 
 	for (;;) {
-		error = lgfs2_get_log_header(ip, *blk, head);
+		error = get_lh(priv, *blk, head);
 		if (error <= 0)
 			return error;
 
@@ -144,10 +165,10 @@ static int find_good_lh(struct lgfs2_inode *ip, unsigned int *blk, struct lgfs2_
  * Returns: errno
  */
 
-static int jhead_scan(struct lgfs2_inode *ip, struct lgfs2_log_header *head)
+static int jhead_scan(uint32_t jd_blocks, lgfs2_get_lh_t get_lh, void *priv,
+                      struct lgfs2_log_header *head)
 {
 	unsigned int blk = head->lh_blkno;
-	uint32_t jd_blocks = ip->i_size / ip->i_sbd->sd_bsize;
 	struct lgfs2_log_header lh;
 	int error;
 
@@ -155,7 +176,7 @@ static int jhead_scan(struct lgfs2_inode *ip, struct lgfs2_log_header *head)
 		if (++blk == jd_blocks)
 			blk = 0;
 
-		error = lgfs2_get_log_header(ip, blk, &lh);
+		error = get_lh(priv, blk, &lh);
 		if (error < 0)
 			return error;
 		if (error == 1)
@@ -173,21 +194,22 @@ static int jhead_scan(struct lgfs2_inode *ip, struct lgfs2_log_header *head)
 }
 
 /**
- * gfs2_find_jhead - find the head of a log
- * @jd: the journal
+ * lgfs2_find_jhead_with - find the head of a log, given a way to get its headers
+ * @jd_blocks: the number of blocks in the journal
+ * @get_lh: returns the log header at a block like lgfs2_get_log_header()
+ * @priv: passed to get_lh
  * @head: the log descriptor for the head of the log is returned here
  *
- * Do a binary search of a journal and find the valid log entry with the
- * highest sequence number.  (i.e. the log head)
+ * This allows the headers to be looked up in a journal which has already been
+ * read, rather than by reading each block as it is needed.
  *
  * Returns: errno
  */
-
-int lgfs2_find_jhead(struct lgfs2_inode *ip, struct lgfs2_log_header *head)
+int lgfs2_find_jhead_with(uint32_t jd_blocks, lgfs2_get_lh_t get_lh, void *priv,
+                          struct lgfs2_log_header *head)
 {
 	struct lgfs2_log_header lh_1, lh_m;
 	uint32_t blk_1, blk_2, blk_m;
-	uint32_t jd_blocks = ip->i_size / ip->i_sbd->sd_bsize;
 	int error;
 
 	blk_1 = 0;
@@ -196,11 +218,11 @@ int lgfs2_find_jhead(struct lgfs2_inode *ip, struct lgfs2_log_header *head)
 	for (;;) {
 		blk_m = (blk_1 + blk_2) / 2;
 
-		error = find_good_lh(ip, &blk_1, &lh_1);
+		error = find_good_lh(jd_blocks, get_lh, priv, &blk_1, &lh_1);
 		if (error)
 			return error;
 
-		error = find_good_lh(ip, &blk_m, &lh_m);
+		error = find_good_lh(jd_blocks, get_lh, priv, &blk_m, &lh_m);
 		if (error)
 			return error;
 
@@ -213,7 +235,7 @@ int lgfs2_find_jhead(struct lgfs2_inode *ip, struct lgfs2_log_header *head)
 			blk_2 = blk_m;
 	}
 
-	error = jhead_scan(ip, &lh_1);
+	error = jhead_scan(jd_blocks, get_lh, priv, &lh_1);
 	if (error)
 		return error;
 
@@ -222,6 +244,24 @@ int lgfs2_find_jhead(struct lgfs2_inode *ip, struct lgfs2_log_header *head)
 	return error;
 }
 
+/**
+ * gfs2_find_jhead - find the head of a log
+ * @jd: the journal
+ * @head: the log descriptor for the head of the log is returned here
+ *
+ * Do a binary search of a journal and find the valid log entry with the
+ * highest sequence number.  (i.e. the log head)
+ *
+ * Returns: errno
+ */
+
+int lgfs2_find_jhead(struct lgfs2_inode *ip, struct lgfs2_log_header *head)
+{
+	uint32_t jd_blocks = ip->i_size / ip->i_sbd->sd_bsize;
+
+	return lgfs2_find_jhead_with(jd_blocks, get_log_header, ip, head);
+}
+
 /**
  * clean_journal - mark a dirty journal as being clean
  * @sdp: the filesystem
@@ -89,6 +89,39 @@ errbits:
 struct lgfs2_rgrp_tree *lgfs2_blk2rgrpd(struct lgfs2_sbd *sdp, uint64_t blk)
 {
 	struct lgfs2_rgrp_tree *rgd = (struct lgfs2_rgrp_tree *)sdp->rgtree.osi_node;
+	const struct lgfs2_rgrp_index *ri = sdp->rgindex;
+
+	if (ri != NULL && ri->ri_root == sdp->rgtree.osi_node) {
+		unsigned i;
+
+		if (blk < ri->ri_starts[0])
+			return NULL;
+		if (ri->ri_stride != 0) {
+			if (blk < ri->ri_base)
+				i = 0;
+			else {
+				uint64_t q = (blk - ri->ri_base) / ri->ri_stride + 1;
+
+				i = q < ri->ri_count ? q : ri->ri_count - 1;
+			}
+		} else {
+			const uint64_t *base = ri->ri_starts;
+			unsigned n = ri->ri_count;
+
+			/* Find the last rgrp which starts at or before blk */
+			while (n > 1) {
+				unsigned half = n / 2;
+
+				base = (base[half] <= blk) ? base + half : base;
+				n -= half;
+			}
+			i = base - ri->ri_starts;
+		}
+		rgd = ri->ri_rgd[i];
+		if (blk >= rgd->rt_data0 + rgd->rt_data)
+			return NULL;
+		return rgd;
+	}
 	while (rgd) {
 		if (blk < rgd->rt_addr)
 			rgd = (struct lgfs2_rgrp_tree *) rgd->rt_node.osi_left;
@@ -100,6 +133,78 @@ struct lgfs2_rgrp_tree *lgfs2_blk2rgrpd(struct lgfs2_sbd *sdp, uint64_t blk)
 	return NULL;
 }
 
+/**
+ * lgfs2_rgrp_index_build - Build a lookup table for lgfs2_blk2rgrpd()
+ * @sdp: The superblock, with sdp->rgtree complete
+ *
+ * The table is a copy of the resource group tree so it must be rebuilt, or
+ * freed with lgfs2_rgrp_index_free(), if resource groups are added, removed
+ * or moved. lgfs2_rindex_read() builds it and lgfs2_rgrp_free() frees it.
+ *
+ * Returns 0 on success or -1 with errno set, in which case lookups fall back
+ * to searching the tree.
+ */
+int lgfs2_rgrp_index_build(struct lgfs2_sbd *sdp)
+{
+	struct lgfs2_rgrp_index *ri;
+	struct osi_node *n;
+	unsigned count = 0;
+
+	lgfs2_rgrp_index_free(sdp);
+	for (n = osi_first(&sdp->rgtree); n; n = osi_next(n))
+		count++;
+	if (count == 0)
+		return 0;
+
+	ri = calloc(1, sizeof(*ri));
+	if (ri == NULL)
+		return -1;
+	ri->ri_starts = malloc(count * sizeof(*ri->ri_starts));
+	ri->ri_rgd = malloc(count * sizeof(*ri->ri_rgd));
+	if (ri->ri_starts == NULL || ri->ri_rgd == NULL) {
+		free(ri->ri_starts);
+		free(ri->ri_rgd);
+		free(ri);
+		return -1;
+	}
+	count = 0;
+	for (n = osi_first(&sdp->rgtree); n; n = osi_next(n)) {
+		struct lgfs2_rgrp_tree *rgd = (struct lgfs2_rgrp_tree *)n;
+
+		ri->ri_starts[count] = rgd->rt_addr;
+		ri->ri_rgd[count++] = rgd;
+	}
+	ri->ri_count = count;
+	ri->ri_root = sdp->rgtree.osi_node;
+
+	/* The first rgrp is often a different size due to the space reserved at
+	   the start of the device, so only the distances after it have to match */
+	if (count >= 3) {
+		ri->ri_base = ri->ri_starts[1];
+		ri->ri_stride = ri->ri_starts[2] - ri->ri_starts[1];
+		for (unsigned i = 2; i < count; i++) {
+			if (ri->ri_starts[i] - ri->ri_starts[i - 1] != ri->ri_stride) {
+				ri->ri_stride = 0;
+				break;
+			}
+		}
+	}
+	sdp->rgindex = ri;
+	return 0;
+}
+
+void lgfs2_rgrp_index_free(struct lgfs2_sbd *sdp)
+{
+	struct lgfs2_rgrp_index *ri = sdp->rgindex;
+
+	if (ri == NULL)
+		return;
+	free(ri->ri_starts);
+	free(ri->ri_rgd);
+	free(ri);
+	sdp->rgindex = NULL;
+}
+
 /**
  * Allocate a multi-block buffer for a resource group's bitmaps. This is done
  * as one chunk and should be freed using lgfs2_rgrp_bitbuf_free().
@@ -196,6 +301,8 @@ uint64_t lgfs2_rgrp_read(struct lgfs2_sbd *sdp, struct lgfs2_rgrp_tree *rgd)
 
 	if (length == 0 || lgfs2_check_range(sdp, rgd->rt_addr))
 		return -1;
+	if (lgfs2_bcache_sync(sdp, rgd->rt_addr, rgd->rt_length))
+		return -1;
 
 	buf = calloc(1, length);
 	if (buf == NULL)
@@ -229,6 +336,8 @@ void lgfs2_rgrp_relse(struct lgfs2_sbd *sdp, struct lgfs2_rgrp_tree *rgd)
 {
 	if (rgd->rt_bits == NULL)
 		return;
+	if (lgfs2_bcache_sync(sdp, rgd->rt_addr, rgd->rt_length))
+		fprintf(stderr, "Failed to write back cached blocks: %s\n", strerror(errno));
 	for (unsigned i = 0; i < rgd->rt_length; i++) {
 		off_t offset = sdp->sd_bsize * (rgd->rt_addr + i);
 		ssize_t ret;
@@ -283,6 +392,8 @@ void lgfs2_rgrp_free(struct lgfs2_sbd *sdp, struct osi_root *rgrp_tree)
 	struct lgfs2_rgrp_tree *rgd;
 	struct osi_node *n;
 
+	if (sdp != NULL && rgrp_tree == &sdp->rgtree)
+		lgfs2_rgrp_index_free(sdp);
 	if (OSI_EMPTY_ROOT(rgrp_tree))
 		return;
 	while ((n = osi_first(rgrp_tree))) {
@@ -607,6 +718,7 @@ unsigned lgfs2_rgsize_for_data(uint64_t blksreq, unsigned bsize)
 // Temporary function to aid in API migration
 void lgfs2_attach_rgrps(struct lgfs2_sbd *sdp, lgfs2_rgrps_t rgs)
 {
+	lgfs2_rgrp_index_free(sdp);
 	sdp->rgtree.osi_node = rgs->rgs_root.osi_node;
 }
 
@@ -28,6 +28,21 @@ struct _lgfs2_rgrps {
 	unsigned long rgs_align_off;
 };
 
+/**
+ * A flat copy of sdp->rgtree for lgfs2_blk2rgrpd(). The start addresses are
+ * kept in their own array so that a binary search touches as few cache lines
+ * as possible. When the resource groups after the first are all the same
+ * distance apart, as mkfs lays them out, the index is calculated directly.
+ */
+struct lgfs2_rgrp_index {
+	struct osi_node *ri_root;        /* sdp->rgtree's root when it was built */
+	uint64_t *ri_starts;             /* rt_addr of each rgrp, in order */
+	struct lgfs2_rgrp_tree **ri_rgd;
+	uint64_t ri_base;                /* rt_addr of the second rgrp */
+	uint64_t ri_stride;              /* Distance between rgrps, or 0 if uneven */
+	unsigned ri_count;
+};
+
 struct lgfs2_rbm {
 	lgfs2_rgrp_t rgd;
 	uint32_t offset;    /* The offset is bitmap relative */
@@ -112,6 +112,8 @@ int lgfs2_write_journal_data(struct lgfs2_inode *ip)
 	uint64_t jblk = jext0;
 	char *buf;
 
+	if (lgfs2_bcache_sync(sdp, jext0, blocks) != 0)
+		return -1;
 	buf = calloc(1, sdp->sd_bsize);
 	if (buf == NULL)
 		return -1;
@@ -518,16 +520,7 @@ int lgfs2_check_meta(const char *buf, int type)
 unsigned lgfs2_bm_scan(struct lgfs2_rgrp_tree *rgd, unsigned idx, uint64_t *buf, uint8_t state)
 {
 	struct lgfs2_bitmap *bi = &rgd->rt_bits[idx];
-	unsigned n = 0;
-	uint32_t blk = 0;
-
-	while(blk < (bi->bi_len * GFS2_NBBY)) {
-		blk = lgfs2_bitfit((uint8_t *)bi->bi_data + bi->bi_offset,
-				  bi->bi_len, blk, state);
-		if (blk == LGFS2_BFITNOENT)
-			break;
-		buf[n++] = blk + (bi->bi_start * GFS2_NBBY) + rgd->rt_data0;
-		blk++;
-	}
-	return n;
+
+	return lgfs2_bitmap_scan((uint8_t *)bi->bi_data + bi->bi_offset, bi->bi_len, state,
+	                         (bi->bi_start * GFS2_NBBY) + rgd->rt_data0, buf);
 }
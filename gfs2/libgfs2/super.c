@@ -183,6 +183,7 @@ int lgfs2_rindex_read(struct lgfs2_sbd *sdp, uint64_t *rgcount, int *ok)
 
 	*ok = 1;
 	*rgcount = 0;
+	lgfs2_rgrp_index_free(sdp);
 	if (sdp->md.riinode->i_size % sizeof(struct gfs2_rindex))
 		*ok = 0; /* rindex file size must be a multiple of 96 */
 	for (rg = 0; ; rg++) {
@@ -228,5 +229,7 @@ int lgfs2_rindex_read(struct lgfs2_sbd *sdp, uint64_t *rgcount, int *ok)
 	}
 	if (*rgcount == 0)
 		return -1;
+	/* Lookups still work without the index, just more slowly */
+	lgfs2_rgrp_index_build(sdp);
 	return 0;
 }